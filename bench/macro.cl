@@ -0,0 +1,23 @@
+// Heavy use of the preprocessor: the unrolled body below expands to 4^5
+// copies of STEP, to measure preprocessing and the optimizer's handling of
+// long straight-line code.
+
+#define STEP(x) x = x * 1.0001f + 0.5f; x = native_sin(x) * x;
+#define REP4(m, x) m(x) m(x) m(x) m(x)
+#define R1(x) REP4(STEP, x)
+#define R2(x) R1(x) R1(x) R1(x) R1(x)
+#define R3(x) R2(x) R2(x) R2(x) R2(x)
+#define R4(x) R3(x) R3(x) R3(x) R3(x)
+#define R5(x) R4(x) R4(x) R4(x) R4(x)
+
+#define VEC_KERNEL(type, name) \
+    __kernel void name(__global type *data) \
+    { \
+        size_t i = get_global_id(0); \
+        type v = data[i]; \
+        R5(v) \
+        data[i] = v; \
+    }
+
+VEC_KERNEL(float, unrolled_float)
+VEC_KERNEL(float4, unrolled_float4)
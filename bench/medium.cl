@@ -0,0 +1,114 @@
+// A handful of typical compute kernels, to measure an ordinary compile
+
+#ifndef TILE
+# define TILE 16
+#endif
+
+__kernel void sgemm(
+    int M, int N, int K,
+    __global const float *A,
+    __global const float *B,
+    __global float *C)
+{
+    __local float As[TILE][TILE];
+    __local float Bs[TILE][TILE];
+    const int row = get_local_id(1);
+    const int col = get_local_id(0);
+    const int grow = TILE * get_group_id(1) + row;
+    const int gcol = TILE * get_group_id(0) + col;
+    float acc = 0.0f;
+    int t, k;
+
+    for (t = 0; t < (K + TILE - 1) / TILE; t++)
+    {
+        const int tcol = TILE * t + col;
+        const int trow = TILE * t + row;
+        As[row][col] = (grow < M && tcol < K) ? A[grow * K + tcol] : 0.0f;
+        Bs[row][col] = (trow < K && gcol < N) ? B[trow * N + gcol] : 0.0f;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for (k = 0; k < TILE; k++)
+            acc = mad(As[row][k], Bs[k][col], acc);
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (grow < M && gcol < N)
+        C[grow * N + gcol] = acc;
+}
+
+__kernel void reduce_sum(
+    __global const float *in,
+    __global float *out,
+    __local float *scratch,
+    unsigned int n)
+{
+    const size_t lid = get_local_id(0);
+    size_t gid = get_global_id(0);
+    float acc = 0.0f;
+    size_t s;
+
+    while (gid < n)
+    {
+        acc += in[gid];
+        gid += get_global_size(0);
+    }
+    scratch[lid] = acc;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (s = get_local_size(0) / 2; s > 0; s >>= 1)
+    {
+        if (lid < s)
+            scratch[lid] += scratch[lid + s];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (lid == 0)
+        out[get_group_id(0)] = scratch[0];
+}
+
+__kernel void scan_block(__global const int *in, __global int *out, __local int *temp)
+{
+    const int lid = get_local_id(0);
+    const int n = get_local_size(0);
+    const int base = get_group_id(0) * n;
+    int offset;
+
+    temp[lid] = in[base + lid];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (offset = 1; offset < n; offset <<= 1)
+    {
+        int value = lid >= offset ? temp[lid - offset] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        temp[lid] += value;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    out[base + lid] = temp[lid];
+}
+
+__constant float gauss5[5] = { 0.0625f, 0.25f, 0.375f, 0.25f, 0.0625f };
+
+__kernel void blur(
+    __read_only image2d_t src,
+    __write_only image2d_t dst,
+    sampler_t sampler)
+{
+    const int2 pos = (int2) (get_global_id(0), get_global_id(1));
+    float4 sum = (float4) (0.0f);
+    int dx, dy;
+
+    for (dy = -2; dy <= 2; dy++)
+        for (dx = -2; dx <= 2; dx++)
+            sum += gauss5[dx + 2] * gauss5[dy + 2] * read_imagef(src, sampler, pos + (int2) (dx, dy));
+    write_imagef(dst, pos, sum);
+}
+
+__kernel void histogram(__global const uchar *data, unsigned int n, __global volatile unsigned int *bins)
+{
+    __local unsigned int local_bins[256];
+    size_t i;
+
+    for (i = get_local_id(0); i < 256; i += get_local_size(0))
+        local_bins[i] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (i = get_global_id(0); i < n; i += get_global_size(0))
+        atomic_inc(&local_bins[data[i]]);
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (i = get_local_id(0); i < 256; i += get_local_size(0))
+        atomic_add(&bins[i], local_bins[i]);
+}
@@ -0,0 +1,237 @@
+#!/usr/bin/env python
+"""Measure the compile latency and memory use of onlineclc.
+
+Each kernel in the corpus is compiled with each option set, repeatedly, in
+three modes:
+
+  cold    a new process per compile, with no cache
+  server  through a compile server that keeps its context warm
+  cached  a new process per compile, hitting a warm binary cache
+
+The wall-clock time and peak RSS of every compile are collected, and the
+minimum, median, 90th percentile and maximum are written as JSON (and shown
+as a table). Only Linux is supported, since peak RSS comes from wait4().
+Linux carries the parent's RSS over to the child at fork(), so the peak RSS
+of a small compile reads as at least that of this script.
+"""
+
+from __future__ import print_function
+
+import json
+import optparse
+import os
+import platform
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+OPTION_SETS = [
+    ('default', []),
+    ('fast-math', ['-cl-fast-relaxed-math']),
+    ('opt-disable', ['-cl-opt-disable']),
+    ('define', ['-D', 'TILE=8', '-DNDEBUG']),
+]
+
+MODES = ['cold', 'server', 'cached']
+
+
+def generate_large(path, kernels):
+    """Write a large machine-generated source, as produced by templating."""
+    with open(path, 'w') as f:
+        f.write('// Generated by run_bench.py: %d kernels\n' % kernels)
+        for i in range(kernels):
+            f.write('__kernel void generated_%d(__global float *a, __global const float *b, float s)\n' % i)
+            f.write('{\n')
+            f.write('    size_t i = get_global_id(0);\n')
+            f.write('    float x = b[i] * %d.0f;\n' % (i + 1))
+            for j in range(8):
+                f.write('    x = mad(x, s, %d.%df);\n' % (j, i % 10))
+                f.write('    if (x > %d.0f) x -= a[(i + %d) %% 64];\n' % (i + j, j))
+            f.write('    a[i] = x;\n')
+            f.write('}\n\n')
+
+
+def run(argv, env):
+    """Run a command, returning (exit status, wall seconds, peak RSS in KiB)."""
+    devnull = open(os.devnull, 'w')
+    start = time.time()
+    proc = subprocess.Popen(argv, env=env, stdout=devnull, stderr=subprocess.PIPE)
+    stderr = proc.stderr.read()
+    _, status, rusage = os.wait4(proc.pid, 0)
+    elapsed = time.time() - start
+    proc.returncode = status
+    devnull.close()
+    if os.WIFEXITED(status) and os.WEXITSTATUS(status) == 0:
+        return 0, elapsed, rusage.ru_maxrss
+    sys.stderr.write(stderr.decode('utf-8', 'replace'))
+    return status or 1, elapsed, rusage.ru_maxrss
+
+
+def percentile(values, fraction):
+    """Percentile by linear interpolation between the closest ranks."""
+    values = sorted(values)
+    if not values:
+        return None
+    pos = (len(values) - 1) * fraction
+    lower = int(pos)
+    upper = min(lower + 1, len(values) - 1)
+    return values[lower] + (values[upper] - values[lower]) * (pos - lower)
+
+
+def summarize(values):
+    return {
+        'min': min(values),
+        'median': percentile(values, 0.5),
+        'p90': percentile(values, 0.9),
+        'max': max(values),
+    }
+
+
+def start_server(program, sock, env):
+    proc = subprocess.Popen([program, '--server', sock], env=env)
+    deadline = time.time() + 30
+    while time.time() < deadline:
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            s.connect(sock)
+            return proc
+        except socket.error:
+            time.sleep(0.05)
+        finally:
+            s.close()
+        if proc.poll() is not None:
+            break
+    proc.kill()
+    raise RuntimeError('compile server did not start')
+
+
+def stop_server(proc):
+    """Stop the server, returning its peak RSS in KiB."""
+    proc.terminate()
+    _, _, rusage = os.wait4(proc.pid, 0)
+    proc.returncode = 0
+    return rusage.ru_maxrss
+
+
+def bench_case(opts, workdir, kernel, source, option_set, mode, env):
+    program = os.path.abspath(opts.program)
+    base = [program]
+    if opts.device:
+        base += ['-b', opts.device]
+    argv = base + option_set[1] + ['-o', os.path.join(workdir, 'out.bin'), source]
+    env = dict(env)
+    server = None
+    result = {'kernel': kernel, 'options': option_set[0], 'mode': mode}
+
+    if mode == 'cached':
+        cache_dir = os.path.join(workdir, 'cache')
+        shutil.rmtree(cache_dir, ignore_errors=True)
+        env['ONLINECLC_CACHE_DIR'] = cache_dir
+    elif mode == 'server':
+        sock = os.path.join(workdir, 'server.sock')
+        server = start_server(program, sock, env)
+        env['ONLINECLC_SERVER'] = sock
+
+    walls = []
+    rss = []
+    try:
+        # One untimed run fills the cache or warms the server's context
+        if mode != 'cold':
+            status, _, _ = run(argv, env)
+            if status != 0:
+                result['error'] = 'warm-up compile failed'
+                return result
+        for _ in range(opts.repeat):
+            status, wall, peak = run(argv, env)
+            if status != 0:
+                result['error'] = 'compile failed'
+                return result
+            walls.append(wall * 1000.0)
+            rss.append(peak)
+    finally:
+        if server is not None:
+            result['server_peak_rss_kb'] = stop_server(server)
+
+    result['runs'] = len(walls)
+    result['wall_ms'] = summarize(walls)
+    result['peak_rss_kb'] = summarize(rss)
+    return result
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = optparse.OptionParser(usage='%prog [options]')
+    parser.add_option('--program', default='build/onlineclc', help='onlineclc binary to measure')
+    parser.add_option('--output', default='bench.json', help='JSON file to write the results to')
+    parser.add_option('--repeat', type='int', default=10, help='timed compiles per case')
+    parser.add_option('-b', '--device', default=None, help='device to compile for (passed as -b)')
+    parser.add_option('--corpus', default=here, help='directory containing the *.cl corpus')
+    parser.add_option('--large-kernels', type='int', default=2000,
+                      help='number of kernels in the generated large source (0 to skip)')
+    parser.add_option('--modes', default=','.join(MODES), help='comma-separated modes to run')
+    parser.add_option('--mock', default=None, metavar='DIR',
+                      help='load the stub libOpenCL from DIR, to measure only onlineclc itself')
+    opts, args = parser.parse_args()
+    if args:
+        parser.error('unexpected arguments')
+    modes = opts.modes.split(',')
+    for mode in modes:
+        if mode not in MODES:
+            parser.error('unknown mode %s' % mode)
+
+    env = dict(os.environ)
+    env.pop('ONLINECLC_SERVER', None)
+    env.pop('ONLINECLC_CACHE_DIR', None)
+    if opts.mock:
+        env['LD_LIBRARY_PATH'] = os.path.abspath(opts.mock)
+
+    workdir = tempfile.mkdtemp(prefix='onlineclc-bench.')
+    try:
+        corpus = [(name[:-3], os.path.join(opts.corpus, name))
+                  for name in sorted(os.listdir(opts.corpus)) if name.endswith('.cl')]
+        if opts.large_kernels > 0:
+            large = os.path.join(workdir, 'large.cl')
+            generate_large(large, opts.large_kernels)
+            corpus.append(('large', large))
+
+        results = []
+        print('%-8s %-12s %-7s %10s %10s %10s %10s' %
+              ('kernel', 'options', 'mode', 'min ms', 'median ms', 'p90 ms', 'rss KiB'))
+        for kernel, source in corpus:
+            for option_set in OPTION_SETS:
+                for mode in modes:
+                    result = bench_case(opts, workdir, kernel, source, option_set, mode, env)
+                    results.append(result)
+                    if 'error' in result:
+                        print('%-8s %-12s %-7s %s' % (kernel, option_set[0], mode, result['error']))
+                    else:
+                        wall = result['wall_ms']
+                        print('%-8s %-12s %-7s %10.2f %10.2f %10.2f %10d' %
+                              (kernel, option_set[0], mode, wall['min'], wall['median'], wall['p90'],
+                               result['peak_rss_kb']['max']))
+                    sys.stdout.flush()
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    report = {
+        'program': os.path.abspath(opts.program),
+        'device': opts.device,
+        'host': platform.node(),
+        'kernel_version': platform.release(),
+        'repeat': opts.repeat,
+        'mock': opts.mock is not None,
+        'date': time.strftime('%Y-%m-%dT%H:%M:%SZ', time.gmtime()),
+        'results': results,
+    }
+    with open(opts.output, 'w') as f:
+        json.dump(report, f, indent=2, sort_keys=True)
+        f.write('\n')
+    failed = [r for r in results if 'error' in r]
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
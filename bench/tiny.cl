@@ -0,0 +1,6 @@
+// Smallest useful kernel, to measure the fixed cost of an invocation
+__kernel void copy(__global const float *in, __global float *out)
+{
+    size_t i = get_global_id(0);
+    out[i] = in[i];
+}
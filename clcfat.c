@@ -0,0 +1,303 @@
+/*  OnlineCLC: Front-end to online OpenCL C compiler
+ *  Copyright (C) 2011  Bruce Merry
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Loader for fat binaries: see clcfat.h for the format */
+
+#ifndef _POSIX_C_SOURCE
+# define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "clcfat.h"
+
+struct clcfat
+{
+    const unsigned char *data;
+    size_t size;
+    /* Set if data was mapped by clcfat_open, and must be unmapped */
+    int mapped;
+    uint32_t num_entries;
+    const unsigned char *strings;
+    uint64_t strings_size;
+};
+
+static uint32_t get_u32(const unsigned char *p)
+{
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+    return (uint64_t) get_u32(p) | ((uint64_t) get_u32(p + 4) << 32);
+}
+
+static const unsigned char *entry_at(const clcfat *fat, uint32_t i)
+{
+    return fat->data + CLCFAT_HEADER_SIZE + (size_t) i * CLCFAT_ENTRY_SIZE;
+}
+
+/* Checks that a string reference is within the string table and that the
+ * string is NUL-terminated, so that lookups can use it as it is.
+ */
+static int valid_string(const clcfat *fat, const unsigned char *ref)
+{
+    uint64_t offset = get_u32(ref), len = get_u32(ref + 4);
+    return offset + len < fat->strings_size && fat->strings[offset + len] == '\0';
+}
+
+static const char *get_string(const clcfat *fat, const unsigned char *ref)
+{
+    return (const char *) fat->strings + get_u32(ref);
+}
+
+/* Checks the header and index, so that nothing needs checking later */
+static clcfat_status check_index(clcfat *fat)
+{
+    const unsigned char *h = fat->data;
+    uint64_t strings_offset;
+    uint32_t i;
+
+    if (fat->size < CLCFAT_HEADER_SIZE || memcmp(h, CLCFAT_MAGIC, 8) != 0
+        || get_u32(h + 8) != CLCFAT_VERSION)
+        return CLCFAT_INVALID_FILE;
+    fat->num_entries = get_u32(h + 12);
+    strings_offset = get_u64(h + 24);
+    fat->strings_size = get_u64(h + 32);
+    if ((fat->size - CLCFAT_HEADER_SIZE) / CLCFAT_ENTRY_SIZE < fat->num_entries
+        || strings_offset > fat->size || fat->strings_size > fat->size - strings_offset)
+        return CLCFAT_INVALID_FILE;
+    fat->strings = fat->data + strings_offset;
+    for (i = 0; i < fat->num_entries; i++)
+    {
+        const unsigned char *e = entry_at(fat, i);
+        uint64_t offset = get_u64(e), size = get_u64(e + 8);
+
+        if (offset > fat->size || size > fat->size - offset
+            || !valid_string(fat, e + 24) || !valid_string(fat, e + 32)
+            || !valid_string(fat, e + 40) || !valid_string(fat, e + 48))
+            return CLCFAT_INVALID_FILE;
+    }
+    return CLCFAT_SUCCESS;
+}
+
+clcfat_status clcfat_open_memory(const void *data, size_t size, clcfat **fat)
+{
+    clcfat_status status;
+    clcfat *ans = (clcfat *) malloc(sizeof(clcfat));
+
+    if (ans == NULL)
+        return CLCFAT_OUT_OF_MEMORY;
+    ans->data = (const unsigned char *) data;
+    ans->size = size;
+    ans->mapped = 0;
+    status = check_index(ans);
+    if (status != CLCFAT_SUCCESS)
+    {
+        free(ans);
+        return status;
+    }
+    *fat = ans;
+    return CLCFAT_SUCCESS;
+}
+
+clcfat_status clcfat_open(const char *path, clcfat **fat)
+{
+    struct stat sb;
+    void *addr;
+    int fd, saved_errno;
+    clcfat_status status;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return CLCFAT_IO_ERROR;
+    if (fstat(fd, &sb) != 0)
+    {
+        saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return CLCFAT_IO_ERROR;
+    }
+    if (sb.st_size < CLCFAT_HEADER_SIZE)
+    {
+        close(fd);
+        return CLCFAT_INVALID_FILE;
+    }
+    addr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    saved_errno = errno;
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+        errno = saved_errno;
+        return CLCFAT_IO_ERROR;
+    }
+    status = clcfat_open_memory(addr, sb.st_size, fat);
+    if (status != CLCFAT_SUCCESS)
+        munmap(addr, sb.st_size);
+    else
+        (*fat)->mapped = 1;
+    return status;
+}
+
+void clcfat_close(clcfat *fat)
+{
+    if (fat == NULL)
+        return;
+    if (fat->mapped)
+        munmap((void *) fat->data, fat->size);
+    free(fat);
+}
+
+uint64_t clcfat_options_hash(const char *options)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    int space = 0;
+
+    if (options == NULL)
+        options = "";
+    while (isspace((unsigned char) *options))
+        options++;
+    for (; *options != '\0'; options++)
+    {
+        if (isspace((unsigned char) *options))
+        {
+            space = 1;
+            continue;
+        }
+        if (space)
+        {
+            hash ^= (unsigned char) ' ';
+            hash *= 1099511628211ULL;
+            space = 0;
+        }
+        hash ^= (unsigned char) *options;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+clcfat_status clcfat_find(const clcfat *fat, const char *device_name, const char *driver_version,
+                          const char *options, const unsigned char **binary, size_t *size)
+{
+    uint64_t hash = clcfat_options_hash(options);
+    uint32_t i;
+
+    for (i = 0; i < fat->num_entries; i++)
+    {
+        const unsigned char *e = entry_at(fat, i);
+
+        if (get_u64(e + 16) == hash
+            && 0 == strcmp(get_string(fat, e + 24), device_name)
+            && 0 == strcmp(get_string(fat, e + 32), driver_version))
+        {
+            *binary = fat->data + get_u64(e);
+            *size = (size_t) get_u64(e + 8);
+            return CLCFAT_SUCCESS;
+        }
+    }
+    return CLCFAT_NO_MATCH;
+}
+
+/* Queries a string property of a device, returning a malloced string or
+ * NULL (with the error in *status)
+ */
+static char *device_string(cl_device_id device, cl_device_info param, cl_int *status)
+{
+    size_t len;
+    char *value;
+
+    *status = clGetDeviceInfo(device, param, 0, NULL, &len);
+    if (*status != CL_SUCCESS)
+        return NULL;
+    value = (char *) malloc(len + 1);
+    if (value == NULL)
+    {
+        *status = CL_OUT_OF_HOST_MEMORY;
+        return NULL;
+    }
+    *status = clGetDeviceInfo(device, param, len, value, NULL);
+    if (*status != CL_SUCCESS)
+    {
+        free(value);
+        return NULL;
+    }
+    value[len] = '\0';
+    return value;
+}
+
+clcfat_status clcfat_create_program(const clcfat *fat, cl_context ctx, cl_device_id device,
+                                    const char *options, cl_program *program, cl_int *cl_status)
+{
+    char *name, *driver = NULL;
+    const unsigned char *binary;
+    size_t size;
+    cl_int status, binary_status;
+    clcfat_status ret;
+
+    name = device_string(device, CL_DEVICE_NAME, &status);
+    if (name != NULL)
+        driver = device_string(device, CL_DRIVER_VERSION, &status);
+    if (driver == NULL)
+    {
+        free(name);
+        if (cl_status != NULL)
+            *cl_status = status;
+        return CLCFAT_CL_ERROR;
+    }
+    ret = clcfat_find(fat, name, driver, options, &binary, &size);
+    free(name);
+    free(driver);
+    if (ret != CLCFAT_SUCCESS)
+        return ret;
+
+    *program = clCreateProgramWithBinary(ctx, 1, &device, &size, &binary, &binary_status, &status);
+    if (status == CL_SUCCESS)
+        status = binary_status;
+    if (status == CL_SUCCESS)
+        status = clBuildProgram(*program, 1, &device, options != NULL ? options : "", NULL, NULL);
+    if (status != CL_SUCCESS)
+    {
+        /* A program may be created even though the binary was rejected */
+        if (*program != NULL)
+            clReleaseProgram(*program);
+        *program = NULL;
+        if (cl_status != NULL)
+            *cl_status = status;
+        return CLCFAT_CL_ERROR;
+    }
+    return CLCFAT_SUCCESS;
+}
+
+const char *clcfat_status_string(clcfat_status status)
+{
+    switch (status)
+    {
+    case CLCFAT_SUCCESS: return "success";
+    case CLCFAT_NO_MATCH: return "no binary for the device";
+    case CLCFAT_IO_ERROR: return "could not read the file";
+    case CLCFAT_INVALID_FILE: return "not a valid fat binary";
+    case CLCFAT_CL_ERROR: return "OpenCL call failed";
+    case CLCFAT_OUT_OF_MEMORY: return "out of memory";
+    }
+    return "unknown status";
+}
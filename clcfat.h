@@ -0,0 +1,127 @@
+/*  OnlineCLC: Front-end to online OpenCL C compiler
+ *  Copyright (C) 2011  Bruce Merry
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Loader for the fat binaries written by onlineclc --emit fat, which hold
+ * binaries of one program for several devices (and options). A fat binary
+ * is mapped into memory as it is, and the binary for a device is handed to
+ * clCreateProgramWithBinary straight from the mapping.
+ *
+ * Layout of a fat binary, with all integers little-endian:
+ *
+ *   header (CLCFAT_HEADER_SIZE bytes)
+ *      0  magic, CLCFAT_MAGIC (8 bytes)
+ *      8  format version, CLCFAT_VERSION (u32)
+ *     12  number of entries (u32)
+ *     16  alignment of the binaries, a multiple of the page size (u32)
+ *     20  reserved, 0 (u32)
+ *     24  offset of the string table (u64)
+ *     32  size of the string table (u64)
+ *     40  reserved, 0 (24 bytes)
+ *   index (CLCFAT_ENTRY_SIZE bytes per entry, following the header)
+ *      0  offset of the binary, a multiple of the alignment (u64)
+ *      8  size of the binary (u64)
+ *     16  clcfat_options_hash of the build options (u64)
+ *     24  device name (CL_DEVICE_NAME), as a string reference
+ *     32  driver version (CL_DRIVER_VERSION), as a string reference
+ *     40  device version (CL_DEVICE_VERSION), as a string reference
+ *     48  build options, as a string reference
+ *     56  reserved, 0 (u64)
+ *   string table
+ *   binaries
+ *
+ * A string reference is the offset of the string in the string table (u32)
+ * followed by its length (u32); the string is also NUL-terminated.
+ */
+
+#ifndef CLCFAT_H
+#define CLCFAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CLCFAT_MAGIC "CLCFAT\r\n"
+#define CLCFAT_VERSION 1
+#define CLCFAT_HEADER_SIZE 64
+#define CLCFAT_ENTRY_SIZE 64
+
+/* An open fat binary */
+typedef struct clcfat clcfat;
+
+typedef enum
+{
+    CLCFAT_SUCCESS = 0,
+    CLCFAT_NO_MATCH,        /* there is no binary for the device and options */
+    CLCFAT_IO_ERROR,        /* the file could not be opened or mapped (see errno) */
+    CLCFAT_INVALID_FILE,    /* the file is not a fat binary, or is damaged */
+    CLCFAT_CL_ERROR,        /* an OpenCL call failed */
+    CLCFAT_OUT_OF_MEMORY
+} clcfat_status;
+
+/* Maps a fat binary file into memory and checks its index. On success,
+ * *fat is set to a handle to be released with clcfat_close.
+ */
+clcfat_status clcfat_open(const char *path, clcfat **fat);
+
+/* As clcfat_open, for a fat binary already in memory (such as one built
+ * into the application with --emit c). The memory is not copied, and must
+ * outlive the handle.
+ */
+clcfat_status clcfat_open_memory(const void *data, size_t size, clcfat **fat);
+
+void clcfat_close(clcfat *fat);
+
+/* The hash by which entries are keyed by their build options: 64-bit
+ * FNV-1a of the options string, with NULL treated as "". Leading and
+ * trailing white space are ignored and other runs of white space count as
+ * a single space, so "-DN=4  -DM=2 " and "-DN=4 -DM=2" hash alike.
+ */
+uint64_t clcfat_options_hash(const char *options);
+
+/* Finds the binary for a device, by its name and driver version, built
+ * with options. On success, *binary points into the fat binary and *size
+ * is its size. Returns CLCFAT_NO_MATCH if there is none, in which case the
+ * application should build the program from source.
+ */
+clcfat_status clcfat_find(const clcfat *fat, const char *device_name, const char *driver_version,
+                          const char *options, const unsigned char **binary, size_t *size);
+
+/* Finds the binary for device, as clcfat_find, and creates and builds a
+ * program from it with clCreateProgramWithBinary and clBuildProgram. If an
+ * OpenCL call fails, returns CLCFAT_CL_ERROR with the error code stored in
+ * *cl_status (if cl_status is not NULL), and *program set to NULL.
+ */
+clcfat_status clcfat_create_program(const clcfat *fat, cl_context ctx, cl_device_id device,
+                                    const char *options, cl_program *program, cl_int *cl_status);
+
+/* Describes a status, for messages */
+const char *clcfat_status_string(clcfat_status status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CLCFAT_H */
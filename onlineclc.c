@@ -40,12 +40,97 @@
 #include <errno.h>
 #include <assert.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <dirent.h>
+#include <utime.h>
+#include <time.h>
+#include <poll.h>
+#include <dlfcn.h>
+#ifdef __linux__
+# include <sys/inotify.h>
+#endif
+
+/* Size limit for the binary cache if --cache-size is not given */
+#define ONLINECLC_DEFAULT_CACHE_SIZE (1024ULL * 1024 * 1024)
 
 #ifdef __APPLE__
 #include <OpenCL/cl.h>
 #else
 #include <CL/cl.h>
 #endif
+#include "clcfat.h"
+#include "onlineclc.h"
+
+/* Returned by the ICD loader when there are no platforms (from cl_ext.h) */
+#ifndef CL_PLATFORM_NOT_FOUND_KHR
+# define CL_PLATFORM_NOT_FOUND_KHR -1001
+#endif
+
+/* ELF machine and flags of objects written by --emit elf for the host, or
+ * a machine of 0 if the host is not known
+ */
+#if defined(__x86_64__)
+# define ELF_HOST_MACHINE 62
+# define ELF_HOST_FLAGS 0
+#elif defined(__i386__)
+# define ELF_HOST_MACHINE 3
+# define ELF_HOST_FLAGS 0
+#elif defined(__aarch64__)
+# define ELF_HOST_MACHINE 183
+# define ELF_HOST_FLAGS 0
+#elif defined(__arm__)
+# define ELF_HOST_MACHINE 40
+# if defined(__ARM_PCS_VFP)
+#  define ELF_HOST_FLAGS 0x05000400     /* EABI version 5, hard float */
+# else
+#  define ELF_HOST_FLAGS 0x05000200     /* EABI version 5, soft float */
+# endif
+#elif defined(__powerpc64__)
+# define ELF_HOST_MACHINE 21
+# if defined(_CALL_ELF) && _CALL_ELF == 2
+#  define ELF_HOST_FLAGS 2
+# else
+#  define ELF_HOST_FLAGS 1
+# endif
+#elif defined(__powerpc__)
+# define ELF_HOST_MACHINE 20
+# define ELF_HOST_FLAGS 0
+#elif defined(__riscv)
+# define ELF_HOST_MACHINE 243
+# if defined(__riscv_float_abi_double)
+#  define ELF_HOST_FLOAT_ABI 4
+# elif defined(__riscv_float_abi_single)
+#  define ELF_HOST_FLOAT_ABI 2
+# else
+#  define ELF_HOST_FLOAT_ABI 0
+# endif
+# if defined(__riscv_compressed)
+#  define ELF_HOST_FLAGS (ELF_HOST_FLOAT_ABI | 1)
+# else
+#  define ELF_HOST_FLAGS ELF_HOST_FLOAT_ABI
+# endif
+#elif defined(__s390x__)
+# define ELF_HOST_MACHINE 22
+# define ELF_HOST_FLAGS 0
+#else
+# define ELF_HOST_MACHINE 0
+# define ELF_HOST_FLAGS 0
+#endif
+
+/* Output formats for --emit */
+typedef enum
+{
+    EMIT_BINARY,        /* the binary as it is */
+    EMIT_C,             /* a C source defining the binary */
+    EMIT_HEADER,        /* a C header defining the binary with static linkage */
+    EMIT_ELF,           /* a relocatable object for the host */
+    EMIT_FAT            /* a fat binary (see clcfat.h) */
+} emit_format;
 
 /* Holds state associated with a compilation */
 typedef struct
@@ -56,6 +141,10 @@ typedef struct
     size_t len;
     /* Space allocated for options */
     size_t size;
+    /* Options to pass to clLinkProgram with --link, held like the above */
+    char *link_options;
+    size_t link_len;
+    size_t link_size;
 
     /* -b command-line option, or NULL if not given
      * A shallow copy from argv, do not free.
@@ -65,611 +154,9425 @@ typedef struct
      * A shallow copy from argv, do not free.
      */
     const char *output_filename;
-    /* Source filename from command line (cannot be NULL)
+    /* Source filename from command line (NULL only in batch mode)
      * A shallow copy from argv, do not free.
      */
     const char *source_filename;
+    /* --batch command-line option, or NULL if not given
+     * A shallow copy from argv, do not free.
+     */
+    const char *batch_filename;
+    /* --server command-line option, or NULL if not given
+     * A shallow copy from argv, do not free.
+     */
+    const char *server_socket;
+    /* --cache-dir command-line option, or $ONLINECLC_CACHE_DIR, or NULL if
+     * caching is disabled. Do not free.
+     */
+    const char *cache_dir;
+    /* Size limit for the cache, in bytes */
+    unsigned long long cache_size;
+    /* Maximum number of concurrent builds (-j) */
+    unsigned int jobs;
+    /* Memory that concurrent builds may use (--mem-budget), or 0 */
+    unsigned long long mem_budget;
+    /* Set if --build-stats was given */
+    int build_stats;
+    /* Wall-clock limit on each build in seconds (--timeout), or 0 */
+    double timeout;
+    /* --icd command-line option, or $ONLINECLC_ICD, or NULL to use the ICD
+     * loader. Do not free.
+     */
+    const char *icd;
+    /* Set if --all-devices was given */
+    int all_devices;
+    /* Set if --time was given */
+    int time;
+    /* --trace command-line option, or NULL if not given
+     * A shallow copy from argv, do not free.
+     */
+    const char *trace_filename;
+    /* Directories given with -I, in order. The array is dynamically
+     * allocated, but the strings are shallow copies from argv.
+     */
+    const char **include_dirs;
+    size_t num_include_dirs;
+    /* Set if -MD or -MMD was given */
+    int depfile;
+    /* Set if -MP was given */
+    int depfile_phony;
+    /* -MF and -MT command-line options, or NULL if not given
+     * Shallow copies from argv, do not free.
+     */
+    const char *depfile_filename;
+    const char *depfile_target;
+    /* Set if -c was given, to compile to an object rather than build */
+    int compile_only;
+    /* Set if --link was given */
+    int link;
+    /* Files to link with --link, in order. The array is dynamically
+     * allocated, but the strings are shallow copies from argv.
+     */
+    const char **inputs;
+    size_t num_inputs;
+    /* Set if --bundle-headers was given */
+    int bundle_headers;
+    /* Arguments of --sweep (NAME=v1,v2,...), in order. The array is
+     * dynamically allocated, but the strings are shallow copies from argv.
+     */
+    const char **sweeps;
+    size_t num_sweeps;
+    /* --report command-line option, or NULL if not given
+     * A shallow copy from argv, do not free.
+     */
+    const char *report_filename;
+    /* Set if --report-format json was given */
+    int report_json;
+    /* Set if --kernel-info was given */
+    int kernel_info;
+    /* Set if --verify-binary was given */
+    int verify_binary;
+    /* Set if --watch was given */
+    int watch;
+    /* Set if --spirv was given, to take the source as SPIR-V */
+    int spirv;
+    /* Number of timed builds of each kind for --verify-binary (--verify-runs) */
+    unsigned int verify_runs;
+    /* --emit command-line option */
+    emit_format emit;
+    /* --symbol command-line option, or NULL if not given
+     * A shallow copy from argv, do not free.
+     */
+    const char *symbol;
 } compiler_options;
 
-/* Assorted CL objects */
+/* Options parsed for the library interface */
+struct onlineclc_options
+{
+    compiler_options options;
+    /* Copies of the arguments, to which options points, or NULL if the
+     * options belong to the command-line tool
+     */
+    char **argv;
+    int argc;
+};
+
+/* A device selected through the library interface, and a context on it */
+struct onlineclc_session
+{
+    cl_device_id device;
+    /* Created when first needed, and protected by lock. It never changes
+     * once set.
+     */
+    cl_context ctx;
+    pthread_mutex_t lock;
+};
+
+/* How the chunks of a source_text are held, to know how to release them */
+typedef enum
+{
+    SOURCE_BORROWED,    /* owned by someone else */
+    SOURCE_MAPPED,      /* a single chunk mapped with mmap */
+    SOURCE_ALLOCATED    /* each chunk allocated with malloc */
+} source_storage;
+
+/* Contents of a source file, loaded by load_source. A regular file is
+ * mapped as a single chunk, while a pipe is read into a list of chunks that
+ * are passed to the compiler as separate fragments, so that a large source
+ * never needs to be contiguous in memory.
+ */
+typedef struct
+{
+    /* Filename to show in messages and #line ("<stdin>" for -) */
+    const char *name;
+    const char **chunks;
+    size_t *chunk_lens;
+    size_t num_chunks;
+    /* Total length of all the chunks */
+    size_t len;
+    source_storage storage;
+} source_text;
+
+/* State of a SHA-256 computation */
+typedef struct
+{
+    uint32_t state[8];
+    /* Total number of bytes hashed so far */
+    uint64_t bytes;
+    /* Partial block, holding bytes % 64 bytes */
+    unsigned char block[64];
+} sha256_context;
+
+/* A cache key, which is a SHA-256 hash of the inputs to the compiler */
+typedef struct
+{
+    unsigned char hash[32];
+    /* Hash in hexadecimal, used as the filename in the cache */
+    char hex[65];
+} cache_key;
+
+/* Memory and CPU time used by a build */
+typedef struct
+{
+    double cpu_ms;
+    /* Highest RSS of the process during the build, less its RSS when the
+     * build started, in bytes (0 if the RSS cannot be read)
+     */
+    unsigned long long peak_rss;
+    /* Set if other builds ran at the same time, in which case the figures
+     * include what they used
+     */
+    int shared;
+} build_usage;
+
+/* Outcome of building for one device in --all-devices mode */
+typedef struct
+{
+    cl_device_id device;
+    /* Set if the build is satisfied from the cache */
+    int cached;
+    cl_int status;
+    /* Dynamically allocated build log and binary (either may be NULL) */
+    char *log;
+    size_t log_len;
+    unsigned char *binary;
+    size_t binary_size;
+    /* What the build used (for all the devices of the platform) */
+    build_usage used;
+} device_build;
+
+/* The devices of one platform in --all-devices mode, which are built in a
+ * single clBuildProgram call (in a thread of their own).
+ */
+typedef struct
+{
+    const compiler_options *options;
+    const source_text *src;
+    /* The builds for this platform that were not satisfied from the cache */
+    device_build **builds;
+    cl_uint num_builds;
+} platform_build;
+
+/* One line of a batch list file */
+typedef struct
+{
+    /* Both dynamically allocated; output_filename is NULL if not given */
+    char *source_filename;
+    char *output_filename;
+} batch_entry;
+
+/* Work shared between the threads compiling a batch. The CL objects are
+ * shared by all the threads; only next and failed are mutable, and they are
+ * protected by lock.
+ */
 typedef struct
 {
+    const compiler_options *options;
     cl_device_id device;
     cl_context ctx;
-    cl_program program;
-} state;
 
-/* Prints msg (printf-style) and kills the process */
-static void die(int exitcode, const char *msg, ...)
+    batch_entry *entries;
+    size_t num_entries;
+    /* Index of the next entry to be claimed by a worker */
+    size_t next;
+    /* Set to 1 if any of the sources failed to build */
+    int failed;
+    /* Set to 1 if any of the builds timed out */
+    int timed_out;
+    pthread_mutex_t lock;
+} batch;
+
+/* Redirection of diagnostics for the current thread. The compile server
+ * installs one of these while handling a request, so that messages are
+ * returned to the client and fatal errors end only the request, not the
+ * server. Memory and CL objects held at the time of the error are leaked.
+ */
+typedef struct
 {
-    va_list ap;
+    /* Stream that receives messages in place of stderr */
+    FILE *messages;
+    /* Jumped to with exit code + 1 in place of exit() */
+    jmp_buf trap;
+} diagnostics;
 
-    va_start(ap, msg);
-    vfprintf(stderr, msg, ap);
-    va_end(ap);
-    fprintf(stderr, "\n");
-    exit(exitcode);
+static pthread_key_t diagnostics_key;
+static pthread_once_t diagnostics_once = PTHREAD_ONCE_INIT;
+
+static void diagnostics_init(void)
+{
+    pthread_key_create(&diagnostics_key, NULL);
 }
 
-/* Prints msg (printf-style) followed by perror(), and kills the process */
-static void pdie(int exitcode, const char *msg, ...)
+/* Returns the diagnostics redirection for this thread, or NULL */
+static diagnostics *get_diagnostics(void)
 {
-    va_list ap;
+    pthread_once(&diagnostics_once, diagnostics_init);
+    return (diagnostics *) pthread_getspecific(diagnostics_key);
+}
 
-    va_start(ap, msg);
-    vfprintf(stderr, msg, ap);
-    va_end(ap);
-    fputs(": ", stderr);
-    perror(NULL);
-    exit(exitcode);
+static void set_diagnostics(diagnostics *diag)
+{
+    pthread_once(&diagnostics_once, diagnostics_init);
+    pthread_setspecific(diagnostics_key, diag);
 }
 
-static void *onlineclc_malloc(size_t size, const char *purpose)
+/* Returns the stream to which messages should be written (normally stderr) */
+static FILE *message_stream(void)
 {
-    void *ptr = malloc(size);
-    if (ptr == NULL)
-        die(1, "Failed to allocate %zu bytes for %s", size, purpose);
-    return ptr;
+    diagnostics *diag = get_diagnostics();
+    return diag != NULL ? diag->messages : stderr;
 }
 
-/* Returns the string form of an OpenCL error code,
- * as a static string.
+/* Reads back the messages written to a diagnostics stream. Returns a
+ * NUL-terminated copy (dynamically allocated) and stores its length in *len,
+ * or returns NULL with *len of 0 if there were none or they could not be
+ * read. This does not fail, since it runs outside the trap.
  */
-static const char *error_to_string(cl_int error)
+static char *read_messages(FILE *messages, size_t *len)
 {
-#define ERROR_CASE(name) case name: return #name
-    switch (error)
+    long size;
+    char *ans;
+
+    *len = 0;
+    fflush(messages);
+    size = ftell(messages);
+    if (size <= 0)
+        return NULL;
+    ans = (char *) malloc(size + 1);
+    rewind(messages);
+    if (ans == NULL || fread(ans, 1, size, messages) != (size_t) size)
     {
-        ERROR_CASE(CL_DEVICE_NOT_AVAILABLE);
-        ERROR_CASE(CL_DEVICE_NOT_FOUND);
-        ERROR_CASE(CL_INVALID_BINARY);
-        ERROR_CASE(CL_INVALID_BUILD_OPTIONS);
-        ERROR_CASE(CL_INVALID_DEVICE);
-        ERROR_CASE(CL_INVALID_DEVICE_TYPE);
-        ERROR_CASE(CL_INVALID_OPERATION);
-        ERROR_CASE(CL_INVALID_PLATFORM);
-        ERROR_CASE(CL_INVALID_PROGRAM);
-        ERROR_CASE(CL_INVALID_VALUE);
-        ERROR_CASE(CL_OUT_OF_HOST_MEMORY);
-    default:
-        return "unknown error";
+        free(ans);
+        return NULL;
     }
-#undef ERROR_CASE
+    ans[size] = '\0';
+    *len = size;
+    return ans;
 }
 
-/* Prints msg (printf-style) and an explanation of a CL error code, and
- * kills the process.
+/* Kills the process, or just the current server request */
+static void terminate(int exitcode)
+{
+    diagnostics *diag = get_diagnostics();
+    if (diag != NULL)
+        longjmp(diag->trap, exitcode + 1);
+    exit(exitcode);
+}
+
+/* Prints msg (printf-style) to the message stream, followed by ": detail"
+ * if detail is not NULL
  */
-static void die_cl(cl_int status, int exitcode, const char *msg, ...)
+static void vreport(const char *detail, const char *msg, va_list ap)
+{
+    FILE *out = message_stream();
+
+    vfprintf(out, msg, ap);
+    if (detail != NULL)
+        fprintf(out, ": %s\n", detail);
+    else
+        fprintf(out, "\n");
+}
+
+/* Prints msg (printf-style), for an error that the caller recovers from */
+static void report(const char *msg, ...)
 {
     va_list ap;
 
     va_start(ap, msg);
-    vfprintf(stderr, msg, ap);
+    vreport(NULL, msg, ap);
     va_end(ap);
-    fprintf(stderr, ": Error code %d (%s)\n",
-            (int) status, error_to_string(status));
-    exit(exitcode);
 }
 
-/* Finds the device ID for a device with the given name. If device_name is
- * NULL, matches any device. If the device could not be found, kills the
- * process.
+/* Prints msg (printf-style) followed by strerror(errno), for an error that
+ * the caller recovers from
  */
-static cl_device_id find_device(const char *device_name)
+static void preport(const char *msg, ...)
 {
-    size_t size;
-    cl_int status;
-
-    cl_uint num_platforms, i;
-    cl_platform_id *platforms;
-
-    cl_device_id ans = NULL;
-    cl_uint total_devices = 0;
-    cl_uint match_devices = 0;
+    const char *err = strerror(errno);
+    va_list ap;
 
-    /* Get number of available platforms */
-    status = clGetPlatformIDs(0, NULL, &num_platforms);
-    if (status != CL_SUCCESS)
-        die_cl(status, 1, "Failed to get platform ID count");
-    if (num_platforms == 0)
-        die_cl(status, 1, "No OpenCL platforms found");
+    va_start(ap, msg);
+    vreport(err, msg, ap);
+    va_end(ap);
+}
 
-    /* Get a list of platforms */
-    size = sizeof(cl_platform_id) * num_platforms;
-    platforms = (cl_platform_id *) onlineclc_malloc(size, "platform IDs");
-    status = clGetPlatformIDs(num_platforms, platforms, NULL);
-    if (status != CL_SUCCESS)
-        die_cl(status, 1, "Failed to get platform IDs");
+/* Prints msg (printf-style) and kills the process */
+static void die(int exitcode, const char *msg, ...)
+{
+    va_list ap;
 
-    for (i = 0; i < num_platforms; i++)
-    {
-        cl_device_id *devices;
-        cl_uint num_devices, j;
+    va_start(ap, msg);
+    vreport(NULL, msg, ap);
+    va_end(ap);
+    terminate(exitcode);
+}
 
-        /* Get number of available devices for the platform */
-        status = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 0, NULL, &num_devices);
-        if (status != CL_SUCCESS)
-            die_cl(status, 1, "Failed to get device ID count");
-        total_devices += num_devices;
+#if !ONLINECLC_LIBRARY
+/* Prints msg (printf-style) followed by strerror(errno), and kills the
+ * process
+ */
+static void pdie(int exitcode, const char *msg, ...)
+{
+    const char *err = strerror(errno);
+    va_list ap;
 
-        /* Early-out to avoid allocating zero bytes, which doesn't always work
-         * on all platforms.
-         */
-        if (num_devices == 0)
-            continue;
+    va_start(ap, msg);
+    vreport(err, msg, ap);
+    va_end(ap);
+    terminate(exitcode);
+}
+#endif /* !ONLINECLC_LIBRARY */
 
-        size = sizeof(cl_device_id) * num_devices;
-        devices = (cl_device_id *) onlineclc_malloc(size, "device IDs");
-        status = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, num_devices, devices, NULL);
-        if (status != CL_SUCCESS)
-            die_cl(status, 1, "Failed to get device IDs");
+/* Allocates memory, or reports the failure and returns NULL */
+static void *try_malloc(size_t size, const char *purpose)
+{
+    void *ptr = malloc(size);
+    if (ptr == NULL)
+        report("Failed to allocate %zu bytes for %s", size, purpose);
+    return ptr;
+}
 
-        for (j = 0; j < num_devices; j++)
-        {
-            size_t name_len;
-            char *name;
+#if !ONLINECLC_LIBRARY
+static void *onlineclc_malloc(size_t size, const char *purpose)
+{
+    void *ptr = try_malloc(size, purpose);
+    if (ptr == NULL)
+        terminate(1);
+    return ptr;
+}
+#endif /* !ONLINECLC_LIBRARY */
 
-            /* Determine space needed for the name */
-            status = clGetDeviceInfo(devices[j], CL_DEVICE_NAME, 0, NULL, &name_len);
-            if (status != CL_SUCCESS)
-                die_cl(status, 1, "Failed to query device name length");
-            name = (char *) onlineclc_malloc(name_len * sizeof(char), "device names");
-            status = clGetDeviceInfo(devices[j], CL_DEVICE_NAME, name_len, name, NULL);
-            if (status != CL_SUCCESS)
-                die_cl(status, 1, "Failed to query device name");
+/* Returns a dynamically allocated copy of the first len bytes of str, or
+ * reports the failure and returns NULL
+ */
+static char *try_strndup(const char *str, size_t len, const char *purpose)
+{
+    char *copy = (char *) try_malloc((len + 1) * sizeof(char), purpose);
+    if (copy == NULL)
+        return NULL;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
 
-            if (device_name == NULL || strcmp(name, device_name) == 0)
-            {
-                /* Match found */
-                /* TODO: check that the device supports online compilation */
-                if (match_devices == 0)
-                    ans = devices[j];
-                match_devices++;
-            }
-            free(name);
-        }
-        free(devices);
-    }
-    free(platforms);
+#if !ONLINECLC_LIBRARY
+/* Returns a dynamically allocated copy of the first len bytes of str */
+static char *onlineclc_strndup(const char *str, size_t len, const char *purpose)
+{
+    char *copy = try_strndup(str, len, purpose);
+    if (copy == NULL)
+        terminate(1);
+    return copy;
+}
+#endif /* !ONLINECLC_LIBRARY */
 
-    if (total_devices == 0)
-        die(1, "No OpenCL devices found");
-    else if (match_devices == 0)
+/* Writes exactly len bytes, returning 0 on success or -1 on failure */
+static int write_all(int fd, const void *data, size_t len)
+{
+    const char *ptr = (const char *) data;
+    while (len > 0)
     {
-        assert(device_name != NULL);
-        die(1, "No OpenCL device called `%s' found", device_name);
+        ssize_t written = write(fd, ptr, len);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        ptr += written;
+        len -= written;
     }
+    return 0;
+}
 
-    if (match_devices > 1)
+/* Reads exactly len bytes, returning 0 on success or -1 on failure or EOF */
+static int read_all(int fd, void *data, size_t len)
+{
+    char *ptr = (char *) data;
+    while (len > 0)
     {
-        fprintf(stderr, "Warning: multiple devices match, using the first one\n");
+        ssize_t got = read(fd, ptr, len);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        ptr += got;
+        len -= got;
     }
-    return ans;
+    return 0;
 }
 
-/* Create an OpenCL context for device, and kill the process on failure.
- */
-static cl_context create_context(cl_device_id device)
+/* A growable string, for assembling reports */
+typedef struct
 {
-    cl_context ctx;
-    cl_int status;
-    cl_context_properties props[3];
-    cl_platform_id platform;
+    char *data;
+    size_t len;
+    size_t size;
+} string_buffer;
 
-    status = clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL);
-    if (status != CL_SUCCESS)
-        die_cl(status, 1, "Failed to query platform from device");
+/* Appends len bytes to a buffer. Returns 0, or -1 if there is no memory
+ * (which is reported, and leaves the buffer as it was).
+ */
+static int try_buffer_append(string_buffer *buf, const char *data, size_t len)
+{
+    if (buf->len + len + 1 > buf->size)
+    {
+        size_t new_size = buf->size == 0 ? 256 : buf->size;
+        char *grown;
 
-    props[0] = CL_CONTEXT_PLATFORM;
-    props[1] = (cl_context_properties) platform;
-    props[2] = 0;
+        while (buf->len + len + 1 > new_size)
+            new_size *= 2;
+        grown = (char *) realloc(buf->data, new_size);
+        if (grown == NULL)
+        {
+            report("Out of memory trying to allocate %zu bytes", new_size);
+            return -1;
+        }
+        buf->data = grown;
+        buf->size = new_size;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+    return 0;
+}
 
-    ctx = clCreateContext(props, 1, &device, NULL, NULL, &status);
-    if (status != CL_SUCCESS)
-        die_cl(status, 1, "Failed to create OpenCL context");
-    return ctx;
+static void buffer_append(string_buffer *buf, const char *data, size_t len)
+{
+    if (try_buffer_append(buf, data, len) != 0)
+        terminate(1);
 }
 
-/* Writes the build log to the output. Does not check for errors on the
- * output stream.
- */
-static void dump_build_log(FILE *out, cl_program program, cl_device_id device)
+/* Appends formatted text to a buffer, as for try_buffer_append */
+static int try_buffer_vprintf(string_buffer *buf, const char *fmt, va_list ap)
 {
-    cl_int status;
-    char *build_log;
-    size_t len;
+    char small[256];
+    va_list copy;
+    char *big;
+    int len, ret;
 
-    status = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &len);
-    if (status != CL_SUCCESS)
-        die_cl(status, 1, "Failed to get length of build log");
+    va_copy(copy, ap);
+    len = vsnprintf(small, sizeof(small), fmt, copy);
+    va_end(copy);
+    if (len < (int) sizeof(small))
+        return try_buffer_append(buf, small, len);
+    big = (char *) try_malloc(len + 1, "a report");
+    if (big == NULL)
+        return -1;
+    vsnprintf(big, len + 1, fmt, ap);
+    ret = try_buffer_append(buf, big, len);
+    free(big);
+    return ret;
+}
 
-    /* Early-out to avoid dealing with malloc(0) */
-    if (len == 0)
-        return;
+static int try_buffer_printf(string_buffer *buf, const char *fmt, ...)
+{
+    va_list ap;
+    int ret;
 
-    build_log = (char *) onlineclc_malloc(len * sizeof(char), "the build log");
+    va_start(ap, fmt);
+    ret = try_buffer_vprintf(buf, fmt, ap);
+    va_end(ap);
+    return ret;
+}
 
-    status = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, len, build_log, NULL);
-    if (status != CL_SUCCESS)
-        die_cl(status, 1, "Failed to get build log");
-    /* The CL implementation should null-terminate itself; this is just to
-     * protect against bugs.
-     */
-    build_log[len - 1] = '\0';
+static void buffer_printf(string_buffer *buf, const char *fmt, ...)
+{
+    va_list ap;
+    int ret;
 
-    fputs(build_log, out);
-    /* Add a trailing newline if required */
-    if (len >= 2 && build_log[len - 2] != '\n')
-        fputs("\n", out);
-    free(build_log);
+    va_start(ap, fmt);
+    ret = try_buffer_vprintf(buf, fmt, ap);
+    va_end(ap);
+    if (ret != 0)
+        terminate(1);
 }
 
-/* Checks whether c may appear unencoded in a string literal. According to C99,
- * string literals may contain characters from the source character set except
- * for double-quote, backslash or newline. To be safe, we also exclude '?'
- * since it can form trigraphs.
- *
- * C99 does not specify the extended source character set, so we consider only
- * the basic character set.
- */
-static int safe_for_string_literal(char c)
+/* Appends str as a quoted JSON string */
+static void buffer_append_json_string(string_buffer *buf, const char *str)
+{
+    buffer_append(buf, "\"", 1);
+    for (; *str != '\0'; str++)
+    {
+        unsigned char c = (unsigned char) *str;
+        if (c == '"' || c == '\\')
+        {
+            buffer_append(buf, "\\", 1);
+            buffer_append(buf, str, 1);
+        }
+        else if (c < 0x20)
+            buffer_printf(buf, "\\u%04x", c);
+        else
+            buffer_append(buf, str, 1);
+    }
+    buffer_append(buf, "\"", 1);
+}
+
+/* Start of a phase timed for --time and --trace */
+typedef struct
+{
+    struct timespec wall;
+    struct timespec cpu;
+} phase_timer;
+
+/* Where phase timings go. This is shared by all threads, and set up once by
+ * profile_start.
+ */
+typedef struct
+{
+    /* Set if timings are printed as messages (--time) */
+    int report;
+    /* File that trace events are added to (--trace), or NULL */
+    const char *trace_filename;
+    /* Trace events not yet written, protected by lock */
+    string_buffer events;
+    unsigned int next_tid;
+    pthread_mutex_t lock;
+} profiler;
+
+static profiler profile = { 0, NULL, { NULL, 0, 0 }, 0, PTHREAD_MUTEX_INITIALIZER };
+static pthread_key_t trace_tid_key;
+static pthread_once_t trace_tid_once = PTHREAD_ONCE_INIT;
+
+static void trace_tid_init(void)
+{
+    pthread_key_create(&trace_tid_key, NULL);
+}
+
+/* Returns a small number identifying the calling thread in the trace */
+static unsigned int trace_tid(void)
+{
+    uintptr_t tid;
+
+    pthread_once(&trace_tid_once, trace_tid_init);
+    tid = (uintptr_t) pthread_getspecific(trace_tid_key);
+    if (tid == 0)
+    {
+        pthread_mutex_lock(&profile.lock);
+        tid = ++profile.next_tid;
+        pthread_mutex_unlock(&profile.lock);
+        pthread_setspecific(trace_tid_key, (void *) tid);
+    }
+    return (unsigned int) tid;
+}
+
+static double elapsed_us(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e6 + (end->tv_nsec - start->tv_nsec) * 1e-3;
+}
+
+static void phase_begin(phase_timer *timer)
+{
+    if (!profile.report && profile.trace_filename == NULL)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &timer->wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &timer->cpu);
+}
+
+/* Records the end of a phase started with phase_begin. The detail (which may
+ * be NULL) says what the phase worked on, typically a filename.
+ */
+static void phase_end(const phase_timer *timer, const char *phase, const char *detail)
+{
+    struct timespec wall, cpu;
+    double wall_us, cpu_us;
+    string_buffer event = { NULL, 0, 0 };
+
+    if (!profile.report && profile.trace_filename == NULL)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    wall_us = elapsed_us(&timer->wall, &wall);
+    cpu_us = elapsed_us(&timer->cpu, &cpu);
+
+    if (profile.report)
+    {
+        FILE *out = message_stream();
+        flockfile(out);
+        fprintf(out, "Time: %-17s %10.3f ms wall %10.3f ms CPU", phase, wall_us / 1000, cpu_us / 1000);
+        if (detail != NULL)
+            fprintf(out, "  %s", detail);
+        fprintf(out, "\n");
+        funlockfile(out);
+    }
+    if (profile.trace_filename != NULL)
+    {
+        /* Timestamps come from the monotonic clock, which is shared by all
+         * processes, so traces from several invocations line up.
+         */
+        buffer_append(&event, "{\"name\":", 8);
+        buffer_append_json_string(&event, phase);
+        buffer_printf(&event, ",\"cat\":\"onlineclc\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                      "\"pid\":%ld,\"tid\":%u,\"args\":{\"cpu_ms\":%.3f",
+                      (timer->wall.tv_sec * 1e6 + timer->wall.tv_nsec * 1e-3), wall_us,
+                      (long) getpid(), trace_tid(), cpu_us / 1000);
+        if (detail != NULL)
+        {
+            buffer_append(&event, ",\"detail\":", 10);
+            buffer_append_json_string(&event, detail);
+        }
+        buffer_append(&event, "}},\n", 4);
+        pthread_mutex_lock(&profile.lock);
+        buffer_append(&profile.events, event.data, event.len);
+        pthread_mutex_unlock(&profile.lock);
+        free(event.data);
+    }
+}
+
+#if !ONLINECLC_LIBRARY
+/* Appends the collected trace events to the trace file (at exit). The file
+ * is in the JSON array form of the Chrome trace event format, which does not
+ * need the closing bracket, so each invocation can append to it. A lock
+ * keeps concurrent invocations from interleaving.
+ */
+static void profile_flush(void)
+{
+    struct flock lock;
+    struct stat sb;
+    int fd;
+
+    if (profile.trace_filename == NULL || profile.events.len == 0)
+        return;
+    fd = open(profile.trace_filename, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Warning: failed to open `%s': %s\n", profile.trace_filename, strerror(errno));
+        return;
+    }
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    while (fcntl(fd, F_SETLKW, &lock) != 0 && errno == EINTR)
+        ;
+    if ((fstat(fd, &sb) == 0 && sb.st_size == 0 && write_all(fd, "[\n", 2) != 0)
+        || write_all(fd, profile.events.data, profile.events.len) != 0)
+        fprintf(stderr, "Warning: failed to write `%s': %s\n", profile.trace_filename, strerror(errno));
+    close(fd);
+    profile.events.len = 0;
+}
+
+/* Enables the phase timings requested by --time and --trace. The name of
+ * the process in the trace is taken from what it compiles.
+ */
+static void profile_start(const compiler_options *options)
+{
+    const char *what;
+
+    profile.report = options->time;
+    profile.trace_filename = options->trace_filename;
+    if (profile.trace_filename == NULL)
+        return;
+    what = options->source_filename != NULL ? options->source_filename
+        : options->batch_filename != NULL ? options->batch_filename
+        : options->link ? options->inputs[0] : options->server_socket;
+    buffer_printf(&profile.events, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%ld,\"args\":{\"name\":",
+                  (long) getpid());
+    buffer_append_json_string(&profile.events, what);
+    buffer_append(&profile.events, "}},\n", 4);
+    atexit(profile_flush);
+}
+#endif /* !ONLINECLC_LIBRARY */
+
+/* Returns the string form of an OpenCL error code,
+ * as a static string.
+ */
+static const char *error_to_string(cl_int error)
+{
+#define ERROR_CASE(name) case name: return #name
+    switch (error)
+    {
+        ERROR_CASE(CL_DEVICE_NOT_AVAILABLE);
+        ERROR_CASE(CL_DEVICE_NOT_FOUND);
+        ERROR_CASE(CL_INVALID_BINARY);
+        ERROR_CASE(CL_INVALID_BUILD_OPTIONS);
+        ERROR_CASE(CL_INVALID_COMPILER_OPTIONS);
+        ERROR_CASE(CL_INVALID_LINKER_OPTIONS);
+        ERROR_CASE(CL_COMPILE_PROGRAM_FAILURE);
+        ERROR_CASE(CL_LINK_PROGRAM_FAILURE);
+        ERROR_CASE(CL_INVALID_DEVICE);
+        ERROR_CASE(CL_INVALID_DEVICE_TYPE);
+        ERROR_CASE(CL_INVALID_OPERATION);
+        ERROR_CASE(CL_INVALID_PLATFORM);
+        ERROR_CASE(CL_INVALID_PROGRAM);
+        ERROR_CASE(CL_INVALID_VALUE);
+        ERROR_CASE(CL_OUT_OF_HOST_MEMORY);
+        ERROR_CASE(CL_OUT_OF_RESOURCES);
+        ERROR_CASE(CL_PLATFORM_NOT_FOUND_KHR);
+    default:
+        return "unknown error";
+    }
+#undef ERROR_CASE
+}
+
+/* Prints msg (printf-style) and an explanation of a CL error code */
+static void vreport_cl(cl_int status, const char *msg, va_list ap)
+{
+    FILE *out = message_stream();
+
+    vfprintf(out, msg, ap);
+    fprintf(out, ": Error code %d (%s)\n",
+            (int) status, error_to_string(status));
+}
+
+/* Prints msg (printf-style) and an explanation of a CL error code, for an
+ * error that the caller recovers from
+ */
+static void report_cl(cl_int status, const char *msg, ...)
+{
+    va_list ap;
+
+    va_start(ap, msg);
+    vreport_cl(status, msg, ap);
+    va_end(ap);
+}
+
+#if !ONLINECLC_LIBRARY
+/* Prints msg (printf-style) and an explanation of a CL error code, and
+ * kills the process.
+ */
+static void die_cl(cl_int status, int exitcode, const char *msg, ...)
+{
+    va_list ap;
+
+    va_start(ap, msg);
+    vreport_cl(status, msg, ap);
+    va_end(ap);
+    terminate(exitcode);
+}
+#endif /* !ONLINECLC_LIBRARY */
+
+/* Status of a build abandoned at the --timeout deadline. It is positive, so
+ * it cannot be mistaken for an OpenCL error.
+ */
+#define BUILD_TIMED_OUT 1
+/* Status of a build (or of a step towards one) that failed for a reason
+ * other than the source, such as an error from the driver. The error has
+ * already been reported, and everything that the step held released.
+ */
+#define BUILD_ERROR 2
+/* Exit code when a build times out, as for timeout(1) */
+#define EXIT_TIMED_OUT 124
+
+#if !ONLINECLC_LIBRARY
+/* The OpenCL library is not linked, but loaded with dlopen by the first
+ * call into it, so that --help and the errors found before a device is
+ * needed do not pay for loading it (and every ICD the loader finds). The
+ * cl* functions used are defined below to call through this table.
+ * The library build links the OpenCL library as usual instead, so as not to
+ * define these functions in the application.
+ */
+#ifdef __APPLE__
+# define OPENCL_LIBRARY "/System/Library/Frameworks/OpenCL.framework/OpenCL"
+#else
+# define OPENCL_LIBRARY "libOpenCL.so.1"
+#endif
+
+typedef struct
+{
+    cl_int (CL_API_CALL *GetPlatformIDs)(cl_uint, cl_platform_id *, cl_uint *);
+    cl_int (CL_API_CALL *GetPlatformInfo)(cl_platform_id, cl_platform_info, size_t, void *, size_t *);
+    cl_int (CL_API_CALL *GetDeviceIDs)(cl_platform_id, cl_device_type, cl_uint, cl_device_id *, cl_uint *);
+    cl_int (CL_API_CALL *GetDeviceInfo)(cl_device_id, cl_device_info, size_t, void *, size_t *);
+    cl_context (CL_API_CALL *CreateContext)(const cl_context_properties *, cl_uint, const cl_device_id *,
+                                            void (CL_CALLBACK *)(const char *, const void *, size_t, void *),
+                                            void *, cl_int *);
+    cl_int (CL_API_CALL *ReleaseContext)(cl_context);
+    cl_int (CL_API_CALL *GetContextInfo)(cl_context, cl_context_info, size_t, void *, size_t *);
+    cl_program (CL_API_CALL *CreateProgramWithSource)(cl_context, cl_uint, const char **, const size_t *,
+                                                      cl_int *);
+    cl_program (CL_API_CALL *CreateProgramWithBinary)(cl_context, cl_uint, const cl_device_id *,
+                                                      const size_t *, const unsigned char **,
+                                                      cl_int *, cl_int *);
+#ifdef CL_VERSION_2_1
+    cl_program (CL_API_CALL *CreateProgramWithIL)(cl_context, const void *, size_t, cl_int *);
+#endif
+    cl_int (CL_API_CALL *RetainProgram)(cl_program);
+    cl_int (CL_API_CALL *ReleaseProgram)(cl_program);
+    cl_int (CL_API_CALL *BuildProgram)(cl_program, cl_uint, const cl_device_id *, const char *,
+                                       void (CL_CALLBACK *)(cl_program, void *), void *);
+    cl_int (CL_API_CALL *CompileProgram)(cl_program, cl_uint, const cl_device_id *, const char *, cl_uint,
+                                         const cl_program *, const char **,
+                                         void (CL_CALLBACK *)(cl_program, void *), void *);
+    cl_program (CL_API_CALL *LinkProgram)(cl_context, cl_uint, const cl_device_id *, const char *, cl_uint,
+                                          const cl_program *, void (CL_CALLBACK *)(cl_program, void *),
+                                          void *, cl_int *);
+    cl_int (CL_API_CALL *GetProgramInfo)(cl_program, cl_program_info, size_t, void *, size_t *);
+    cl_int (CL_API_CALL *GetProgramBuildInfo)(cl_program, cl_device_id, cl_program_build_info,
+                                              size_t, void *, size_t *);
+    cl_int (CL_API_CALL *CreateKernelsInProgram)(cl_program, cl_uint, cl_kernel *, cl_uint *);
+    cl_int (CL_API_CALL *ReleaseKernel)(cl_kernel);
+    cl_int (CL_API_CALL *GetKernelInfo)(cl_kernel, cl_kernel_info, size_t, void *, size_t *);
+    cl_int (CL_API_CALL *GetKernelWorkGroupInfo)(cl_kernel, cl_device_id, cl_kernel_work_group_info,
+                                                 size_t, void *, size_t *);
+    void *(CL_API_CALL *GetExtensionFunctionAddressForPlatform)(cl_platform_id, const char *);
+} opencl_api;
+
+static opencl_api opencl;
+static pthread_once_t opencl_once = PTHREAD_ONCE_INIT;
+/* Why the library could not be loaded, or empty if it was */
+static char opencl_error[1024];
+#endif /* !ONLINECLC_LIBRARY */
+
+/* --icd command-line option or $ONLINECLC_ICD (the library to load instead
+ * of the ICD loader), or NULL. Set by opencl_start before the first call.
+ */
+static const char *opencl_icd = NULL;
+
+#if !ONLINECLC_LIBRARY
+/* The --icd library when it is a whole OpenCL implementation (opened by
+ * opencl_start to tell), or NULL to load the ICD loader
+ */
+static void *opencl_handle = NULL;
+
+/* Loads the OpenCL library if opencl_start did not, and fills in opencl, or
+ * sets opencl_error. This runs once, in whichever thread first calls into
+ * OpenCL, so it does not terminate the process itself.
+ */
+static void opencl_load(void)
+{
+    void *handle = opencl_handle;
+
+    if (handle == NULL)
+    {
+        handle = dlopen(OPENCL_LIBRARY, RTLD_LAZY | RTLD_LOCAL);
+        if (handle == NULL)
+        {
+            snprintf(opencl_error, sizeof(opencl_error), "Failed to load the OpenCL library: %s", dlerror());
+            return;
+        }
+    }
+
+    /* The result of dlsym is stored through a pointer, since converting it
+     * to a function pointer is not valid C
+     */
+#define OPENCL_ENTRY(entry) (*(void **) &opencl.entry = dlsym(handle, "cl" #entry))
+    OPENCL_ENTRY(GetPlatformIDs);
+    OPENCL_ENTRY(GetPlatformInfo);
+    OPENCL_ENTRY(GetDeviceIDs);
+    OPENCL_ENTRY(GetDeviceInfo);
+    OPENCL_ENTRY(CreateContext);
+    OPENCL_ENTRY(ReleaseContext);
+    OPENCL_ENTRY(GetContextInfo);
+    OPENCL_ENTRY(CreateProgramWithSource);
+    OPENCL_ENTRY(CreateProgramWithBinary);
+#ifdef CL_VERSION_2_1
+    OPENCL_ENTRY(CreateProgramWithIL);
+#endif
+    OPENCL_ENTRY(RetainProgram);
+    OPENCL_ENTRY(ReleaseProgram);
+    OPENCL_ENTRY(BuildProgram);
+    OPENCL_ENTRY(CompileProgram);
+    OPENCL_ENTRY(LinkProgram);
+    OPENCL_ENTRY(GetProgramInfo);
+    OPENCL_ENTRY(GetProgramBuildInfo);
+    OPENCL_ENTRY(CreateKernelsInProgram);
+    OPENCL_ENTRY(ReleaseKernel);
+    OPENCL_ENTRY(GetKernelInfo);
+    OPENCL_ENTRY(GetKernelWorkGroupInfo);
+    OPENCL_ENTRY(GetExtensionFunctionAddressForPlatform);
+#undef OPENCL_ENTRY
+}
+
+/* Loads the OpenCL library if it is not loaded yet, and checks that it has
+ * the entry point name (whose address is fn, once loaded). Kills the
+ * process if either fails.
+ */
+static void opencl_need(void * const *fn, const char *name)
+{
+    pthread_once(&opencl_once, opencl_load);
+    if (opencl_error[0] != '\0')
+        die(1, "%s", opencl_error);
+    if (*fn == NULL)
+        die(1, "The OpenCL library does not have %s", name);
+}
+
+#define OPENCL_NEED(entry) opencl_need((void * const *) &opencl.entry, "cl" #entry)
+
+CL_API_ENTRY cl_int CL_API_CALL clGetPlatformIDs(cl_uint num_entries, cl_platform_id *platforms,
+                                                 cl_uint *num_platforms)
+{
+    OPENCL_NEED(GetPlatformIDs);
+    return opencl.GetPlatformIDs(num_entries, platforms, num_platforms);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetPlatformInfo(cl_platform_id platform, cl_platform_info param_name,
+                                                  size_t param_value_size, void *param_value,
+                                                  size_t *param_value_size_ret)
+{
+    OPENCL_NEED(GetPlatformInfo);
+    return opencl.GetPlatformInfo(platform, param_name, param_value_size, param_value, param_value_size_ret);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetDeviceIDs(cl_platform_id platform, cl_device_type device_type,
+                                               cl_uint num_entries, cl_device_id *devices,
+                                               cl_uint *num_devices)
+{
+    OPENCL_NEED(GetDeviceIDs);
+    return opencl.GetDeviceIDs(platform, device_type, num_entries, devices, num_devices);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetDeviceInfo(cl_device_id device, cl_device_info param_name,
+                                                size_t param_value_size, void *param_value,
+                                                size_t *param_value_size_ret)
+{
+    OPENCL_NEED(GetDeviceInfo);
+    return opencl.GetDeviceInfo(device, param_name, param_value_size, param_value, param_value_size_ret);
+}
+
+CL_API_ENTRY cl_context CL_API_CALL clCreateContext(
+    const cl_context_properties *properties,
+    cl_uint num_devices,
+    const cl_device_id *devices,
+    void (CL_CALLBACK *pfn_notify)(const char *, const void *, size_t, void *),
+    void *user_data,
+    cl_int *errcode_ret)
+{
+    OPENCL_NEED(CreateContext);
+    return opencl.CreateContext(properties, num_devices, devices, pfn_notify, user_data, errcode_ret);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clReleaseContext(cl_context context)
+{
+    OPENCL_NEED(ReleaseContext);
+    return opencl.ReleaseContext(context);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetContextInfo(cl_context context, cl_context_info param_name,
+                                                 size_t param_value_size, void *param_value,
+                                                 size_t *param_value_size_ret)
+{
+    OPENCL_NEED(GetContextInfo);
+    return opencl.GetContextInfo(context, param_name, param_value_size, param_value, param_value_size_ret);
+}
+
+CL_API_ENTRY cl_program CL_API_CALL clCreateProgramWithSource(cl_context context, cl_uint count,
+                                                              const char **strings, const size_t *lengths,
+                                                              cl_int *errcode_ret)
+{
+    OPENCL_NEED(CreateProgramWithSource);
+    return opencl.CreateProgramWithSource(context, count, strings, lengths, errcode_ret);
+}
+
+CL_API_ENTRY cl_program CL_API_CALL clCreateProgramWithBinary(
+    cl_context context,
+    cl_uint num_devices,
+    const cl_device_id *device_list,
+    const size_t *lengths,
+    const unsigned char **binaries,
+    cl_int *binary_status,
+    cl_int *errcode_ret)
+{
+    OPENCL_NEED(CreateProgramWithBinary);
+    return opencl.CreateProgramWithBinary(context, num_devices, device_list, lengths, binaries,
+                                          binary_status, errcode_ret);
+}
+
+#ifdef CL_VERSION_2_1
+CL_API_ENTRY cl_program CL_API_CALL clCreateProgramWithIL(cl_context context, const void *il, size_t length,
+                                                          cl_int *errcode_ret)
+{
+    OPENCL_NEED(CreateProgramWithIL);
+    return opencl.CreateProgramWithIL(context, il, length, errcode_ret);
+}
+#endif
+
+CL_API_ENTRY cl_int CL_API_CALL clRetainProgram(cl_program program)
+{
+    OPENCL_NEED(RetainProgram);
+    return opencl.RetainProgram(program);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clReleaseProgram(cl_program program)
+{
+    OPENCL_NEED(ReleaseProgram);
+    return opencl.ReleaseProgram(program);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clBuildProgram(
+    cl_program program,
+    cl_uint num_devices,
+    const cl_device_id *device_list,
+    const char *options,
+    void (CL_CALLBACK *pfn_notify)(cl_program, void *),
+    void *user_data)
+{
+    OPENCL_NEED(BuildProgram);
+    return opencl.BuildProgram(program, num_devices, device_list, options, pfn_notify, user_data);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clCompileProgram(
+    cl_program program,
+    cl_uint num_devices,
+    const cl_device_id *device_list,
+    const char *options,
+    cl_uint num_input_headers,
+    const cl_program *input_headers,
+    const char **header_include_names,
+    void (CL_CALLBACK *pfn_notify)(cl_program, void *),
+    void *user_data)
+{
+    OPENCL_NEED(CompileProgram);
+    return opencl.CompileProgram(program, num_devices, device_list, options, num_input_headers,
+                                 input_headers, header_include_names, pfn_notify, user_data);
+}
+
+CL_API_ENTRY cl_program CL_API_CALL clLinkProgram(
+    cl_context context,
+    cl_uint num_devices,
+    const cl_device_id *device_list,
+    const char *options,
+    cl_uint num_input_programs,
+    const cl_program *input_programs,
+    void (CL_CALLBACK *pfn_notify)(cl_program, void *),
+    void *user_data,
+    cl_int *errcode_ret)
+{
+    OPENCL_NEED(LinkProgram);
+    return opencl.LinkProgram(context, num_devices, device_list, options, num_input_programs,
+                              input_programs, pfn_notify, user_data, errcode_ret);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetProgramInfo(cl_program program, cl_program_info param_name,
+                                                 size_t param_value_size, void *param_value,
+                                                 size_t *param_value_size_ret)
+{
+    OPENCL_NEED(GetProgramInfo);
+    return opencl.GetProgramInfo(program, param_name, param_value_size, param_value, param_value_size_ret);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetProgramBuildInfo(cl_program program, cl_device_id device,
+                                                      cl_program_build_info param_name,
+                                                      size_t param_value_size, void *param_value,
+                                                      size_t *param_value_size_ret)
+{
+    OPENCL_NEED(GetProgramBuildInfo);
+    return opencl.GetProgramBuildInfo(program, device, param_name, param_value_size, param_value,
+                                      param_value_size_ret);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clCreateKernelsInProgram(cl_program program, cl_uint num_kernels,
+                                                         cl_kernel *kernels, cl_uint *num_kernels_ret)
+{
+    OPENCL_NEED(CreateKernelsInProgram);
+    return opencl.CreateKernelsInProgram(program, num_kernels, kernels, num_kernels_ret);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clReleaseKernel(cl_kernel kernel)
+{
+    OPENCL_NEED(ReleaseKernel);
+    return opencl.ReleaseKernel(kernel);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetKernelInfo(cl_kernel kernel, cl_kernel_info param_name,
+                                                size_t param_value_size, void *param_value,
+                                                size_t *param_value_size_ret)
+{
+    OPENCL_NEED(GetKernelInfo);
+    return opencl.GetKernelInfo(kernel, param_name, param_value_size, param_value, param_value_size_ret);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL clGetKernelWorkGroupInfo(cl_kernel kernel, cl_device_id device,
+                                                         cl_kernel_work_group_info param_name,
+                                                         size_t param_value_size, void *param_value,
+                                                         size_t *param_value_size_ret)
+{
+    OPENCL_NEED(GetKernelWorkGroupInfo);
+    return opencl.GetKernelWorkGroupInfo(kernel, device, param_name, param_value_size, param_value,
+                                         param_value_size_ret);
+}
+
+CL_API_ENTRY void * CL_API_CALL clGetExtensionFunctionAddressForPlatform(cl_platform_id platform,
+                                                                         const char *func_name)
+{
+    OPENCL_NEED(GetExtensionFunctionAddressForPlatform);
+    return opencl.GetExtensionFunctionAddressForPlatform(platform, func_name);
+}
+
+#undef OPENCL_NEED
+
+/* Chooses the library that the first call into OpenCL will load (--icd).
+ * This runs before any other threads, since a vendor ICD is passed to the
+ * ICD loader through the environment.
+ */
+static void opencl_start(const compiler_options *options)
+{
+    void *handle;
+    int is_icd;
+
+    opencl_icd = options->icd;
+    if (opencl_icd == NULL)
+        return;
+    handle = dlopen(opencl_icd, RTLD_LAZY | RTLD_LOCAL);
+    if (handle == NULL)
+        die(1, "Failed to load `%s': %s", opencl_icd, dlerror());
+    /* A whole OpenCL implementation is used in place of the loader */
+    if (dlsym(handle, "clGetPlatformIDs") != NULL)
+    {
+        opencl_handle = handle;
+        return;
+    }
+    is_icd = dlsym(handle, "clIcdGetPlatformIDsKHR") != NULL;
+    dlclose(handle);
+    if (!is_icd)
+        die(1, "`%s' is not an OpenCL library or ICD", opencl_icd);
+    /* A vendor ICD only has the entry points that the ICD loader needs, so
+     * the loader is used, but told to load just this one (OCL_ICD_VENDORS
+     * names no directory, so that the Khronos loader does not add the others).
+     */
+    if (setenv("OCL_ICD_FILENAMES", opencl_icd, 1) != 0 || setenv("OCL_ICD_VENDORS", "/dev/null", 1) != 0)
+        pdie(1, "Failed to set up the ICD loader");
+}
+#endif /* !ONLINECLC_LIBRARY */
+
+/* Stores the platform of a device in *platform. Returns CL_SUCCESS or
+ * BUILD_ERROR (after reporting it).
+ */
+static cl_int get_device_platform(cl_device_id device, cl_platform_id *platform)
+{
+    cl_int status;
+
+    status = clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(*platform), platform, NULL);
+    if (status != CL_SUCCESS)
+    {
+        report_cl(status, "Failed to query platform from device");
+        return BUILD_ERROR;
+    }
+    return CL_SUCCESS;
+}
+
+#if !ONLINECLC_LIBRARY
+/* Returns the platform of a device, killing the process on failure */
+static cl_platform_id device_platform(cl_device_id device)
+{
+    cl_platform_id platform;
+
+    if (get_device_platform(device, &platform) != CL_SUCCESS)
+        terminate(1);
+    return platform;
+}
+#endif /* !ONLINECLC_LIBRARY */
+
+/* Creates an OpenCL context for devices, which must all belong to the same
+ * platform, and stores it in *ctx. Returns CL_SUCCESS or BUILD_ERROR.
+ */
+static cl_int open_context(cl_uint num_devices, const cl_device_id *devices, cl_context *ctx)
+{
+    cl_int status;
+    cl_platform_id platform;
+    cl_context_properties props[3];
+    phase_timer timer;
+
+    phase_begin(&timer);
+    if (get_device_platform(devices[0], &platform) != CL_SUCCESS)
+        return BUILD_ERROR;
+    props[0] = CL_CONTEXT_PLATFORM;
+    props[1] = (cl_context_properties) platform;
+    props[2] = 0;
+
+    *ctx = clCreateContext(props, num_devices, devices, NULL, NULL, &status);
+    if (status != CL_SUCCESS)
+    {
+        report_cl(status, "Failed to create OpenCL context");
+        return BUILD_ERROR;
+    }
+    phase_end(&timer, "create context", NULL);
+    return CL_SUCCESS;
+}
+
+#if !ONLINECLC_LIBRARY
+/* Create an OpenCL context for devices, which must all belong to the same
+ * platform, and kill the process on failure.
+ */
+static cl_context create_context_devices(cl_uint num_devices, const cl_device_id *devices)
+{
+    cl_context ctx;
+
+    if (open_context(num_devices, devices, &ctx) != CL_SUCCESS)
+        terminate(1);
+    return ctx;
+}
+
+/* Create an OpenCL context for device, and kill the process on failure.
+ */
+static cl_context create_context(cl_device_id device)
+{
+    return create_context_devices(1, &device);
+}
+#endif /* !ONLINECLC_LIBRARY */
+
+/* Retrieves the build log. It is stored in *log, dynamically allocated (or
+ * NULL if the log is empty), and must be freed by the caller. The length,
+ * excluding the terminating NUL, is stored in *len. Returns CL_SUCCESS or
+ * BUILD_ERROR (with *log NULL).
+ */
+static cl_int get_build_log(cl_program program, cl_device_id device, char **log, size_t *len)
+{
+    cl_int status;
+    char *build_log;
+    size_t size;
+
+    *log = NULL;
+    *len = 0;
+    status = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &size);
+    if (status != CL_SUCCESS)
+    {
+        report_cl(status, "Failed to get length of build log");
+        return BUILD_ERROR;
+    }
+
+    /* Early-out to avoid dealing with malloc(0) */
+    if (size == 0)
+        return CL_SUCCESS;
+
+    build_log = (char *) try_malloc(size * sizeof(char), "the build log");
+    if (build_log == NULL)
+        return BUILD_ERROR;
+
+    status = clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, size, build_log, NULL);
+    if (status != CL_SUCCESS)
+    {
+        report_cl(status, "Failed to get build log");
+        free(build_log);
+        return BUILD_ERROR;
+    }
+    /* The CL implementation should null-terminate itself; this is just to
+     * protect against bugs.
+     */
+    build_log[size - 1] = '\0';
+    *log = build_log;
+    *len = strlen(build_log);
+    return CL_SUCCESS;
+}
+
+/* Writes a build log of len bytes to the output, in one piece even if other
+ * threads are writing to the same stream. Does not check for errors on the
+ * output stream.
+ */
+static void write_build_log(FILE *out, const char *build_log, size_t len)
+{
+    if (len == 0)
+        return;
+    flockfile(out);
+    fwrite(build_log, 1, len, out);
+    /* Add a trailing newline if required */
+    if (build_log[len - 1] != '\n')
+        fputs("\n", out);
+    funlockfile(out);
+}
+
+/* Checks whether c may appear unencoded in a string literal. According to C99,
+ * string literals may contain characters from the source character set except
+ * for double-quote, backslash or newline. To be safe, we also exclude '?'
+ * since it can form trigraphs.
+ *
+ * C99 does not specify the extended source character set, so we consider only
+ * the basic character set.
+ */
+static int safe_for_string_literal(char c)
 {
     if (isalnum(c))
         return 1;
-    else switch(c)
+    else switch(c)
+    {
+    case '!':
+    case '#':
+    case '%':
+    case '&':
+    case '\'':
+    case '(':
+    case ')':
+    case '*':
+    case '+':
+    case ',':
+    case '-':
+    case '.':
+    case '/':
+    case ':':
+    case ';':
+    case '<':
+    case '=':
+    case '>':
+    case '[':
+    case ']':
+    case '^':
+    case '_':
+    case '{':
+    case '|':
+    case '}':
+    case '~':
+    case ' ':
+    case '\t':
+    case '\v':
+    case '\f':
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Escapes a string so that it may appear between double quotes in OpenCL C.
+ * The return value is dynamically allocated, and must be freed by the caller
+ * (or is NULL if there is no memory, which is reported).
+ *
+ * Unsafe characters (e.g. double quotes) are escaped using an octal escape.
+ * Hex escapes are avoided since they can gobble up following numbers.
+ */
+static char *escape_c_string(const char *str)
+{
+    const size_t src_len = strlen(str);
+    size_t i;
+    size_t dst_len = 0;
+    char *dst, *cur;
+
+    /* First pass: determine memory requirement */
+    for (i = 0; i < src_len; i++)
+    {
+        if (safe_for_string_literal(str[i]))
+            dst_len++;
+        else
+            dst_len += 4; /* for an octal escape */
+    }
+
+    dst = (char *) try_malloc((dst_len + 1) * sizeof(char), "string");
+    if (dst == NULL)
+        return NULL;
+
+    /* Second pass: fill in the string */
+    cur = dst;
+    for (i = 0; i < src_len; i++)
+    {
+        if (safe_for_string_literal(str[i]))
+            *cur++ = str[i];
+        else
+        {
+            unsigned char value = (unsigned char) str[i];
+            *cur++ = '\\';
+            *cur++ = '0' + ((value / 64) % 8);
+            *cur++ = '0' + ((value / 8) % 8);
+            *cur++ = '0' + (value % 8);
+        }
+    }
+    *cur = '\0';
+    return dst;
+}
+
+/* Returns the name under which a source file is shown in messages */
+static const char *source_display_name(const char *source_filename)
+{
+    return 0 == strcmp(source_filename, "-") ? "<stdin>" : source_filename;
+}
+
+/* Appends a chunk to a source. Returns 0, or -1 if there is no memory
+ * (which is reported, and leaves the source as it was).
+ */
+static int add_source_chunk(source_text *src, const char *data, size_t len)
+{
+    const char **chunks;
+    size_t *chunk_lens;
+
+    chunks = (const char **) realloc(src->chunks, (src->num_chunks + 1) * sizeof(const char *));
+    if (chunks != NULL)
+        src->chunks = chunks;
+    chunk_lens = (size_t *) realloc(src->chunk_lens, (src->num_chunks + 1) * sizeof(size_t));
+    if (chunk_lens != NULL)
+        src->chunk_lens = chunk_lens;
+    if (chunks == NULL || chunk_lens == NULL)
+    {
+        report("Out of memory trying to allocate source chunks");
+        return -1;
+    }
+    src->chunks[src->num_chunks] = data;
+    src->chunk_lens[src->num_chunks] = len;
+    src->num_chunks++;
+    src->len += len;
+    return 0;
+}
+
+/* Makes a source from a single buffer in memory, which is not copied and
+ * must outlive it. The source must still be released with free_source, even
+ * if this fails for want of memory (which is reported, and returns -1
+ * rather than 0).
+ */
+static int source_from_memory(source_text *src, const char *source_filename, const char *data, size_t len)
+{
+    src->name = source_display_name(source_filename);
+    src->chunks = NULL;
+    src->chunk_lens = NULL;
+    src->num_chunks = 0;
+    src->len = 0;
+    src->storage = SOURCE_BORROWED;
+    if (len > 0)
+        return add_source_chunk(src, data, len);
+    return 0;
+}
+
+static void free_source(source_text *src)
+{
+    size_t i;
+
+    if (src->storage == SOURCE_MAPPED)
+        munmap((void *) src->chunks[0], src->chunk_lens[0]);
+    else if (src->storage == SOURCE_ALLOCATED)
+    {
+        for (i = 0; i < src->num_chunks; i++)
+            free((void *) src->chunks[i]);
+    }
+    free(src->chunks);
+    free(src->chunk_lens);
+}
+
+/* Reads a source from a pipe or other stream that cannot be mapped, in
+ * chunks that grow geometrically (to keep the number of fragments down) up
+ * to a limit (to keep the slack down). Returns 0, or -1 if reading fails or
+ * there is no memory (which is reported).
+ */
+static int stream_source(source_text *src, int fd)
+{
+    size_t chunk_size = 64 * 1024;
+    int eof = 0;
+
+    while (!eof)
+    {
+        char *chunk = (char *) try_malloc(chunk_size, "the source");
+        size_t used = 0;
+
+        if (chunk == NULL)
+            return -1;
+        while (used < chunk_size)
+        {
+            ssize_t n = read(fd, chunk + used, chunk_size - used);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+            {
+                preport("Failed to read `%s'", src->name);
+                free(chunk);
+                return -1;
+            }
+            if (n == 0)
+            {
+                eof = 1;
+                break;
+            }
+            used += n;
+        }
+        if (used == 0)
+            free(chunk);
+        else if (add_source_chunk(src, chunk, used) != 0)
+        {
+            free(chunk);
+            return -1;
+        }
+        if (chunk_size < 16 * 1024 * 1024)
+            chunk_size *= 2;
+    }
+    return 0;
+}
+
+/* Loads a source file into memory. Returns 0, or -1 if it cannot be read or
+ * there is no memory (which is reported, and leaves nothing to release).
+ *
+ * Regular files are loaded with mmap(), which avoids a copy. Anything else,
+ * including standard input (given as -), is read in chunks.
+ */
+static int read_source_data(source_text *src, const char *source_filename)
+{
+    struct stat sb;          /* stat info on the file, to determine its size */
+    int fd;                  /* file descriptor for the source file */
+    void *addr;              /* mmap address for the source file */
+    int ret = 0;
+
+    source_from_memory(src, source_filename, NULL, 0);
+    if (0 == strcmp(source_filename, "-"))
+        fd = STDIN_FILENO;
+    else
+    {
+        fd = open(source_filename, O_RDONLY);
+        if (fd < 0)
+        {
+            preport("Failed to open `%s'", source_filename);
+            return -1;
+        }
+    }
+
+    if (fstat(fd, &sb) == -1)
+    {
+        preport("Failed to stat `%s'", src->name);
+        ret = -1;
+    }
+    else if (!S_ISREG(sb.st_mode))
+    {
+        src->storage = SOURCE_ALLOCATED;
+        ret = stream_source(src, fd);
+    }
+    else if (sb.st_size > 0)
+    {
+        /* Can't portably mmap 0 bytes, so an empty file has no chunks */
+        addr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED)
+        {
+            preport("Failed to map `%s'", src->name);
+            ret = -1;
+        }
+        else if (add_source_chunk(src, (const char *) addr, sb.st_size) != 0)
+        {
+            munmap(addr, sb.st_size);
+            ret = -1;
+        }
+        else
+            src->storage = SOURCE_MAPPED;
+    }
+    if (fd != STDIN_FILENO)
+        close(fd);
+    if (ret != 0)
+        free_source(src);
+    return ret;
+}
+
+#if !ONLINECLC_LIBRARY
+/* Loads a source file into memory. On failure, the process is terminated. */
+static void load_source_data(source_text *src, const char *source_filename)
+{
+    if (read_source_data(src, source_filename) != 0)
+        terminate(1);
+}
+
+/* load_source_data, timed as a phase */
+static void load_source(source_text *src, const char *source_filename)
+{
+    phase_timer timer;
+
+    phase_begin(&timer);
+    load_source_data(src, source_filename);
+    phase_end(&timer, "load source", src->name);
+}
+#endif /* !ONLINECLC_LIBRARY */
+
+/* SPIR-V modules start with this word, in the byte order of the module */
+#define SPIRV_MAGIC 0x07230203
+
+/* Determines whether a loaded source is a SPIR-V module rather than OpenCL C,
+ * because --spirv was given or from its magic number
+ */
+static int is_spirv(const compiler_options *options, const source_text *src)
+{
+    unsigned char magic[4];
+    size_t i, j, n = 0;
+
+    if (options->spirv)
+        return 1;
+    for (i = 0; i < src->num_chunks && n < 4; i++)
+        for (j = 0; j < src->chunk_lens[i] && n < 4; j++)
+            magic[n++] = (unsigned char) src->chunks[i][j];
+    if (n < 4)
+        return 0;
+    return ((uint32_t) magic[0] | ((uint32_t) magic[1] << 8) | ((uint32_t) magic[2] << 16)
+            | ((uint32_t) magic[3] << 24)) == SPIRV_MAGIC
+        || ((uint32_t) magic[3] | ((uint32_t) magic[2] << 8) | ((uint32_t) magic[1] << 16)
+            | ((uint32_t) magic[0] << 24)) == SPIRV_MAGIC;
+}
+
+/* Creates a program from a loaded source, and stores it in *program.
+ * Returns CL_SUCCESS or BUILD_ERROR.
+ */
+static cl_int program_from_source(cl_context ctx, const source_text *src, cl_program *program)
+{
+    char *escaped_filename;  /* Source filename with quotes etc escaped */
+    const char **srcs;       /* pointers to fragments of source */
+    size_t *src_lens;        /* lengths for source fragments */
+    cl_int status;
+    phase_timer timer;
+
+    phase_begin(&timer);
+    srcs = (const char **) try_malloc((src->num_chunks + 3) * sizeof(const char *), "source fragments");
+    src_lens = (size_t *) try_malloc((src->num_chunks + 3) * sizeof(size_t), "source fragments");
+
+    /* Inject a line of the form
+     * #line 1 "filename"
+     * so that the build log can show the correct filename in error messages
+     * (depending on the OpenCL implementation)
+     */
+    escaped_filename = srcs != NULL && src_lens != NULL ? escape_c_string(src->name) : NULL;
+    if (escaped_filename == NULL)
+    {
+        free(srcs);
+        free(src_lens);
+        return BUILD_ERROR;
+    }
+    srcs[0] = "#line 1 \"";                         src_lens[0] = 0;
+    srcs[1] = escaped_filename;                     src_lens[1] = 0;
+    srcs[2] = "\"\n";                               src_lens[2] = 0;
+    memcpy(srcs + 3, src->chunks, src->num_chunks * sizeof(const char *));
+    memcpy(src_lens + 3, src->chunk_lens, src->num_chunks * sizeof(size_t));
+
+    *program = clCreateProgramWithSource(ctx, src->num_chunks + 3, srcs, src_lens, &status);
+    free(escaped_filename);
+    free(srcs);
+    free(src_lens);
+    if (status != CL_SUCCESS)
+    {
+        report_cl(status, "Failed to load source from `%s'", src->name);
+        return BUILD_ERROR;
+    }
+    phase_end(&timer, "create program", src->name);
+    return CL_SUCCESS;
+}
+
+/* Client for the GNU make jobserver. A process run by make -jN holds one
+ * job slot implicitly, and may run another job for each token that it reads
+ * from the jobserver (a pipe, or a named fifo since make 4.4) until it
+ * writes the token back. Each build takes a slot with jobserver_acquire, so
+ * that the builds of every process in the make run are limited to N.
+ *
+ * Tokens are read by a thread of their own, since a read blocks until
+ * another job finishes, and a build waiting for a token must also be able
+ * to take the implicit slot when it comes free. This is shared by all
+ * threads, and set up once by jobserver_start.
+ */
+typedef struct
+{
+    /* Descriptors of the jobserver, or -1 if there is none */
+    int read_fd;
+    int write_fd;
+    /* The rest is protected by lock */
+    /* Set if the implicit slot is in use */
+    int implicit_held;
+    /* Tokens read and in use, and read but not yet taken by a build */
+    string_buffer busy;
+    string_buffer idle;
+    /* Builds waiting for a slot */
+    unsigned int waiting;
+    pthread_mutex_t lock;
+    /* Signalled when a slot comes free, and when the reader is needed */
+    pthread_cond_t freed;
+    pthread_cond_t wanted;
+} jobserver;
+
+static jobserver jobs =
+{
+    -1, -1, 0, { NULL, 0, 0 }, { NULL, 0, 0 }, 0,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
+
+/* Slots returned by jobserver_acquire other than tokens */
+#define JOBSERVER_NONE (-2)         /* there is no jobserver */
+#define JOBSERVER_IMPLICIT (-1)     /* the implicit slot */
+
+static void write_token(unsigned char token)
+{
+    while (write(jobs.write_fd, &token, 1) < 0 && errno == EINTR)
+        ;
+}
+
+#if !ONLINECLC_LIBRARY
+/* Writes back the tokens still held (at exit), so that make does not lose
+ * them when a build fails
+ */
+static void jobserver_release_all(void)
+{
+    size_t i;
+
+    pthread_mutex_lock(&jobs.lock);
+    for (i = 0; i < jobs.busy.len; i++)
+        write_token((unsigned char) jobs.busy.data[i]);
+    for (i = 0; i < jobs.idle.len; i++)
+        write_token((unsigned char) jobs.idle.data[i]);
+    jobs.busy.len = 0;
+    jobs.idle.len = 0;
+    pthread_mutex_unlock(&jobs.lock);
+}
+
+/* Reads tokens while builds are waiting for them. A token that is no
+ * longer wanted by the time it arrives is written straight back.
+ */
+static void *jobserver_reader(void *arg)
+{
+    unsigned char token;
+    struct pollfd pfd;
+    ssize_t n;
+
+    (void) arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&jobs.lock);
+        while (jobs.waiting <= jobs.idle.len)
+            pthread_cond_wait(&jobs.wanted, &jobs.lock);
+        pthread_mutex_unlock(&jobs.lock);
+
+        n = read(jobs.read_fd, &token, 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        /* Newer versions of make may leave the pipe non-blocking */
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            pfd.fd = jobs.read_fd;
+            pfd.events = POLLIN;
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        pthread_mutex_lock(&jobs.lock);
+        if (n != 1)
+        {
+            /* The jobserver has gone away, so carry on without it */
+            jobs.read_fd = -1;
+            pthread_cond_broadcast(&jobs.freed);
+            pthread_mutex_unlock(&jobs.lock);
+            return NULL;
+        }
+        if (jobs.waiting > jobs.idle.len)
+        {
+            buffer_append(&jobs.idle, (const char *) &token, 1);
+            pthread_cond_broadcast(&jobs.freed);
+        }
+        else
+            write_token(token);
+        pthread_mutex_unlock(&jobs.lock);
+    }
+}
+
+/* Finds the jobserver named by --jobserver-auth (or the older
+ * --jobserver-fds) in MAKEFLAGS. make only passes the descriptors of a pipe
+ * to recipes that it considers recursive, so if they are not open there is
+ * no jobserver. The compile server does not use the jobserver, since its
+ * clients already hold slots for the builds that they ask for.
+ */
+static void jobserver_start(const compiler_options *options)
+{
+    const char *flags = getenv("MAKEFLAGS");
+    const char *auth = NULL, *p;
+    int read_fd = -1, write_fd = -1;
+    pthread_t reader;
+
+    if (flags == NULL || options->server_socket != NULL)
+        return;
+    /* The last one wins, as in make */
+    for (p = flags; (p = strstr(p, "--jobserver-")) != NULL; p++)
+        if (0 == strncmp(p, "--jobserver-auth=", 17))
+            auth = p + 17;
+        else if (0 == strncmp(p, "--jobserver-fds=", 16))
+            auth = p + 16;
+    if (auth == NULL)
+        return;
+    if (0 == strncmp(auth, "fifo:", 5))
+    {
+        char *path = onlineclc_strndup(auth + 5, strcspn(auth + 5, " "), "the jobserver name");
+
+        read_fd = write_fd = open(path, O_RDWR);
+        free(path);
+        if (read_fd < 0)
+            return;
+    }
+    else if (sscanf(auth, "%d,%d", &read_fd, &write_fd) != 2
+             || fcntl(read_fd, F_GETFD) < 0 || fcntl(write_fd, F_GETFD) < 0)
+        return;
+    jobs.read_fd = read_fd;
+    jobs.write_fd = write_fd;
+    if (pthread_create(&reader, NULL, jobserver_reader, NULL) != 0)
+    {
+        jobs.read_fd = jobs.write_fd = -1;
+        return;
+    }
+    pthread_detach(reader);
+    atexit(jobserver_release_all);
+}
+#endif /* !ONLINECLC_LIBRARY */
+
+/* Waits for a job slot: the implicit one if it is free, or else a token
+ * from the jobserver. Returns the slot, to be given back with
+ * jobserver_release.
+ */
+static int jobserver_acquire(void)
+{
+    int slot;
+
+    if (jobs.write_fd < 0)
+        return JOBSERVER_NONE;
+    pthread_mutex_lock(&jobs.lock);
+    jobs.waiting++;
+    for (;;)
+    {
+        if (!jobs.implicit_held)
+        {
+            jobs.implicit_held = 1;
+            slot = JOBSERVER_IMPLICIT;
+            break;
+        }
+        if (jobs.idle.len > 0)
+        {
+            char token = jobs.idle.data[--jobs.idle.len];
+            buffer_append(&jobs.busy, &token, 1);
+            slot = (unsigned char) token;
+            break;
+        }
+        if (jobs.read_fd < 0)
+        {
+            slot = JOBSERVER_NONE;
+            break;
+        }
+        pthread_cond_signal(&jobs.wanted);
+        pthread_cond_wait(&jobs.freed, &jobs.lock);
+    }
+    jobs.waiting--;
+    pthread_mutex_unlock(&jobs.lock);
+    return slot;
+}
+
+/* Gives back a slot taken with jobserver_acquire: to a build that is
+ * waiting for one, or else to make
+ */
+static void jobserver_release(int slot)
+{
+    size_t i;
+
+    if (slot == JOBSERVER_NONE)
+        return;
+    pthread_mutex_lock(&jobs.lock);
+    if (slot == JOBSERVER_IMPLICIT)
+        jobs.implicit_held = 0;
+    else
+    {
+        for (i = 0; i < jobs.busy.len; i++)
+            if ((unsigned char) jobs.busy.data[i] == slot)
+            {
+                jobs.busy.data[i] = jobs.busy.data[--jobs.busy.len];
+                break;
+            }
+        if (jobs.waiting > jobs.idle.len)
+        {
+            char token = (char) slot;
+            buffer_append(&jobs.idle, &token, 1);
+        }
+        else
+            write_token((unsigned char) slot);
+    }
+    pthread_cond_broadcast(&jobs.freed);
+    pthread_mutex_unlock(&jobs.lock);
+}
+
+/* A build in progress, being measured by meter_begin and meter_end */
+typedef struct usage_probe
+{
+    /* Key of the source for the estimates (dynamically allocated) */
+    char *key;
+    unsigned long long start_rss;
+    unsigned long long peak_rss;
+    /* Share of the memory budget given to the build */
+    unsigned long long reserved;
+    /* Set if another build ran at the same time */
+    int shared;
+    /* Set once the build is abandoned at the deadline, which takes over its
+     * reservation (see meter_release)
+     */
+    int abandoned;
+    struct timespec cpu;
+    struct usage_probe *next;
+} usage_probe;
+
+/* Past peak RSS of a source, for --mem-budget */
+typedef struct
+{
+    char *key;
+    unsigned long long peak_rss;
+    /* Set if measured by this process, rather than loaded */
+    int measured;
+} memory_estimate;
+
+/* Measures the builds, and admits them so that their estimated memory use
+ * fits in the --mem-budget. The RSS of the process is sampled by a thread
+ * of its own while any build runs. This is shared by all threads, and set
+ * up once by meter_start.
+ */
+typedef struct
+{
+    /* --mem-budget in bytes, or 0 for no limit */
+    unsigned long long budget;
+    /* Cache directory that the estimates are kept in, or NULL */
+    const char *cache_dir;
+    /* The rest is protected by lock */
+    /* Sum of the reservations of the builds that are running */
+    unsigned long long reserved;
+    unsigned int running;
+    usage_probe *probes;
+    memory_estimate *estimates;
+    size_t num_estimates;
+    int sampler_started;
+    pthread_mutex_t lock;
+    /* Signalled when a build ends, and when one starts (for the sampler) */
+    pthread_cond_t finished;
+    pthread_cond_t started;
+} memory_meter;
+
+static memory_meter meter =
+{
+    0, NULL, 0, 0, NULL, NULL, 0, 0,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
+
+/* Name of the file in the cache directory that the estimates are kept in */
+#define MEMORY_ESTIMATES_NAME "memory-usage"
+
+/* Interval at which the RSS is sampled during builds */
+#define RSS_SAMPLE_NS 5000000
+
+/* Returns the current RSS of the process in bytes, or 0 if it is unknown */
+static unsigned long long current_rss(void)
+{
+    char text[64];
+    unsigned long long pages;
+    ssize_t n;
+    int fd;
+
+    fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0)
+        return 0;
+    n = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    text[n] = '\0';
+    if (sscanf(text, "%*u %llu", &pages) != 1)
+        return 0;
+    return pages * (unsigned long long) sysconf(_SC_PAGESIZE);
+}
+
+/* Raises the peak of every build in progress to rss. The lock must be held. */
+static void update_peaks(unsigned long long rss)
+{
+    usage_probe *p;
+
+    for (p = meter.probes; p != NULL; p = p->next)
+        if (rss > p->peak_rss)
+            p->peak_rss = rss;
+}
+
+static void *rss_sampler(void *arg)
+{
+    struct timespec interval = { 0, RSS_SAMPLE_NS };
+    unsigned long long rss;
+
+    (void) arg;
+    pthread_mutex_lock(&meter.lock);
+    for (;;)
+    {
+        while (meter.probes == NULL)
+            pthread_cond_wait(&meter.started, &meter.lock);
+        pthread_mutex_unlock(&meter.lock);
+        nanosleep(&interval, NULL);
+        rss = current_rss();
+        pthread_mutex_lock(&meter.lock);
+        update_peaks(rss);
+    }
+    return NULL;
+}
+
+/* Returns the estimate for a source (none if key is NULL). The lock must be
+ * held.
+ */
+static memory_estimate *find_estimate(const char *key)
+{
+    size_t i;
+
+    for (i = 0; key != NULL && i < meter.num_estimates; i++)
+        if (0 == strcmp(meter.estimates[i].key, key))
+            return &meter.estimates[i];
+    return NULL;
+}
+
+/* Records the peak RSS of a source. The lock must be held, so this does
+ * not terminate: without the memory for a new source, its peak is simply
+ * not recorded.
+ */
+static void set_estimate(const char *key, unsigned long long peak_rss, int measured)
+{
+    memory_estimate *e = find_estimate(key);
+
+    if (e == NULL)
+    {
+        memory_estimate *grown;
+        char *copy = (char *) malloc(strlen(key) + 1);
+
+        if (copy == NULL)
+            return;
+        grown = (memory_estimate *) realloc(meter.estimates, (meter.num_estimates + 1) * sizeof(memory_estimate));
+        if (grown == NULL)
+        {
+            free(copy);
+            return;
+        }
+        strcpy(copy, key);
+        meter.estimates = grown;
+        e = &meter.estimates[meter.num_estimates++];
+        e->key = copy;
+    }
+    e->peak_rss = peak_rss;
+    e->measured = measured;
+}
+
+/* Estimates the memory that a build of a source will need: its own last
+ * peak, or else the largest peak of any source, or else the whole budget,
+ * so that the first build of an unknown source runs alone. The lock must
+ * be held.
+ */
+static unsigned long long estimate_memory(const char *key)
+{
+    const memory_estimate *e = find_estimate(key);
+    unsigned long long largest = 0;
+    size_t i;
+
+    if (e != NULL)
+        return e->peak_rss;
+    if (meter.num_estimates == 0)
+        return meter.budget;
+    for (i = 0; i < meter.num_estimates; i++)
+        if (meter.estimates[i].peak_rss > largest)
+            largest = meter.estimates[i].peak_rss;
+    return largest;
+}
+
+#if !ONLINECLC_LIBRARY
+/* Loads the estimates file: a "<peak RSS> <source>" line per source. A
+ * damaged line is skipped. If keep_measured is set, the sources measured
+ * by this process keep their peaks. The lock must be held.
+ */
+static void load_estimates(const char *path, int keep_measured)
+{
+    FILE *f;
+    char line[4096];
+
+    f = fopen(path, "r");
+    if (f == NULL)
+        return;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        unsigned long long peak_rss;
+        char *key;
+
+        line[strcspn(line, "\n")] = '\0';
+        peak_rss = strtoull(line, &key, 10);
+        if (*key != ' ' || key[1] == '\0')
+            continue;
+        /* Our own measurements are newer than those in the file */
+        if (keep_measured)
+        {
+            const memory_estimate *e = find_estimate(key + 1);
+            if (e != NULL && e->measured)
+                continue;
+        }
+        set_estimate(key + 1, peak_rss, 0);
+    }
+    fclose(f);
+}
+
+/* Merges the peaks measured by this process into the estimates file in the
+ * cache directory (at exit). Failure is not fatal.
+ */
+static void store_estimates(void)
+{
+    string_buffer text = { NULL, 0, 0 };
+    string_buffer path = { NULL, 0, 0 };
+    string_buffer tmp_path = { NULL, 0, 0 };
+    size_t i;
+    int fd, measured = 0;
+
+    buffer_printf(&path, "%s/" MEMORY_ESTIMATES_NAME, meter.cache_dir);
+    pthread_mutex_lock(&meter.lock);
+    for (i = 0; i < meter.num_estimates; i++)
+        measured |= meter.estimates[i].measured;
+    if (measured)
+    {
+        /* Keep what other processes stored since this one started */
+        load_estimates(path.data, 1);
+        for (i = 0; i < meter.num_estimates; i++)
+            if (strchr(meter.estimates[i].key, '\n') == NULL)
+                buffer_printf(&text, "%llu %s\n", meter.estimates[i].peak_rss, meter.estimates[i].key);
+    }
+    pthread_mutex_unlock(&meter.lock);
+
+    if (measured && (mkdir(meter.cache_dir, 0777) == 0 || errno == EEXIST))
+    {
+        buffer_printf(&tmp_path, "%s/.tmp.XXXXXX", meter.cache_dir);
+        fd = mkstemp(tmp_path.data);
+        if (fd >= 0)
+        {
+            int failed = fchmod(fd, 0644) != 0 || write_all(fd, text.data, text.len) != 0;
+            failed = close(fd) != 0 || failed;
+            if (failed || rename(tmp_path.data, path.data) != 0)
+                unlink(tmp_path.data);
+        }
+    }
+    free(tmp_path.data);
+    free(path.data);
+    free(text.data);
+}
+
+/* Sets the memory budget from --mem-budget. With a cache directory, the
+ * peak RSS of each source is kept there, so that later runs with a budget
+ * can estimate the memory of a build before its first measurement.
+ */
+static void meter_start(const compiler_options *options)
+{
+    string_buffer path = { NULL, 0, 0 };
+
+    meter.budget = options->mem_budget;
+    if (meter.budget == 0 || options->cache_dir == NULL)
+        return;
+    meter.cache_dir = options->cache_dir;
+    buffer_printf(&path, "%s/" MEMORY_ESTIMATES_NAME, meter.cache_dir);
+    pthread_mutex_lock(&meter.lock);
+    load_estimates(path.data, 0);
+    pthread_mutex_unlock(&meter.lock);
+    free(path.data);
+    atexit(store_estimates);
+}
+#endif /* !ONLINECLC_LIBRARY */
+
+/* Waits until a build of a source fits in the memory budget, and starts
+ * measuring it. Each meter_begin must be followed by meter_end from the
+ * same thread.
+ */
+static void meter_begin(usage_probe *probe, const char *source_filename)
+{
+    char *path = realpath(source_filename, NULL);
+    unsigned long long estimate;
+    pthread_t sampler;
+    usage_probe *p;
+
+    /* The key is the absolute path, since the cache may be shared. Without
+     * the memory for a key, the build is measured but not remembered.
+     */
+    if (path != NULL)
+        probe->key = path;
+    else
+        probe->key = try_strndup(source_filename, strlen(source_filename), "a source name");
+
+    pthread_mutex_lock(&meter.lock);
+    for (;;)
+    {
+        estimate = estimate_memory(probe->key);
+        if (meter.budget == 0 || meter.running == 0 || meter.reserved + estimate <= meter.budget)
+            break;
+        pthread_cond_wait(&meter.finished, &meter.lock);
+    }
+    probe->reserved = meter.budget != 0 ? estimate : 0;
+    meter.reserved += probe->reserved;
+    meter.running++;
+    if (!meter.sampler_started && pthread_create(&sampler, NULL, rss_sampler, NULL) == 0)
+    {
+        pthread_detach(sampler);
+        meter.sampler_started = 1;
+    }
+    pthread_mutex_unlock(&meter.lock);
+
+    probe->start_rss = current_rss();
+    probe->peak_rss = probe->start_rss;
+    probe->abandoned = 0;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &probe->cpu);
+    pthread_mutex_lock(&meter.lock);
+    probe->shared = meter.probes != NULL;
+    for (p = meter.probes; p != NULL; p = p->next)
+        p->shared = 1;
+    probe->next = meter.probes;
+    meter.probes = probe;
+    pthread_cond_signal(&meter.started);
+    pthread_mutex_unlock(&meter.lock);
+}
+
+/* Finishes measuring a build started with meter_begin, storing what it used
+ * in *used, and lets waiting builds in unless the build was abandoned.
+ */
+static void meter_end(usage_probe *probe, build_usage *used)
+{
+    struct timespec cpu;
+    unsigned long long rss = current_rss();
+    unsigned long long peak_rss;
+    usage_probe **p;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    pthread_mutex_lock(&meter.lock);
+    update_peaks(rss);
+    for (p = &meter.probes; *p != probe; p = &(*p)->next)
+        ;
+    *p = probe->next;
+    peak_rss = probe->start_rss != 0 ? probe->peak_rss - probe->start_rss : 0;
+    /* A shared peak also counts other builds, so it is only better than
+     * nothing. That of an abandoned build is not known yet.
+     */
+    if (probe->key != NULL && probe->start_rss != 0 && !probe->abandoned
+        && (!probe->shared || find_estimate(probe->key) == NULL))
+        set_estimate(probe->key, peak_rss, 1);
+    if (!probe->abandoned)
+    {
+        meter.reserved -= probe->reserved;
+        meter.running--;
+        pthread_cond_broadcast(&meter.finished);
+    }
+    pthread_mutex_unlock(&meter.lock);
+
+    used->cpu_ms = elapsed_us(&probe->cpu, &cpu) / 1000.0;
+    used->peak_rss = peak_rss;
+    used->shared = probe->shared;
+    free(probe->key);
+}
+
+/* Gives back the reservation of a build abandoned at the deadline, once it
+ * is really over
+ */
+static void meter_release(unsigned long long reserved)
+{
+    pthread_mutex_lock(&meter.lock);
+    meter.reserved -= reserved;
+    meter.running--;
+    pthread_cond_broadcast(&meter.finished);
+    pthread_mutex_unlock(&meter.lock);
+}
+
+/* Formats what a build used, to follow its build log (--build-stats) */
+static void write_build_usage(FILE *out, const build_usage *used)
+{
+    fprintf(out, "Build: %.3f ms CPU, peak RSS +%.1f MiB%s\n",
+            used->cpu_ms, used->peak_rss / (1024.0 * 1024.0),
+            used->shared ? " (shared with concurrent builds)" : "");
+}
+
+/* A build with a deadline. The OpenCL call is made from a thread of its
+ * own, since many implementations block in clBuildProgram even when given
+ * a callback, and the caller waits for the callback or the deadline. If the
+ * deadline passes first, the build is abandoned to the thread. This is
+ * shared by the caller, the thread and the callback, and freed by the last
+ * of them to finish with it. A call that fails without starting the build
+ * never calls back, but one that reports a failed build may, so in that
+ * case it is leaked, which is safer than guessing.
+ */
+typedef struct
+{
+    cl_program program;
+    cl_uint num_devices;
+    cl_device_id *devices;
+    char *options;
+    /* Set for clCompileProgram rather than clBuildProgram */
+    int compile;
+    /* The rest is protected by lock */
+    /* Set if the build was abandoned with a share of the memory budget, which
+     * the thread gives back with meter_release
+     */
+    int metered;
+    unsigned long long reserved;
+    cl_int status;
+    /* Set once the call has returned, and once the callback is called */
+    int returned;
+    int notified;
+    unsigned int refs;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} deadline_build;
+
+/* Drops a reference to a deadline_build, with the lock held. The lock is
+ * released.
+ */
+static void release_deadline_build(deadline_build *b)
+{
+    unsigned int refs = --b->refs;
+
+    pthread_mutex_unlock(&b->lock);
+    if (refs > 0)
+        return;
+    pthread_cond_destroy(&b->done);
+    pthread_mutex_destroy(&b->lock);
+    clReleaseProgram(b->program);
+    free(b->devices);
+    free(b->options);
+    free(b);
+}
+
+/* Tells whether the build is over, with the lock held. The callback is
+ * only sure to be called if the call succeeded.
+ */
+static int deadline_build_done(const deadline_build *b)
+{
+    return b->returned && (b->notified || b->status != CL_SUCCESS);
+}
+
+static void CL_CALLBACK deadline_notify(cl_program program, void *user_data)
+{
+    deadline_build *b = (deadline_build *) user_data;
+
+    (void) program;
+    pthread_mutex_lock(&b->lock);
+    b->notified = 1;
+    pthread_cond_broadcast(&b->done);
+    release_deadline_build(b);
+}
+
+static void *deadline_thread(void *arg)
+{
+    deadline_build *b = (deadline_build *) arg;
+    unsigned long long reserved;
+    cl_int status;
+    int slot, metered;
+
+    slot = jobserver_acquire();
+    if (b->compile)
+        status = clCompileProgram(b->program, b->num_devices, b->devices, b->options,
+                                  0, NULL, NULL, deadline_notify, b);
+    else
+        status = clBuildProgram(b->program, b->num_devices, b->devices, b->options, deadline_notify, b);
+    pthread_mutex_lock(&b->lock);
+    b->status = status;
+    b->returned = 1;
+    if (status != CL_SUCCESS
+        && status != (b->compile ? CL_COMPILE_PROGRAM_FAILURE : CL_BUILD_PROGRAM_FAILURE))
+        b->refs--;
+    /* Hold the job slot, and the memory of an abandoned build, until the
+     * build is really over
+     */
+    while (!deadline_build_done(b))
+        pthread_cond_wait(&b->done, &b->lock);
+    jobserver_release(slot);
+    metered = b->metered;
+    reserved = b->reserved;
+    pthread_cond_broadcast(&b->done);
+    release_deadline_build(b);
+    if (metered)
+        meter_release(reserved);
+    return NULL;
+}
+
+/* Makes the build or compile call for build_program or compile_program,
+ * giving up after timeout seconds. If the build is being measured by probe
+ * (which may be NULL), a build that is given up on keeps its share of the
+ * memory budget until it is over. Returns the status of the call
+ * (with a failed build reported as failure_status, even if the call
+ * returned early), BUILD_TIMED_OUT, or BUILD_ERROR if the build could not
+ * be started (which is reported).
+ */
+static cl_int call_with_deadline(
+    cl_program program,
+    cl_uint num_devices,
+    const cl_device_id *devices,
+    const char *options,
+    double timeout,
+    int compile,
+    cl_int failure_status,
+    usage_probe *probe)
+{
+    deadline_build *b;
+    pthread_condattr_t attr;
+    pthread_t thread;
+    struct timespec deadline;
+    cl_int status;
+    cl_uint i;
+    int ret;
+
+    b = (deadline_build *) try_malloc(sizeof(deadline_build), "a build");
+    if (b == NULL)
+        return BUILD_ERROR;
+    b->program = program;
+    b->num_devices = num_devices;
+    b->devices = (cl_device_id *) try_malloc(num_devices * sizeof(cl_device_id), "device IDs");
+    b->options = (char *) try_malloc(strlen(options) + 1, "build options");
+    if (b->devices == NULL || b->options == NULL)
+    {
+        free(b->devices);
+        free(b->options);
+        free(b);
+        return BUILD_ERROR;
+    }
+    memcpy(b->devices, devices, num_devices * sizeof(cl_device_id));
+    strcpy(b->options, options);
+    b->compile = compile;
+    b->metered = 0;
+    b->reserved = 0;
+    b->status = CL_SUCCESS;
+    b->returned = 0;
+    b->notified = 0;
+    /* The caller, the thread and the callback */
+    b->refs = 3;
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&b->done, &attr);
+    pthread_condattr_destroy(&attr);
+    /* The build may outlive the caller's reference to the program */
+    clRetainProgram(program);
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (time_t) timeout;
+    deadline.tv_nsec += (long) ((timeout - (time_t) timeout) * 1e9);
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    ret = pthread_create(&thread, NULL, deadline_thread, b);
+    if (ret != 0)
+    {
+        errno = ret;
+        preport("Failed to create thread");
+        /* Neither the thread nor the callback will drop theirs */
+        pthread_mutex_lock(&b->lock);
+        b->refs = 1;
+        release_deadline_build(b);
+        return BUILD_ERROR;
+    }
+    pthread_detach(thread);
+    pthread_mutex_lock(&b->lock);
+    ret = 0;
+    while (!deadline_build_done(b) && ret != ETIMEDOUT)
+        ret = pthread_cond_timedwait(&b->done, &b->lock, &deadline);
+    status = deadline_build_done(b) ? b->status : BUILD_TIMED_OUT;
+    if (status == BUILD_TIMED_OUT && probe != NULL)
+    {
+        b->metered = 1;
+        b->reserved = probe->reserved;
+        probe->abandoned = 1;
+    }
+    release_deadline_build(b);
+
+    /* The call may return before the build is done, and so cannot report
+     * a failed build
+     */
+    for (i = 0; status == CL_SUCCESS && i < num_devices; i++)
+    {
+        cl_build_status build_status;
+
+        status = clGetProgramBuildInfo(program, devices[i], CL_PROGRAM_BUILD_STATUS,
+                                       sizeof(build_status), &build_status, NULL);
+        if (status == CL_SUCCESS && build_status == CL_BUILD_ERROR)
+            status = failure_status;
+    }
+    return status;
+}
+
+/* Reports a build abandoned at the deadline */
+static void report_timeout(const char *source_filename, double timeout)
+{
+    fprintf(message_stream(), "Build of `%s' timed out after %g s\n", source_filename, timeout);
+}
+
+/* Builds a loaded program for one or more devices. Returns CL_SUCCESS, or
+ * CL_BUILD_PROGRAM_FAILURE if the source did not compile for at least one of
+ * them (in which case the build log says why), BUILD_TIMED_OUT if it took
+ * longer than --timeout, or BUILD_ERROR if it failed for another reason
+ * (which is reported). If used is not NULL, the build is held to the --mem-budget and what it
+ * used is stored in *used.
+ *
+ * This may be called from several threads at once for different programs.
+ */
+static cl_int build_program(
+    cl_program program,
+    cl_uint num_devices,
+    const cl_device_id *devices,
+    const char *source_filename,
+    const compiler_options *options,
+    build_usage *used)
+{
+    const char *cl_options = options->options != NULL ? options->options : "";
+    cl_int status;
+    phase_timer timer;
+    usage_probe probe;
+    int slot;
+
+    if (used != NULL)
+        meter_begin(&probe, source_filename);
+    phase_begin(&timer);
+    if (options->timeout > 0)
+        status = call_with_deadline(program, num_devices, devices, cl_options, options->timeout,
+                                    0, CL_BUILD_PROGRAM_FAILURE, used != NULL ? &probe : NULL);
+    else
+    {
+        slot = jobserver_acquire();
+        status = clBuildProgram(program, num_devices, devices, cl_options, NULL, NULL);
+        jobserver_release(slot);
+    }
+    if (used != NULL)
+        meter_end(&probe, used);
+    if (status == BUILD_TIMED_OUT)
+        report_timeout(source_filename, options->timeout);
+    else if (status != CL_SUCCESS && status != CL_BUILD_PROGRAM_FAILURE && status != BUILD_ERROR)
+    {
+        report_cl(status, "Failed to build `%s'", source_filename);
+        status = BUILD_ERROR;
+    }
+    phase_end(&timer, "build", source_filename);
+    return status;
+}
+
+/* Compiles a loaded program to an object for one or more devices, as for
+ * build_program. Returns CL_SUCCESS, CL_COMPILE_PROGRAM_FAILURE,
+ * BUILD_TIMED_OUT or BUILD_ERROR.
+ */
+static cl_int compile_program(
+    cl_program program,
+    cl_uint num_devices,
+    const cl_device_id *devices,
+    const char *source_filename,
+    const compiler_options *options,
+    build_usage *used)
+{
+    const char *cl_options = options->options != NULL ? options->options : "";
+    cl_int status;
+    phase_timer timer;
+    usage_probe probe;
+    int slot;
+
+    if (used != NULL)
+        meter_begin(&probe, source_filename);
+    phase_begin(&timer);
+    if (options->timeout > 0)
+        status = call_with_deadline(program, num_devices, devices, cl_options, options->timeout,
+                                    1, CL_COMPILE_PROGRAM_FAILURE, used != NULL ? &probe : NULL);
+    else
+    {
+        slot = jobserver_acquire();
+        status = clCompileProgram(program, num_devices, devices, cl_options, 0, NULL, NULL, NULL, NULL);
+        jobserver_release(slot);
+    }
+    if (used != NULL)
+        meter_end(&probe, used);
+    if (status == BUILD_TIMED_OUT)
+        report_timeout(source_filename, options->timeout);
+    else if (status != CL_SUCCESS && status != CL_COMPILE_PROGRAM_FAILURE && status != BUILD_ERROR)
+    {
+        report_cl(status, "Failed to compile `%s'", source_filename);
+        status = BUILD_ERROR;
+    }
+    phase_end(&timer, "compile", source_filename);
+    return status;
+}
+
+/* Builds or, with -c, compiles a loaded program */
+static cl_int build_or_compile(
+    cl_program program,
+    cl_uint num_devices,
+    const cl_device_id *devices,
+    const char *source_filename,
+    const compiler_options *options,
+    build_usage *used)
+{
+    if (options->compile_only)
+        return compile_program(program, num_devices, devices, source_filename, options, used);
+    return build_program(program, num_devices, devices, source_filename, options, used);
+}
+
+/* Print usage information and exit with exitcode.
+ * If message is not NULL, it is displayed first.
+ */
+static void usage(int exitcode, const char *message)
+{
+    if (message != NULL)
+    {
+        fprintf(message_stream(), "%s\n\n", message);
+    }
+    fputs("Usage: onlineclc [<options>] [-b <machine>] [-o <outfile>] <source>\n"
+          "       onlineclc [<options>] [-b <machine>] [-j <jobs>] --batch <listfile>\n"
+          "       onlineclc [<options>] [-b <machine>] [-o <outfile>] --link <input>...\n"
+          "       onlineclc [<options>] [-b <machine>] --sweep <NAME=v1,v2> ... <source>\n"
+          "       onlineclc [-j <jobs>] --server <socket>\n"
+          "\n"
+          "   -b machine          Specify device to use, by name or selector\n"
+          "   -o outfile          Specify output file (- for stdout)\n"
+          "   --all-devices       Build for every device matching -b\n"
+          "   -c                  Compile to an object, for --link\n"
+          "   --link              Link objects and sources into one program\n"
+          "   --batch listfile    Compile every source named in listfile (- for stdin)\n"
+          "   -j jobs             Maximum number of concurrent builds\n"
+          "   --mem-budget size   Limit the estimated memory of concurrent builds\n"
+          "   --timeout seconds   Abandon a build that takes longer (exit status 124)\n"
+          "   --icd library       Load this OpenCL library or vendor ICD, not the ICD loader\n"
+          "   --server socket     Run a compile server listening on socket\n"
+          "   --cache-dir dir     Cache binaries in dir\n"
+          "   --cache-size size   Limit the cache to size bytes (K, M, G suffixes)\n"
+          "   -MD | -MMD          Write a make dependency file for the output\n"
+          "   -MF depfile         Name the dependency file (default: outfile with .d)\n"
+          "   -MT target          Name the target in the dependency file\n"
+          "   -MP                 Add an empty rule for each header\n"
+          "   --bundle-headers    Inline the headers before passing the source on\n"
+          "   --spirv             Take the source as a SPIR-V module (detected otherwise)\n"
+          "   --sweep NAME=v1,... Build a variant with -DNAME=v for each value\n"
+          "   --emit format       Write the binary as binary (the default), c, header, elf or fat\n"
+          "   --symbol name       Name the binary in the output of --emit\n"
+          "   --kernel-info       Show the attributes of each kernel after building\n"
+          "   --verify-binary     Reload the binary and time it against building from source\n"
+          "   --verify-runs n     Time n builds of each kind for --verify-binary (default 5)\n"
+          "   --watch             Rebuild whenever the source or its headers change\n"
+          "   --report file       Write the --sweep or --kernel-info report to file\n"
+          "   --report-format fmt Write the report as csv (the default) or json\n"
+          "   --build-stats       Show the CPU time and peak RSS of each build\n"
+          "   --time              Report the time taken by each phase\n"
+          "   --trace tracefile   Append trace events for each phase to tracefile\n"
+          "   -h | --help         Show usage\n"
+          "\n"
+          "Other options are passed to the online compiler\n"
+          "NB: exactly one source file must be given, as the last argument\n"
+          "(- for stdin).\n"
+          "In batch mode, each line of listfile is a source filename, optionally\n"
+          "followed by a tab and an output filename.\n"
+          "A selector is a /-separated list of platform:<index or name>,\n"
+          "device:<index>, type:<cpu|gpu|accelerator|default|all> and name:<device>.\n"
+          "With --all-devices, the binary for device n is written to outfile.n and\n"
+          "with --sweep, the binary for variant n is written to outfile.n\n"
+          "(with --emit fat, all of them are written to outfile).\n"
+          "The symbol for --emit defaults to the name of outfile without its extension.\n"
+          "With --link, inputs ending in .cl (or -) are sources, and others are objects.\n"
+          "If ONLINECLC_SERVER names the socket of a running server, the source is\n"
+          "compiled by the server.\n",
+          message != NULL ? message_stream() : stdout
+         );
+    terminate(exitcode);
+}
+
+/* Determine whether a command-line option is expected to be followed by an
+ * argument, which should not be parsed as an option. This is necessarily
+ * approximate since there may be vendor-specific options, but it reduces the
+ * chance of accidentally processing an argument as an option.
+ */
+static int option_has_argument(const char *option)
+{
+    return (0 == strcmp(option, "-I"))
+        || (0 == strcmp(option, "-D"))
+        || (0 == strcmp(option, "-b"))
+        || (0 == strcmp(option, "-o"))
+        || (0 == strcmp(option, "-j"))
+        || (0 == strcmp(option, "--batch"))
+        || (0 == strcmp(option, "--server"))
+        || (0 == strcmp(option, "--cache-dir"))
+        || (0 == strcmp(option, "--cache-size"))
+        || (0 == strcmp(option, "--mem-budget"))
+        || (0 == strcmp(option, "--timeout"))
+        || (0 == strcmp(option, "--icd"))
+        || (0 == strcmp(option, "--trace"))
+        || (0 == strcmp(option, "-MF"))
+        || (0 == strcmp(option, "-MT"));
+}
+
+/* Adds option to an options string of length *len in *size bytes, and
+ * appends a trailing space so that options will be space-separated. It will
+ * dynamically resize the memory if needed, and kill the process if that
+ * fails.
+ */
+static void append_option(char **text, size_t *len, size_t *size, const char *option)
+{
+    size_t option_len = strlen(option);
+    /* *len + option_len + 2 bytes are needed:
+     * *len + option_len for options text, one for trailing space, one for NUL
+     */
+    while (*len + option_len + 1 >= *size)
+    {
+        size_t new_size = 2 * *size;
+        char *grown;
+
+        if (new_size == 0)
+            new_size = 64;
+        /* The old text stays with the options, which are freed as usual */
+        grown = realloc(*text, new_size);
+        if (grown == NULL)
+            die(1, "Out of memory trying to allocate %zu bytes", new_size);
+
+        *text = grown;
+        *size = new_size;
+    }
+    memcpy(*text + *len, option, option_len);
+    *len += option_len;
+    (*text)[*len] = ' ';
+    (*text)[*len + 1] = '\0';
+    (*len)++;
+}
+
+/* Adds option to the options for clBuildProgram and clCompileProgram */
+static void append_compiler_option(compiler_options *options, const char *option)
+{
+    append_option(&options->options, &options->len, &options->size, option);
+}
+
+/* Adds option to the options for clLinkProgram */
+static void append_link_option(compiler_options *options, const char *option)
+{
+    append_option(&options->link_options, &options->link_len, &options->link_size, option);
+}
+
+/* Determines whether an option is for clLinkProgram. Returns 2 for options
+ * that are only for linking, 1 for ones that apply to both compiling and
+ * linking, and 0 for the rest, which are only for compiling.
+ */
+static int link_option_kind(const char *option)
+{
+    static const char * const link_only[] =
+    {
+        "-create-library", "-enable-link-options"
+    };
+    static const char * const both[] =
+    {
+        "-cl-denorms-are-zero", "-cl-no-signed-zeros", "-cl-unsafe-math-optimizations",
+        "-cl-finite-math-only", "-cl-fast-relaxed-math", "-cl-no-subgroup-ifp"
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(link_only) / sizeof(link_only[0]); i++)
+        if (0 == strcmp(option, link_only[i]))
+            return 2;
+    for (i = 0; i < sizeof(both) / sizeof(both[0]); i++)
+        if (0 == strcmp(option, both[i]))
+            return 1;
+    return 0;
+}
+
+/* Records a -I directory, so that #include can be resolved on the host */
+static void add_include_dir(compiler_options *options, const char *dir)
+{
+    const char **grown = (const char **) realloc(
+        options->include_dirs, (options->num_include_dirs + 1) * sizeof(const char *));
+
+    if (grown == NULL)
+        die(1, "Out of memory trying to allocate include directories");
+    options->include_dirs = grown;
+    options->include_dirs[options->num_include_dirs++] = dir;
+}
+
+/* Parses a size in bytes, with an optional K, M or G suffix (powers of
+ * 1024). Returns 0 on success or -1 if str is not a valid size.
+ */
+static int parse_size(const char *str, unsigned long long *size)
+{
+    char *end;
+    unsigned long long value;
+    unsigned int shift = 0;
+
+    if (!isdigit((unsigned char) str[0]))
+        return -1;
+    errno = 0;
+    value = strtoull(str, &end, 10);
+    if (errno != 0)
+        return -1;
+    switch (*end)
+    {
+    case '\0': break;
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    default: return -1;
+    }
+    if (*end != '\0' || value > (~0ULL >> shift))
+        return -1;
+    *size = value << shift;
+    return 0;
+}
+
+/* Returns the argument to the option argv[i], where argv[last] is the first
+ * argument that is not an option (i.e., the source file). If the argument is
+ * missing, kills the process. If current is not NULL the option has already
+ * been given, which is also an error.
+ */
+static const char *option_argument(const char * const *argv, int i, int last, const char *current)
+{
+    if (i + 1 >= last)
+    {
+        if (argv[last] != NULL)
+            usage(2, "Source file not specified");
+        die(2, "%s option requires an argument", argv[i]);
+    }
+    if (current != NULL)
+        die(2, "%s option specified twice", argv[i]);
+    return argv[i + 1];
+}
+
+/* Parse the command-line options into a structure. The options structure
+ * does not need to be pre-initialized.
+ */
+static void process_options(compiler_options *options, int argc, const char * const *argv)
+{
+    int i;
+    int last;           /* index of the source file in argv */
+    const char *jobs = NULL;
+    const char *cache_dir = NULL;
+    const char *cache_size = NULL;
+    const char *report_format = NULL;
+    const char *emit = NULL;
+    const char *verify_runs = NULL;
+    const char *mem_budget = NULL;
+    const char *timeout = NULL;
+    const char *icd = NULL;
+    const char **grown;
+
+    options->options = NULL;
+    options->size = 0;
+    options->len = 0;
+    options->machine = NULL;
+    options->output_filename = NULL;
+    options->source_filename = NULL;
+    options->batch_filename = NULL;
+    options->server_socket = NULL;
+    options->cache_dir = getenv("ONLINECLC_CACHE_DIR");
+    if (options->cache_dir != NULL && options->cache_dir[0] == '\0')
+        options->cache_dir = NULL;
+    options->cache_size = ONLINECLC_DEFAULT_CACHE_SIZE;
+    options->jobs = 0;
+    options->mem_budget = 0;
+    options->build_stats = 0;
+    options->timeout = 0.0;
+    options->icd = getenv("ONLINECLC_ICD");
+    if (options->icd != NULL && options->icd[0] == '\0')
+        options->icd = NULL;
+    options->all_devices = 0;
+    options->time = 0;
+    options->trace_filename = NULL;
+    options->include_dirs = NULL;
+    options->num_include_dirs = 0;
+    options->depfile = 0;
+    options->depfile_phony = 0;
+    options->depfile_filename = NULL;
+    options->depfile_target = NULL;
+    options->link_options = NULL;
+    options->link_len = 0;
+    options->link_size = 0;
+    options->compile_only = 0;
+    options->link = 0;
+    options->inputs = NULL;
+    options->num_inputs = 0;
+    options->bundle_headers = 0;
+    options->sweeps = NULL;
+    options->num_sweeps = 0;
+    options->report_filename = NULL;
+    options->report_json = 0;
+    options->kernel_info = 0;
+    options->verify_binary = 0;
+    options->watch = 0;
+    options->verify_runs = 0;
+    options->spirv = 0;
+    options->emit = EMIT_BINARY;
+    options->symbol = NULL;
+    /* Everything that free_options releases is now set, so it is safe on
+     * whatever a failure below leaves behind
+     */
+    if (argc <= 1)
+        usage(2, "Source file not specified");
+
+    /* First look for --help, and show help, even if there is no source file. */
+    for (i = 1; i < argc; i++)
+        if (0 == strcmp(argv[i], "-h") || 0 == strcmp(argv[i], "--help"))
+            usage(0, NULL);
+    /* In batch mode the sources come from the list file and in server mode
+     * from the clients, so all the arguments are options. With --link, the
+     * inputs are picked out from among the options.
+     */
+    last = argc - 1;
+    for (i = 1; i < argc; i++)
+        if (0 == strcmp(argv[i], "--batch") || 0 == strcmp(argv[i], "--server"))
+            last = argc;
+        else if (0 == strcmp(argv[i], "--link"))
+        {
+            options->link = 1;
+            last = argc;
+        }
+    for (i = 1; i < last; i++)
+    {
+        if (0 == strcmp(argv[i], "-b"))
+        {
+            options->machine = option_argument(argv, i, last, options->machine);
+            i++;
+        }
+        else if (0 == strcmp(argv[i], "-o"))
+        {
+            options->output_filename = option_argument(argv, i, last, options->output_filename);
+            i++;
+        }
+        else if (0 == strcmp(argv[i], "--batch"))
+        {
+            options->batch_filename = option_argument(argv, i, last, options->batch_filename);
+            i++;
+        }
+        else if (0 == strcmp(argv[i], "--server"))
+        {
+            options->server_socket = option_argument(argv, i, last, options->server_socket);
+            i++;
+        }
+        else if (0 == strcmp(argv[i], "--all-devices"))
+            options->all_devices = 1;
+        else if (0 == strcmp(argv[i], "-c"))
+            options->compile_only = 1;
+        else if (0 == strcmp(argv[i], "--link"))
+            ;
+        else if (0 == strcmp(argv[i], "--bundle-headers"))
+            options->bundle_headers = 1;
+        else if (0 == strcmp(argv[i], "--sweep"))
+        {
+            const char *sweep = option_argument(argv, i, last, NULL);
+            const char *eq = strchr(sweep, '=');
+
+            if (eq == NULL || eq == sweep || eq[1] == '\0')
+                die(2, "Invalid sweep `%s'", sweep);
+            grown = (const char **) realloc(options->sweeps, (options->num_sweeps + 1) * sizeof(const char *));
+            if (grown == NULL)
+                die(1, "Out of memory trying to allocate sweeps");
+            options->sweeps = grown;
+            options->sweeps[options->num_sweeps++] = sweep;
+            i++;
+        }
+        else if (0 == strcmp(argv[i], "--kernel-info"))
+            options->kernel_info = 1;
+        else if (0 == strcmp(argv[i], "--verify-binary"))
+            options->verify_binary = 1;
+        else if (0 == strcmp(argv[i], "--watch"))
+            options->watch = 1;
+        else if (0 == strcmp(argv[i], "--spirv"))
+            options->spirv = 1;
+        else if (0 == strcmp(argv[i], "--verify-runs"))
+        {
+            char *end;
+            unsigned long value;
+
+            verify_runs = option_argument(argv, i, last, verify_runs);
+            value = strtoul(verify_runs, &end, 10);
+            if (*verify_runs == '\0' || *end != '\0' || value == 0 || value > 1000)
+                die(2, "Invalid run count `%s'", verify_runs);
+            options->verify_runs = (unsigned int) value;
+            i++;
+        }
+        else if (0 == strcmp(argv[i], "--emit"))
+        {
+            emit = option_argument(argv, i, last, emit);
+            if (0 == strcmp(emit, "binary"))
+                options->emit = EMIT_BINARY;
+            else if (0 == strcmp(emit, "c"))
+                options->emit = EMIT_C;
+            else if (0 == strcmp(emit, "header"))
+                options->emit = EMIT_HEADER;
+            else if (0 == strcmp(emit, "elf"))
+            {
+                if (ELF_HOST_MACHINE == 0)
+                    die(2, "--emit elf is not supported on this host");
+                options->emit = EMIT_ELF;
+            }
+            else if (0 == strcmp(emit, "fat"))
+                options->emit = EMIT_FAT;
+            else
+                die(2, "Invalid output format `%s'", emit);
+            i++;
+        }
+        else if (0 == strcmp(argv[i], "--symbol"))
+        {
+            const char *c;
+
+            options->symbol = option_argument(argv, i, last, options->symbol);
+            for (c = options->symbol; *c != '\0'; c++)
+                if (!(isalnum((unsigned char) *c) || *c == '_'))
+                    break;
+            if (*c != '\0' || options->symbol[0] == '\0' || isdigit((unsigned char) options->symbol[0]))
+                die(2, "Invalid symbol `%s'", options->symbol);
+            i++;
+        }
+        else if (0 == strcmp(argv[i], "--report"))
+        {
+            options->report_filename = option_argument(argv, i, last, options->report_filename);
+            i++;
+        }
+        else if (0 == strcmp(argv[i], "--report-format"))
+        {
+            report_format = option_argument(argv, i, last, report_format);
+            if (0 == strcmp(report_format, "json"))
+                options->report_json = 1;
+            else if (0 == strcmp(report_format, "csv"))
+                options->report_json = 0;
+            else
+                die(2, "Invalid report format `%s'", report_format);
+            i++;
+        }
+        else if (options->link && (argv[i][0] != '-' || 0 == strcmp(argv[i], "-")))
+        {
+            grown = (const char **) realloc(options->inputs, (options->num_inputs + 1) * sizeof(const char *));
+            if (grown == NULL)
+                die(1, "Out of memory trying to allocate inputs");
+            options->inputs = grown;
+            options->inputs[options->num_inputs++] = argv[i];
+        }
+        else if (0 == strcmp(argv[i], "--time"))
+            options->time = 1;
+        else if (0 == strcmp(argv[i], "--trace"))
+        {
+            options->trace_filename = option_argument(argv, i, last, options->trace_filename);
+            i++;
+        }
+        else if (0 == strcmp(argv[i], "-MD") || 0 == strcmp(argv[i], "-MMD"))
+            options->depfile = 1;
+        else if (0 == strcmp(argv[i], "-MP"))
+            options->depfile_phony = 1;
+        else if (0 == strcmp(argv[i], "-MF"))
+        {
+            options->depfile_filename = option_argument(argv, i, last, options->depfile_filename);
+            i++;
+        }
+        else if (0 == strcmp(argv[i], "-MT"))
+        {
+            options->depfile_target = option_argument(argv, i, last, options->depfile_target);
+            i++;
+        }
+        else if (0 == strcmp(argv[i], "--cache-dir"))
+        {
+            cache_dir = option_argument(argv, i, last, cache_dir);
+            options->cache_dir = cache_dir;
+            i++;
+        }
+        else if (0 == strcmp(argv[i], "--cache-size"))
+        {
+            cache_size = option_argument(argv, i, last, cache_size);
+            if (parse_size(cache_size, &options->cache_size) != 0)
+                die(2, "Invalid cache size `%s'", cache_size);
+            i++;
+        }
+        else if (0 == strcmp(argv[i], "--mem-budget"))
+        {
+            mem_budget = option_argument(argv, i, last, mem_budget);
+            if (parse_size(mem_budget, &options->mem_budget) != 0 || options->mem_budget == 0)
+                die(2, "Invalid memory budget `%s'", mem_budget);
+            i++;
+        }
+        else if (0 == strcmp(argv[i], "--build-stats"))
+            options->build_stats = 1;
+        else if (0 == strcmp(argv[i], "--timeout"))
+        {
+            char *end;
+
+            timeout = option_argument(argv, i, last, timeout);
+            options->timeout = strtod(timeout, &end);
+            if (*timeout == '\0' || *end != '\0' || !(options->timeout > 0 && options->timeout <= 1e6))
+                die(2, "Invalid timeout `%s'", timeout);
+            i++;
+        }
+        else if (0 == strcmp(argv[i], "--icd"))
+        {
+            icd = option_argument(argv, i, last, icd);
+            options->icd = icd;
+            i++;
+        }
+        else if (0 == strcmp(argv[i], "-j"))
+        {
+            char *end;
+            unsigned long value;
+
+            jobs = option_argument(argv, i, last, jobs);
+            value = strtoul(jobs, &end, 10);
+            if (*jobs == '\0' || *end != '\0' || value == 0 || value > 1024)
+                die(2, "Invalid job count `%s'", jobs);
+            options->jobs = (unsigned int) value;
+            i++;
+        }
+        else
+        {
+            /* -I is passed on, but also recorded to find dependencies */
+            int kind = link_option_kind(argv[i]);
+
+            if (0 == strcmp(argv[i], "-I") && i < last - 1)
+                add_include_dir(options, argv[i + 1]);
+            else if (0 == strncmp(argv[i], "-I", 2) && argv[i][2] != '\0')
+                add_include_dir(options, argv[i] + 2);
+            if (kind == 2 && !options->link)
+                die(2, "%s can only be used with --link", argv[i]);
+            if (kind != 0)
+                append_link_option(options, argv[i]);
+            if (kind == 2)
+                continue;
+            append_compiler_option(options, argv[i]);
+            if (option_has_argument(argv[i]) && i < last - 1)
+            {
+                append_compiler_option(options, argv[i + 1]);
+                i++;
+            }
+        }
+    }
+    if (last < argc)
+        options->source_filename = argv[last];
+    if (options->batch_filename != NULL && options->output_filename != NULL)
+        die(2, "-o cannot be used with --batch");
+    if (options->all_devices && (options->batch_filename != NULL || options->server_socket != NULL))
+        die(2, "--all-devices cannot be used with --batch or --server");
+    if (options->link)
+    {
+        if (options->num_inputs == 0)
+            usage(2, "No files to link");
+        if (options->batch_filename != NULL || options->server_socket != NULL || options->all_devices
+            || options->compile_only || options->depfile)
+            die(2, "--link cannot be used with --batch, --server, --all-devices, -c or -MD");
+    }
+    if (options->num_sweeps > 0)
+    {
+        if (options->batch_filename != NULL || options->server_socket != NULL || options->all_devices
+            || options->link || options->compile_only || options->depfile)
+            die(2, "--sweep cannot be used with --batch, --server, --all-devices, --link, -c or -MD");
+        if (options->output_filename != NULL && 0 == strcmp(options->output_filename, "-"))
+            die(2, "-o - cannot be used with --sweep");
+    }
+    else if ((options->report_filename != NULL || report_format != NULL) && !options->kernel_info)
+        die(2, "--report needs --sweep or --kernel-info");
+    if (options->kernel_info
+        && (options->batch_filename != NULL || options->server_socket != NULL || options->all_devices
+            || options->link || options->num_sweeps > 0 || options->compile_only))
+        die(2, "--kernel-info cannot be used with --batch, --server, --all-devices, --link, --sweep or -c");
+    if (options->verify_binary
+        && (options->batch_filename != NULL || options->server_socket != NULL || options->all_devices
+            || options->link || options->num_sweeps > 0 || options->compile_only))
+        die(2, "--verify-binary cannot be used with --batch, --server, --all-devices, --link, --sweep or -c");
+    if (options->watch)
+    {
+        if (options->batch_filename != NULL || options->server_socket != NULL || options->all_devices
+            || options->link || options->num_sweeps > 0 || options->kernel_info || options->verify_binary)
+            die(2, "--watch cannot be used with --batch, --server, --all-devices, --link, --sweep, "
+                "--kernel-info or --verify-binary");
+        if (0 == strcmp(options->source_filename, "-"))
+            die(2, "--watch needs a source file, not -");
+        if (options->output_filename != NULL && 0 == strcmp(options->output_filename, "-"))
+            die(2, "-o - cannot be used with --watch");
+    }
+    if (verify_runs != NULL && !options->verify_binary)
+        die(2, "--verify-runs needs --verify-binary");
+    if (options->verify_runs == 0)
+        options->verify_runs = 5;
+    if (options->symbol != NULL && options->batch_filename != NULL)
+        die(2, "--symbol cannot be used with --batch");
+    if (options->emit != EMIT_BINARY && options->emit != EMIT_FAT && options->symbol == NULL
+        && options->output_filename != NULL && 0 == strcmp(options->output_filename, "-"))
+        die(2, "--emit needs --symbol when writing to stdout");
+    if (options->server_socket != NULL
+        && (options->batch_filename != NULL || options->output_filename != NULL
+            || options->machine != NULL || options->len > 0 || cache_dir != NULL || cache_size != NULL
+            || options->time || options->trace_filename != NULL || options->depfile
+            || options->compile_only || emit != NULL || options->symbol != NULL || options->build_stats))
+        die(2, "--server only accepts the -j, --mem-budget, --timeout and --icd options");
+    if (options->depfile && options->batch_filename != NULL
+        && (options->depfile_filename != NULL || options->depfile_target != NULL))
+        die(2, "-MF and -MT cannot be used with --batch");
+    if (options->depfile && options->batch_filename == NULL && options->server_socket == NULL)
+    {
+        int to_stdout = options->output_filename != NULL && 0 == strcmp(options->output_filename, "-");
+        if (options->depfile_target == NULL && (options->output_filename == NULL || to_stdout))
+            die(2, "-MD needs -o <outfile> or -MT <target>");
+        if (options->depfile_filename == NULL && (options->output_filename == NULL || to_stdout))
+            die(2, "-MD needs -o <outfile> or -MF <depfile>");
+    }
+
+    /* Strip trailing space after last option */
+    if (options->len > 0)
+    {
+        options->options[options->len - 1] = '\0';
+        options->len--;
+    }
+    if (options->link_len > 0)
+    {
+        options->link_options[options->link_len - 1] = '\0';
+        options->link_len--;
+    }
+}
+
+/* Frees the memory allocated by process_options */
+static void free_options(compiler_options *options)
+{
+    free(options->options);
+    free(options->link_options);
+    free(options->include_dirs);
+    free(options->inputs);
+    free(options->sweeps);
+}
+
+/* Extract the binary from program. It is stored in *binary, dynamically
+ * allocated, and must be freed by the caller; its size is stored in *size.
+ * Returns CL_SUCCESS or BUILD_ERROR.
+ */
+static cl_int get_program_binary(cl_program program, unsigned char **binary, size_t *size)
+{
+    cl_int status;
+    cl_uint num_devices;
+    size_t sizes[1];
+    unsigned char *binaries[1];
+    phase_timer timer;
+
+    phase_begin(&timer);
+    *binary = NULL;
+    /* Verify that there is only one device */
+    status = clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &num_devices, NULL);
+    if (status != CL_SUCCESS)
+    {
+        report_cl(status, "Failed to query number of devices from program");
+        return BUILD_ERROR;
+    }
+    if (num_devices != 1)
+    {
+        report("Expected one device but found %u", (unsigned int) num_devices);
+        return BUILD_ERROR;
+    }
+
+    status = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), sizes, NULL);
+    if (status != CL_SUCCESS)
+    {
+        report_cl(status, "Failed to obtain binary size");
+        return BUILD_ERROR;
+    }
+
+    if (sizes[0] == 0)
+    {
+        report("No binary was produced by the compiler");
+        return BUILD_ERROR;
+    }
+
+    binaries[0] = (unsigned char *) try_malloc(sizes[0], "the program binary");
+    if (binaries[0] == NULL)
+        return BUILD_ERROR;
+    status = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char *), binaries, NULL);
+    if (status != CL_SUCCESS)
+    {
+        report_cl(status, "Failed to query the program binary");
+        free(binaries[0]);
+        return BUILD_ERROR;
+    }
+
+    *binary = binaries[0];
+    *size = sizes[0];
+    phase_end(&timer, "get binary", NULL);
+    return CL_SUCCESS;
+}
+
+#if !ONLINECLC_LIBRARY
+/* Creates a hidden temporary file in the same directory as path, so that
+ * it can be renamed over path. The name is stored in *tmp_path, which must
+ * be freed by the caller. Returns the file descriptor, or -1 with errno set.
+ *
+ * This uses O_EXCL with a name of our own rather than mkstemp(), so that the
+ * file is created with the usual permissions (subject to the umask).
+ */
+static int create_temp_beside(const char *path, char **tmp_path)
+{
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static unsigned int counter = 0;
+    const char *base;
+    size_t dir_len;
+    unsigned int attempt, n;
+    int fd = -1;
+
+    base = strrchr(path, '/');
+    base = base != NULL ? base + 1 : path;
+    dir_len = base - path;
+    *tmp_path = (char *) onlineclc_malloc(strlen(path) + 64, "a filename");
+    for (attempt = 0; attempt < 100; attempt++)
+    {
+        pthread_mutex_lock(&lock);
+        n = counter++;
+        pthread_mutex_unlock(&lock);
+        sprintf(*tmp_path, "%.*s.%s.%ld.%u", (int) dir_len, path, base, (long) getpid(), n);
+        fd = open(*tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (fd >= 0 || errno != EEXIST)
+            break;
+    }
+    return fd;
+}
+
+/* Write size bytes of data to output_filename, which may be - for standard
+ * output.
+ *
+ * A regular file is replaced atomically: the data is written to a temporary
+ * file beside it, which is then renamed over it, so that other processes
+ * never see a partial binary and a failure leaves the old file in place.
+ * A symlink is followed to the file it names, which is created if need be.
+ * Anything else (a pipe, a terminal, /dev/stdout) is simply written to.
+ */
+static void write_binary_data(const char *output_filename, const unsigned char *data, size_t size)
+{
+    struct stat sb, stdout_sb, link_sb;
+    char resolved[4096];
+    const char *path = output_filename;
+    char *tmp_path;
+    int fd, ret, saved_errno;
+    int exists, links;
+
+    exists = stat(output_filename, &sb) == 0;
+    if (0 == strcmp(output_filename, "-")
+        || (exists && fstat(STDOUT_FILENO, &stdout_sb) == 0
+            && sb.st_dev == stdout_sb.st_dev && sb.st_ino == stdout_sb.st_ino))
+    {
+        /* Writing to the file behind stdout from its start would clobber
+         * anything already written to it, so append to stdout itself.
+         */
+        if (write_all(STDOUT_FILENO, data, size) != 0)
+            pdie(1, "Failed to write `%s'", output_filename);
+        return;
+    }
+    if (exists && !S_ISREG(sb.st_mode))
+    {
+        fd = open(output_filename, O_WRONLY);
+        if (fd < 0)
+            pdie(1, "Failed to open `%s'", output_filename);
+        if (write_all(fd, data, size) != 0)
+        {
+            saved_errno = errno;
+            close(fd);
+            errno = saved_errno;
+            pdie(1, "Failed to write `%s'", output_filename);
+        }
+        close(fd);
+        return;
+    }
+
+    /* Replace the target of a symlink rather than the symlink itself, and
+     * create it if the symlink dangles. A relative target is resolved from
+     * the directory of the link.
+     */
+    for (links = 0; lstat(path, &link_sb) == 0 && S_ISLNK(link_sb.st_mode); links++)
+    {
+        const char *slash = strrchr(path, '/');
+        char target[sizeof(resolved)];
+        size_t dir_len = 0;
+        ssize_t len = -1;
+
+        if (links < 40)
+            len = readlink(path, target, sizeof(target));
+        else
+            errno = ELOOP;
+        if (len > 0 && target[0] != '/' && slash != NULL)
+            dir_len = slash - path + 1;
+        if (len >= 0 && dir_len + len >= sizeof(resolved))
+        {
+            len = -1;
+            errno = ENAMETOOLONG;
+        }
+        if (len < 0)
+            pdie(1, "Failed to resolve `%s'", output_filename);
+        /* path may already be resolved, in which case its directory stays */
+        memmove(resolved, path, dir_len);
+        memcpy(resolved + dir_len, target, len);
+        resolved[dir_len + len] = '\0';
+        path = resolved;
+    }
+
+    fd = create_temp_beside(path, &tmp_path);
+    if (fd < 0)
+        pdie(1, "Failed to open `%s'", output_filename);
+    /* Keep the permissions of the file being replaced */
+    if (exists)
+        fchmod(fd, sb.st_mode & 07777);
+    ret = write_all(fd, data, size);
+    saved_errno = errno;
+    if (close(fd) != 0 && ret == 0)
+    {
+        ret = -1;
+        saved_errno = errno;
+    }
+    if (ret != 0)
+    {
+        unlink(tmp_path);
+        errno = saved_errno;
+        pdie(1, "Failed to write `%s'", output_filename);
+    }
+    if (rename(tmp_path, path) != 0)
+    {
+        saved_errno = errno;
+        unlink(tmp_path);
+        errno = saved_errno;
+        pdie(1, "Failed to rename `%s' to `%s'", tmp_path, output_filename);
+    }
+    free(tmp_path);
+}
+
+/* write_binary_data, timed as a phase */
+static void write_binary_file(const char *output_filename, const unsigned char *data, size_t size)
+{
+    phase_timer timer;
+
+    phase_begin(&timer);
+    write_binary_data(output_filename, data, size);
+    phase_end(&timer, "write output", output_filename);
+}
+#endif /* !ONLINECLC_LIBRARY */
+
+static const uint32_t sha256_k[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_init(sha256_context *ctx)
+{
+    static const uint32_t initial[8] =
+    {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->bytes = 0;
+}
+
+/* Processes one 64-byte block */
+static void sha256_transform(sha256_context *ctx, const unsigned char *block)
+{
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = ((uint32_t) block[4 * i] << 24) | ((uint32_t) block[4 * i + 1] << 16)
+            | ((uint32_t) block[4 * i + 2] << 8) | (uint32_t) block[4 * i + 3];
+    for (i = 16; i < 64; i++)
+    {
+        uint32_t s0 = SHA256_ROTR(w[i - 15], 7) ^ SHA256_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = SHA256_ROTR(w[i - 2], 17) ^ SHA256_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+    e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+    for (i = 0; i < 64; i++)
+    {
+        uint32_t s1 = SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0 = SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+static void sha256_update(sha256_context *ctx, const void *data, size_t len)
+{
+    const unsigned char *ptr = (const unsigned char *) data;
+    size_t used = ctx->bytes % 64;
+
+    ctx->bytes += len;
+    if (used > 0)
+    {
+        size_t take = 64 - used < len ? 64 - used : len;
+        memcpy(ctx->block + used, ptr, take);
+        ptr += take;
+        len -= take;
+        if (used + take < 64)
+            return;
+        sha256_transform(ctx, ctx->block);
+    }
+    while (len >= 64)
+    {
+        sha256_transform(ctx, ptr);
+        ptr += 64;
+        len -= 64;
+    }
+    memcpy(ctx->block, ptr, len);
+}
+
+static void sha256_final(sha256_context *ctx, unsigned char hash[32])
+{
+    unsigned char pad[72];
+    uint64_t bits = ctx->bytes * 8;
+    size_t pad_len = 64 - (ctx->bytes + 8) % 64;
+    int i;
+
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++)
+        pad[pad_len + i] = (unsigned char) (bits >> (56 - 8 * i));
+    sha256_update(ctx, pad, pad_len + 8);
+    for (i = 0; i < 32; i++)
+        hash[i] = (unsigned char) (ctx->state[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+/* Adds a length-prefixed field to a hash, so that the boundaries between
+ * fields are unambiguous.
+ */
+static void sha256_field(sha256_context *ctx, const void *data, size_t len)
+{
+    uint64_t len64 = len;
+    sha256_update(ctx, &len64, sizeof(len64));
+    sha256_update(ctx, data, len);
+}
+
+/* Headers found by scanning a source for #include directives */
+typedef struct
+{
+    /* Paths of the headers, in the order found (dynamically allocated) */
+    char **paths;
+    size_t num_paths;
+    /* Hash of the paths and contents of the headers, for the cache key */
+    unsigned char hash[32];
+} dependency_list;
+
+/* An #include (or #pragma once) found by scan_includes */
+typedef struct
+{
+    /* The name between the quotes or angle brackets, or NULL for #pragma
+     * once
+     */
+    const char *name;
+    /* Set for <name> */
+    int angle;
+    /* Offsets in the source of the start of the directive's line and of the
+     * end of its last line (including the newline)
+     */
+    size_t begin;
+    size_t end;
+    /* Number of the line after the directive */
+    size_t next_line;
+    /* Number of #if, #ifdef and #ifndef blocks that the directive is in */
+    unsigned int conditional;
+} include_directive;
+
+/* Called by scan_includes for each #include and #pragma once. Returns 0, or
+ * -1 to stop the scan after a failure (which it has reported).
+ */
+typedef int (*include_callback)(void *arg, const include_directive *inc);
+
+/* Reads the characters of a source_text across its chunks, with line
+ * splices (backslash-newline) removed.
+ */
+typedef struct
+{
+    const source_text *src;
+    size_t chunk;
+    size_t offset;
+    /* Offset from the start of the source, and newlines passed so far */
+    size_t pos;
+    size_t newlines;
+} source_reader;
+
+/* Returns the character ahead positions after the current one, without
+ * removing splices, or EOF.
+ */
+static int reader_raw(const source_reader *r, size_t ahead)
+{
+    size_t chunk = r->chunk, offset = r->offset + ahead;
+
+    while (chunk < r->src->num_chunks && offset >= r->src->chunk_lens[chunk])
+        offset -= r->src->chunk_lens[chunk++];
+    if (chunk == r->src->num_chunks)
+        return EOF;
+    return (unsigned char) r->src->chunks[chunk][offset];
+}
+
+static void reader_advance(source_reader *r, size_t n)
+{
+    for (; n > 0 && r->chunk < r->src->num_chunks; n--)
+    {
+        if (r->src->chunks[r->chunk][r->offset] == '\n')
+            r->newlines++;
+        r->pos++;
+        r->offset++;
+        while (r->chunk < r->src->num_chunks && r->offset >= r->src->chunk_lens[r->chunk])
+            r->offset -= r->src->chunk_lens[r->chunk++];
+    }
+}
+
+static int reader_peek(source_reader *r)
+{
+    for (;;)
+    {
+        if (reader_raw(r, 0) != '\\')
+            break;
+        if (reader_raw(r, 1) == '\n')
+            reader_advance(r, 2);
+        else if (reader_raw(r, 1) == '\r' && reader_raw(r, 2) == '\n')
+            reader_advance(r, 3);
+        else
+            break;
+    }
+    return reader_raw(r, 0);
+}
+
+static int reader_next(source_reader *r)
+{
+    int c = reader_peek(r);
+    if (c != EOF)
+        reader_advance(r, 1);
+    return c;
+}
+
+/* Whether the directive text starts with the word name */
+static int directive_is(const char *text, const char *name)
+{
+    size_t len = strlen(name);
+
+    return 0 == strncmp(text, name, len) && !isalnum((unsigned char) text[len]) && text[len] != '_';
+}
+
+/* Parses a preprocessing directive (the text after the #), calling found
+ * if it is an #include of a literal name or #pragma once. #include of a
+ * macro is ignored. Conditionals update inc->conditional. Returns 0, or -1
+ * if found fails or there is no memory (which is reported).
+ */
+static int parse_directive(const char *text, include_directive *inc, include_callback found, void *arg)
+{
+    const char *end;
+    char *name;
+    int ret;
+
+    while (*text == ' ' || *text == '\t')
+        text++;
+    if (directive_is(text, "if") || directive_is(text, "ifdef") || directive_is(text, "ifndef"))
+    {
+        inc->conditional++;
+        return 0;
+    }
+    if (directive_is(text, "endif"))
+    {
+        if (inc->conditional > 0)
+            inc->conditional--;
+        return 0;
+    }
+    if (0 == strncmp(text, "pragma", 6) && (text[6] == ' ' || text[6] == '\t'))
+    {
+        text += 6;
+        while (*text == ' ' || *text == '\t')
+            text++;
+        if (0 == strncmp(text, "once", 4) && (text[4] == '\0' || isspace((unsigned char) text[4])))
+        {
+            inc->name = NULL;
+            inc->angle = 0;
+            return found(arg, inc);
+        }
+        return 0;
+    }
+    if (0 != strncmp(text, "include", 7))
+        return 0;
+    text += 7;
+    while (*text == ' ' || *text == '\t')
+        text++;
+    if (*text == '"')
+        end = strchr(text + 1, '"');
+    else if (*text == '<')
+        end = strchr(text + 1, '>');
+    else
+        return 0;
+    if (end == NULL || end == text + 1)
+        return 0;
+    name = try_strndup(text + 1, end - text - 1, "an include name");
+    if (name == NULL)
+        return -1;
+    inc->name = name;
+    inc->angle = *text == '<';
+    ret = found(arg, inc);
+    free(name);
+    return ret;
+}
+
+/* Finds the #include directives in a source, calling found for each. This
+ * is a host-side approximation of the preprocessor: it follows comments,
+ * string literals and line splices, but does not evaluate conditionals, so
+ * it reports the includes of every branch (with how deeply nested they are).
+ * Returns 0, or -1 if found fails or there is no memory (which is reported).
+ */
+static int scan_includes(const source_text *src, include_callback found, void *arg)
+{
+    source_reader r;
+    string_buffer directive = { NULL, 0, 0 };
+    include_directive inc;
+    int line_start = 1;         /* only whitespace so far on this line */
+    int in_directive = 0;
+    int ret = 0;
+    int c;
+
+    r.src = src;
+    r.chunk = 0;
+    r.offset = 0;
+    r.pos = 0;
+    r.newlines = 0;
+    /* Skip any empty chunks at the start */
+    while (r.chunk < src->num_chunks && src->chunk_lens[r.chunk] == 0)
+        r.chunk++;
+    inc.begin = 0;
+    inc.conditional = 0;
+    do
+    {
+        c = reader_next(&r);
+        if (c == '/' && reader_peek(&r) == '*')
+        {
+            /* A block comment counts as a space */
+            reader_next(&r);
+            while ((c = reader_next(&r)) != EOF)
+                if (c == '*' && reader_peek(&r) == '/')
+                {
+                    reader_next(&r);
+                    break;
+                }
+            c = ' ';
+        }
+        else if (c == '/' && reader_peek(&r) == '/')
+        {
+            while (reader_peek(&r) != '\n' && reader_peek(&r) != EOF)
+                reader_next(&r);
+            continue;
+        }
+        else if (c == '"' || c == '\'')
+        {
+            /* Skip a literal, keeping it if it is part of a directive */
+            int quote = c;
+            char ch = (char) c;
+
+            if (in_directive && try_buffer_append(&directive, &ch, 1) != 0)
+                ret = -1;
+            while ((c = reader_peek(&r)) != EOF && c != '\n')
+            {
+                reader_next(&r);
+                ch = (char) c;
+                if (in_directive && try_buffer_append(&directive, &ch, 1) != 0)
+                    ret = -1;
+                if (c == quote)
+                    break;
+                if (c == '\\' && reader_peek(&r) != '\n' && reader_peek(&r) != EOF)
+                {
+                    ch = (char) reader_next(&r);
+                    if (in_directive && try_buffer_append(&directive, &ch, 1) != 0)
+                        ret = -1;
+                }
+            }
+            line_start = 0;
+            continue;
+        }
+
+        if (c == '\n' || c == EOF)
+        {
+            if (in_directive && ret == 0)
+            {
+                inc.end = r.pos;
+                inc.next_line = r.newlines + 1;
+                if (try_buffer_append(&directive, "", 1) != 0
+                    || parse_directive(directive.data, &inc, found, arg) != 0)
+                    ret = -1;
+                directive.len = 0;
+            }
+            in_directive = 0;
+            line_start = 1;
+            inc.begin = r.pos;
+        }
+        else if (in_directive)
+        {
+            char ch = (char) c;
+            if (try_buffer_append(&directive, &ch, 1) != 0)
+                ret = -1;
+        }
+        else if (c == '#' && line_start)
+            in_directive = 1;
+        else if (!isspace(c))
+            line_start = 0;
+    } while (c != EOF && ret == 0);
+    free(directive.data);
+    return ret;
+}
+
+/* State for find_dependencies, passed to its include_callback */
+typedef struct
+{
+    const compiler_options *options;
+    dependency_list *deps;
+    /* Directory of the file being scanned, for "" includes ("" for the
+     * current directory)
+     */
+    const char *dir;
+} dependency_scan;
+
+/* Returns a dynamically allocated path for name in dir, or NULL if there is
+ * no memory (which is reported)
+ */
+static char *join_path(const char *dir, const char *name)
+{
+    char *path;
+
+    if (dir[0] == '\0' || name[0] == '/')
+        return try_strndup(name, strlen(name), "a path");
+    path = (char *) try_malloc(strlen(dir) + strlen(name) + 2, "a path");
+    if (path != NULL)
+        sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+#if !ONLINECLC_LIBRARY
+/* Returns a dynamically allocated copy of path, made absolute relative to cwd */
+static char *absolute_path(const char *cwd, const char *path)
+{
+    char *result;
+
+    if (path[0] == '/')
+        return onlineclc_strndup(path, strlen(path), "a path");
+    result = (char *) onlineclc_malloc(strlen(cwd) + strlen(path) + 2, "a path");
+    sprintf(result, "%s/%s", cwd, path);
+    return result;
+}
+#endif /* !ONLINECLC_LIBRARY */
+
+/* Returns a dynamically allocated copy of the directory part of path ("" if
+ * there is none), or NULL if there is no memory (which is reported)
+ */
+static char *dir_name(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+
+    if (slash == NULL)
+        return try_strndup("", 0, "a path");
+    if (slash == path)
+        return try_strndup("/", 1, "a path");
+    return try_strndup(path, slash - path, "a path");
+}
+
+/* Resolves an #include like the preprocessor: "" looks in dir (that of the
+ * including file) and then in the -I directories, and <> only in the -I
+ * directories. Stores the dynamically allocated path of the header in
+ * *path, or NULL if it is not found (such as one built into the compiler).
+ * Returns 0, or -1 if there is no memory (which is reported).
+ */
+static int resolve_include(const compiler_options *options, const char *dir,
+                           const char *name, int angle, char **path)
+{
+    size_t i;
+    struct stat sb;
+
+    *path = NULL;
+    if (!angle || name[0] == '/')
+    {
+        *path = join_path(dir, name);
+        if (*path == NULL)
+            return -1;
+        if (stat(*path, &sb) != 0 || !S_ISREG(sb.st_mode))
+        {
+            free(*path);
+            *path = NULL;
+        }
+    }
+    for (i = 0; *path == NULL && name[0] != '/' && i < options->num_include_dirs; i++)
+    {
+        *path = join_path(options->include_dirs[i], name);
+        if (*path == NULL)
+            return -1;
+        if (stat(*path, &sb) != 0 || !S_ISREG(sb.st_mode))
+        {
+            free(*path);
+            *path = NULL;
+        }
+    }
+    return 0;
+}
+
+/* Records the header named by an #include as a dependency, if it is found */
+static int add_dependency(void *arg, const include_directive *inc)
+{
+    dependency_scan *scan = (dependency_scan *) arg;
+    dependency_list *deps = scan->deps;
+    size_t i;
+    char *path;
+    char **grown;
+
+    if (inc->name == NULL)
+        return 0;
+    if (resolve_include(scan->options, scan->dir, inc->name, inc->angle, &path) != 0)
+        return -1;
+    if (path == NULL)
+        return 0;
+
+    for (i = 0; i < deps->num_paths; i++)
+        if (0 == strcmp(deps->paths[i], path))
+        {
+            free(path);
+            return 0;
+        }
+    grown = (char **) realloc(deps->paths, (deps->num_paths + 1) * sizeof(char *));
+    if (grown == NULL)
+    {
+        report("Out of memory trying to allocate dependencies");
+        free(path);
+        return -1;
+    }
+    deps->paths = grown;
+    deps->paths[deps->num_paths++] = path;
+    return 0;
+}
+
+static void free_dependencies(dependency_list *deps)
+{
+    size_t i;
+
+    for (i = 0; i < deps->num_paths; i++)
+        free(deps->paths[i]);
+    free(deps->paths);
+}
+
+/* Finds the headers that a source includes, directly or indirectly, by
+ * scanning on the host. Since the scan does not evaluate conditionals or
+ * macros, the result is an approximation: it may list headers that are not
+ * used, and misses those named by macros. Returns 0, or -1 if a header
+ * cannot be read or there is no memory (which is reported, and leaves the
+ * list empty).
+ */
+static int find_dependencies(dependency_list *deps, const compiler_options *options,
+                             const char *source_filename, const source_text *src)
+{
+    dependency_scan scan;
+    sha256_context ctx;
+    char *dir;
+    size_t i, j;
+    int ret;
+    phase_timer timer;
+
+    phase_begin(&timer);
+    deps->paths = NULL;
+    deps->num_paths = 0;
+    scan.options = options;
+    scan.deps = deps;
+    dir = 0 == strcmp(source_filename, "-") ? dir_name("") : dir_name(source_filename);
+    scan.dir = dir;
+    ret = dir != NULL ? 0 : -1;
+    /* A SPIR-V module has no headers */
+    if (ret == 0 && !is_spirv(options, src))
+        ret = scan_includes(src, add_dependency, &scan);
+    free(dir);
+
+    /* Headers found along the way are appended, and scanned in turn */
+    sha256_init(&ctx);
+    for (i = 0; ret == 0 && i < deps->num_paths; i++)
+    {
+        source_text header;
+
+        if (read_source_data(&header, deps->paths[i]) != 0)
+        {
+            ret = -1;
+            break;
+        }
+        sha256_field(&ctx, deps->paths[i], strlen(deps->paths[i]));
+        sha256_field(&ctx, &header.len, sizeof(header.len));
+        for (j = 0; j < header.num_chunks; j++)
+            sha256_update(&ctx, header.chunks[j], header.chunk_lens[j]);
+        dir = dir_name(deps->paths[i]);
+        scan.dir = dir;
+        if (dir == NULL || scan_includes(&header, add_dependency, &scan) != 0)
+            ret = -1;
+        free(dir);
+        free_source(&header);
+    }
+    if (ret != 0)
+    {
+        free_dependencies(deps);
+        deps->paths = NULL;
+        deps->num_paths = 0;
+        return -1;
+    }
+    sha256_final(&ctx, deps->hash);
+    phase_end(&timer, "scan includes", source_filename);
+    return 0;
+}
+
+/* A file with #pragma once, found by bundle_file */
+typedef struct
+{
+    /* Its real path (dynamically allocated) */
+    char *path;
+    /* Set once its #pragma once has been inlined outside any conditional,
+     * after which the file is not inlined again
+     */
+    int done;
+    /* Set while the file is being inlined */
+    int active;
+} once_file;
+
+/* A source with the headers that it includes inlined, made by
+ * bundle_source. The text borrows from the headers and strings held here.
+ */
+typedef struct
+{
+    source_text text;
+    /* Loaded headers */
+    source_text *headers;
+    size_t num_headers;
+    /* Generated directives (dynamically allocated) */
+    char **strings;
+    size_t num_strings;
+    /* Files with #pragma once. The pragma of once[i] is replaced by the
+     * definition of ONLINECLC_ONCE_i, which guards any later inlining.
+     */
+    once_file *once;
+    size_t num_once;
+} source_bundle;
+
+/* The deepest nesting of #include that bundle_source follows */
+#define MAX_INCLUDE_DEPTH 200
+
+/* Adds the bytes from begin to end of src to a bundle, chunk by chunk.
+ * Returns 0, or -1 if there is no memory (which is reported).
+ */
+static int bundle_range(source_bundle *bundle, const source_text *src, size_t begin, size_t end)
+{
+    size_t i, pos = 0;
+
+    for (i = 0; i < src->num_chunks && pos < end; i++)
+    {
+        size_t chunk_end = pos + src->chunk_lens[i];
+        size_t from = begin > pos ? begin : pos;
+        size_t to = end < chunk_end ? end : chunk_end;
+
+        if (from < to && add_source_chunk(&bundle->text, src->chunks[i] + (from - pos), to - from) != 0)
+            return -1;
+        pos = chunk_end;
+    }
+    return 0;
+}
+
+/* Adds a generated directive (dynamically allocated, and then held by the
+ * bundle, or freed on failure) to a bundle. Returns 0, or -1 if there is
+ * no memory (which is reported).
+ */
+static int bundle_directive(source_bundle *bundle, char *directive)
+{
+    char **grown = (char **) realloc(bundle->strings, (bundle->num_strings + 1) * sizeof(char *));
+
+    if (grown == NULL)
+    {
+        report("Out of memory trying to bundle headers");
+        free(directive);
+        return -1;
+    }
+    bundle->strings = grown;
+    bundle->strings[bundle->num_strings++] = directive;
+    return add_source_chunk(&bundle->text, directive, strlen(directive));
+}
+
+/* Adds a #line directive to a bundle, setting the line and file of the
+ * text that follows. It starts with a newline, in case the text before it
+ * did not end with one. Returns 0, or -1 if there is no memory (which is
+ * reported).
+ */
+static int bundle_line(source_bundle *bundle, size_t line, const char *filename)
+{
+    char *escaped = escape_c_string(filename);
+    char *directive;
+
+    if (escaped == NULL)
+        return -1;
+    directive = (char *) try_malloc(strlen(escaped) + 32, "a #line directive");
+    if (directive != NULL)
+        sprintf(directive, "\n#line %lu \"%s\"\n", (unsigned long) line, escaped);
+    free(escaped);
+    return directive != NULL ? bundle_directive(bundle, directive) : -1;
+}
+
+/* Adds a directive to a bundle that names the macro of bundle->once[index],
+ * with a newline before it. kind is "define", "ifndef" or "endif". Returns
+ * 0, or -1 if there is no memory (which is reported).
+ */
+static int bundle_once(source_bundle *bundle, const char *kind, size_t index)
+{
+    char *directive = (char *) try_malloc(64, "a directive");
+
+    if (directive == NULL)
+        return -1;
+    if (0 == strcmp(kind, "endif"))
+        sprintf(directive, "\n#endif /* ONLINECLC_ONCE_%lu */", (unsigned long) index);
+    else
+        sprintf(directive, "\n#%s ONLINECLC_ONCE_%lu", kind, (unsigned long) index);
+    return bundle_directive(bundle, directive);
+}
+
+/* Returns the index of the file with real path in bundle->once, or
+ * bundle->num_once if it is not there
+ */
+static size_t find_once(const source_bundle *bundle, const char *path)
+{
+    size_t i;
+
+    for (i = 0; i < bundle->num_once; i++)
+        if (0 == strcmp(bundle->once[i].path, path))
+            break;
+    return i;
+}
+
+/* Returns the real path of a file (dynamically allocated), so that files
+ * reached by different paths compare equal, or a copy of path if it has none
+ * (or NULL if there is no memory for that, which is reported)
+ */
+static char *real_path(const char *path)
+{
+    char *real = realpath(path, NULL);
+
+    return real != NULL ? real : try_strndup(path, strlen(path), "a path");
+}
+
+/* Collects the #include directives of one file for bundle_file */
+typedef struct
+{
+    include_directive *includes;
+    size_t num_includes;
+} include_list;
+
+static int collect_include(void *arg, const include_directive *inc)
+{
+    include_list *list = (include_list *) arg;
+    include_directive *grown;
+    char *name = NULL;
+
+    if (inc->name != NULL && (name = try_strndup(inc->name, strlen(inc->name), "an include name")) == NULL)
+        return -1;
+    grown = (include_directive *) realloc(list->includes, (list->num_includes + 1) * sizeof(include_directive));
+    if (grown == NULL)
+    {
+        report("Out of memory trying to bundle headers");
+        free(name);
+        return -1;
+    }
+    list->includes = grown;
+    list->includes[list->num_includes] = *inc;
+    list->includes[list->num_includes++].name = name;
+    return 0;
+}
+
+/* Adds a file with #pragma once, with real path real, to bundle->once.
+ * Returns 0, or -1 if there is no memory (which is reported).
+ */
+static int add_once(source_bundle *bundle, const char *real)
+{
+    char *path = try_strndup(real, strlen(real), "a path");
+    once_file *grown;
+
+    if (path == NULL)
+        return -1;
+    grown = (once_file *) realloc(bundle->once, (bundle->num_once + 1) * sizeof(once_file));
+    if (grown == NULL)
+    {
+        report("Out of memory trying to bundle headers");
+        free(path);
+        return -1;
+    }
+    bundle->once = grown;
+    bundle->once[bundle->num_once].path = path;
+    bundle->once[bundle->num_once].done = 0;
+    bundle->once[bundle->num_once].active = 1;
+    bundle->num_once++;
+    return 0;
+}
+
+/* Adds src, named filename and found in dir, to a bundle, with each #include
+ * of a header that can be found replaced by the (bundled) header and #line
+ * directives to keep the line numbers right. An #include that cannot be
+ * resolved is left for the compiler. real is the real path of the file, and
+ * conditional the number of conditionals that the bundled text is in.
+ * Returns 0, or -1 if a header cannot be read or there is no memory (which
+ * is reported).
+ */
+static int bundle_file(source_bundle *bundle, const compiler_options *options,
+                       const source_text *src, const char *filename, const char *real,
+                       const char *dir, unsigned int conditional, unsigned int depth)
+{
+    include_list list = { NULL, 0 };
+    size_t pos = 0, i, j;
+    int ret;
+
+    if (depth > MAX_INCLUDE_DEPTH)
+    {
+        report("#include nested too deeply in `%s'", filename);
+        return -1;
+    }
+    ret = scan_includes(src, collect_include, &list);
+    for (i = 0; i < list.num_includes && ret == 0; i++)
+    {
+        const include_directive *inc = &list.includes[i];
+        char *path, *header_real;
+        source_text *header;
+        char *header_dir;
+        int guard;
+
+        if (inc->name == NULL)
+        {
+            /* Replace #pragma once, which the compiler would warn about
+             * outside a header, with a macro that marks the file as
+             * included. The macro guards the places where the file is
+             * inlined again, since the pragma may be in a branch that is
+             * not taken. Outside any conditional it surely is taken, so the
+             * file need not be inlined again at all.
+             */
+            ret = bundle_range(bundle, src, pos, inc->begin);
+            pos = inc->end;
+            j = find_once(bundle, real);
+            if (ret == 0 && j == bundle->num_once)
+                ret = add_once(bundle, real);
+            if (ret != 0)
+                break;
+            if (conditional + inc->conditional == 0)
+                bundle->once[j].done = 1;
+            ret = bundle_once(bundle, "define", j);
+            if (ret == 0)
+                ret = bundle_line(bundle, inc->next_line, src->name);
+            continue;
+        }
+        if (resolve_include(options, dir, inc->name, inc->angle, &path) != 0)
+        {
+            ret = -1;
+            break;
+        }
+        if (path == NULL)
+            continue;
+        header_real = real_path(path);
+        if (header_real == NULL || bundle_range(bundle, src, pos, inc->begin) != 0)
+        {
+            free(header_real);
+            free(path);
+            ret = -1;
+            break;
+        }
+        pos = inc->end;
+
+        /* A file with #pragma once is left out once that is certain to have
+         * taken effect, and when it includes itself
+         */
+        j = find_once(bundle, header_real);
+        guard = j < bundle->num_once;
+        if (!guard || (!bundle->once[j].done && !bundle->once[j].active))
+        {
+            source_text *grown = (source_text *) realloc(
+                bundle->headers, (bundle->num_headers + 1) * sizeof(source_text));
+
+            if (grown == NULL)
+                report("Out of memory trying to bundle headers");
+            else
+            {
+                bundle->headers = grown;
+                header = &bundle->headers[bundle->num_headers];
+            }
+            if (grown == NULL || read_source_data(header, path) != 0)
+            {
+                free(header_real);
+                free(path);
+                ret = -1;
+                break;
+            }
+            bundle->num_headers++;
+            /* Keep the path, for messages */
+            header->name = path;
+            path = NULL;
+            if (guard)
+            {
+                ret = bundle_once(bundle, "ifndef", j);
+                bundle->once[j].active = 1;
+            }
+            if (ret == 0)
+                ret = bundle_line(bundle, 1, header->name);
+            header_dir = ret == 0 ? dir_name(header->name) : NULL;
+            /* The array may move while the header is bundled, so pass a copy.
+             * The guard does not count as a conditional: whether or not it
+             * is taken, the macro ends up defined if the pragma is reached.
+             */
+            if (header_dir == NULL)
+                ret = -1;
+            else
+            {
+                source_text copy = *header;
+                ret = bundle_file(bundle, options, &copy, copy.name, header_real, header_dir,
+                                  conditional + inc->conditional, depth + 1);
+            }
+            free(header_dir);
+            j = find_once(bundle, header_real);
+            if (j < bundle->num_once)
+                bundle->once[j].active = 0;
+            if (guard && ret == 0)
+                ret = bundle_once(bundle, "endif", j);
+        }
+        free(header_real);
+        free(path);
+        if (ret == 0)
+            ret = bundle_line(bundle, inc->next_line, src->name);
+    }
+    if (ret == 0)
+        ret = bundle_range(bundle, src, pos, src->len);
+    for (i = 0; i < list.num_includes; i++)
+        free((char *) list.includes[i].name);
+    free(list.includes);
+    return ret;
+}
+
+static void free_bundle(source_bundle *bundle)
+{
+    size_t i;
+
+    for (i = 0; i < bundle->num_headers; i++)
+    {
+        free((char *) bundle->headers[i].name);
+        free_source(&bundle->headers[i]);
+    }
+    for (i = 0; i < bundle->num_strings; i++)
+        free(bundle->strings[i]);
+    for (i = 0; i < bundle->num_once; i++)
+        free(bundle->once[i].path);
+    free(bundle->headers);
+    free(bundle->strings);
+    free(bundle->once);
+    free_source(&bundle->text);
+}
+
+/* Makes a copy of src with the headers that it includes inlined, so that the
+ * compiler does not need to read them from the file system itself (which
+ * may be slow, and done more than once). The bundle must be released with
+ * free_bundle, and src must outlive it. Returns 0, or -1 if a header cannot
+ * be read or there is no memory (which is reported, and leaves nothing to
+ * release).
+ */
+static int bundle_source(source_bundle *bundle, const compiler_options *options,
+                         const char *source_filename, const source_text *src)
+{
+    char *dir, *real;
+    phase_timer timer;
+    int ret = -1;
+
+    phase_begin(&timer);
+    source_from_memory(&bundle->text, source_filename, NULL, 0);
+    bundle->headers = NULL;
+    bundle->num_headers = 0;
+    bundle->strings = NULL;
+    bundle->num_strings = 0;
+    bundle->once = NULL;
+    bundle->num_once = 0;
+    dir = dir_name(0 == strcmp(source_filename, "-") ? "" : source_filename);
+    real = 0 == strcmp(source_filename, "-") ? try_strndup("-", 1, "a path") : real_path(source_filename);
+    if (dir != NULL && real != NULL)
+        ret = bundle_file(bundle, options, src, src->name, real, dir, 0, 0);
+    free(real);
+    free(dir);
+    if (ret != 0)
+    {
+        free_bundle(bundle);
+        return -1;
+    }
+    phase_end(&timer, "bundle headers", src->name);
+    return 0;
+}
+
+#if !ONLINECLC_LIBRARY
+/* Appends a filename to a depfile, escaped for make */
+static void append_make_escaped(string_buffer *buf, const char *name)
+{
+    for (; *name != '\0'; name++)
+    {
+        if (*name == ' ' || *name == '\t' || *name == '#' || *name == '\\')
+            buffer_append(buf, "\\", 1);
+        else if (*name == '$')
+            buffer_append(buf, "$", 1);
+        buffer_append(buf, name, 1);
+    }
+}
+
+/* Returns the dependency file to write for -MD: the -MF option, or the
+ * output filename with its extension replaced by .d. The result is
+ * dynamically allocated.
+ */
+static char *depfile_name(const compiler_options *options, const char *output_filename)
+{
+    const char *base, *dot;
+    char *name;
+    size_t len;
+
+    if (options->depfile_filename != NULL)
+        return onlineclc_strndup(options->depfile_filename, strlen(options->depfile_filename), "a filename");
+    base = strrchr(output_filename, '/');
+    base = base != NULL ? base + 1 : output_filename;
+    dot = strrchr(base, '.');
+    len = dot != NULL && dot != base ? (size_t) (dot - output_filename) : strlen(output_filename);
+    name = (char *) onlineclc_malloc(len + 3, "a filename");
+    memcpy(name, output_filename, len);
+    strcpy(name + len, ".d");
+    return name;
+}
+
+/* Writes the make-compatible dependency file for -MD, stating that the
+ * targets (or the -MT target) depend on the source and the headers it
+ * includes. With -MP, each header also gets an empty rule, so that make
+ * does not fail when a header is removed. The file is named by
+ * depfile_name.
+ */
+static void write_depfile(const compiler_options *options, const char *output_filename,
+                          const char * const *targets, size_t num_targets,
+                          const char *source_filename, const dependency_list *deps)
+{
+    string_buffer buf = { NULL, 0, 0 };
+    char *filename;
+    size_t i;
+
+    if (options->depfile_target != NULL)
+    {
+        targets = &options->depfile_target;
+        num_targets = 1;
+    }
+    for (i = 0; i < num_targets; i++)
+    {
+        if (i > 0)
+            buffer_append(&buf, " ", 1);
+        append_make_escaped(&buf, targets[i]);
+    }
+    buffer_append(&buf, ":", 1);
+    if (0 != strcmp(source_filename, "-"))
+    {
+        buffer_append(&buf, " ", 1);
+        append_make_escaped(&buf, source_filename);
+    }
+    for (i = 0; i < deps->num_paths; i++)
+    {
+        buffer_append(&buf, " \\\n  ", 4);
+        append_make_escaped(&buf, deps->paths[i]);
+    }
+    buffer_append(&buf, "\n", 1);
+    for (i = 0; options->depfile_phony && i < deps->num_paths; i++)
+    {
+        buffer_append(&buf, "\n", 1);
+        append_make_escaped(&buf, deps->paths[i]);
+        buffer_append(&buf, ":\n", 2);
+    }
+    filename = depfile_name(options, output_filename);
+    write_binary_data(filename, (const unsigned char *) buf.data, buf.len);
+    free(filename);
+    free(buf.data);
+}
+#endif /* !ONLINECLC_LIBRARY */
+
+/* Retrieves a string-valued device or platform property into *value, which
+ * is dynamically allocated and must be freed by the caller. Returns
+ * CL_SUCCESS or BUILD_ERROR (after reporting it, with *value NULL).
+ */
+static cl_int get_device_string(cl_device_id device, cl_device_info param, char **value)
+{
+    cl_int status;
+    size_t len;
+
+    *value = NULL;
+    status = clGetDeviceInfo(device, param, 0, NULL, &len);
+    if (status == CL_SUCCESS)
+    {
+        *value = (char *) try_malloc(len + 1, "device information");
+        if (*value == NULL)
+            return BUILD_ERROR;
+        status = clGetDeviceInfo(device, param, len, *value, NULL);
+    }
+    if (status != CL_SUCCESS)
+    {
+        report_cl(status, "Failed to query device information");
+        free(*value);
+        *value = NULL;
+        return BUILD_ERROR;
+    }
+    (*value)[len] = '\0';
+    return CL_SUCCESS;
+}
+
+static cl_int get_platform_string(cl_platform_id platform, cl_platform_info param, char **value)
+{
+    cl_int status;
+    size_t len;
+
+    *value = NULL;
+    status = clGetPlatformInfo(platform, param, 0, NULL, &len);
+    if (status == CL_SUCCESS)
+    {
+        *value = (char *) try_malloc(len + 1, "platform information");
+        if (*value == NULL)
+            return BUILD_ERROR;
+        status = clGetPlatformInfo(platform, param, len, *value, NULL);
+    }
+    if (status != CL_SUCCESS)
+    {
+        report_cl(status, "Failed to query platform information");
+        free(*value);
+        *value = NULL;
+        return BUILD_ERROR;
+    }
+    (*value)[len] = '\0';
+    return CL_SUCCESS;
+}
+
+#if !ONLINECLC_LIBRARY
+/* get_device_string, killing the process on failure */
+static char *device_string(cl_device_id device, cl_device_info param)
+{
+    char *value;
+
+    if (get_device_string(device, param, &value) != CL_SUCCESS)
+        terminate(1);
+    return value;
+}
+#endif /* !ONLINECLC_LIBRARY */
+
+#ifndef CL_DEVICE_IL_VERSION_KHR
+# define CL_DEVICE_IL_VERSION_KHR 0x105B
+#endif
+
+typedef cl_program (CL_API_CALL *create_program_with_il_fn)(cl_context, const void *, size_t, cl_int *);
+
+/* Determines whether a device lists an extension in CL_DEVICE_EXTENSIONS.
+ * Returns 1 if it does, 0 if not, or -1 if the query fails (which is
+ * reported).
+ */
+static int device_has_extension(cl_device_id device, const char *extension)
+{
+    char *extensions;
+    size_t len = strlen(extension);
+    const char *p;
+    int found = 0;
+
+    if (get_device_string(device, CL_DEVICE_EXTENSIONS, &extensions) != CL_SUCCESS)
+        return -1;
+    for (p = extensions; (p = strstr(p, extension)) != NULL; p += len)
+        if ((p == extensions || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0'))
+        {
+            found = 1;
+            break;
+        }
+    free(extensions);
+    return found;
+}
+
+/* Finds the function that creates a program from IL for a device: the core
+ * clCreateProgramWithIL from OpenCL 2.1, or else clCreateProgramWithILKHR
+ * from cl_khr_il_program. Returns NULL, after reporting it, if the device
+ * cannot take SPIR-V, as reported by CL_DEVICE_IL_VERSION, or cannot be
+ * queried.
+ */
+static create_program_with_il_fn find_il_loader(cl_device_id device)
+{
+    create_program_with_il_fn fn = NULL;
+    char *version, *il = NULL, *name;
+    cl_platform_id platform;
+    int major = 0, minor = 0, has_khr = 0;
+
+    if (get_device_string(device, CL_DEVICE_VERSION, &version) != CL_SUCCESS)
+        return NULL;
+    sscanf(version, "OpenCL %d.%d", &major, &minor);
+    free(version);
+#ifdef CL_VERSION_2_1
+    if (major > 2 || (major == 2 && minor >= 1))
+        fn = clCreateProgramWithIL;
+#endif
+    if (fn == NULL && (has_khr = device_has_extension(device, "cl_khr_il_program")) < 0)
+        return NULL;
+    if (has_khr)
+    {
+        if (get_device_platform(device, &platform) != CL_SUCCESS)
+            return NULL;
+        fn = (create_program_with_il_fn) clGetExtensionFunctionAddressForPlatform(
+            platform, "clCreateProgramWithILKHR");
+    }
+    if (fn != NULL && get_device_string(device, CL_DEVICE_IL_VERSION_KHR, &il) != CL_SUCCESS)
+        return NULL;
+    if (il == NULL || strstr(il, "SPIR-V") == NULL)
+    {
+        if (get_device_string(device, CL_DEVICE_NAME, &name) != CL_SUCCESS)
+        {
+            free(il);
+            return NULL;
+        }
+        if (il == NULL)
+            report("Device `%s' does not accept IL programs", name);
+        else
+            report("Device `%s' does not accept SPIR-V (CL_DEVICE_IL_VERSION is `%s')", name, il);
+        free(name);
+        fn = NULL;
+    }
+    free(il);
+    return fn;
+}
+
+/* Creates a program from a loaded SPIR-V module, for the devices of ctx, and
+ * stores it in *program. Returns CL_SUCCESS or BUILD_ERROR.
+ */
+static cl_int program_from_il(cl_context ctx, const source_text *src, cl_program *program)
+{
+    cl_device_id *devices;
+    create_program_with_il_fn fn = NULL;
+    size_t size, i, pos = 0;
+    char *joined = NULL;
+    const void *il;
+    cl_int status;
+    phase_timer timer;
+
+    status = clGetContextInfo(ctx, CL_CONTEXT_DEVICES, 0, NULL, &size);
+    if (status != CL_SUCCESS)
+    {
+        report_cl(status, "Failed to query context devices");
+        return BUILD_ERROR;
+    }
+    devices = (cl_device_id *) try_malloc(size, "devices");
+    if (devices == NULL)
+        return BUILD_ERROR;
+    status = clGetContextInfo(ctx, CL_CONTEXT_DEVICES, size, devices, NULL);
+    if (status != CL_SUCCESS)
+    {
+        report_cl(status, "Failed to query context devices");
+        free(devices);
+        return BUILD_ERROR;
+    }
+    /* All the devices are on one platform, so any of them gives the function */
+    for (i = 0; i < size / sizeof(cl_device_id); i++)
+    {
+        fn = find_il_loader(devices[i]);
+        if (fn == NULL)
+            break;
+    }
+    free(devices);
+    if (fn == NULL)
+        return BUILD_ERROR;
+
+    if (src->len == 0)
+    {
+        report("`%s' is empty", src->name);
+        return BUILD_ERROR;
+    }
+    /* A module must be contiguous, so join the chunks read from a pipe */
+    if (src->num_chunks == 1)
+        il = src->chunks[0];
+    else
+    {
+        joined = (char *) try_malloc(src->len, "a SPIR-V module");
+        if (joined == NULL)
+            return BUILD_ERROR;
+        for (i = 0; i < src->num_chunks; i++)
+        {
+            memcpy(joined + pos, src->chunks[i], src->chunk_lens[i]);
+            pos += src->chunk_lens[i];
+        }
+        il = joined;
+    }
+
+    phase_begin(&timer);
+    *program = fn(ctx, il, src->len, &status);
+    free(joined);
+    if (status != CL_SUCCESS)
+    {
+        report_cl(status, "Failed to load SPIR-V from `%s'", src->name);
+        return BUILD_ERROR;
+    }
+    phase_end(&timer, "create program", src->name);
+    return CL_SUCCESS;
+}
+
+/* Creates a program from a loaded source, bundling its headers first if
+ * --bundle-headers was given, and stores it in *program. A SPIR-V module is
+ * loaded as IL instead. Returns CL_SUCCESS or BUILD_ERROR.
+ */
+static cl_int create_program(cl_context ctx, const compiler_options *options,
+                             const char *source_filename, const source_text *src,
+                             cl_program *program)
+{
+    source_bundle bundle;
+    cl_int status;
+
+    if (is_spirv(options, src))
+        return program_from_il(ctx, src, program);
+    if (!options->bundle_headers)
+        return program_from_source(ctx, src, program);
+    if (bundle_source(&bundle, options, source_filename, src) != 0)
+        return BUILD_ERROR;
+    status = program_from_source(ctx, &bundle.text, program);
+    free_bundle(&bundle);
+    return status;
+}
+
+/* Device details stored alongside a binary by --emit */
+typedef struct
+{
+    /* All dynamically allocated */
+    char *device;
+    char *device_version;
+    char *driver_version;
+} binary_metadata;
+
+/* Alignment of the binary written by --emit, which suits any host */
+#define EMIT_ALIGNMENT 64
+
+#if !ONLINECLC_LIBRARY
+/* Makes the C identifier for the binary written by --emit: symbol, or else
+ * the base name of the output file without its extension, with anything
+ * that cannot be in an identifier replaced by _. A non-negative index (for
+ * --all-devices and --sweep) is appended as _n. Returns a dynamically
+ * allocated string.
+ */
+static char *symbol_name(const char *symbol, const char *output_filename, int index)
+{
+    const char *base, *dot;
+    size_t len, i, j = 0;
+    char *name;
+
+    if (symbol != NULL)
+    {
+        base = symbol;
+        len = strlen(symbol);
+    }
+    else
+    {
+        base = strrchr(output_filename, '/');
+        base = base != NULL ? base + 1 : output_filename;
+        dot = strrchr(base, '.');
+        len = dot != NULL && dot != base ? (size_t) (dot - base) : strlen(base);
+    }
+    name = (char *) onlineclc_malloc(len + 32, "a symbol name");
+    if (len == 0 || isdigit((unsigned char) base[0]))
+        name[j++] = '_';
+    for (i = 0; i < len; i++)
+        name[j++] = isalnum((unsigned char) base[i]) ? base[i] : '_';
+    if (index >= 0)
+        sprintf(name + j, "_%d", index);
+    else
+        name[j] = '\0';
+    return name;
+}
+
+/* Formats a binary as C source that defines it as an array, along with its
+ * size and the device it was built for. With header set, the definitions
+ * have static linkage and an include guard, so the output can be included
+ * directly.
+ */
+static void format_c_source(string_buffer *buf, const char *symbol, int header,
+                            const binary_metadata *meta, const unsigned char *binary, size_t size)
+{
+    const char *storage = header ? "static " : "";
+    const char *names[3];
+    const char *values[3];
+    size_t i;
+
+    names[0] = "device";
+    values[0] = meta->device;
+    names[1] = "device_version";
+    values[1] = meta->device_version;
+    names[2] = "driver_version";
+    values[2] = meta->driver_version;
+
+    buffer_printf(buf, "/* OpenCL program binary generated by onlineclc: do not edit */\n");
+    if (header)
+    {
+        string_buffer guard = { NULL, 0, 0 };
+
+        buffer_printf(&guard, "ONLINECLC_%s_H", symbol);
+        for (i = 0; i < guard.len; i++)
+            guard.data[i] = toupper((unsigned char) guard.data[i]);
+        buffer_printf(buf, "#ifndef %s\n#define %s\n", guard.data, guard.data);
+        free(guard.data);
+    }
+    buffer_printf(buf, "\n#include <stddef.h>\n\n"
+                  "#if defined(__GNUC__)\n"
+                  "__attribute__((aligned(%d)))\n"
+                  "#elif defined(_MSC_VER)\n"
+                  "__declspec(align(%d))\n"
+                  "#endif\n"
+                  "%sconst unsigned char %s[%lu] =\n{",
+                  EMIT_ALIGNMENT, EMIT_ALIGNMENT, storage, symbol, (unsigned long) size);
+    for (i = 0; i < size; i++)
+        buffer_printf(buf, "%s0x%02x,", i % 12 == 0 ? "\n    " : " ", binary[i]);
+    buffer_printf(buf, "\n};\n%sconst size_t %s_size = %lu;\n", storage, symbol, (unsigned long) size);
+    for (i = 0; i < 3; i++)
+    {
+        char *escaped = escape_c_string(values[i]);
+        if (escaped == NULL)
+            terminate(1);
+        buffer_printf(buf, "%sconst char %s_%s[] = \"%s\";\n", storage, symbol, names[i], escaped);
+        free(escaped);
+    }
+    if (header)
+        buffer_printf(buf, "\n#endif\n");
+}
+
+/* Appends an integer of width bytes, in the host's byte order */
+static void append_elf_int(string_buffer *buf, uint64_t value, size_t width)
+{
+    uint8_t u8 = (uint8_t) value;
+    uint16_t u16 = (uint16_t) value;
+    uint32_t u32 = (uint32_t) value;
+
+    if (width == 1)
+        buffer_append(buf, (const char *) &u8, 1);
+    else if (width == 2)
+        buffer_append(buf, (const char *) &u16, 2);
+    else if (width == 4)
+        buffer_append(buf, (const char *) &u32, 4);
+    else
+        buffer_append(buf, (const char *) &value, 8);
+}
+
+/* Pads with zeros to a multiple of align */
+static void append_elf_padding(string_buffer *buf, size_t align)
+{
+    static const char zeros[EMIT_ALIGNMENT] = { 0 };
+    if (buf->len % align != 0)
+        buffer_append(buf, zeros, align - buf->len % align);
+}
+
+/* Appends a section header. The fields that are the size of an address
+ * (flags, address, offset, size, alignment and entry size) are w bytes.
+ */
+static void append_elf_section(string_buffer *buf, size_t w, uint32_t name, uint32_t type, uint64_t flags,
+                               uint64_t offset, uint64_t size, uint32_t link, uint32_t info,
+                               uint64_t align, uint64_t entsize)
+{
+    append_elf_int(buf, name, 4);
+    append_elf_int(buf, type, 4);
+    append_elf_int(buf, flags, w);
+    append_elf_int(buf, 0, w);
+    append_elf_int(buf, offset, w);
+    append_elf_int(buf, size, w);
+    append_elf_int(buf, link, 4);
+    append_elf_int(buf, info, 4);
+    append_elf_int(buf, align, w);
+    append_elf_int(buf, entsize, w);
+}
+
+/* Appends a global data symbol in section shndx */
+static void append_elf_symbol(string_buffer *buf, size_t w, uint32_t name, uint16_t shndx,
+                              uint64_t value, uint64_t size)
+{
+    const unsigned int info = (1 << 4) | 1;    /* STB_GLOBAL, STT_OBJECT */
+
+    append_elf_int(buf, name, 4);
+    if (w == 8)
+    {
+        append_elf_int(buf, info, 1);
+        append_elf_int(buf, 0, 1);
+        append_elf_int(buf, shndx, 2);
+        append_elf_int(buf, value, 8);
+        append_elf_int(buf, size, 8);
+    }
+    else
+    {
+        append_elf_int(buf, value, 4);
+        append_elf_int(buf, size, 4);
+        append_elf_int(buf, info, 1);
+        append_elf_int(buf, 0, 1);
+        append_elf_int(buf, shndx, 2);
+    }
+}
+
+/* Formats a binary as a relocatable ELF object for the host. The binary is
+ * in a section named .onlineclc, under the symbol, and the size and device
+ * details are in .rodata under the same names as in format_c_source, so
+ * the object can be linked into a program that declares
+ *
+ *     extern const unsigned char symbol[];
+ *     extern const size_t symbol_size;
+ *     extern const char symbol_device[];
+ */
+static void format_elf_object(string_buffer *buf, const char *symbol,
+                              const binary_metadata *meta, const unsigned char *binary, size_t size)
+{
+    /* Section indices */
+    enum { SEC_NULL, SEC_BINARY, SEC_RODATA, SEC_NOTE, SEC_SYMTAB, SEC_STRTAB, SEC_SHSTRTAB, NUM_SECTIONS };
+    static const char shstrtab[] =
+        "\0.onlineclc\0.rodata\0.note.GNU-stack\0.symtab\0.strtab\0.shstrtab";
+    const uint32_t shnames[NUM_SECTIONS] = { 0, 1, 12, 20, 36, 44, 52 };
+    const size_t w = sizeof(void *) == 8 ? 8 : 4;
+    const size_t ehsize = w == 8 ? 64 : 52;
+    const size_t shentsize = w == 8 ? 64 : 40;
+    const size_t symentsize = w == 8 ? 24 : 16;
+    const uint16_t one = 1;
+    const char *values[3];
+    const char *suffixes[4] = { "_size", "_device", "_device_version", "_driver_version" };
+    string_buffer strtab = { NULL, 0, 0 };
+    string_buffer header = { NULL, 0, 0 };
+    size_t binary_offset, rodata_offset, rodata_size, symtab_offset, strtab_offset, shstrtab_offset, shoff;
+    size_t value_offset, i;
+    uint32_t name;
+
+    values[0] = meta->device;
+    values[1] = meta->device_version;
+    values[2] = meta->driver_version;
+
+    /* The header is filled in last, once the offsets are known */
+    for (i = 0; i < ehsize; i++)
+        append_elf_int(buf, 0, 1);
+    append_elf_padding(buf, EMIT_ALIGNMENT);
+    binary_offset = buf->len;
+    buffer_append(buf, (const char *) binary, size);
+
+    append_elf_padding(buf, w);
+    rodata_offset = buf->len;
+    append_elf_int(buf, size, w);
+    for (i = 0; i < 3; i++)
+        buffer_append(buf, values[i], strlen(values[i]) + 1);
+    rodata_size = buf->len - rodata_offset;
+
+    /* The first symbol and the first string are empty */
+    append_elf_padding(buf, w);
+    symtab_offset = buf->len;
+    for (i = 0; i < symentsize; i++)
+        append_elf_int(buf, 0, 1);
+    buffer_append(&strtab, "", 1);
+    name = (uint32_t) strtab.len;
+    buffer_printf(&strtab, "%s", symbol);
+    buffer_append(&strtab, "", 1);
+    append_elf_symbol(buf, w, name, SEC_BINARY, 0, size);
+    value_offset = 0;
+    for (i = 0; i < 4; i++)
+    {
+        size_t value_size = i == 0 ? w : strlen(values[i - 1]) + 1;
+
+        name = (uint32_t) strtab.len;
+        buffer_printf(&strtab, "%s%s", symbol, suffixes[i]);
+        buffer_append(&strtab, "", 1);
+        append_elf_symbol(buf, w, name, SEC_RODATA, value_offset, value_size);
+        value_offset += value_size;
+    }
+
+    strtab_offset = buf->len;
+    buffer_append(buf, strtab.data, strtab.len);
+    shstrtab_offset = buf->len;
+    buffer_append(buf, shstrtab, sizeof(shstrtab));
+
+    append_elf_padding(buf, w);
+    shoff = buf->len;
+    append_elf_section(buf, w, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    append_elf_section(buf, w, shnames[SEC_BINARY], 1, 2, binary_offset, size, 0, 0, EMIT_ALIGNMENT, 0);
+    append_elf_section(buf, w, shnames[SEC_RODATA], 1, 2, rodata_offset, rodata_size, 0, 0, w, 0);
+    append_elf_section(buf, w, shnames[SEC_NOTE], 1, 0, shstrtab_offset, 0, 0, 0, 1, 0);
+    append_elf_section(buf, w, shnames[SEC_SYMTAB], 2, 0, symtab_offset, strtab_offset - symtab_offset,
+                       SEC_STRTAB, 1, w, symentsize);
+    append_elf_section(buf, w, shnames[SEC_STRTAB], 3, 0, strtab_offset, strtab.len, 0, 0, 1, 0);
+    append_elf_section(buf, w, shnames[SEC_SHSTRTAB], 3, 0, shstrtab_offset, sizeof(shstrtab), 0, 0, 1, 0);
+
+    buffer_append(&header, "\177ELF", 4);
+    append_elf_int(&header, w == 8 ? 2 : 1, 1);                 /* class */
+    append_elf_int(&header, *(const uint8_t *) &one == 1 ? 1 : 2, 1);  /* byte order */
+    append_elf_int(&header, 1, 1);                              /* version */
+    for (i = 0; i < 9; i++)
+        append_elf_int(&header, 0, 1);
+    append_elf_int(&header, 1, 2);                              /* ET_REL */
+    append_elf_int(&header, ELF_HOST_MACHINE, 2);
+    append_elf_int(&header, 1, 4);                              /* version */
+    append_elf_int(&header, 0, w);                              /* entry */
+    append_elf_int(&header, 0, w);                              /* program headers */
+    append_elf_int(&header, shoff, w);
+    append_elf_int(&header, ELF_HOST_FLAGS, 4);
+    append_elf_int(&header, ehsize, 2);
+    append_elf_int(&header, 0, 2);
+    append_elf_int(&header, 0, 2);
+    append_elf_int(&header, shentsize, 2);
+    append_elf_int(&header, NUM_SECTIONS, 2);
+    append_elf_int(&header, SEC_SHSTRTAB, 2);
+    memcpy(buf->data, header.data, header.len);
+    free(header.data);
+    free(strtab.data);
+}
+
+static void get_binary_metadata(binary_metadata *meta, cl_device_id device)
+{
+    meta->device = device_string(device, CL_DEVICE_NAME);
+    meta->device_version = device_string(device, CL_DEVICE_VERSION);
+    meta->driver_version = device_string(device, CL_DRIVER_VERSION);
+}
+
+static void free_binary_metadata(binary_metadata *meta)
+{
+    free(meta->device);
+    free(meta->device_version);
+    free(meta->driver_version);
+}
+
+/* A binary to put in a fat binary */
+typedef struct
+{
+    binary_metadata meta;
+    /* Options the binary was built with. Not owned. */
+    const char *options;
+    const unsigned char *binary;
+    size_t size;
+} fat_entry;
+
+/* Appends an unsigned integer of width bytes, little-endian */
+static void append_le(string_buffer *buf, uint64_t value, size_t width)
+{
+    size_t i;
+
+    for (i = 0; i < width; i++)
+    {
+        char c = (char) (value >> (8 * i));
+        buffer_append(buf, &c, 1);
+    }
+}
+
+/* Adds a string to the string table of a fat binary, and appends the
+ * reference to it to the index.
+ */
+static void append_fat_string(string_buffer *index, string_buffer *strings, const char *str, size_t len)
+{
+    if (strings->len + len + 1 > UINT32_MAX)
+        die(1, "Too many strings for a fat binary");
+    append_le(index, strings->len, 4);
+    append_le(index, len, 4);
+    buffer_append(strings, str, len);
+    buffer_append(strings, "", 1);
+}
+
+/* Formats binaries as a fat binary, in the layout described in clcfat.h.
+ * Binaries are aligned to pages, so that each can be used in place once the
+ * file is mapped. Of entries with the same device name, driver version and
+ * options, only the first is kept, since the loader could not tell them
+ * apart.
+ */
+static void format_fat_binary(string_buffer *buf, const fat_entry *entries, size_t num_entries)
+{
+    static const char zeros[64] = { 0 };
+    string_buffer index = { NULL, 0, 0 };
+    string_buffer strings = { NULL, 0, 0 };
+    uint64_t *hashes;
+    size_t *kept;
+    size_t num_kept = 0, i, j;
+    uint64_t offset;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t align = page > 4096 ? (size_t) page : 4096;
+
+    hashes = (uint64_t *) onlineclc_malloc(num_entries * sizeof(uint64_t) + 1, "options hashes");
+    kept = (size_t *) onlineclc_malloc(num_entries * sizeof(size_t) + 1, "fat binary entries");
+    for (i = 0; i < num_entries; i++)
+    {
+        hashes[i] = clcfat_options_hash(entries[i].options);
+        for (j = 0; j < num_kept; j++)
+        {
+            const fat_entry *e = &entries[kept[j]];
+
+            if (hashes[kept[j]] == hashes[i]
+                && 0 == strcmp(e->meta.device, entries[i].meta.device)
+                && 0 == strcmp(e->meta.driver_version, entries[i].meta.driver_version))
+                break;
+        }
+        if (j == num_kept)
+            kept[num_kept++] = i;
+    }
+
+    for (i = 0; i < num_kept; i++)
+    {
+        const fat_entry *e = &entries[kept[i]];
+        const char *options = e->options != NULL ? e->options : "";
+        size_t len = strlen(options);
+
+        /* Drop the trailing space left by append_option */
+        while (len > 0 && isspace((unsigned char) options[len - 1]))
+            len--;
+        append_le(&index, 0, 8);    /* offset, filled in below */
+        append_le(&index, e->size, 8);
+        append_le(&index, hashes[kept[i]], 8);
+        append_fat_string(&index, &strings, e->meta.device, strlen(e->meta.device));
+        append_fat_string(&index, &strings, e->meta.driver_version, strlen(e->meta.driver_version));
+        append_fat_string(&index, &strings, e->meta.device_version, strlen(e->meta.device_version));
+        append_fat_string(&index, &strings, options, len);
+        append_le(&index, 0, 8);
+    }
+
+    offset = CLCFAT_HEADER_SIZE + index.len + strings.len;
+    for (i = 0; i < num_kept; i++)
+    {
+        offset = (offset + align - 1) / align * align;
+        for (j = 0; j < 8; j++)
+            index.data[i * CLCFAT_ENTRY_SIZE + j] = (char) (offset >> (8 * j));
+        offset += entries[kept[i]].size;
+    }
+
+    buffer_append(buf, CLCFAT_MAGIC, 8);
+    append_le(buf, CLCFAT_VERSION, 4);
+    append_le(buf, num_kept, 4);
+    append_le(buf, align, 4);
+    append_le(buf, 0, 4);
+    append_le(buf, CLCFAT_HEADER_SIZE + index.len, 8);
+    append_le(buf, strings.len, 8);
+    buffer_append(buf, zeros, CLCFAT_HEADER_SIZE - 40);
+    buffer_append(buf, index.data, index.len);
+    buffer_append(buf, strings.data, strings.len);
+    for (i = 0; i < num_kept; i++)
+    {
+        const fat_entry *e = &entries[kept[i]];
+
+        while (buf->len % align != 0)
+            buffer_append(buf, zeros, align - buf->len % align < sizeof(zeros)
+                          ? align - buf->len % align : sizeof(zeros));
+        buffer_append(buf, (const char *) e->binary, e->size);
+    }
+    free(index.data);
+    free(strings.data);
+    free(hashes);
+    free(kept);
+}
+
+/* Writes the fat binary holding entries to filename */
+static void write_fat_file(const char *filename, const fat_entry *entries, size_t num_entries)
+{
+    string_buffer out = { NULL, 0, 0 };
+
+    format_fat_binary(&out, entries, num_entries);
+    write_binary_file(filename, (const unsigned char *) out.data, out.len);
+    free(out.data);
+}
+
+/* Writes a binary built for device to a file in the --emit format. With a
+ * non-negative index (for --all-devices and --sweep), the file is
+ * output_filename.index and the symbol has _index appended.
+ */
+static void write_program_file(const compiler_options *options, cl_device_id device,
+                               const char *output_filename, int index,
+                               const unsigned char *binary, size_t size)
+{
+    char *filename = NULL;
+    char *symbol;
+    binary_metadata meta;
+    string_buffer out = { NULL, 0, 0 };
+
+    if (index >= 0)
+    {
+        filename = (char *) onlineclc_malloc(strlen(output_filename) + 16, "the output filename");
+        sprintf(filename, "%s.%d", output_filename, index);
+    }
+    if (options->emit == EMIT_BINARY)
+    {
+        write_binary_file(filename != NULL ? filename : output_filename, binary, size);
+        free(filename);
+        return;
+    }
+
+    if (options->emit == EMIT_FAT)
+    {
+        fat_entry entry;
+
+        get_binary_metadata(&entry.meta, device);
+        entry.options = options->link ? options->link_options : options->options;
+        entry.binary = binary;
+        entry.size = size;
+        write_fat_file(filename != NULL ? filename : output_filename, &entry, 1);
+        free_binary_metadata(&entry.meta);
+        free(filename);
+        return;
+    }
+
+    symbol = symbol_name(options->symbol, output_filename, index);
+    get_binary_metadata(&meta, device);
+    if (options->emit == EMIT_ELF)
+        format_elf_object(&out, symbol, &meta, binary, size);
+    else
+        format_c_source(&out, symbol, options->emit == EMIT_HEADER, &meta, binary, size);
+    write_binary_file(filename != NULL ? filename : output_filename, (const unsigned char *) out.data, out.len);
+    free(out.data);
+    free_binary_metadata(&meta);
+    free(symbol);
+    free(filename);
+}
+#endif /* !ONLINECLC_LIBRARY */
+
+/* Computes the cache key for compiling a source. It covers everything that
+ * the binary and build log depend on: the source and its filename (which
+ * appears in #line), the options, the identity of the device and of the
+ * driver, and the headers found by find_dependencies (if deps is not NULL).
+ * Returns CL_SUCCESS, or BUILD_ERROR if the device cannot be queried (which
+ * is reported).
+ */
+static cl_int compute_cache_key(
+    cache_key *key,
+    cl_device_id device,
+    const compiler_options *options,
+    const char *source_filename,
+    const source_text *src,
+    const dependency_list *deps)
+{
+    static const char hex_digits[] = "0123456789abcdef";
+    static const cl_device_info device_params[] =
+    {
+        CL_DEVICE_NAME, CL_DEVICE_VENDOR, CL_DEVICE_VERSION, CL_DRIVER_VERSION
+    };
+    sha256_context ctx;
+    cl_platform_id platform;
+    char *value;
+    uint64_t len64;
+    size_t i;
+
+    sha256_init(&ctx);
+    sha256_field(&ctx, "onlineclc-cache-1", strlen("onlineclc-cache-1"));
+    for (i = 0; i < sizeof(device_params) / sizeof(device_params[0]); i++)
+    {
+        if (get_device_string(device, device_params[i], &value) != CL_SUCCESS)
+            return BUILD_ERROR;
+        sha256_field(&ctx, value, strlen(value));
+        free(value);
+    }
+    if (get_device_platform(device, &platform) != CL_SUCCESS
+        || get_platform_string(platform, CL_PLATFORM_VERSION, &value) != CL_SUCCESS)
+        return BUILD_ERROR;
+    sha256_field(&ctx, value, strlen(value));
+    free(value);
+
+    value = options->options != NULL ? options->options : "";
+    sha256_field(&ctx, value, strlen(value));
+    /* An object from -c is a different kind of binary */
+    if (options->compile_only)
+        sha256_field(&ctx, "compiled-object", strlen("compiled-object"));
+    /* SPIR-V goes to clCreateProgramWithIL rather than the compiler */
+    if (is_spirv(options, src))
+        sha256_field(&ctx, "spirv", strlen("spirv"));
+    /* Bundling changes the #line directives that the compiler sees */
+    if (options->bundle_headers)
+        sha256_field(&ctx, "bundled-headers", strlen("bundled-headers"));
+    sha256_field(&ctx, source_filename, strlen(source_filename));
+    len64 = src->len;
+    sha256_update(&ctx, &len64, sizeof(len64));
+    for (i = 0; i < src->num_chunks; i++)
+        sha256_update(&ctx, src->chunks[i], src->chunk_lens[i]);
+    if (deps != NULL)
+        sha256_field(&ctx, deps->hash, sizeof(deps->hash));
+    sha256_final(&ctx, key->hash);
+
+    for (i = 0; i < 32; i++)
+    {
+        key->hex[2 * i] = hex_digits[key->hash[i] >> 4];
+        key->hex[2 * i + 1] = hex_digits[key->hash[i] & 15];
+    }
+    key->hex[64] = '\0';
+    return CL_SUCCESS;
+}
+
+/* Header of a cache entry. The build log and then the binary follow it. The
+ * entry is only ever read on the machine that wrote it, so native byte
+ * order is used.
+ */
+typedef struct
+{
+    char magic[8];
+    uint64_t log_len;
+    uint64_t binary_size;
+} cache_header;
+
+#define CACHE_MAGIC "OCLCACH1"
+
+/* Name of the file in the cache directory that holds the running total of
+ * the sizes of the entries, so that the directory need not be scanned for
+ * eviction on every store
+ */
+#define CACHE_SIZE_NAME ".size"
+
+/* Returns the dynamically allocated path of a file in the cache, or NULL if
+ * there is no memory (which is reported)
+ */
+static char *cache_path(const char *cache_dir, const char *name)
+{
+    char *path = (char *) try_malloc(strlen(cache_dir) + strlen(name) + 2, "a path");
+    if (path != NULL)
+        sprintf(path, "%s/%s", cache_dir, name);
+    return path;
+}
+
+/* Looks up key in the cache. On a hit, the build log is stored in *log and
+ * its length in *log_len (as for get_build_log), the binary is stored in
+ * *binary (if binary is not NULL) and 1 is returned. A missing or damaged
+ * entry is a miss, and 0 is returned, as is one with no memory to read it.
+ */
+static int cache_lookup(
+    const char *cache_dir,
+    const cache_key *key,
+    char **log,
+    size_t *log_len,
+    unsigned char **binary,
+    size_t *binary_size)
+{
+    char *path = cache_path(cache_dir, key->hex);
+    struct stat sb;
+    cache_header header;
+    char *contents = NULL;
+    int fd, hit = 0;
+    phase_timer timer;
+
+    phase_begin(&timer);
+    fd = path != NULL ? open(path, O_RDONLY) : -1;
+    if (fd >= 0 && fstat(fd, &sb) == 0 && (size_t) sb.st_size >= sizeof(header))
+    {
+        contents = (char *) try_malloc(sb.st_size, "a cache entry");
+        if (contents != NULL && read_all(fd, contents, sb.st_size) == 0)
+        {
+            memcpy(&header, contents, sizeof(header));
+            hit = 0 == memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic))
+                && header.binary_size > 0
+                && header.log_len <= (uint64_t) sb.st_size
+                && header.binary_size == (uint64_t) sb.st_size - sizeof(header) - header.log_len;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+
+    if (hit)
+    {
+        const char *stored_log = contents + sizeof(header);
+
+        /* If there is no memory for the copies, treat it as a miss */
+        *log_len = header.log_len;
+        *log = NULL;
+        if (header.log_len > 0)
+        {
+            *log = (char *) try_malloc(header.log_len + 1, "the build log");
+            hit = *log != NULL;
+            if (hit)
+            {
+                memcpy(*log, stored_log, header.log_len);
+                (*log)[header.log_len] = '\0';
+            }
+        }
+        if (hit && binary != NULL)
+        {
+            *binary_size = header.binary_size;
+            *binary = (unsigned char *) try_malloc(*binary_size, "the program binary");
+            hit = *binary != NULL;
+            if (hit)
+                memcpy(*binary, stored_log + header.log_len, *binary_size);
+            else
+            {
+                free(*log);
+                *log = NULL;
+            }
+        }
+    }
+    /* Mark the entry as recently used, for eviction */
+    if (hit)
+        utime(path, NULL);
+    free(contents);
+    free(path);
+    phase_end(&timer, hit ? "cache hit" : "cache miss", key->hex);
+    return hit;
+}
+
+/* An entry in the cache directory, for eviction */
+typedef struct
+{
+    char *name;
+    time_t mtime;
+    unsigned long long size;
+} cache_file;
+
+static int compare_cache_files(const void *a, const void *b)
+{
+    const cache_file *fa = (const cache_file *) a;
+    const cache_file *fb = (const cache_file *) b;
+    return fa->mtime < fb->mtime ? -1 : fa->mtime > fb->mtime ? 1 : 0;
+}
+
+/* Removes the least recently used entries from the cache until its total
+ * size is at most max_size, and removes temporary files more than a day
+ * old (left by interrupted writers). Errors are ignored, since another
+ * process may be evicting at the same time. Returns the total size of the
+ * entries that are left.
+ */
+static unsigned long long cache_evict(const char *cache_dir, unsigned long long max_size)
+{
+    DIR *dir;
+    struct dirent *entry;
+    cache_file *files = NULL;
+    size_t num_files = 0, size = 0, i;
+    unsigned long long total = 0;
+    time_t now = time(NULL);
+
+    dir = opendir(cache_dir);
+    if (dir == NULL)
+        return 0;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        struct stat sb;
+        char *path;
+
+        if (strlen(entry->d_name) != 64 && strncmp(entry->d_name, ".tmp.", 5) != 0)
+            continue;
+        path = cache_path(cache_dir, entry->d_name);
+        if (path != NULL && stat(path, &sb) == 0 && S_ISREG(sb.st_mode))
+        {
+            if (entry->d_name[0] == '.')
+            {
+                if (now - sb.st_mtime > 24 * 60 * 60)
+                    unlink(path);
+            }
+            else
+            {
+                if (num_files == size)
+                {
+                    cache_file *grown;
+
+                    /* Without memory, evict from the entries seen so far */
+                    size = size == 0 ? 256 : 2 * size;
+                    grown = (cache_file *) realloc(files, size * sizeof(cache_file));
+                    if (grown == NULL)
+                    {
+                        free(path);
+                        break;
+                    }
+                    files = grown;
+                }
+                files[num_files].name = path;
+                files[num_files].mtime = sb.st_mtime;
+                files[num_files].size = sb.st_size;
+                total += sb.st_size;
+                num_files++;
+                path = NULL;
+            }
+        }
+        free(path);
+    }
+    closedir(dir);
+
+    qsort(files, num_files, sizeof(cache_file), compare_cache_files);
+    for (i = 0; i < num_files; i++)
+    {
+        if (total > max_size)
+        {
+            unlink(files[i].name);
+            total -= files[i].size;
+        }
+        free(files[i].name);
+    }
+    free(files);
+    return total;
+}
+
+/* Adds the size of a new entry to the running total in the cache, and
+ * evicts entries (setting the total to what is left) once it passes
+ * max_size. The total is only an estimate, as it counts a replaced entry
+ * twice and misses entries removed by hand, but it is corrected by every
+ * eviction. If it cannot be read, the cache is evicted from at once. A lock
+ * on the file serializes this between processes, and a mutex between the
+ * threads of one process.
+ */
+static void cache_account(const char *cache_dir, unsigned long long max_size, unsigned long long size)
+{
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    struct flock file_lock;
+    char *path = cache_path(cache_dir, CACHE_SIZE_NAME);
+    char buf[32], *end;
+    unsigned long long total = 0;
+    ssize_t len;
+    int fd, known = 0;
+
+    pthread_mutex_lock(&lock);
+    fd = path != NULL ? open(path, O_RDWR | O_CREAT, 0666) : -1;
+    free(path);
+    if (fd < 0)
+    {
+        cache_evict(cache_dir, max_size);
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    memset(&file_lock, 0, sizeof(file_lock));
+    file_lock.l_type = F_WRLCK;
+    file_lock.l_whence = SEEK_SET;
+    while (fcntl(fd, F_SETLKW, &file_lock) != 0 && errno == EINTR)
+        ;
+    len = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (len > 0)
+    {
+        buf[len] = '\0';
+        total = strtoull(buf, &end, 10);
+        known = end != buf && *end == '\n';
+    }
+    total += size;
+    if (!known || total > max_size)
+        total = cache_evict(cache_dir, max_size);
+    len = snprintf(buf, sizeof(buf), "%llu\n", total);
+    if (ftruncate(fd, 0) == 0)
+        pwrite(fd, buf, len, 0);
+    close(fd);
+    pthread_mutex_unlock(&lock);
+}
+
+/* Adds an entry to the cache. It is written to a temporary file and renamed
+ * into place, so that concurrent readers never see a partial entry. Failure
+ * produces a warning but is otherwise ignored.
+ */
+static void cache_store(
+    const compiler_options *options,
+    const cache_key *key,
+    const char *log,
+    size_t log_len,
+    const unsigned char *binary,
+    size_t binary_size)
+{
+    cache_header header;
+    char *tmp_path, *path;
+    int fd, err = 0;
+    phase_timer timer;
+
+    phase_begin(&timer);
+    if (mkdir(options->cache_dir, 0777) != 0 && errno != EEXIST)
+    {
+        fprintf(message_stream(), "Warning: failed to create cache directory `%s': %s\n",
+                options->cache_dir, strerror(errno));
+        return;
+    }
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.log_len = log_len;
+    header.binary_size = binary_size;
+
+    tmp_path = cache_path(options->cache_dir, ".tmp.XXXXXX");
+    path = cache_path(options->cache_dir, key->hex);
+    if (tmp_path == NULL || path == NULL)
+    {
+        free(tmp_path);
+        free(path);
+        return;
+    }
+    fd = mkstemp(tmp_path);
+    if (fd < 0
+        || fchmod(fd, 0644) != 0
+        || write_all(fd, &header, sizeof(header)) != 0
+        || write_all(fd, log, log_len) != 0
+        || write_all(fd, binary, binary_size) != 0)
+        err = errno;
+    /* The descriptor is released even if close() fails, so it is closed once */
+    if (fd >= 0 && close(fd) != 0 && err == 0)
+        err = errno;
+    if (err == 0 && rename(tmp_path, path) != 0)
+        err = errno;
+    if (err != 0)
+    {
+        fprintf(message_stream(), "Warning: failed to write cache entry `%s': %s\n",
+                path, strerror(err));
+        /* The temporary file only exists if it was created */
+        if (fd >= 0)
+            unlink(tmp_path);
+    }
+    else
+        cache_account(options->cache_dir, options->cache_size, sizeof(header) + log_len + binary_size);
+    free(tmp_path);
+    free(path);
+    phase_end(&timer, "cache store", key->hex);
+}
+
+/* What -b selects. A plain device name is a selector with just a name. */
+typedef struct
+{
+    /* Platform to use, by index or by name (or -1 and NULL for any) */
+    long platform_index;
+    const char *platform_name;
+    /* Device types to consider (CL_DEVICE_TYPE_ALL for any) */
+    cl_device_type type;
+    /* Index among the devices of the above types in each platform, or -1 */
+    long device_index;
+    /* Device name, or NULL for any */
+    const char *device_name;
+    /* Storage for the strings above, to be freed */
+    char *storage;
+} device_selector;
+
+static void free_selector(device_selector *sel)
+{
+    free(sel->storage);
+    sel->storage = NULL;
+}
+
+/* Devices found on one platform, possibly in a thread of their own */
+typedef struct
+{
+    cl_platform_id platform;
+    /* Types to ask the platform for */
+    cl_device_type type;
+    /* Set if names (and types) must be queried too */
+    int query_names;
+
+    /* Results. types and names are NULL if not queried. */
+    cl_uint num_devices;
+    cl_device_id *devices;
+    cl_device_type *types;
+    char **names;
+    /* On failure, the error code and what failed (since the thread cannot die) */
+    cl_int status;
+    const char *failure;
+} platform_scan;
+
+/* Parses a device type name for type: selectors. Returns 0 if unknown. */
+static cl_device_type parse_device_type(const char *name)
+{
+    if (0 == strcmp(name, "cpu"))
+        return CL_DEVICE_TYPE_CPU;
+    else if (0 == strcmp(name, "gpu"))
+        return CL_DEVICE_TYPE_GPU;
+    else if (0 == strcmp(name, "accelerator"))
+        return CL_DEVICE_TYPE_ACCELERATOR;
+    else if (0 == strcmp(name, "default"))
+        return CL_DEVICE_TYPE_DEFAULT;
+    else if (0 == strcmp(name, "all"))
+        return CL_DEVICE_TYPE_ALL;
+    return 0;
+}
+
+/* Parses the argument of -b. A string made up of /-separated key:value
+ * components (platform:, device:, type: and name:) is a selector; anything
+ * else is the name of a device. Returns 0 on success, or else an exit
+ * status: 2 if a selector is malformed, or 1 if there is no memory for it
+ * (which is reported). The selector must be released with free_selector.
+ */
+static int parse_selector(device_selector *sel, const char *machine)
+{
+    static const char * const keys[] = { "platform:", "device:", "type:", "name:" };
+    char *component, *next, *end;
+    unsigned int i;
+    int is_selector = 1;
+
+    sel->platform_index = -1;
+    sel->platform_name = NULL;
+    sel->type = CL_DEVICE_TYPE_ALL;
+    sel->device_index = -1;
+    sel->device_name = NULL;
+    sel->storage = NULL;
+    if (machine == NULL)
+        return 0;
+
+    /* Check that every component has a known key */
+    for (component = (char *) machine; is_selector && component != NULL; )
+    {
+        for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+            if (0 == strncmp(component, keys[i], strlen(keys[i])))
+                break;
+        is_selector = i < sizeof(keys) / sizeof(keys[0]);
+        component = strchr(component, '/');
+        if (component != NULL)
+            component++;
+    }
+    if (!is_selector)
+    {
+        sel->device_name = machine;
+        return 0;
+    }
+
+    sel->storage = try_strndup(machine, strlen(machine), "the device selector");
+    if (sel->storage == NULL)
+        return 1;
+    for (component = sel->storage; component != NULL; component = next)
+    {
+        char *value = strchr(component, ':') + 1;
+
+        next = strchr(component, '/');
+        if (next != NULL)
+            *next++ = '\0';
+        if (0 == strncmp(component, "platform:", 9))
+        {
+            if (isdigit((unsigned char) value[0]))
+            {
+                sel->platform_index = strtol(value, &end, 10);
+                if (*end != '\0')
+                    break;
+            }
+            else
+                sel->platform_name = value;
+        }
+        else if (0 == strncmp(component, "device:", 7))
+        {
+            if (!isdigit((unsigned char) value[0]))
+                break;
+            sel->device_index = strtol(value, &end, 10);
+            if (*end != '\0')
+                break;
+        }
+        else if (0 == strncmp(component, "type:", 5))
+        {
+            sel->type = parse_device_type(value);
+            if (sel->type == 0)
+                break;
+        }
+        else
+            sel->device_name = value;
+    }
+    if (component != NULL)
+    {
+        free_selector(sel);
+        return 2;
+    }
+    return 0;
+}
+
+
+/* Queries the name of a device without terminating on failure. On success,
+ * *name is dynamically allocated.
+ */
+static cl_int query_device_name(cl_device_id device, char **name)
+{
+    size_t len;
+    cl_int status;
+
+    status = clGetDeviceInfo(device, CL_DEVICE_NAME, 0, NULL, &len);
+    if (status != CL_SUCCESS)
+        return status;
+    *name = (char *) malloc(len + 1);
+    if (*name == NULL)
+        return CL_OUT_OF_HOST_MEMORY;
+    status = clGetDeviceInfo(device, CL_DEVICE_NAME, len, *name, NULL);
+    (*name)[len] = '\0';
+    if (status != CL_SUCCESS)
+    {
+        free(*name);
+        *name = NULL;
+    }
+    return status;
+}
+
+/* Finds the devices of one platform. This is the body of a thread when
+ * several platforms are scanned at once, so it reports failure in the
+ * scan rather than terminating.
+ */
+static void *scan_platform(void *arg)
+{
+    platform_scan *scan = (platform_scan *) arg;
+    cl_uint i;
+
+    scan->num_devices = 0;
+    scan->devices = NULL;
+    scan->types = NULL;
+    scan->names = NULL;
+    scan->status = clGetDeviceIDs(scan->platform, scan->type, 0, NULL, &scan->num_devices);
+    /* A platform with no devices (of the type) reports that none were found */
+    if (scan->status == CL_DEVICE_NOT_FOUND || (scan->status == CL_SUCCESS && scan->num_devices == 0))
+    {
+        scan->num_devices = 0;
+        scan->status = CL_SUCCESS;
+        return NULL;
+    }
+    scan->failure = "Failed to get device ID count";
+    if (scan->status != CL_SUCCESS)
+        return NULL;
+
+    scan->failure = "Out of memory trying to allocate device IDs";
+    scan->status = CL_OUT_OF_HOST_MEMORY;
+    scan->devices = (cl_device_id *) malloc(scan->num_devices * sizeof(cl_device_id));
+    if (scan->query_names)
+    {
+        scan->types = (cl_device_type *) calloc(scan->num_devices, sizeof(cl_device_type));
+        scan->names = (char **) calloc(scan->num_devices, sizeof(char *));
+        if (scan->types == NULL || scan->names == NULL)
+            return NULL;
+    }
+    if (scan->devices == NULL)
+        return NULL;
+
+    scan->failure = "Failed to get device IDs";
+    scan->status = clGetDeviceIDs(scan->platform, scan->type, scan->num_devices, scan->devices, NULL);
+    if (scan->status != CL_SUCCESS || !scan->query_names)
+        return NULL;
+    for (i = 0; i < scan->num_devices; i++)
+    {
+        scan->failure = "Failed to query device name";
+        scan->status = query_device_name(scan->devices[i], &scan->names[i]);
+        if (scan->status != CL_SUCCESS)
+            return NULL;
+        scan->failure = "Failed to query device type";
+        scan->status = clGetDeviceInfo(scan->devices[i], CL_DEVICE_TYPE, sizeof(cl_device_type),
+                                       &scan->types[i], NULL);
+        if (scan->status != CL_SUCCESS)
+            return NULL;
+    }
+    return NULL;
+}
+
+/* Scans several platforms, concurrently if there is more than one, since
+ * the first query of a platform is where its driver is initialized.
+ * Returns 0, or -1 if a scan failed (which is reported). The scans must be
+ * released with free_scans either way.
+ */
+static int scan_platforms(platform_scan *scans, cl_uint num_scans)
+{
+    pthread_t *threads;
+    int *started;
+    cl_uint i;
+
+    if (num_scans == 1)
+        scan_platform(&scans[0]);
+    else if (num_scans > 1)
+    {
+        /* Without memory to track threads, scan one platform at a time */
+        threads = (pthread_t *) malloc(num_scans * sizeof(pthread_t));
+        started = (int *) calloc(num_scans, sizeof(int));
+        for (i = 0; i < num_scans; i++)
+        {
+            if (threads != NULL && started != NULL)
+                started[i] = 0 == pthread_create(&threads[i], NULL, scan_platform, &scans[i]);
+            /* Do it here if a thread can't be had */
+            if (started == NULL || !started[i])
+                scan_platform(&scans[i]);
+        }
+        for (i = 0; started != NULL && i < num_scans; i++)
+            if (started[i])
+                pthread_join(threads[i], NULL);
+        free(threads);
+        free(started);
+    }
+    for (i = 0; i < num_scans; i++)
+        if (scans[i].status != CL_SUCCESS)
+        {
+            if (scans[i].status == CL_OUT_OF_HOST_MEMORY && scans[i].devices == NULL)
+                report("%s", scans[i].failure);
+            else
+                report_cl(scans[i].status, "%s", scans[i].failure);
+            return -1;
+        }
+    return 0;
+}
+
+static void free_scans(platform_scan *scans, cl_uint num_scans)
+{
+    cl_uint i, j;
+
+    for (i = 0; i < num_scans; i++)
+    {
+        if (scans[i].names != NULL)
+            for (j = 0; j < scans[i].num_devices; j++)
+                free(scans[i].names[j]);
+        free(scans[i].devices);
+        free(scans[i].types);
+        free(scans[i].names);
+    }
+    free(scans);
+}
+
+/* Computes the name of the device map in the cache directory. The map is
+ * only valid for the same set of OpenCL implementations, so the name covers
+ * the ICD vendor files (and the drivers they name), the environment
+ * variables that ICD loaders use to find them and --icd. Returns NULL if
+ * there is no memory (which is reported).
+ */
+static char *device_map_path(const char *cache_dir)
+{
+    static const char * const env_vars[] =
+    {
+        "OCL_ICD_VENDORS", "OCL_ICD_FILENAMES", "OPENCL_VENDOR_PATH", "LD_LIBRARY_PATH"
+    };
+    static const char hex_digits[] = "0123456789abcdef";
+    sha256_context ctx;
+    unsigned char hash[32];
+    char name[8 + 2 * 16 + 1];
+    const char *vendor_dir;
+    DIR *dir;
+    struct dirent *entry;
+    char **icds = NULL, **grown;
+    size_t num_icds = 0, i, j;
+    int failed = 0;
+
+    sha256_init(&ctx);
+    sha256_field(&ctx, "onlineclc-devices-1", strlen("onlineclc-devices-1"));
+    for (i = 0; i < sizeof(env_vars) / sizeof(env_vars[0]); i++)
+    {
+        const char *value = getenv(env_vars[i]);
+        if (value == NULL)
+            value = "";
+        sha256_field(&ctx, value, strlen(value));
+    }
+    sha256_field(&ctx, opencl_icd != NULL ? opencl_icd : "", opencl_icd != NULL ? strlen(opencl_icd) : 0);
+
+    vendor_dir = getenv("OCL_ICD_VENDORS");
+    if (vendor_dir == NULL || vendor_dir[0] == '\0')
+        vendor_dir = getenv("OPENCL_VENDOR_PATH");
+    if (vendor_dir == NULL || vendor_dir[0] == '\0')
+        vendor_dir = "/etc/OpenCL/vendors";
+    dir = opendir(vendor_dir);
+    while (!failed && dir != NULL && (entry = readdir(dir)) != NULL)
+    {
+        size_t len = strlen(entry->d_name);
+        if (len < 4 || 0 != strcmp(entry->d_name + len - 4, ".icd"))
+            continue;
+        grown = (char **) realloc(icds, (num_icds + 1) * sizeof(char *));
+        if (grown == NULL)
+        {
+            report("Out of memory trying to list ICD files");
+            failed = 1;
+            break;
+        }
+        icds = grown;
+        icds[num_icds] = try_strndup(entry->d_name, len, "a filename");
+        failed = icds[num_icds] == NULL;
+        if (!failed)
+            num_icds++;
+    }
+    if (dir != NULL)
+        closedir(dir);
+
+    /* Directory order is arbitrary, so sort the files */
+    for (i = 1; i < num_icds; i++)
+        for (j = i; j > 0 && strcmp(icds[j - 1], icds[j]) > 0; j--)
+        {
+            char *tmp = icds[j];
+            icds[j] = icds[j - 1];
+            icds[j - 1] = tmp;
+        }
+    for (i = 0; i < num_icds; i++)
+    {
+        char *path = failed ? NULL : cache_path(vendor_dir, icds[i]);
+        char library[4096];
+        struct stat sb;
+        FILE *f;
+
+        failed = path == NULL;
+        sha256_field(&ctx, icds[i], strlen(icds[i]));
+        f = failed ? NULL : fopen(path, "r");
+        if (f != NULL && fgets(library, sizeof(library), f) != NULL)
+        {
+            library[strcspn(library, "\r\n")] = '\0';
+            sha256_field(&ctx, library, strlen(library));
+            /* An updated driver may have different devices */
+            if (stat(library, &sb) == 0)
+            {
+                uint64_t stamp[2];
+                stamp[0] = sb.st_size;
+                stamp[1] = sb.st_mtime;
+                sha256_field(&ctx, stamp, sizeof(stamp));
+            }
+        }
+        if (f != NULL)
+            fclose(f);
+        free(path);
+        free(icds[i]);
+    }
+    free(icds);
+    if (failed)
+        return NULL;
+
+    sha256_final(&ctx, hash);
+    strcpy(name, "devices-");
+    for (i = 0; i < 16; i++)
+    {
+        name[8 + 2 * i] = hex_digits[hash[i] >> 4];
+        name[8 + 2 * i + 1] = hex_digits[hash[i] & 15];
+    }
+    name[8 + 32] = '\0';
+    return cache_path(cache_dir, name);
+}
+
+/* Loads the device map: for each platform, the names and types of all its
+ * devices. The map is a text file with a "platform <devices>" line per
+ * platform, each followed by a "<type> <name>" line per device. Returns the
+ * number of platforms, or 0 if there is no usable map (including when there
+ * is no memory to load it). The map is returned as scans with no device IDs.
+ */
+static cl_uint load_device_map(const char *path, platform_scan **scans)
+{
+    FILE *f;
+    char line[4096];
+    cl_uint num_platforms = 0, i;
+    int ok = 1;
+
+    *scans = NULL;
+    f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+    while (ok && fgets(line, sizeof(line), f) != NULL)
+    {
+        platform_scan *scan, *grown;
+        unsigned long num_devices;
+
+        if (0 != strncmp(line, "platform ", 9))
+        {
+            ok = 0;
+            break;
+        }
+        num_devices = strtoul(line + 9, NULL, 10);
+        grown = (platform_scan *) realloc(*scans, (num_platforms + 1) * sizeof(platform_scan));
+        if (grown == NULL)
+        {
+            ok = 0;
+            break;
+        }
+        *scans = grown;
+        scan = &(*scans)[num_platforms++];
+        memset(scan, 0, sizeof(*scan));
+        scan->num_devices = (cl_uint) num_devices;
+        scan->types = (cl_device_type *) calloc(num_devices + 1, sizeof(cl_device_type));
+        scan->names = (char **) calloc(num_devices + 1, sizeof(char *));
+        if (scan->types == NULL || scan->names == NULL)
+        {
+            ok = 0;
+            break;
+        }
+        for (i = 0; ok && i < num_devices; i++)
+        {
+            unsigned long long type;
+            char *name;
+
+            if (fgets(line, sizeof(line), f) == NULL)
+                ok = 0;
+            else
+            {
+                line[strcspn(line, "\n")] = '\0';
+                type = strtoull(line, &name, 16);
+                ok = *name == ' ';
+                scan->types[i] = (cl_device_type) type;
+                if (ok)
+                {
+                    scan->names[i] = (char *) malloc(strlen(name + 1) + 1);
+                    ok = scan->names[i] != NULL;
+                    if (ok)
+                        strcpy(scan->names[i], name + 1);
+                }
+            }
+        }
+    }
+    fclose(f);
+    if (!ok || num_platforms == 0)
+    {
+        free_scans(*scans, num_platforms);
+        *scans = NULL;
+        return 0;
+    }
+    return num_platforms;
+}
+
+/* Writes the device map from a full scan. Failure is not fatal. */
+static void store_device_map(const char *cache_dir, const char *path,
+                             const platform_scan *scans, cl_uint num_platforms)
+{
+    string_buffer map = { NULL, 0, 0 };
+    char *tmp_path;
+    cl_uint i, j;
+    int fd, failed = 0;
+
+    for (i = 0; i < num_platforms && !failed; i++)
+    {
+        failed = try_buffer_printf(&map, "platform %u\n", (unsigned int) scans[i].num_devices) != 0;
+        for (j = 0; j < scans[i].num_devices && !failed; j++)
+            failed = try_buffer_printf(&map, "%llx %s\n", (unsigned long long) scans[i].types[j],
+                                       scans[i].names[j]) != 0;
+    }
+    tmp_path = failed ? NULL : cache_path(cache_dir, ".tmp.XXXXXX");
+    if (tmp_path == NULL || (mkdir(cache_dir, 0777) != 0 && errno != EEXIST))
+    {
+        free(tmp_path);
+        free(map.data);
+        return;
+    }
+    fd = mkstemp(tmp_path);
+    if (fd >= 0)
+    {
+        failed = fchmod(fd, 0644) != 0 || write_all(fd, map.data, map.len) != 0;
+        failed = close(fd) != 0 || failed;
+        if (failed || rename(tmp_path, path) != 0)
+            unlink(tmp_path);
+    }
+    free(tmp_path);
+    free(map.data);
+}
+
+/* Finds the device IDs for all devices matching a -b argument (see
+ * parse_selector), or all devices if machine is NULL. Devices without a
+ * compiler are skipped, since they only load binaries. The dynamically
+ * allocated array of matches is stored in *devices and the number of them
+ * in *match_devices. Returns 0, or an exit status if no device could be
+ * found (2 if the selector is malformed), after reporting it.
+ *
+ * Only the platforms that the selector allows are queried, concurrently.
+ * Matching by device name needs the name of every device, so if cache_dir
+ * is not NULL, the names are kept in a device map there and later runs
+ * only query the platforms that have a match.
+ */
+static int find_devices(const char *machine, const char *cache_dir,
+                        cl_device_id **devices, cl_uint *match_devices)
+{
+    device_selector sel;
+    cl_int status;
+    cl_uint num_platforms, num_scans = 0, num_matches = 0, total_devices = 0, no_compiler = 0, i, j;
+    cl_platform_id *platforms = NULL;
+    platform_scan *scans = NULL;
+    int *wanted = NULL;
+    char *map_path = NULL;
+    cl_device_id *ans = NULL;
+    phase_timer timer;
+    int ret;
+
+    ret = parse_selector(&sel, machine);
+    if (ret != 0)
+    {
+        if (ret == 2)
+            report("Invalid device selector `%s'", machine);
+        return ret;
+    }
+    ret = 1;
+
+    phase_begin(&timer);
+    /* Get number of available platforms */
+    status = clGetPlatformIDs(0, NULL, &num_platforms);
+    if (status == CL_PLATFORM_NOT_FOUND_KHR)
+        num_platforms = 0;
+    else if (status != CL_SUCCESS)
+    {
+        report_cl(status, "Failed to get platform ID count");
+        goto fail;
+    }
+    if (num_platforms == 0)
+    {
+        report("No OpenCL platforms found");
+        goto fail;
+    }
+
+    /* Get a list of platforms */
+    platforms = (cl_platform_id *) try_malloc(num_platforms * sizeof(cl_platform_id), "platform IDs");
+    if (platforms == NULL)
+        goto fail;
+    status = clGetPlatformIDs(num_platforms, platforms, NULL);
+    if (status != CL_SUCCESS)
+    {
+        report_cl(status, "Failed to get platform IDs");
+        goto fail;
+    }
+    if (sel.platform_index >= (long) num_platforms)
+    {
+        report("No OpenCL platform %ld found (there are %u)", sel.platform_index, (unsigned int) num_platforms);
+        goto fail;
+    }
+
+    /* Decide which platforms the selector allows */
+    wanted = (int *) try_malloc(num_platforms * sizeof(int), "platform flags");
+    if (wanted == NULL)
+        goto fail;
+    for (i = 0; i < num_platforms; i++)
+    {
+        wanted[i] = sel.platform_index < 0 || sel.platform_index == (long) i;
+        if (wanted[i] && sel.platform_name != NULL)
+        {
+            char *name;
+
+            if (get_platform_string(platforms[i], CL_PLATFORM_NAME, &name) != CL_SUCCESS)
+                goto fail;
+            wanted[i] = 0 == strcmp(name, sel.platform_name);
+            free(name);
+        }
+    }
+
+    /* Use the device map, if there is one and it matches */
+    if (sel.device_name != NULL && cache_dir != NULL)
+    {
+        map_path = device_map_path(cache_dir);
+        if (map_path == NULL)
+            goto fail;
+        num_scans = load_device_map(map_path, &scans);
+        if (num_scans != 0 && num_scans != num_platforms)
+        {
+            free_scans(scans, num_scans);
+            scans = NULL;
+            num_scans = 0;
+        }
+    }
+    if (num_scans != 0)
+    {
+        /* Only the platforms with a match in the map need their device IDs.
+         * If there is no match, the device may be new, so the map is treated
+         * as stale.
+         */
+        cl_uint num_matched = 0;
+
+        for (i = 0; i < num_scans; i++)
+        {
+            cl_uint num_devices = 0;
+
+            for (j = 0; wanted[i] && j < scans[i].num_devices; j++)
+                if (0 == strcmp(scans[i].names[j], sel.device_name))
+                    break;
+            if (!wanted[i] || j == scans[i].num_devices)
+                continue;
+            num_matched++;
+            scans[i].devices = (cl_device_id *) try_malloc(scans[i].num_devices * sizeof(cl_device_id),
+                                                           "device IDs");
+            if (scans[i].devices == NULL)
+                goto fail;
+            status = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, scans[i].num_devices,
+                                    scans[i].devices, &num_devices);
+            if (status != CL_SUCCESS && status != CL_DEVICE_NOT_FOUND)
+            {
+                report_cl(status, "Failed to get device IDs");
+                goto fail;
+            }
+            if (num_devices != scans[i].num_devices)
+            {
+                /* The map is stale, so replace it with a full scan */
+                num_matched = 0;
+                break;
+            }
+        }
+        if (num_matched == 0)
+        {
+            free_scans(scans, num_scans);
+            scans = NULL;
+            num_scans = 0;
+        }
+    }
+    if (num_scans == 0)
+    {
+        /* Writing the map needs every device on every platform */
+        int full = map_path != NULL;
+        platform_scan *todo;
+        cl_uint num_todo = 0;
+        int failed;
+
+        scans = (platform_scan *) try_malloc(num_platforms * sizeof(platform_scan), "platform scans");
+        todo = (platform_scan *) try_malloc(num_platforms * sizeof(platform_scan), "platform scans");
+        if (scans == NULL || todo == NULL)
+        {
+            free(todo);
+            goto fail;
+        }
+        num_scans = num_platforms;
+        memset(scans, 0, num_scans * sizeof(platform_scan));
+        for (i = 0; i < num_scans; i++)
+        {
+            scans[i].platform = platforms[i];
+            scans[i].type = full ? CL_DEVICE_TYPE_ALL : sel.type;
+            scans[i].query_names = sel.device_name != NULL;
+            if (full || wanted[i])
+                todo[num_todo++] = scans[i];
+        }
+        failed = scan_platforms(todo, num_todo) != 0;
+        for (i = 0, j = 0; i < num_scans; i++)
+            if (full || wanted[i])
+                scans[i] = todo[j++];
+        free(todo);
+        if (failed)
+            goto fail;
+        if (full)
+            store_device_map(cache_dir, map_path, scans, num_scans);
+    }
+
+    /* Pick out the matches, in platform order */
+    for (i = 0; i < num_scans; i++)
+    {
+        long index = 0;
+
+        if (!wanted[i])
+            continue;
+        for (j = 0; j < scans[i].num_devices; j++)
+        {
+            cl_device_id *grown;
+            cl_bool compiler;
+
+            if (scans[i].types != NULL && !(scans[i].types[j] & sel.type))
+                continue;
+            total_devices++;
+            if (sel.device_index >= 0 && index++ != sel.device_index)
+                continue;
+            if (sel.device_name != NULL && 0 != strcmp(scans[i].names[j], sel.device_name))
+                continue;
+            /* Match found */
+            status = clGetDeviceInfo(scans[i].devices[j], CL_DEVICE_COMPILER_AVAILABLE,
+                                     sizeof(compiler), &compiler, NULL);
+            if (status != CL_SUCCESS)
+            {
+                report_cl(status, "Failed to query whether the device has a compiler");
+                goto fail;
+            }
+            if (!compiler)
+            {
+                no_compiler++;
+                continue;
+            }
+            grown = (cl_device_id *) realloc(ans, (num_matches + 1) * sizeof(cl_device_id));
+            if (grown == NULL)
+            {
+                report("Out of memory trying to allocate device IDs");
+                goto fail;
+            }
+            ans = grown;
+            ans[num_matches++] = scans[i].devices[j];
+        }
+    }
+
+    if (num_matches == 0)
+    {
+        /* A selector may have filtered out devices before they were counted */
+        if (no_compiler > 0 && machine != NULL)
+            report("No OpenCL device matching `%s' has a compiler", machine);
+        else if (no_compiler > 0)
+            report("No OpenCL device has a compiler");
+        else if (sel.storage != NULL)
+            report("No OpenCL device matches `%s'", machine);
+        else if (total_devices == 0)
+            report("No OpenCL devices found");
+        else
+            report("No OpenCL device called `%s' found", machine);
+        goto fail;
+    }
+    free_scans(scans, num_scans);
+    free(wanted);
+    free(platforms);
+    free(map_path);
+    free_selector(&sel);
+    phase_end(&timer, "enumerate devices", machine);
+    *devices = ans;
+    *match_devices = num_matches;
+    return 0;
+
+fail:
+    free(ans);
+    free_scans(scans, num_scans);
+    free(wanted);
+    free(platforms);
+    free(map_path);
+    free_selector(&sel);
+    return ret;
+}
+
+/* Finds the device ID for the device selected by machine (as for
+ * find_devices), and stores it in *device. Returns 0, or an exit status as
+ * for find_devices.
+ */
+static int find_device(const char *machine, const char *cache_dir, cl_device_id *device)
+{
+    cl_device_id *devices;
+    cl_uint match_devices;
+    int ret;
+
+    ret = find_devices(machine, cache_dir, &devices, &match_devices);
+    if (ret != 0)
+        return ret;
+    if (match_devices > 1)
+    {
+        fprintf(message_stream(), "Warning: multiple devices match, using the first one\n");
+    }
+    *device = devices[0];
+    free(devices);
+    return 0;
+}
+
+/* Compiles one source for device, or fetches the result from the cache if
+ * it is enabled. The build log is written to log_out. If binary is not NULL
+ * and the build succeeds, the binary is stored in it (dynamically allocated).
+ * deps, if not NULL, adds the headers to the cache key. With -c, the source
+ * is compiled to an object instead of built.
+ * *ctx is created if it is NULL and a build is actually needed, and is
+ * owned by the caller even on failure. Returns CL_SUCCESS,
+ * CL_BUILD_PROGRAM_FAILURE (CL_COMPILE_PROGRAM_FAILURE with -c),
+ * BUILD_TIMED_OUT or BUILD_ERROR (after reporting it).
+ */
+static cl_int compile_source(
+    const compiler_options *options,
+    cl_device_id device,
+    cl_context *ctx,
+    const char *source_filename,
+    const source_text *src,
+    const dependency_list *deps,
+    FILE *log_out,
+    unsigned char **binary,
+    size_t *binary_size)
+{
+    cache_key key;
+    cl_program program;
+    cl_int status;
+    char *log;
+    size_t log_len;
+    build_usage used;
+
+    if (options->cache_dir != NULL)
+    {
+        if (compute_cache_key(&key, device, options, source_filename, src, deps) != CL_SUCCESS)
+            return BUILD_ERROR;
+        if (cache_lookup(options->cache_dir, &key, &log, &log_len, binary, binary_size))
+        {
+            write_build_log(log_out, log, log_len);
+            free(log);
+            return CL_SUCCESS;
+        }
+    }
+
+    if (*ctx == NULL && open_context(1, &device, ctx) != CL_SUCCESS)
+    {
+        *ctx = NULL;
+        return BUILD_ERROR;
+    }
+    if (create_program(*ctx, options, source_filename, src, &program) != CL_SUCCESS)
+        return BUILD_ERROR;
+    status = build_or_compile(program, 1, &device, src->name, options, &used);
+    if (status == BUILD_ERROR || get_build_log(program, device, &log, &log_len) != CL_SUCCESS)
+    {
+        clReleaseProgram(program);
+        return BUILD_ERROR;
+    }
+    write_build_log(log_out, log, log_len);
+    if (options->build_stats)
+        write_build_usage(log_out, &used);
+    if (status == CL_SUCCESS && (binary != NULL || options->cache_dir != NULL))
+    {
+        unsigned char *program_binary;
+        size_t program_binary_size;
+
+        if (get_program_binary(program, &program_binary, &program_binary_size) != CL_SUCCESS)
+        {
+            free(log);
+            clReleaseProgram(program);
+            return BUILD_ERROR;
+        }
+        if (options->cache_dir != NULL)
+            cache_store(options, &key, log, log_len, program_binary, program_binary_size);
+        if (binary != NULL)
+        {
+            *binary = program_binary;
+            *binary_size = program_binary_size;
+        }
+        else
+            free(program_binary);
+    }
+    free(log);
+    clReleaseProgram(program);
+    return status;
+}
+
+/* Extract the binary for one device from a program that may have been built
+ * for several, as for get_program_binary.
+ */
+static cl_int get_device_binary(cl_program program, cl_device_id device,
+                                unsigned char **binary, size_t *size)
+{
+    cl_int status;
+    cl_uint num_devices, i;
+    cl_device_id *devices = NULL;
+    size_t *sizes = NULL;
+    unsigned char **binaries = NULL;
+    unsigned char *ans = NULL;
+    phase_timer timer;
+
+    phase_begin(&timer);
+    *binary = NULL;
+    status = clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &num_devices, NULL);
+    if (status != CL_SUCCESS)
+    {
+        report_cl(status, "Failed to query number of devices from program");
+        return BUILD_ERROR;
+    }
+    devices = (cl_device_id *) try_malloc(num_devices * sizeof(cl_device_id), "device IDs");
+    sizes = (size_t *) try_malloc(num_devices * sizeof(size_t), "binary sizes");
+    binaries = (unsigned char **) try_malloc(num_devices * sizeof(unsigned char *), "binaries");
+    if (devices == NULL || sizes == NULL || binaries == NULL)
+        goto fail;
+    status = clGetProgramInfo(program, CL_PROGRAM_DEVICES, num_devices * sizeof(cl_device_id), devices, NULL);
+    if (status != CL_SUCCESS)
+    {
+        report_cl(status, "Failed to query devices from program");
+        goto fail;
+    }
+    status = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, num_devices * sizeof(size_t), sizes, NULL);
+    if (status != CL_SUCCESS)
+    {
+        report_cl(status, "Failed to obtain binary size");
+        goto fail;
+    }
+
+    /* NULL entries tell the implementation to skip the other devices */
+    for (i = 0; i < num_devices; i++)
+    {
+        binaries[i] = NULL;
+        if (devices[i] == device && ans == NULL)
+        {
+            if (sizes[i] == 0)
+            {
+                report("No binary was produced by the compiler");
+                goto fail;
+            }
+            ans = binaries[i] = (unsigned char *) try_malloc(sizes[i], "the program binary");
+            if (ans == NULL)
+                goto fail;
+            *size = sizes[i];
+        }
+    }
+    if (ans == NULL)
+    {
+        report("Device not found in program");
+        goto fail;
+    }
+    status = clGetProgramInfo(program, CL_PROGRAM_BINARIES, num_devices * sizeof(unsigned char *), binaries, NULL);
+    if (status != CL_SUCCESS)
+    {
+        report_cl(status, "Failed to query the program binary");
+        goto fail;
+    }
+
+    free(devices);
+    free(sizes);
+    free(binaries);
+    *binary = ans;
+    phase_end(&timer, "get binary", NULL);
+    return CL_SUCCESS;
+
+fail:
+    free(ans);
+    free(devices);
+    free(sizes);
+    free(binaries);
+    return BUILD_ERROR;
+}
+
+#if !ONLINECLC_LIBRARY
+/* The most warnings that check_kernel gives for one kernel */
+#define MAX_KERNEL_WARNINGS 4
+
+/* Work-group and memory attributes of one kernel on a device */
+typedef struct
+{
+    /* Dynamically allocated */
+    char *name;
+    size_t work_group_size;
+    /* All zero unless the kernel has reqd_work_group_size */
+    size_t compile_work_group_size[3];
+    size_t preferred_multiple;
+    cl_ulong local_mem_size;
+    cl_ulong private_mem_size;
+    /* Problems found by check_kernel (dynamically allocated) */
+    char *warnings[MAX_KERNEL_WARNINGS];
+    unsigned int num_warnings;
+} kernel_info;
+
+/* Limits of a device that kernels are checked against */
+typedef struct
+{
+    size_t max_work_group_size;
+    cl_ulong local_mem_size;
+} device_limits;
+
+static void get_kernel_work_group_info(cl_kernel kernel, cl_device_id device,
+                                       cl_kernel_work_group_info param, size_t size, void *value)
+{
+    cl_int status = clGetKernelWorkGroupInfo(kernel, device, param, size, value, NULL);
+    if (status != CL_SUCCESS)
+        die_cl(status, 1, "Failed to query kernel work-group info");
+}
+
+static void get_device_limits(cl_device_id device, device_limits *limits)
+{
+    cl_int status;
+
+    status = clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t),
+                             &limits->max_work_group_size, NULL);
+    if (status == CL_SUCCESS)
+        status = clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong),
+                                 &limits->local_mem_size, NULL);
+    if (status != CL_SUCCESS)
+        die_cl(status, 1, "Failed to query device limits");
+}
+
+static void add_kernel_warning(kernel_info *k, const char *fmt, ...)
+{
+    va_list ap;
+    char *warning = (char *) onlineclc_malloc(256, "a warning");
+
+    va_start(ap, fmt);
+    vsnprintf(warning, 256, fmt, ap);
+    va_end(ap);
+    k->warnings[k->num_warnings++] = warning;
+}
+
+/* Checks a kernel against the limits of the device, recording a warning for
+ * each thing that will keep it from filling the device: private memory
+ * (which is usually spilled registers), a work-group size held down by
+ * register use, and local memory that leaves room for few work-groups per
+ * compute unit.
+ */
+static void check_kernel(kernel_info *k, const device_limits *limits)
+{
+    const size_t *reqd = k->compile_work_group_size;
+
+    k->num_warnings = 0;
+    if (k->private_mem_size > 0)
+        add_kernel_warning(k, "uses %llu bytes of private memory per work-item, "
+                           "which may be registers spilled to memory",
+                           (unsigned long long) k->private_mem_size);
+    if (reqd[0] != 0 && reqd[0] * reqd[1] * reqd[2] > k->work_group_size)
+        add_kernel_warning(k, "requires work-groups of %lux%lux%lu but can only run %lu work-items per group",
+                           (unsigned long) reqd[0], (unsigned long) reqd[1], (unsigned long) reqd[2],
+                           (unsigned long) k->work_group_size);
+    else if (k->work_group_size < limits->max_work_group_size)
+        add_kernel_warning(k, "can only run %lu work-items per group (the device allows %lu), "
+                           "which suggests high register use",
+                           (unsigned long) k->work_group_size, (unsigned long) limits->max_work_group_size);
+    if (k->local_mem_size > limits->local_mem_size)
+        add_kernel_warning(k, "uses %llu bytes of local memory, more than the device's %llu",
+                           (unsigned long long) k->local_mem_size,
+                           (unsigned long long) limits->local_mem_size);
+    else if (k->local_mem_size > limits->local_mem_size / 2)
+        add_kernel_warning(k, "uses %llu bytes of local memory, so only one work-group "
+                           "fits on a compute unit at a time",
+                           (unsigned long long) k->local_mem_size);
+}
+
+/* Queries the attributes of every kernel in a built program, and checks
+ * them with check_kernel. The number of kernels is stored in *num_kernels,
+ * and the dynamically allocated array is returned (NULL if there are
+ * none). Use free_kernels to free it.
+ */
+static kernel_info *query_kernels(cl_program program, cl_device_id device, cl_uint *num_kernels)
+{
+    cl_kernel *kernels;
+    kernel_info *info;
+    cl_uint n, i;
+    cl_int status;
+    device_limits limits;
+    phase_timer timer;
+
+    phase_begin(&timer);
+    get_device_limits(device, &limits);
+    status = clCreateKernelsInProgram(program, 0, NULL, &n);
+    if (status != CL_SUCCESS)
+        die_cl(status, 1, "Failed to query number of kernels");
+    *num_kernels = n;
+    if (n == 0)
+    {
+        phase_end(&timer, "kernel info", NULL);
+        return NULL;
+    }
+    kernels = (cl_kernel *) onlineclc_malloc(n * sizeof(cl_kernel), "kernels");
+    info = (kernel_info *) onlineclc_malloc(n * sizeof(kernel_info), "kernel info");
+    status = clCreateKernelsInProgram(program, n, kernels, NULL);
+    if (status != CL_SUCCESS)
+        die_cl(status, 1, "Failed to create kernels");
+    for (i = 0; i < n; i++)
+    {
+        size_t name_len;
+
+        status = clGetKernelInfo(kernels[i], CL_KERNEL_FUNCTION_NAME, 0, NULL, &name_len);
+        if (status != CL_SUCCESS)
+            die_cl(status, 1, "Failed to query kernel name");
+        info[i].name = (char *) onlineclc_malloc(name_len + 1, "a kernel name");
+        status = clGetKernelInfo(kernels[i], CL_KERNEL_FUNCTION_NAME, name_len, info[i].name, NULL);
+        if (status != CL_SUCCESS)
+            die_cl(status, 1, "Failed to query kernel name");
+        info[i].name[name_len] = '\0';
+        get_kernel_work_group_info(kernels[i], device, CL_KERNEL_WORK_GROUP_SIZE,
+                                   sizeof(size_t), &info[i].work_group_size);
+        get_kernel_work_group_info(kernels[i], device, CL_KERNEL_COMPILE_WORK_GROUP_SIZE,
+                                   3 * sizeof(size_t), info[i].compile_work_group_size);
+        get_kernel_work_group_info(kernels[i], device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+                                   sizeof(size_t), &info[i].preferred_multiple);
+        get_kernel_work_group_info(kernels[i], device, CL_KERNEL_LOCAL_MEM_SIZE,
+                                   sizeof(cl_ulong), &info[i].local_mem_size);
+        get_kernel_work_group_info(kernels[i], device, CL_KERNEL_PRIVATE_MEM_SIZE,
+                                   sizeof(cl_ulong), &info[i].private_mem_size);
+        check_kernel(&info[i], &limits);
+        clReleaseKernel(kernels[i]);
+    }
+    free(kernels);
+    phase_end(&timer, "kernel info", NULL);
+    return info;
+}
+
+static void free_kernels(kernel_info *kernels, cl_uint num_kernels)
+{
+    cl_uint i;
+    unsigned int j;
+
+    for (i = 0; i < num_kernels; i++)
+    {
+        free(kernels[i].name);
+        for (j = 0; j < kernels[i].num_warnings; j++)
+            free(kernels[i].warnings[j]);
+    }
+    free(kernels);
+}
+
+/* Appends a CSV field, quoted if it needs to be */
+static void buffer_append_csv_field(string_buffer *buf, const char *field)
+{
+    if (strpbrk(field, ",\"\r\n") == NULL)
+    {
+        buffer_append(buf, field, strlen(field));
+        return;
+    }
+    buffer_append(buf, "\"", 1);
+    for (; *field != '\0'; field++)
+    {
+        if (*field == '"')
+            buffer_append(buf, "\"", 1);
+        buffer_append(buf, field, 1);
+    }
+    buffer_append(buf, "\"", 1);
+}
+
+/* Header of the kernel columns written by format_kernel_csv */
+#define KERNEL_CSV_COLUMNS "kernel,work_group_size,compile_work_group_size," \
+    "preferred_work_group_size_multiple,local_mem_size,private_mem_size,warnings"
+
+/* Appends the attributes of a kernel as CSV fields (or empty fields, for
+ * NULL). The warnings are joined with "; ".
+ */
+static void format_kernel_csv(string_buffer *buf, const kernel_info *k)
+{
+    string_buffer warnings = { NULL, 0, 0 };
+    unsigned int i;
+
+    if (k == NULL)
+    {
+        buffer_printf(buf, ",,,,,,");
+        return;
+    }
+    buffer_append_csv_field(buf, k->name);
+    buffer_printf(buf, ",%lu,", (unsigned long) k->work_group_size);
+    if (k->compile_work_group_size[0] != 0)
+        buffer_printf(buf, "%lux%lux%lu", (unsigned long) k->compile_work_group_size[0],
+                      (unsigned long) k->compile_work_group_size[1],
+                      (unsigned long) k->compile_work_group_size[2]);
+    buffer_printf(buf, ",%lu,%llu,%llu,", (unsigned long) k->preferred_multiple,
+                  (unsigned long long) k->local_mem_size,
+                  (unsigned long long) k->private_mem_size);
+    for (i = 0; i < k->num_warnings; i++)
+        buffer_printf(&warnings, "%s%s", i > 0 ? "; " : "", k->warnings[i]);
+    buffer_append_csv_field(buf, warnings.data != NULL ? warnings.data : "");
+    free(warnings.data);
+}
+
+/* Appends the attributes of the kernels as a JSON array */
+static void format_kernels_json(string_buffer *buf, const kernel_info *kernels, cl_uint num_kernels,
+                                const char *indent)
+{
+    cl_uint i;
+    unsigned int j;
+
+    buffer_printf(buf, "[");
+    for (i = 0; i < num_kernels; i++)
+    {
+        const kernel_info *k = &kernels[i];
+
+        buffer_printf(buf, "%s\n%s  {\"name\": ", i > 0 ? "," : "", indent);
+        buffer_append_json_string(buf, k->name);
+        buffer_printf(buf, ", \"work_group_size\": %lu, \"compile_work_group_size\": [%lu, %lu, %lu], "
+                      "\"preferred_work_group_size_multiple\": %lu, "
+                      "\"local_mem_size\": %llu, \"private_mem_size\": %llu",
+                      (unsigned long) k->work_group_size,
+                      (unsigned long) k->compile_work_group_size[0],
+                      (unsigned long) k->compile_work_group_size[1],
+                      (unsigned long) k->compile_work_group_size[2],
+                      (unsigned long) k->preferred_multiple,
+                      (unsigned long long) k->local_mem_size,
+                      (unsigned long long) k->private_mem_size);
+        buffer_printf(buf, ", \"warnings\": [");
+        for (j = 0; j < k->num_warnings; j++)
+        {
+            if (j > 0)
+                buffer_printf(buf, ", ");
+            buffer_append_json_string(buf, k->warnings[j]);
+        }
+        buffer_printf(buf, "]}");
+    }
+    buffer_printf(buf, num_kernels > 0 ? "\n%s]" : "]", indent);
+}
+
+
+/* Thread body for --all-devices mode: builds the source for all the devices
+ * of one platform with a single clBuildProgram call, and collects the log and
+ * binary for each.
+ */
+static void *platform_build_worker(void *arg)
+{
+    platform_build *pb = (platform_build *) arg;
+    cl_device_id *devices;
+    cl_context ctx;
+    cl_program program;
+    build_usage used;
+    cl_int build_status;
+    cl_uint i;
+
+    devices = (cl_device_id *) onlineclc_malloc(pb->num_builds * sizeof(cl_device_id), "device IDs");
+    for (i = 0; i < pb->num_builds; i++)
+        devices[i] = pb->builds[i]->device;
+    ctx = create_context_devices(pb->num_builds, devices);
+    if (create_program(ctx, pb->options, pb->options->source_filename, pb->src, &program) != CL_SUCCESS)
+        terminate(1);
+    build_status = build_or_compile(program, pb->num_builds, devices, pb->src->name, pb->options, &used);
+    if (build_status == BUILD_ERROR)
+        terminate(1);
+
+    for (i = 0; i < pb->num_builds; i++)
+    {
+        device_build *build = pb->builds[i];
+        cl_build_status device_status;
+        cl_int status;
+
+        status = clGetProgramBuildInfo(program, build->device, CL_PROGRAM_BUILD_STATUS,
+                                       sizeof(device_status), &device_status, NULL);
+        if (status != CL_SUCCESS)
+            die_cl(status, 1, "Failed to query build status");
+        if (build_status == BUILD_TIMED_OUT)
+            build->status = BUILD_TIMED_OUT;
+        else
+            build->status = device_status == CL_BUILD_SUCCESS ? CL_SUCCESS : CL_BUILD_PROGRAM_FAILURE;
+        if (get_build_log(program, build->device, &build->log, &build->log_len) != CL_SUCCESS)
+            terminate(1);
+        build->used = used;
+        if (build->status == CL_SUCCESS
+            && get_device_binary(program, build->device, &build->binary, &build->binary_size) != CL_SUCCESS)
+            terminate(1);
+    }
+
+    clReleaseProgram(program);
+    clReleaseContext(ctx);
+    free(devices);
+    return NULL;
+}
+
+/* Compiles the source for every device matching -b (or every device), and
+ * writes the binary for device n to the output filename with .n appended
+ * (or all of them to the output file, with --emit fat). Devices on the same
+ * platform are built in one clBuildProgram call, and the
+ * platforms are built concurrently. The device names are listed along with
+ * their build logs. Returns the process exit code.
+ */
+static int run_all_devices(const compiler_options *options)
+{
+    cl_device_id *devices;
+    cl_uint num_devices, i, j;
+    device_build *builds;
+    platform_build *platforms;
+    pthread_t *threads;
+    cl_uint num_platforms = 0;
+    cache_key *keys = NULL;
+    source_text src;
+    dependency_list deps;
+    fat_entry *fat = NULL;
+    size_t num_fat = 0;
+    int scan = options->cache_dir != NULL || options->depfile;
+    int ret = 0;
+
+    ret = find_devices(options->machine, options->cache_dir, &devices, &num_devices);
+    if (ret != 0)
+        terminate(ret);
+    if (options->emit == EMIT_FAT)
+        fat = (fat_entry *) onlineclc_malloc(num_devices * sizeof(fat_entry), "fat binary entries");
+    load_source(&src, options->source_filename);
+    if (scan && find_dependencies(&deps, options, options->source_filename, &src) != 0)
+        terminate(1);
+    builds = (device_build *) onlineclc_malloc(num_devices * sizeof(device_build), "builds");
+    if (options->cache_dir != NULL)
+        keys = (cache_key *) onlineclc_malloc(num_devices * sizeof(cache_key), "cache keys");
+
+    for (i = 0; i < num_devices; i++)
+    {
+        device_build *build = &builds[i];
+        build->device = devices[i];
+        build->cached = 0;
+        build->log = NULL;
+        build->log_len = 0;
+        build->binary = NULL;
+        build->binary_size = 0;
+        if (keys != NULL)
+        {
+            if (compute_cache_key(&keys[i], devices[i], options, options->source_filename, &src, &deps)
+                != CL_SUCCESS)
+                terminate(1);
+            build->cached = cache_lookup(options->cache_dir, &keys[i], &build->log, &build->log_len,
+                                         &build->binary, &build->binary_size);
+            build->status = CL_SUCCESS;
+        }
+    }
+
+    /* Group the remaining builds by platform */
+    platforms = (platform_build *) onlineclc_malloc(num_devices * sizeof(platform_build), "platforms");
+    for (i = 0; i < num_devices; i++)
+    {
+        cl_platform_id platform;
+
+        if (builds[i].cached)
+            continue;
+        platform = device_platform(devices[i]);
+        for (j = 0; j < num_platforms; j++)
+            if (device_platform(platforms[j].builds[0]->device) == platform)
+                break;
+        if (j == num_platforms)
+        {
+            platforms[j].options = options;
+            platforms[j].src = &src;
+            platforms[j].builds = (device_build **) onlineclc_malloc(
+                num_devices * sizeof(device_build *), "builds");
+            platforms[j].num_builds = 0;
+            num_platforms++;
+        }
+        platforms[j].builds[platforms[j].num_builds++] = &builds[i];
+    }
+
+    threads = (pthread_t *) onlineclc_malloc((num_platforms + 1) * sizeof(pthread_t), "threads");
+    for (j = 0; j < num_platforms; j++)
+    {
+        int status = pthread_create(&threads[j], NULL, platform_build_worker, &platforms[j]);
+        if (status != 0)
+        {
+            errno = status;
+            pdie(1, "Failed to create thread");
+        }
+    }
+    for (j = 0; j < num_platforms; j++)
+    {
+        pthread_join(threads[j], NULL);
+        free(platforms[j].builds);
+    }
+    free(threads);
+    free(platforms);
+    free_source(&src);
+
+    for (i = 0; i < num_devices; i++)
+    {
+        device_build *build = &builds[i];
+        char *name = device_string(build->device, CL_DEVICE_NAME);
+
+        fprintf(stderr, "Device %u: %s\n", (unsigned int) i, name);
+        free(name);
+        write_build_log(stderr, build->log, build->log_len);
+        if (options->build_stats && !build->cached)
+            write_build_usage(stderr, &build->used);
+        if (build->status != CL_SUCCESS)
+            ret = build->status == BUILD_TIMED_OUT || ret == EXIT_TIMED_OUT ? EXIT_TIMED_OUT : 1;
+        else
+        {
+            if (keys != NULL && !build->cached)
+                cache_store(options, &keys[i], build->log, build->log_len,
+                            build->binary, build->binary_size);
+            if (options->output_filename != NULL && options->emit == EMIT_FAT)
+            {
+                fat_entry *entry = &fat[num_fat++];
+
+                get_binary_metadata(&entry->meta, build->device);
+                entry->options = options->options;
+                entry->binary = build->binary;
+                entry->size = build->binary_size;
+            }
+            else if (options->output_filename != NULL)
+                write_program_file(options, build->device, options->output_filename, (int) i,
+                                   build->binary, build->binary_size);
+        }
+        free(build->log);
+    }
+    if (ret == 0 && fat != NULL)
+        write_fat_file(options->output_filename, fat, num_fat);
+    for (i = 0; i < num_fat; i++)
+        free_binary_metadata(&fat[i].meta);
+    free(fat);
+    for (i = 0; i < num_devices; i++)
+        free(builds[i].binary);
+    if (ret == 0 && options->depfile)
+    {
+        /* Every per-device binary depends on the headers */
+        char **targets = NULL;
+        size_t num_targets = num_devices;
+
+        if (options->output_filename != NULL && options->emit == EMIT_FAT)
+        {
+            num_targets = 1;
+            targets = (char **) onlineclc_malloc(sizeof(char *), "targets");
+            targets[0] = onlineclc_strndup(options->output_filename, strlen(options->output_filename),
+                                            "a filename");
+        }
+        else if (options->output_filename != NULL)
+        {
+            targets = (char **) onlineclc_malloc(num_devices * sizeof(char *), "targets");
+            for (i = 0; i < num_devices; i++)
+            {
+                targets[i] = (char *) onlineclc_malloc(strlen(options->output_filename) + 16, "a filename");
+                sprintf(targets[i], "%s.%u", options->output_filename, (unsigned int) i);
+            }
+        }
+        write_depfile(options, options->output_filename, (const char * const *) targets, num_targets,
+                      options->source_filename, &deps);
+        for (i = 0; targets != NULL && i < num_targets; i++)
+            free(targets[i]);
+        free(targets);
+    }
+    if (scan)
+        free_dependencies(&deps);
+    free(builds);
+    free(keys);
+    free(devices);
+    return ret;
+}
+
+/* Reads a batch list from in. Each line holds a source filename, optionally
+ * followed by a tab and an output filename. Blank lines and lines starting
+ * with # are ignored. The number of entries is stored in *num_entries, and
+ * the dynamically allocated array of entries is returned (NULL if there are
+ * none). Use free_batch_list to free it.
+ */
+static batch_entry *read_batch_list(FILE *in, const char *list_filename, size_t *num_entries)
+{
+    batch_entry *entries = NULL;
+    size_t size = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    int c;
+
+    *num_entries = 0;
+    do
+    {
+        size_t len = 0;
+        char *tab;
+
+        while ((c = getc(in)) != EOF && c != '\n')
+        {
+            if (len + 1 >= line_size)
+            {
+                line_size = line_size == 0 ? 256 : 2 * line_size;
+                line = (char *) realloc(line, line_size);
+                if (line == NULL)
+                    die(1, "Out of memory trying to allocate %zu bytes", line_size);
+            }
+            line[len++] = (char) c;
+        }
+        if (ferror(in))
+            pdie(1, "Failed to read `%s'", list_filename);
+        if (len > 0 && line[len - 1] == '\r')
+            len--;
+        if (len == 0 || line[0] == '#')
+            continue;
+        line[len] = '\0';
+
+        if (*num_entries == size)
+        {
+            size = size == 0 ? 64 : 2 * size;
+            entries = (batch_entry *) realloc(entries, size * sizeof(batch_entry));
+            if (entries == NULL)
+                die(1, "Out of memory trying to allocate %zu batch entries", size);
+        }
+        tab = strchr(line, '\t');
+        if (tab != NULL)
+        {
+            entries[*num_entries].source_filename =
+                onlineclc_strndup(line, tab - line, "batch list");
+            entries[*num_entries].output_filename =
+                onlineclc_strndup(tab + 1, strlen(tab + 1), "batch list");
+        }
+        else
+        {
+            entries[*num_entries].source_filename = onlineclc_strndup(line, len, "batch list");
+            entries[*num_entries].output_filename = NULL;
+        }
+        (*num_entries)++;
+    } while (c != EOF);
+
+    free(line);
+    return entries;
+}
+
+static void free_batch_list(batch_entry *entries, size_t num_entries)
+{
+    size_t i;
+    for (i = 0; i < num_entries; i++)
+    {
+        free(entries[i].source_filename);
+        free(entries[i].output_filename);
+    }
+    free(entries);
+}
+
+/* Returns the default number of concurrent builds: one per online CPU */
+static unsigned int default_jobs(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > 0)
+        return (unsigned int) cpus;
+#endif
+    return 1;
+}
+
+/* Thread body for batch mode. Repeatedly claims the next entry in the batch
+ * and builds it, until there are no entries left.
+ */
+static void *batch_worker(void *arg)
+{
+    batch *b = (batch *) arg;
+    int scan = b->options->cache_dir != NULL || b->options->depfile;
+
+    for (;;)
+    {
+        const batch_entry *entry;
+        source_text src;
+        dependency_list deps;
+        unsigned char *binary = NULL;
+        size_t binary_size;
+        cl_int status;
+
+        pthread_mutex_lock(&b->lock);
+        entry = b->next < b->num_entries ? &b->entries[b->next++] : NULL;
+        pthread_mutex_unlock(&b->lock);
+        if (entry == NULL)
+            break;
+
+        load_source(&src, entry->source_filename);
+        if (scan && find_dependencies(&deps, b->options, entry->source_filename, &src) != 0)
+            terminate(1);
+        status = compile_source(b->options, b->device, &b->ctx, entry->source_filename,
+                                &src, scan ? &deps : NULL, stderr,
+                                entry->output_filename != NULL ? &binary : NULL, &binary_size);
+        free_source(&src);
+        if (status == BUILD_ERROR)
+            terminate(1);
+        if (status == CL_SUCCESS)
+        {
+            if (entry->output_filename != NULL)
+                write_program_file(b->options, b->device, entry->output_filename, -1, binary, binary_size);
+            /* Without an output file, there is no target to give */
+            if (b->options->depfile && entry->output_filename != NULL)
+                write_depfile(b->options, entry->output_filename,
+                              (const char * const *) &entry->output_filename, 1,
+                              entry->source_filename, &deps);
+            free(binary);
+        }
+        else
+        {
+            pthread_mutex_lock(&b->lock);
+            if (status == BUILD_TIMED_OUT)
+                b->timed_out = 1;
+            else
+                b->failed = 1;
+            pthread_mutex_unlock(&b->lock);
+        }
+        if (scan)
+            free_dependencies(&deps);
+    }
+    return NULL;
+}
+
+/* Compiles every source in the batch list, sharing a single context, with up
+ * to options->jobs builds in flight at once. A source that fails to compile
+ * does not stop the others, but any other error kills the process. Returns
+ * the process exit code.
+ */
+static int run_batch(const compiler_options *options)
+{
+    batch b;
+    FILE *in;
+    pthread_t *threads;
+    unsigned int num_threads, i;
+    int status, ret;
+
+    if (0 == strcmp(options->batch_filename, "-"))
+        in = stdin;
+    else
+    {
+        in = fopen(options->batch_filename, "r");
+        if (in == NULL)
+            pdie(1, "Failed to open `%s'", options->batch_filename);
+    }
+    b.entries = read_batch_list(in, options->batch_filename, &b.num_entries);
+    if (in != stdin)
+        fclose(in);
+    if (b.num_entries == 0)
+        return 0;
+
+    b.options = options;
+    ret = find_device(options->machine, options->cache_dir, &b.device);
+    if (ret != 0)
+        terminate(ret);
+    b.ctx = create_context(b.device);
+    b.next = 0;
+    b.failed = 0;
+    b.timed_out = 0;
+    pthread_mutex_init(&b.lock, NULL);
+
+    num_threads = options->jobs != 0 ? options->jobs : default_jobs();
+    if (num_threads > b.num_entries)
+        num_threads = (unsigned int) b.num_entries;
+    threads = (pthread_t *) onlineclc_malloc(num_threads * sizeof(pthread_t), "threads");
+    for (i = 0; i < num_threads; i++)
+    {
+        status = pthread_create(&threads[i], NULL, batch_worker, &b);
+        if (status != 0)
+        {
+            errno = status;
+            pdie(1, "Failed to create thread");
+        }
+    }
+    for (i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+    pthread_mutex_destroy(&b.lock);
+    clReleaseContext(b.ctx);
+    free_batch_list(b.entries, b.num_entries);
+    return b.timed_out ? EXIT_TIMED_OUT : b.failed ? 1 : 0;
+}
+
+/* One combination of --sweep values */
+typedef struct
+{
+    /* The -D options for the combination, e.g. "-DTILE=8 -DUNROLL=2"
+     * (dynamically allocated)
+     */
+    char *defines;
+    /* A copy of the command-line options, with the defines added to
+     * options.options (which is dynamically allocated)
+     */
+    compiler_options options;
+    cl_int status;
+    double build_ms;
+    build_usage used;
+    /* Dynamically allocated build log, binary (NULL if the build failed)
+     * and kernel attributes
+     */
+    char *log;
+    size_t log_len;
+    unsigned char *binary;
+    size_t binary_size;
+    kernel_info *kernels;
+    cl_uint num_kernels;
+} sweep_variant;
+
+/* Work shared between the threads building the variants of a sweep. Only
+ * next is mutable, and it is protected by lock; each variant is written only
+ * by the thread that claimed it.
+ */
+typedef struct
+{
+    cl_device_id device;
+    cl_context ctx;
+    const source_text *src;
+    sweep_variant *variants;
+    size_t num_variants;
+    size_t next;
+    pthread_mutex_t lock;
+} sweep;
+
+/* The most variants that a sweep may have */
+#define MAX_SWEEP_VARIANTS 65536
+
+/* Expands the --sweep arguments into the full matrix of variants, with the
+ * last --sweep varying fastest. The number of variants is stored in
+ * *num_variants, and the dynamically allocated array is returned.
+ */
+static sweep_variant *make_sweep_variants(const compiler_options *options, size_t *num_variants)
+{
+    size_t n = 1, i, j;
+    size_t *counts;
+    sweep_variant *variants;
+
+    counts = (size_t *) onlineclc_malloc(options->num_sweeps * sizeof(size_t), "sweeps");
+    for (i = 0; i < options->num_sweeps; i++)
+    {
+        const char *p;
+
+        counts[i] = 1;
+        for (p = strchr(options->sweeps[i], '=') + 1; *p != '\0'; p++)
+            if (*p == ',')
+                counts[i]++;
+        if (n * counts[i] > MAX_SWEEP_VARIANTS)
+            die(2, "--sweep makes more than %d variants", MAX_SWEEP_VARIANTS);
+        n *= counts[i];
+    }
+
+    variants = (sweep_variant *) onlineclc_malloc(n * sizeof(sweep_variant), "variants");
+    for (j = 0; j < n; j++)
+    {
+        sweep_variant *v = &variants[j];
+        string_buffer defines = { NULL, 0, 0 };
+        string_buffer all = { NULL, 0, 0 };
+        size_t rest = j;
+
+        /* Pick the value of each sweep, by digits of j in mixed radix */
+        for (i = options->num_sweeps; i-- > 0; )
+        {
+            const char *sweep = options->sweeps[i];
+            const char *eq = strchr(sweep, '=');
+            const char *value = eq + 1;
+            size_t k, value_len;
+            string_buffer define = { NULL, 0, 0 };
+
+            for (k = 0; k < rest % counts[i]; k++)
+                value = strchr(value, ',') + 1;
+            value_len = strcspn(value, ",");
+            buffer_printf(&define, "-D%.*s=%.*s", (int) (eq - sweep), sweep, (int) value_len, value);
+            if (defines.len > 0)
+                buffer_append(&define, " ", 1);
+            buffer_append(&define, defines.data != NULL ? defines.data : "", defines.len);
+            free(defines.data);
+            defines = define;
+            rest /= counts[i];
+        }
+        v->defines = defines.data;
+        v->options = *options;
+        if (options->len > 0)
+        {
+            buffer_append(&all, options->options, options->len);
+            buffer_append(&all, " ", 1);
+        }
+        buffer_append(&all, v->defines, defines.len);
+        v->options.options = all.data;
+        v->options.len = all.len;
+        v->options.size = all.size;
+        v->status = CL_SUCCESS;
+        v->build_ms = 0.0;
+        v->used.cpu_ms = 0.0;
+        v->used.peak_rss = 0;
+        v->used.shared = 0;
+        v->log = NULL;
+        v->log_len = 0;
+        v->binary = NULL;
+        v->binary_size = 0;
+        v->kernels = NULL;
+        v->num_kernels = 0;
+    }
+    free(counts);
+    *num_variants = n;
+    return variants;
+}
+
+/* Thread body for --sweep. Repeatedly claims the next variant and builds it,
+ * until there are none left.
+ */
+static void *sweep_worker(void *arg)
+{
+    sweep *sw = (sweep *) arg;
+
+    for (;;)
+    {
+        sweep_variant *v;
+        cl_program program;
+        struct timespec start, end;
+
+        pthread_mutex_lock(&sw->lock);
+        v = sw->next < sw->num_variants ? &sw->variants[sw->next++] : NULL;
+        pthread_mutex_unlock(&sw->lock);
+        if (v == NULL)
+            break;
+
+        if (create_program(sw->ctx, &v->options, v->options.source_filename, sw->src, &program) != CL_SUCCESS)
+            terminate(1);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        v->status = build_or_compile(program, 1, &sw->device, sw->src->name, &v->options, &v->used);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        v->build_ms = elapsed_us(&start, &end) / 1000.0;
+        if (v->status == BUILD_ERROR || get_build_log(program, sw->device, &v->log, &v->log_len) != CL_SUCCESS)
+            terminate(1);
+        if (v->status == CL_SUCCESS)
+        {
+            if (get_device_binary(program, sw->device, &v->binary, &v->binary_size) != CL_SUCCESS)
+                terminate(1);
+            v->kernels = query_kernels(program, sw->device, &v->num_kernels);
+        }
+        clReleaseProgram(program);
+    }
+    return NULL;
+}
+
+static const char *sweep_status(cl_int status)
+{
+    return status == CL_SUCCESS ? "ok" : status == BUILD_TIMED_OUT ? "timeout" : "failed";
+}
+
+/* Formats the sweep as CSV, with a row per kernel of each variant (or a
+ * single row without kernel columns for a variant that failed or has no
+ * kernels).
+ */
+static void format_sweep_csv(string_buffer *buf, const sweep_variant *variants, size_t num_variants)
+{
+    size_t i;
+    cl_uint j;
+
+    buffer_printf(buf, "variant,options,status,build_ms,cpu_ms,peak_rss_mb,binary_size," KERNEL_CSV_COLUMNS "\n");
+    for (i = 0; i < num_variants; i++)
+    {
+        const sweep_variant *v = &variants[i];
+
+        for (j = 0; j < v->num_kernels || (j == 0 && v->num_kernels == 0); j++)
+        {
+            buffer_printf(buf, "%lu,", (unsigned long) i);
+            buffer_append_csv_field(buf, v->defines);
+            buffer_printf(buf, ",%s,%.3f,%.3f,%.1f,%lu,", sweep_status(v->status),
+                          v->build_ms, v->used.cpu_ms, v->used.peak_rss / (1024.0 * 1024.0),
+                          (unsigned long) v->binary_size);
+            format_kernel_csv(buf, j < v->num_kernels ? &v->kernels[j] : NULL);
+            buffer_append(buf, "\n", 1);
+        }
+    }
+}
+
+static void format_sweep_json(string_buffer *buf, const char *source_name, const char *device_name,
+                              const sweep_variant *variants, size_t num_variants)
+{
+    size_t i;
+
+    buffer_printf(buf, "{\n  \"source\": ");
+    buffer_append_json_string(buf, source_name);
+    buffer_printf(buf, ",\n  \"device\": ");
+    buffer_append_json_string(buf, device_name);
+    buffer_printf(buf, ",\n  \"variants\": [");
+    for (i = 0; i < num_variants; i++)
+    {
+        const sweep_variant *v = &variants[i];
+
+        buffer_printf(buf, "%s\n    {\n      \"variant\": %lu,\n      \"options\": ",
+                      i > 0 ? "," : "", (unsigned long) i);
+        buffer_append_json_string(buf, v->defines);
+        buffer_printf(buf, ",\n      \"status\": \"%s\",\n      \"build_ms\": %.3f,\n"
+                      "      \"cpu_ms\": %.3f,\n      \"peak_rss\": %llu,\n"
+                      "      \"binary_size\": %lu,\n      \"kernels\": ",
+                      sweep_status(v->status), v->build_ms,
+                      v->used.cpu_ms, v->used.peak_rss, (unsigned long) v->binary_size);
+        format_kernels_json(buf, v->kernels, v->num_kernels, "      ");
+        buffer_printf(buf, "\n    }");
+    }
+    buffer_printf(buf, "\n  ]\n}\n");
+}
+
+/* Builds every variant of the --sweep matrix from the one source, sharing a
+ * single context, with up to options->jobs builds in flight at once. The
+ * build logs are listed by variant, the binary for variant n is written to
+ * the output filename with .n appended (or all of them to the output file,
+ * with --emit fat), and the build time, binary size and
+ * kernel attributes of each variant are written to the report. Variants are
+ * never taken from the cache, so that the times are those of real builds.
+ * Returns the process exit code.
+ */
+static int run_sweep(const compiler_options *options)
+{
+    sweep sw;
+    source_text src;
+    pthread_t *threads;
+    unsigned int num_threads, i;
+    string_buffer report = { NULL, 0, 0 };
+    char *device_name;
+    fat_entry *fat = NULL;
+    size_t num_fat = 0;
+    int ret = 0;
+    int status;
+
+    sw.variants = make_sweep_variants(options, &sw.num_variants);
+    if (options->emit == EMIT_FAT)
+        fat = (fat_entry *) onlineclc_malloc(sw.num_variants * sizeof(fat_entry), "fat binary entries");
+    ret = find_device(options->machine, options->cache_dir, &sw.device);
+    if (ret != 0)
+        terminate(ret);
+    sw.ctx = create_context(sw.device);
+    load_source(&src, options->source_filename);
+    sw.src = &src;
+    sw.next = 0;
+    pthread_mutex_init(&sw.lock, NULL);
+
+    num_threads = options->jobs != 0 ? options->jobs : default_jobs();
+    if (num_threads > sw.num_variants)
+        num_threads = (unsigned int) sw.num_variants;
+    threads = (pthread_t *) onlineclc_malloc(num_threads * sizeof(pthread_t), "threads");
+    for (i = 0; i < num_threads; i++)
+    {
+        status = pthread_create(&threads[i], NULL, sweep_worker, &sw);
+        if (status != 0)
+        {
+            errno = status;
+            pdie(1, "Failed to create thread");
+        }
+    }
+    for (i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&sw.lock);
+
+    for (i = 0; i < sw.num_variants; i++)
+    {
+        const sweep_variant *v = &sw.variants[i];
+
+        fprintf(stderr, "Variant %u: %s\n", i, v->defines);
+        write_build_log(stderr, v->log, v->log_len);
+        if (options->build_stats)
+            write_build_usage(stderr, &v->used);
+        if (v->status != CL_SUCCESS)
+            ret = v->status == BUILD_TIMED_OUT || ret == EXIT_TIMED_OUT ? EXIT_TIMED_OUT : 1;
+        else if (options->output_filename != NULL && fat != NULL)
+        {
+            fat_entry *entry = &fat[num_fat++];
+
+            get_binary_metadata(&entry->meta, sw.device);
+            entry->options = v->options.options;
+            entry->binary = v->binary;
+            entry->size = v->binary_size;
+        }
+        else if (options->output_filename != NULL)
+            write_program_file(options, sw.device, options->output_filename, (int) i,
+                               v->binary, v->binary_size);
+    }
+    if (ret == 0 && fat != NULL)
+        write_fat_file(options->output_filename, fat, num_fat);
+    for (i = 0; i < num_fat; i++)
+        free_binary_metadata(&fat[i].meta);
+    free(fat);
+
+    device_name = device_string(sw.device, CL_DEVICE_NAME);
+    if (options->report_json)
+        format_sweep_json(&report, src.name, device_name, sw.variants, sw.num_variants);
+    else
+        format_sweep_csv(&report, sw.variants, sw.num_variants);
+    write_binary_file(options->report_filename != NULL ? options->report_filename : "-",
+                      (const unsigned char *) report.data, report.len);
+    free(report.data);
+    free(device_name);
+
+    for (i = 0; i < sw.num_variants; i++)
+    {
+        sweep_variant *v = &sw.variants[i];
+
+        free(v->defines);
+        free(v->options.options);
+        free(v->log);
+        free(v->binary);
+        free_kernels(v->kernels, v->num_kernels);
+    }
+    free(sw.variants);
+    free_source(&src);
+    clReleaseContext(sw.ctx);
+    return ret;
+}
+
+/* Determines whether a --link input is a source to compile first, rather
+ * than an object from -c
+ */
+static int is_source_input(const char *filename)
+{
+    size_t len = strlen(filename);
+    return 0 == strcmp(filename, "-") || (len > 3 && 0 == strcmp(filename + len - 3, ".cl"));
+}
+
+/* Loads a binary for device into a program, killing the process on failure */
+static cl_program program_from_binary(cl_context ctx, cl_device_id device, const char *filename,
+                                      const unsigned char *binary, size_t size)
+{
+    cl_int status, binary_status;
+    cl_program program;
+    phase_timer timer;
+
+    phase_begin(&timer);
+    program = clCreateProgramWithBinary(ctx, 1, &device, &size, &binary, &binary_status, &status);
+    if (status == CL_SUCCESS)
+        status = binary_status;
+    if (status != CL_SUCCESS)
+        die_cl(status, 1, "Failed to load binary from `%s'", filename);
+    phase_end(&timer, "create program", filename);
+    return program;
+}
+
+/* Loads an object file written by -c into a program */
+static cl_program load_object(cl_context ctx, cl_device_id device, const char *filename)
+{
+    source_text obj;
+    unsigned char *data;
+    cl_program program;
+    size_t i, pos = 0;
+
+    load_source(&obj, filename);
+    if (obj.len == 0)
+        die(1, "`%s' is empty", filename);
+    /* A binary must be contiguous, so join the chunks read from a pipe */
+    if (obj.num_chunks == 1)
+        program = program_from_binary(ctx, device, filename, (const unsigned char *) obj.chunks[0], obj.len);
+    else
+    {
+        data = (unsigned char *) onlineclc_malloc(obj.len, "the object");
+        for (i = 0; i < obj.num_chunks; i++)
+        {
+            memcpy(data + pos, obj.chunks[i], obj.chunk_lens[i]);
+            pos += obj.chunk_lens[i];
+        }
+        program = program_from_binary(ctx, device, filename, data, obj.len);
+        free(data);
+    }
+    free_source(&obj);
+    return program;
+}
+
+/* Links the --link inputs into one program for a single device. Sources
+ * among them are compiled first, as with -c, so with a cache only the
+ * sources that changed are compiled again; objects from -c are used as
+ * they are. Returns the exit code.
+ */
+static int run_link(const compiler_options *options)
+{
+    compiler_options compile_options = *options;
+    cl_device_id device;
+    cl_context ctx;
+    cl_program *objects, program;
+    cl_int status;
+    char *log;
+    size_t log_len, i;
+    int failed = 0;
+    int slot, ret;
+    phase_timer timer;
+
+    compile_options.compile_only = 1;
+    ret = find_device(options->machine, options->cache_dir, &device);
+    if (ret != 0)
+        terminate(ret);
+    ctx = create_context(device);
+    objects = (cl_program *) onlineclc_malloc(options->num_inputs * sizeof(cl_program), "programs");
+    for (i = 0; i < options->num_inputs; i++)
     {
-    case '!':
-    case '#':
-    case '%':
-    case '&':
-    case '\'':
-    case '(':
-    case ')':
-    case '*':
-    case '+':
-    case ',':
-    case '-':
-    case '.':
-    case '/':
-    case ':':
-    case ';':
-    case '<':
-    case '=':
-    case '>':
-    case '[':
-    case ']':
-    case '^':
-    case '_':
-    case '{':
-    case '|':
-    case '}':
-    case '~':
-    case ' ':
-    case '\t':
-    case '\v':
-    case '\f':
+        const char *input = options->inputs[i];
+
+        if (is_source_input(input))
+        {
+            source_text src;
+            dependency_list deps;
+            unsigned char *binary;
+            size_t binary_size;
+
+            load_source(&src, input);
+            if (options->cache_dir != NULL && find_dependencies(&deps, options, input, &src) != 0)
+                terminate(1);
+            status = compile_source(&compile_options, device, &ctx, input, &src,
+                                    options->cache_dir != NULL ? &deps : NULL, stderr,
+                                    &binary, &binary_size);
+            if (options->cache_dir != NULL)
+                free_dependencies(&deps);
+            free_source(&src);
+            if (status == BUILD_ERROR)
+                terminate(1);
+            if (status != CL_SUCCESS)
+            {
+                /* Carry on, to report the errors in the other sources */
+                failed = 1;
+                objects[i] = NULL;
+                continue;
+            }
+            objects[i] = program_from_binary(ctx, device, input, binary, binary_size);
+            free(binary);
+        }
+        else
+            objects[i] = load_object(ctx, device, input);
+    }
+
+    if (!failed)
+    {
+        slot = jobserver_acquire();
+        phase_begin(&timer);
+        program = clLinkProgram(ctx, 1, &device, options->link_options != NULL ? options->link_options : "",
+                                (cl_uint) options->num_inputs, objects, NULL, NULL, &status);
+        jobserver_release(slot);
+        if (status != CL_SUCCESS && status != CL_LINK_PROGRAM_FAILURE)
+            die_cl(status, 1, "Failed to link program");
+        phase_end(&timer, "link", NULL);
+        /* A failed link may or may not leave a program with a log */
+        if (program != NULL)
+        {
+            if (get_build_log(program, device, &log, &log_len) != CL_SUCCESS)
+                terminate(1);
+            write_build_log(stderr, log, log_len);
+            free(log);
+        }
+        if (status == CL_SUCCESS && options->output_filename != NULL)
+        {
+            unsigned char *binary;
+            size_t binary_size;
+
+            if (get_program_binary(program, &binary, &binary_size) != CL_SUCCESS)
+                terminate(1);
+            write_program_file(options, device, options->output_filename, -1, binary, binary_size);
+            free(binary);
+        }
+        failed = status != CL_SUCCESS;
+        if (program != NULL)
+            clReleaseProgram(program);
+    }
+
+    for (i = 0; i < options->num_inputs; i++)
+        if (objects[i] != NULL)
+            clReleaseProgram(objects[i]);
+    free(objects);
+    clReleaseContext(ctx);
+    return failed ? 1 : 0;
+}
+
+/* Shows the attributes of each kernel for --kernel-info, with the warnings
+ * from check_kernel, and writes them to the --report file if one was given.
+ * The binary is loaded back into a program, so that a binary from the cache
+ * can be inspected in the same way as one just built.
+ */
+static void show_kernel_info(const compiler_options *options, cl_device_id device, cl_context *ctx,
+                             const char *source_name, const unsigned char *binary, size_t binary_size)
+{
+    cl_program program;
+    kernel_info *kernels;
+    cl_uint num_kernels, i;
+    unsigned int j;
+    device_limits limits;
+
+    if (*ctx == NULL)
+        *ctx = create_context(device);
+    program = program_from_binary(*ctx, device, source_name, binary, binary_size);
+    if (build_program(program, 1, &device, source_name, options, NULL) != CL_SUCCESS)
+        die(1, "Failed to load the binary built from `%s'", source_name);
+    kernels = query_kernels(program, device, &num_kernels);
+    clReleaseProgram(program);
+
+    for (i = 0; i < num_kernels; i++)
+    {
+        const kernel_info *k = &kernels[i];
+
+        fprintf(stderr, "Kernel %s:\n", k->name);
+        fprintf(stderr, "    Work-group size:                    %lu\n", (unsigned long) k->work_group_size);
+        if (k->compile_work_group_size[0] != 0)
+            fprintf(stderr, "    Required work-group size:           %lux%lux%lu\n",
+                    (unsigned long) k->compile_work_group_size[0],
+                    (unsigned long) k->compile_work_group_size[1],
+                    (unsigned long) k->compile_work_group_size[2]);
+        fprintf(stderr, "    Preferred work-group size multiple: %lu\n", (unsigned long) k->preferred_multiple);
+        fprintf(stderr, "    Local memory:                       %llu bytes\n",
+                (unsigned long long) k->local_mem_size);
+        fprintf(stderr, "    Private memory:                     %llu bytes\n",
+                (unsigned long long) k->private_mem_size);
+        for (j = 0; j < k->num_warnings; j++)
+            fprintf(stderr, "Warning: kernel `%s' %s\n", k->name, k->warnings[j]);
+    }
+
+    if (options->report_filename != NULL)
+    {
+        string_buffer report = { NULL, 0, 0 };
+
+        if (options->report_json)
+        {
+            char *device_name = device_string(device, CL_DEVICE_NAME);
+
+            get_device_limits(device, &limits);
+            buffer_printf(&report, "{\n  \"source\": ");
+            buffer_append_json_string(&report, source_name);
+            buffer_printf(&report, ",\n  \"device\": ");
+            buffer_append_json_string(&report, device_name);
+            buffer_printf(&report, ",\n  \"max_work_group_size\": %lu,\n  \"local_mem_size\": %llu,\n"
+                          "  \"kernels\": ", (unsigned long) limits.max_work_group_size,
+                          (unsigned long long) limits.local_mem_size);
+            format_kernels_json(&report, kernels, num_kernels, "  ");
+            buffer_printf(&report, "\n}\n");
+            free(device_name);
+        }
+        else
+        {
+            buffer_printf(&report, KERNEL_CSV_COLUMNS "\n");
+            for (i = 0; i < num_kernels; i++)
+            {
+                format_kernel_csv(&report, &kernels[i]);
+                buffer_append(&report, "\n", 1);
+            }
+        }
+        write_binary_file(options->report_filename, (const unsigned char *) report.data, report.len);
+        free(report.data);
+    }
+    free_kernels(kernels, num_kernels);
+}
+
+/* Loading a binary that is not at least this many times faster than
+ * building from source suggests that the driver recompiles it
+ */
+#define MIN_BINARY_SPEEDUP 2.0
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Prints the median, minimum and maximum of times (which are sorted), and
+ * returns the median
+ */
+static double report_times(const char *label, double *times, unsigned int n)
+{
+    double median;
+
+    qsort(times, n, sizeof(double), compare_doubles);
+    median = n % 2 ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2;
+    fprintf(stderr, "%-14s %10.3f ms median, %.3f ms min, %.3f ms max over %u runs\n",
+            label, median, times[0], times[n - 1], n);
+    return median;
+}
+
+/* Implements --verify-binary: loads the binary built from src into a
+ * fresh context and checks that it builds as an executable, as an
+ * application loading it would. Then times options->verify_runs builds from
+ * source against as many loads of the binary, and reports the speedup,
+ * warning if there is little, since some drivers quietly recompile
+ * binaries. Kills the process if the binary does not load.
+ */
+static void verify_binary(const compiler_options *options, cl_device_id device, const source_text *src,
+                          const unsigned char *binary, size_t binary_size)
+{
+    cl_context ctx;
+    cl_program program;
+    cl_program_binary_type type;
+    cl_int status;
+    struct timespec start, end;
+    double *source_ms, *binary_ms;
+    double source_median, binary_median;
+    unsigned int i;
+
+    ctx = create_context(device);
+    program = program_from_binary(ctx, device, src->name, binary, binary_size);
+    if (build_program(program, 1, &device, src->name, options, NULL) != CL_SUCCESS)
+    {
+        size_t log_len;
+        char *log;
+
+        if (get_build_log(program, device, &log, &log_len) == CL_SUCCESS)
+            write_build_log(stderr, log, log_len);
+        die(1, "Failed to load the binary built from `%s'", src->name);
+    }
+    status = clGetProgramBuildInfo(program, device, CL_PROGRAM_BINARY_TYPE, sizeof(type), &type, NULL);
+    if (status != CL_SUCCESS)
+        die_cl(status, 1, "Failed to query binary type");
+    clReleaseProgram(program);
+    if (type != CL_PROGRAM_BINARY_TYPE_EXECUTABLE)
+        die(1, "The binary built from `%s' did not load as an executable", src->name);
+    fprintf(stderr, "Binary reload: OK\n");
+
+    /* Alternate the two, so that both see the same conditions */
+    source_ms = (double *) onlineclc_malloc(options->verify_runs * sizeof(double), "timings");
+    binary_ms = (double *) onlineclc_malloc(options->verify_runs * sizeof(double), "timings");
+    for (i = 0; i < options->verify_runs; i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (create_program(ctx, options, options->source_filename, src, &program) != CL_SUCCESS)
+            terminate(1);
+        if (build_program(program, 1, &device, src->name, options, NULL) != CL_SUCCESS)
+            die(1, "Failed to rebuild `%s'", src->name);
+        clReleaseProgram(program);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        source_ms[i] = elapsed_us(&start, &end) / 1000.0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        program = program_from_binary(ctx, device, src->name, binary, binary_size);
+        if (build_program(program, 1, &device, src->name, options, NULL) != CL_SUCCESS)
+            die(1, "Failed to load the binary built from `%s'", src->name);
+        clReleaseProgram(program);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        binary_ms[i] = elapsed_us(&start, &end) / 1000.0;
+    }
+    clReleaseContext(ctx);
+
+    source_median = report_times("Source build:", source_ms, options->verify_runs);
+    binary_median = report_times("Binary load:", binary_ms, options->verify_runs);
+    if (binary_median > 0.0)
+        fprintf(stderr, "Speedup: %.2fx\n", source_median / binary_median);
+    if (binary_median * MIN_BINARY_SPEEDUP > source_median)
+        fprintf(stderr, "Warning: loading the binary is less than %.0fx faster than building `%s' "
+                "from source; the driver may be recompiling it\n", MIN_BINARY_SPEEDUP, src->name);
+    free(source_ms);
+    free(binary_ms);
+}
+
+/* Device and context kept alive by the compile server, for one value of -b */
+typedef struct warm_device
+{
+    /* Dynamically allocated copy of the -b option, or NULL if not given */
+    char *machine;
+    cl_device_id device;
+    cl_context ctx;
+    struct warm_device *next;
+} warm_device;
+
+/* State of the compile server, shared by the request threads */
+typedef struct
+{
+    warm_device *devices;
+    /* Number of requests being handled, and the limit (-j) */
+    unsigned int active;
+    unsigned int max_active;
+    /* The server's --timeout, which applies to every request */
+    double timeout;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+} server;
+
+/* A request accepted by the server */
+typedef struct
+{
+    server *srv;
+    int fd;
+} server_request;
+
+/* Response to a request, filled in by serve_compile */
+typedef struct
+{
+    unsigned char *binary;   /* dynamically allocated, or NULL */
+    size_t binary_size;
+} server_response;
+
+/* What serve_compile holds for a request. It belongs to the server thread,
+ * so that it is released even if the request is trapped part way.
+ */
+typedef struct
+{
+    compiler_options options;
+    source_text src;
+    int have_src;
+    /* The source as the client sees it, for finding its headers */
+    char *source_path;
+    dependency_list deps;
+    server_response response;
+} server_work;
+
+/* The client/server protocol runs over a Unix socket, so everything is sent
+ * in native byte order. A request is an argument count, the arguments, the
+ * client's working directory, and the contents of the source file. A
+ * response is the exit code, the messages that would have gone to stderr,
+ * and the binary (empty if none). Strings and blobs are each preceded by a
+ * 32-bit length.
+ */
+#define SERVER_PROTOCOL_VERSION 2
+
+static int write_u32(int fd, uint32_t value)
+{
+    return write_all(fd, &value, sizeof(value));
+}
+
+static int write_blob(int fd, const void *data, size_t len)
+{
+    if (len > UINT32_MAX)
+    {
+        errno = EFBIG;
+        return -1;
+    }
+    if (write_u32(fd, (uint32_t) len) != 0)
+        return -1;
+    return write_all(fd, data, len);
+}
+
+/* Writes a source as a single blob, one chunk at a time */
+static int write_source(int fd, const source_text *src)
+{
+    size_t i;
+
+    if (src->len > UINT32_MAX)
+    {
+        errno = EFBIG;
+        return -1;
+    }
+    if (write_u32(fd, (uint32_t) src->len) != 0)
+        return -1;
+    for (i = 0; i < src->num_chunks; i++)
+        if (write_all(fd, src->chunks[i], src->chunk_lens[i]) != 0)
+            return -1;
+    return 0;
+}
+
+/* Reads a length-prefixed blob into a dynamically allocated buffer, with a
+ * NUL terminator appended. Returns NULL on failure.
+ */
+static char *read_blob(int fd, size_t *len)
+{
+    uint32_t len32;
+    char *data;
+
+    if (read_all(fd, &len32, sizeof(len32)) != 0)
+        return NULL;
+    data = (char *) malloc((size_t) len32 + 1);
+    if (data == NULL)
+        return NULL;
+    if (read_all(fd, data, len32) != 0)
+    {
+        free(data);
+        return NULL;
+    }
+    data[len32] = '\0';
+    *len = len32;
+    return data;
+}
+
+/* Returns the device and context for machine, creating them on first use */
+static warm_device *get_warm_device(server *srv, const char *machine)
+{
+    warm_device *cur;
+    cl_device_id device;
+    cl_context ctx;
+    int ret;
+
+    pthread_mutex_lock(&srv->lock);
+    for (cur = srv->devices; cur != NULL; cur = cur->next)
+        if (machine == NULL ? cur->machine == NULL
+            : cur->machine != NULL && 0 == strcmp(cur->machine, machine))
+            break;
+    pthread_mutex_unlock(&srv->lock);
+    if (cur != NULL)
+        return cur;
+
+    /* Create the context without holding the lock, since failure does not
+     * return. If another request beats us to it, ours is discarded.
+     */
+    /* Devices are found once per -b value, so the device map is not needed */
+    ret = find_device(machine, NULL, &device);
+    if (ret != 0)
+        terminate(ret);
+    ctx = create_context(device);
+
+    pthread_mutex_lock(&srv->lock);
+    for (cur = srv->devices; cur != NULL; cur = cur->next)
+        if (machine == NULL ? cur->machine == NULL
+            : cur->machine != NULL && 0 == strcmp(cur->machine, machine))
+            break;
+    if (cur == NULL)
+    {
+        cur = (warm_device *) malloc(sizeof(warm_device));
+        if (cur != NULL)
+        {
+            cur->machine = machine != NULL ? onlineclc_strndup(machine, strlen(machine), "device name") : NULL;
+            cur->device = device;
+            cur->ctx = ctx;
+            cur->next = srv->devices;
+            srv->devices = cur;
+            ctx = NULL;
+        }
+    }
+    pthread_mutex_unlock(&srv->lock);
+    if (ctx != NULL)
+        clReleaseContext(ctx);
+    if (cur == NULL)
+        die(1, "Out of memory trying to allocate %zu bytes", sizeof(warm_device));
+    return cur;
+}
+
+/* Compiles the source sent by a client. Messages go to the current message
+ * stream and errors terminate the request. What the request holds is kept
+ * in *work, to be released by free_server_work. Returns the exit code.
+ */
+static int serve_compile(
+    server *srv,
+    int argc,
+    const char * const *argv,
+    const char *cwd,
+    const char *source,
+    size_t source_len,
+    server_work *work)
+{
+    compiler_options *options = &work->options;
+    warm_device *warm;
+    cl_int status;
+    int ret;
+
+    process_options(options, argc, argv);
+    if (options->source_filename == NULL)
+        die(2, "The compile server only handles a single source file");
+    options->timeout = srv->timeout;
+    warm = get_warm_device(srv, options->machine);
+    ret = source_from_memory(&work->src, options->source_filename, source, source_len);
+    work->have_src = 1;
+    if (ret != 0)
         return 1;
-    default:
-        return 0;
+    /* The client writes any depfile, so headers only matter to the cache.
+     * Quoted includes are relative to the client's directory (standard input
+     * is taken to be a file there).
+     */
+    work->source_path = absolute_path(cwd, options->source_filename);
+    if (options->cache_dir != NULL
+        && find_dependencies(&work->deps, options, work->source_path, &work->src) != 0)
+        return 1;
+    status = compile_source(options, warm->device, &warm->ctx, options->source_filename,
+                            &work->src, options->cache_dir != NULL ? &work->deps : NULL, message_stream(),
+                            options->output_filename != NULL ? &work->response.binary : NULL,
+                            &work->response.binary_size);
+    return status == CL_SUCCESS ? 0 : status == BUILD_TIMED_OUT ? EXIT_TIMED_OUT : 1;
+}
+
+static void free_server_work(server_work *work)
+{
+    free_options(&work->options);
+    if (work->have_src)
+        free_source(&work->src);
+    free(work->source_path);
+    free_dependencies(&work->deps);
+    free(work->response.binary);
+}
+
+/* Runs serve_compile with its errors trapped, and returns the exit code.
+ * The setjmp is kept out of server_thread, whose locals change after it.
+ */
+static int trap_serve_compile(
+    diagnostics *diag,
+    server *srv,
+    int argc,
+    const char * const *argv,
+    const char *cwd,
+    const char *source,
+    size_t source_len,
+    server_work *work)
+{
+    int ret;
+
+    set_diagnostics(diag);
+    ret = setjmp(diag->trap);
+    if (ret == 0)
+        ret = serve_compile(srv, argc, argv, cwd, source, source_len, work);
+    else
+        ret--;
+    set_diagnostics(NULL);
+    return ret;
+}
+
+/* Thread body handling one client connection */
+static void *server_thread(void *arg)
+{
+    server_request *req = (server_request *) arg;
+    server *srv = req->srv;
+    uint32_t version, argc32, i;
+    char **argv = NULL;
+    char *cwd = NULL;
+    char *source = NULL;
+    size_t source_len, len;
+    diagnostics diag;
+    server_work work;
+    int ret;
+    char *messages = NULL;
+    size_t messages_len;
+
+    if (read_all(req->fd, &version, sizeof(version)) != 0
+        || version != SERVER_PROTOCOL_VERSION
+        || read_all(req->fd, &argc32, sizeof(argc32)) != 0
+        || argc32 == 0 || argc32 > 65536)
+        goto done;
+    argv = (char **) calloc(argc32 + 1, sizeof(char *));
+    if (argv == NULL)
+        goto done;
+    for (i = 0; i < argc32; i++)
+        if ((argv[i] = read_blob(req->fd, &len)) == NULL)
+            goto done;
+    if ((cwd = read_blob(req->fd, &len)) == NULL
+        || (source = read_blob(req->fd, &source_len)) == NULL)
+        goto done;
+
+    diag.messages = tmpfile();
+    if (diag.messages == NULL)
+        goto done;
+    /* All zero is safe to free, whenever the request stops */
+    memset(&work, 0, sizeof(work));
+    ret = trap_serve_compile(&diag, srv, (int) argc32, (const char * const *) argv,
+                             cwd, source, source_len, &work);
+
+    /* Collect the messages and send the response */
+    messages = read_messages(diag.messages, &messages_len);
+    fclose(diag.messages);
+    if (write_u32(req->fd, (uint32_t) ret) == 0
+        && write_blob(req->fd, messages, messages_len) == 0)
+        write_blob(req->fd, work.response.binary, work.response.binary_size);
+    free_server_work(&work);
+
+done:
+    if (argv != NULL)
+    {
+        for (i = 0; i < argc32; i++)
+            free(argv[i]);
+        free(argv);
     }
+    free(cwd);
+    free(source);
+    free(messages);
+    close(req->fd);
+    free(req);
+
+    pthread_mutex_lock(&srv->lock);
+    srv->active--;
+    pthread_cond_signal(&srv->idle);
+    pthread_mutex_unlock(&srv->lock);
+    return NULL;
 }
 
-/* Escapes a string so that it may appear between double quotes in OpenCL C.
- * The return value is dynamically allocated, and must be freed by the caller.
- *
- * Unsafe characters (e.g. double quotes) are escaped using an octal escape.
- * Hex escapes are avoided since they can gobble up following numbers.
+/* Fills in a socket address for path, killing the process if it is too long */
+static void make_socket_address(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+        die(2, "Socket path `%s' is too long", path);
+    strcpy(addr->sun_path, path);
+}
+
+/* Runs the compile server. It keeps a device and context alive for each
+ * value of -b that clients use, and handles up to options->jobs requests
+ * at once. It only returns on error.
+ */
+static int run_server(const compiler_options *options)
+{
+    server srv;
+    struct sockaddr_un addr;
+    struct stat sb;
+    int listen_fd;
+
+    make_socket_address(&addr, options->server_socket);
+    signal(SIGPIPE, SIG_IGN);
+    /* Requests carry the client's cache directory, so the server's own must
+     * not apply to them. Done before any request thread reads the environment.
+     */
+    unsetenv("ONLINECLC_CACHE_DIR");
+
+    /* Remove a stale socket left by a previous server, but not a live one */
+    if (lstat(options->server_socket, &sb) == 0 && S_ISSOCK(sb.st_mode))
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+            die(1, "A server is already listening on `%s'", options->server_socket);
+        if (fd >= 0)
+            close(fd);
+        unlink(options->server_socket);
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+        pdie(1, "Failed to create socket");
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+        pdie(1, "Failed to bind to `%s'", options->server_socket);
+    if (listen(listen_fd, 64) != 0)
+        pdie(1, "Failed to listen on `%s'", options->server_socket);
+
+    srv.devices = NULL;
+    srv.active = 0;
+    srv.max_active = options->jobs != 0 ? options->jobs : default_jobs();
+    srv.timeout = options->timeout;
+    pthread_mutex_init(&srv.lock, NULL);
+    pthread_cond_init(&srv.idle, NULL);
+
+    for (;;)
+    {
+        server_request *req;
+        pthread_t thread;
+        int fd, status;
+
+        pthread_mutex_lock(&srv.lock);
+        while (srv.active >= srv.max_active)
+            pthread_cond_wait(&srv.idle, &srv.lock);
+        pthread_mutex_unlock(&srv.lock);
+
+        fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            pdie(1, "Failed to accept connection on `%s'", options->server_socket);
+        }
+
+        req = (server_request *) onlineclc_malloc(sizeof(server_request), "a request");
+        req->srv = &srv;
+        req->fd = fd;
+        pthread_mutex_lock(&srv.lock);
+        srv.active++;
+        pthread_mutex_unlock(&srv.lock);
+        status = pthread_create(&thread, NULL, server_thread, req);
+        if (status != 0)
+        {
+            errno = status;
+            pdie(1, "Failed to create thread");
+        }
+        pthread_detach(thread);
+    }
+    return 1;
+}
+
+/* Appends an argument to a dynamically grown argument list */
+static void push_argument(char ***args, int *num_args, char *arg)
+{
+    *args = (char **) realloc(*args, (*num_args + 1) * sizeof(char *));
+    if (*args == NULL)
+        die(1, "Out of memory trying to allocate %d arguments", *num_args + 1);
+    (*args)[(*num_args)++] = arg;
+}
+
+/* Sends the compilation to the server listening on socket_path, and
+ * reproduces its messages, exit status and output file. Include paths are
+ * made absolute, and the client's working directory is added to the include
+ * path and sent along (for the headers of the source), since the server runs
+ * elsewhere. The cache directory, from --cache-dir or $ONLINECLC_CACHE_DIR,
+ * is sent as an absolute --cache-dir. The depfile options are kept back, as
+ * the caller writes the depfile. Returns the exit code, or -1 if the server could not be reached,
+ * in which case the caller should compile locally.
+ */
+static int run_client(const char *socket_path, int argc, const char * const *argv,
+                      const compiler_options *options)
+{
+    struct sockaddr_un addr;
+    char cwd[4096];
+    char **args = NULL;
+    int num_args = 0;
+    int fd, i;
+    source_text src;
+    source_bundle bundle;
+    int bundle_headers;
+    uint32_t ret;
+    char *messages, *binary;
+    size_t messages_len, binary_size;
+    phase_timer timer;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path) || getcwd(cwd, sizeof(cwd)) == NULL)
+        return -1;
+    make_socket_address(&addr, socket_path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    phase_begin(&timer);
+
+    push_argument(&args, &num_args, onlineclc_strndup(argv[0], strlen(argv[0]), "arguments"));
+    push_argument(&args, &num_args, onlineclc_strndup("-I", 2, "arguments"));
+    push_argument(&args, &num_args, onlineclc_strndup(cwd, strlen(cwd), "arguments"));
+    if (options->cache_dir != NULL)
+    {
+        push_argument(&args, &num_args, onlineclc_strndup("--cache-dir", 11, "arguments"));
+        push_argument(&args, &num_args, absolute_path(cwd, options->cache_dir));
+    }
+    for (i = 1; i < argc; i++)
+    {
+        if (0 == strcmp(argv[i], "-I") && i + 1 < argc - 1)
+        {
+            push_argument(&args, &num_args, onlineclc_strndup("-I", 2, "arguments"));
+            push_argument(&args, &num_args, absolute_path(cwd, argv[++i]));
+        }
+        else if (0 == strcmp(argv[i], "-MD") || 0 == strcmp(argv[i], "-MMD") || 0 == strcmp(argv[i], "-MP")
+                 || 0 == strcmp(argv[i], "--bundle-headers"))
+            continue;
+        else if ((0 == strcmp(argv[i], "-MF") || 0 == strcmp(argv[i], "-MT")) && i + 1 < argc - 1)
+            i++;
+        else if (0 == strcmp(argv[i], "--cache-dir") && i + 1 < argc - 1)
+            i++;
+        else if (0 == strncmp(argv[i], "-I", 2) && argv[i][2] != '\0' && i < argc - 1)
+        {
+            char *path = absolute_path(cwd, argv[i] + 2);
+            char *arg = (char *) onlineclc_malloc(strlen(path) + 3, "arguments");
+            sprintf(arg, "-I%s", path);
+            free(path);
+            push_argument(&args, &num_args, arg);
+        }
+        else
+            push_argument(&args, &num_args, onlineclc_strndup(argv[i], strlen(argv[i]), "arguments"));
+    }
+
+    load_source(&src, options->source_filename);
+    /* The headers are bundled here rather than by the server, which may not
+     * see the same files
+     */
+    bundle_headers = options->bundle_headers && !is_spirv(options, &src);
+    if (bundle_headers && bundle_source(&bundle, options, options->source_filename, &src) != 0)
+        terminate(1);
+    if (write_u32(fd, SERVER_PROTOCOL_VERSION) != 0 || write_u32(fd, (uint32_t) num_args) != 0)
+        pdie(1, "Failed to send request to `%s'", socket_path);
+    for (i = 0; i < num_args; i++)
+        if (write_blob(fd, args[i], strlen(args[i])) != 0)
+            pdie(1, "Failed to send request to `%s'", socket_path);
+    if (write_blob(fd, cwd, strlen(cwd)) != 0
+        || write_source(fd, bundle_headers ? &bundle.text : &src) != 0)
+        pdie(1, "Failed to send request to `%s'", socket_path);
+    if (bundle_headers)
+        free_bundle(&bundle);
+    free_source(&src);
+    for (i = 0; i < num_args; i++)
+        free(args[i]);
+    free(args);
+
+    if (read_all(fd, &ret, sizeof(ret)) != 0
+        || (messages = read_blob(fd, &messages_len)) == NULL
+        || (binary = read_blob(fd, &binary_size)) == NULL)
+        die(1, "Lost connection to the compile server on `%s'", socket_path);
+    close(fd);
+    phase_end(&timer, "server request", options->source_filename);
+
+    fwrite(messages, 1, messages_len, stderr);
+    if (ret == 0 && binary_size > 0 && options->output_filename != NULL)
+        write_binary_file(options->output_filename, (const unsigned char *) binary, binary_size);
+    free(messages);
+    free(binary);
+    return (int) ret;
+}
+
+#endif /* !ONLINECLC_LIBRARY */
+
+/* Messages of the last library call on each thread, for onlineclc_messages */
+static pthread_key_t library_messages_key;
+static pthread_once_t library_messages_once = PTHREAD_ONCE_INIT;
+
+static void library_messages_init(void)
+{
+    pthread_key_create(&library_messages_key, free);
+}
+
+/* Replaces the messages of the thread's last call (messages is dynamically
+ * allocated, or NULL for none)
+ */
+static void set_library_messages(char *messages)
+{
+    pthread_once(&library_messages_once, library_messages_init);
+    free(pthread_getspecific(library_messages_key));
+    pthread_setspecific(library_messages_key, messages);
+}
+
+/* Removes the messages of the thread's last call, returning them (or NULL
+ * if there were none) and their length
+ */
+static char *take_library_messages(size_t *len)
+{
+    char *messages;
+
+    pthread_once(&library_messages_once, library_messages_init);
+    messages = (char *) pthread_getspecific(library_messages_key);
+    pthread_setspecific(library_messages_key, NULL);
+    *len = messages != NULL ? strlen(messages) : 0;
+    return messages;
+}
+
+/* A call through the library interface. Fatal errors are trapped, as for the
+ * compile server, and the messages are kept for onlineclc_messages. The
+ * redirection in place when the call began (if any) is restored at the end.
  */
-static char *escape_c_string(const char *str)
+typedef struct
 {
-    const size_t src_len = strlen(str);
-    size_t i;
-    size_t dst_len = 0;
-    char *dst, *cur;
+    diagnostics diag;
+    diagnostics *outer;
+} library_call;
 
-    /* First pass: determine memory requirement */
-    for (i = 0; i < src_len; i++)
+/* Redirects diagnostics for a library call. Returns 0 on success, or -1 if
+ * the messages have nowhere to go (and the call must fail).
+ */
+static int library_begin(library_call *call)
+{
+    call->diag.messages = tmpfile();
+    if (call->diag.messages == NULL)
     {
-        if (safe_for_string_literal(str[i]))
-            dst_len++;
-        else
-            dst_len += 4; /* for an octal escape */
+        char message[256];
+
+        snprintf(message, sizeof(message), "Failed to create a temporary file: %s\n", strerror(errno));
+        set_library_messages(strdup(message));
+        return -1;
     }
+    call->outer = get_diagnostics();
+    set_diagnostics(&call->diag);
+    return 0;
+}
 
-    dst = (char *) onlineclc_malloc((dst_len + 1) * sizeof(char), "string");
+static onlineclc_status library_end(library_call *call, onlineclc_status status)
+{
+    size_t len;
 
-    /* Second pass: fill in the string */
-    cur = dst;
-    for (i = 0; i < src_len; i++)
+    set_diagnostics(call->outer);
+    set_library_messages(read_messages(call->diag.messages, &len));
+    fclose(call->diag.messages);
+    return status;
+}
+
+/* The status of a library call that was trapped with exitcode, or that
+ * failed with it as an exit status (as from find_devices)
+ */
+static onlineclc_status trapped_status(int exitcode)
+{
+    /* 0 is --help, which is no more use to the library than a bad option */
+    return exitcode == 0 || exitcode == 2 ? ONLINECLC_INVALID_ARGUMENTS : ONLINECLC_ERROR;
+}
+
+/* The status of a library call that built a program, from its build status */
+static onlineclc_status build_result(cl_int status)
+{
+    if (status == CL_SUCCESS)
+        return ONLINECLC_SUCCESS;
+    if (status == BUILD_ERROR)
+        return ONLINECLC_ERROR;
+    return status == BUILD_TIMED_OUT ? ONLINECLC_TIMED_OUT : ONLINECLC_BUILD_FAILED;
+}
+
+#if !ONLINECLC_LIBRARY
+/* The exit code of onlineclc for a library status */
+static int library_exit_code(onlineclc_status status)
+{
+    switch (status)
     {
-        if (safe_for_string_literal(str[i]))
-            *cur++ = str[i];
-        else
-        {
-            unsigned char value = (unsigned char) str[i];
-            *cur++ = '\\';
-            *cur++ = '0' + ((value / 64) % 8);
-            *cur++ = '0' + ((value / 8) % 8);
-            *cur++ = '0' + (value % 8);
-        }
+    case ONLINECLC_SUCCESS: return 0;
+    case ONLINECLC_TIMED_OUT: return EXIT_TIMED_OUT;
+    case ONLINECLC_INVALID_ARGUMENTS: return 2;
+    default: return 1;
     }
-    *cur = '\0';
-    return dst;
 }
+#endif /* !ONLINECLC_LIBRARY */
 
-/* This function does the heavy lifting. It loads the source, builds the
- * program and writes the build log. On failure, the process is terminated.
- *
- * Currently the source file is loaded with mmap(), since that is easier to
- * implement than streaming. However, it will prevent compiling from a pipe and
- * is not very portable, so it should be replaced in future.
+/* Makes ctx the session's context, unless another thread got there first
+ * (in which case ctx is released). Returns the session's context.
  */
-static cl_program create_program(
-    cl_context ctx,
-    cl_device_id device,
-    const char *source_filename,
-    const char *options)
+static cl_context adopt_context(onlineclc_session *session, cl_context ctx)
 {
-    void *addr;              /* mmap address for the source file */
-    char *escaped_filename;  /* Soruce filename with quotes etc escaped */
-    const char *srcs[4];     /* pointers to fragments of source */
-    size_t src_lens[4];      /* lengths for source fragments */
-    struct stat sb;          /* stat info on the file, to determine its size */
-    cl_int status;
-    int fd;                  /* file descriptor for the source file */
-    size_t len;              /* length of the source file */
-    cl_program program;
+    cl_context ans;
 
-    fd = open(source_filename, O_RDONLY);
-    if (fd < 0)
-        pdie(1, "Failed to open `%s'", source_filename);
+    pthread_mutex_lock(&session->lock);
+    if (session->ctx == NULL)
+        session->ctx = ctx;
+    ans = session->ctx;
+    pthread_mutex_unlock(&session->lock);
+    if (ctx != ans)
+        clReleaseContext(ctx);
+    return ans;
+}
 
-    if (fstat(fd, &sb) == -1)
-        pdie(1, "Failed to stat `%s'", source_filename);
+/* Stores the session's context in *ctx, creating it if necessary (without
+ * the lock held, since that takes a while). Returns CL_SUCCESS or
+ * BUILD_ERROR.
+ */
+static cl_int session_context(onlineclc_session *session, cl_context *ctx)
+{
+    pthread_mutex_lock(&session->lock);
+    *ctx = session->ctx;
+    pthread_mutex_unlock(&session->lock);
+    if (*ctx != NULL)
+        return CL_SUCCESS;
+    if (open_context(1, &session->device, ctx) != CL_SUCCESS)
+        return BUILD_ERROR;
+    *ctx = adopt_context(session, *ctx);
+    return CL_SUCCESS;
+}
 
-    len = sb.st_size;
-    if (len == 0)
+/* Copies the arguments of onlineclc_options_create, as process_options
+ * expects them: a program name first and a source last. Returns NULL on
+ * failure (after reporting it).
+ */
+static onlineclc_options *new_library_options(int argc, const char * const *argv)
+{
+    onlineclc_options *ans;
+    int i;
+
+    ans = (onlineclc_options *) try_malloc(sizeof(onlineclc_options), "options");
+    if (ans == NULL)
+        return NULL;
+    ans->argc = 0;
+    ans->argv = (char **) try_malloc((argc + 2) * sizeof(char *), "arguments");
+    if (ans->argv == NULL)
     {
-        /* Can't portably mmap 0 bytes */
-        addr = "";
+        free(ans);
+        return NULL;
     }
-    else
+    for (i = 0; i < argc + 2; i++)
     {
-        addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
-        if (addr == MAP_FAILED)
-            pdie(1, "Failed to map `%s'", source_filename);
+        const char *arg = i == 0 ? "onlineclc" : i == argc + 1 ? "-" : argv[i - 1];
+
+        ans->argv[i] = (char *) try_malloc(strlen(arg) + 1, "arguments");
+        if (ans->argv[i] == NULL)
+            break;
+        strcpy(ans->argv[i], arg);
+        ans->argc++;
+    }
+    /* Nothing in options needs freeing until process_options fills it in */
+    memset(&ans->options, 0, sizeof(ans->options));
+    if (ans->argc < argc + 2)
+    {
+        onlineclc_options_free(ans);
+        return NULL;
     }
+    return ans;
+}
 
-    /* Inject a line of the form
-     * #line 1 "filename"
-     * so that the build log can show the correct filename in error messages
-     * (depending on the OpenCL implementation)
+/* Parses the arguments copied by new_library_options into ans->options */
+static onlineclc_status library_options_create(onlineclc_options *ans)
+{
+    const compiler_options *o;
+
+    process_options(&ans->options, ans->argc, (const char * const *) ans->argv);
+    o = &ans->options;
+    if (o->batch_filename != NULL || o->server_socket != NULL || o->link || o->all_devices || o->num_sweeps > 0
+        || o->watch)
+    {
+        report("--batch, --server, --link, --all-devices, --sweep and --watch are not available in the library");
+        return ONLINECLC_INVALID_ARGUMENTS;
+    }
+    /* The library uses the OpenCL library that the program is linked with */
+    if (o->icd != NULL)
+    {
+        report("--icd and ONLINECLC_ICD are not available in the library");
+        return ONLINECLC_INVALID_ARGUMENTS;
+    }
+    /* The memory meter and the phase timings are kept for the whole
+     * process, which the library does not own
      */
-    escaped_filename = escape_c_string(source_filename);
-    srcs[0] = "#line 1 \"";                         src_lens[0] = 0;
-    srcs[1] = escaped_filename;                     src_lens[1] = 0;
-    srcs[2] = "\"\n";                               src_lens[2] = 0;
-    srcs[3] = (const char *) addr;                  src_lens[3] = len;
+    if (o->mem_budget != 0 || o->time || o->trace_filename != NULL)
+    {
+        report("--mem-budget, --time and --trace are not available in the library");
+        return ONLINECLC_INVALID_ARGUMENTS;
+    }
+    return ONLINECLC_SUCCESS;
+}
+
+static onlineclc_status library_session_create(const onlineclc_options *options, onlineclc_session **session)
+{
+    onlineclc_session *ans;
+    cl_device_id device;
+    int ret;
+
+    ret = find_device(options->options.machine, options->options.cache_dir, &device);
+    if (ret != 0)
+        return trapped_status(ret);
+    ans = (onlineclc_session *) try_malloc(sizeof(onlineclc_session), "a session");
+    if (ans == NULL)
+        return ONLINECLC_ERROR;
+    ans->device = device;
+    ans->ctx = NULL;
+    pthread_mutex_init(&ans->lock, NULL);
+    *session = ans;
+    return ONLINECLC_SUCCESS;
+}
+
+static onlineclc_status library_build_program(
+    onlineclc_session *session,
+    const onlineclc_options *options,
+    const char *name,
+    const void *source,
+    size_t size,
+    cl_program *program)
+{
+    source_text src;
+    cl_context ctx;
+    cl_program ans;
+    cl_int status = BUILD_ERROR;
 
-    program = clCreateProgramWithSource(ctx, 4, srcs, src_lens, &status);
+    if (source_from_memory(&src, name, (const char *) source, size) == 0)
+        status = session_context(session, &ctx);
+    if (status == CL_SUCCESS)
+        status = create_program(ctx, &options->options, name, &src, &ans);
+    free_source(&src);
     if (status != CL_SUCCESS)
-        die_cl(status, 1, "Failed to load source from `%s'", source_filename);
-    free(escaped_filename);
+        return build_result(status);
+    status = build_or_compile(ans, 1, &session->device, source_display_name(name), &options->options, NULL);
+    if (status == BUILD_TIMED_OUT || status == BUILD_ERROR)
+        clReleaseProgram(ans);
+    else
+        *program = ans;
+    return build_result(status);
+}
 
-    /* If len == 0 then we didn't use mmap */
-    if (len != 0)
-        munmap(addr, sb.st_size);
-    close(fd);
+static onlineclc_status library_compile(
+    onlineclc_session *session,
+    const onlineclc_options *options,
+    const char *name,
+    const void *source,
+    size_t size,
+    unsigned char **binary,
+    size_t *binary_size)
+{
+    const compiler_options *o = &options->options;
+    source_text src;
+    dependency_list deps;
+    cl_context ctx;
+    cl_int status;
+
+    if (source_from_memory(&src, name, (const char *) source, size) != 0
+        || (o->cache_dir != NULL && find_dependencies(&deps, o, name, &src) != 0))
+    {
+        free_source(&src);
+        return ONLINECLC_ERROR;
+    }
+    /* A cache hit needs no context, so it is only created if missing */
+    pthread_mutex_lock(&session->lock);
+    ctx = session->ctx;
+    pthread_mutex_unlock(&session->lock);
+    status = compile_source(o, session->device, &ctx, name, &src, o->cache_dir != NULL ? &deps : NULL,
+                            message_stream(), binary, binary_size);
+    if (ctx != NULL)
+        adopt_context(session, ctx);
+    if (o->cache_dir != NULL)
+        free_dependencies(&deps);
+    free_source(&src);
+    return build_result(status);
+}
+
+onlineclc_status onlineclc_options_create(int argc, const char * const *argv, onlineclc_options **options)
+{
+    library_call call;
+    onlineclc_options *ans;
+    onlineclc_status status;
+    int ret;
+
+    if (library_begin(&call) != 0)
+        return ONLINECLC_ERROR;
+    ans = new_library_options(argc, argv);
+    if (ans == NULL)
+        return library_end(&call, ONLINECLC_ERROR);
+    ret = setjmp(call.diag.trap);
+    status = ret == 0 ? library_options_create(ans) : trapped_status(ret - 1);
+    if (status == ONLINECLC_SUCCESS)
+        *options = ans;
+    else
+        onlineclc_options_free(ans);
+    return library_end(&call, status);
+}
+
+void onlineclc_options_free(onlineclc_options *options)
+{
+    int i;
 
     if (options == NULL)
-        options = "";
-    status = clBuildProgram(program, 1, &device, options, NULL, NULL);
+        return;
+    free_options(&options->options);
+    for (i = 0; i < options->argc; i++)
+        free(options->argv[i]);
+    free(options->argv);
+    free(options);
+}
+
+onlineclc_status onlineclc_session_create(const onlineclc_options *options, onlineclc_session **session)
+{
+    library_call call;
+    onlineclc_status status;
+    int ret;
+
+    if (library_begin(&call) != 0)
+        return ONLINECLC_ERROR;
+    ret = setjmp(call.diag.trap);
+    status = ret == 0 ? library_session_create(options, session) : trapped_status(ret - 1);
+    return library_end(&call, status);
+}
+
+void onlineclc_session_free(onlineclc_session *session)
+{
+    if (session == NULL)
+        return;
+    if (session->ctx != NULL)
+        clReleaseContext(session->ctx);
+    pthread_mutex_destroy(&session->lock);
+    free(session);
+}
+
+cl_device_id onlineclc_session_device(const onlineclc_session *session)
+{
+    return session->device;
+}
+
+onlineclc_status onlineclc_session_context(onlineclc_session *session, cl_context *ctx)
+{
+    library_call call;
+    int ret;
+
+    if (library_begin(&call) != 0)
+        return ONLINECLC_ERROR;
+    ret = setjmp(call.diag.trap);
+    if (ret == 0)
+        return library_end(&call, build_result(session_context(session, ctx)));
+    return library_end(&call, trapped_status(ret - 1));
+}
+
+onlineclc_status onlineclc_build_program(onlineclc_session *session, const onlineclc_options *options,
+                                         const char *name, const void *source, size_t size,
+                                         cl_program *program)
+{
+    library_call call;
+    onlineclc_status status;
+    int ret;
+
+    if (library_begin(&call) != 0)
+        return ONLINECLC_ERROR;
+    ret = setjmp(call.diag.trap);
+    status = ret == 0 ? library_build_program(session, options, name, source, size, program)
+        : trapped_status(ret - 1);
+    return library_end(&call, status);
+}
+
+onlineclc_status onlineclc_get_build_log(const onlineclc_session *session, cl_program program,
+                                         char **log, size_t *len)
+{
+    library_call call;
+    int ret;
+
+    if (library_begin(&call) != 0)
+        return ONLINECLC_ERROR;
+    ret = setjmp(call.diag.trap);
+    if (ret == 0)
+        return library_end(&call, build_result(get_build_log(program, session->device, log, len)));
+    return library_end(&call, trapped_status(ret - 1));
+}
+
+onlineclc_status onlineclc_get_binary(const onlineclc_session *session, cl_program program,
+                                      unsigned char **binary, size_t *size)
+{
+    library_call call;
+    int ret;
+
+    if (library_begin(&call) != 0)
+        return ONLINECLC_ERROR;
+    ret = setjmp(call.diag.trap);
+    if (ret == 0)
+        return library_end(&call, build_result(get_device_binary(program, session->device, binary, size)));
+    return library_end(&call, trapped_status(ret - 1));
+}
+
+onlineclc_status onlineclc_compile(onlineclc_session *session, const onlineclc_options *options,
+                                   const char *name, const void *source, size_t size,
+                                   char **log, size_t *log_len,
+                                   unsigned char **binary, size_t *binary_size)
+{
+    library_call call;
+    onlineclc_status status;
+    int ret;
+
+    if (library_begin(&call) != 0)
+        return ONLINECLC_ERROR;
+    ret = setjmp(call.diag.trap);
+    status = ret == 0 ? library_compile(session, options, name, source, size, binary, binary_size)
+        : trapped_status(ret - 1);
+    status = library_end(&call, status);
+    /* The log went to the messages, after any warnings */
+    if (log != NULL && (status == ONLINECLC_SUCCESS || status == ONLINECLC_BUILD_FAILED
+                        || status == ONLINECLC_TIMED_OUT))
+        *log = take_library_messages(log_len);
+    return status;
+}
+
+void onlineclc_free(void *ptr)
+{
+    free(ptr);
+}
+
+const char *onlineclc_messages(void)
+{
+    const char *messages;
+
+    pthread_once(&library_messages_once, library_messages_init);
+    messages = (const char *) pthread_getspecific(library_messages_key);
+    return messages != NULL ? messages : "";
+}
+
+const char *onlineclc_status_string(onlineclc_status status)
+{
     switch (status)
     {
-    case CL_SUCCESS:
-        break;
-    case CL_BUILD_PROGRAM_FAILURE:
-        dump_build_log(stderr, program, device);
-        exit(1);
-    default:
-        die_cl(status, 1, "Failed to build `%s'", source_filename);
+    case ONLINECLC_SUCCESS: return "success";
+    case ONLINECLC_BUILD_FAILED: return "build failed";
+    case ONLINECLC_TIMED_OUT: return "build timed out";
+    case ONLINECLC_INVALID_ARGUMENTS: return "invalid arguments";
+    case ONLINECLC_ERROR: return "error";
     }
-    return program;
+    return "unknown status";
 }
 
-/* Print usage information and exit with exitcode.
- * If message is not NULL, it is displayed first.
+#if !ONLINECLC_LIBRARY
+#ifdef __linux__
+/* Time to let a change settle before rebuilding, so that an editor that
+ * saves in several steps triggers only one build
  */
-static void usage(int exitcode, const char *message)
+#define WATCH_DEBOUNCE_MS 100
+
+/* A file watched by --watch. The watch is on its directory rather than the
+ * file itself, since many editors save by replacing the file.
+ */
+typedef struct
 {
-    if (message != NULL)
+    int wd;
+    /* Name of the file within the directory, dynamically allocated */
+    char *name;
+} watched_file;
+
+/* A build started by --watch. It runs in a thread of its own so that a
+ * change can supersede it, in which case it is abandoned to the thread
+ * (since OpenCL has no way to cancel it). Either way, the thread hands it
+ * back through the done pipe once the build is over, and the main thread
+ * frees it.
+ */
+typedef struct
+{
+    onlineclc_session *session;
+    const onlineclc_options *options;
+    char *source;
+    size_t size;
+    /* Headers found in the source, for -MD. Only used by the main thread. */
+    dependency_list deps;
+    /* The build is written to this once it is over */
+    int done_fd;
+    /* Results, including the messages of a failed call */
+    onlineclc_status status;
+    char *log;
+    size_t log_len;
+    unsigned char *binary;
+    size_t binary_size;
+    /* Protected by lock */
+    int done;
+    pthread_mutex_t lock;
+} watch_build;
+
+static void free_watch_build(watch_build *b)
+{
+    pthread_mutex_destroy(&b->lock);
+    free(b->source);
+    free_dependencies(&b->deps);
+    free(b->log);
+    free(b->binary);
+    free(b);
+}
+
+static void *watch_build_thread(void *arg)
+{
+    watch_build *b = (watch_build *) arg;
+    const char *name = b->options->options.source_filename;
+
+    b->status = onlineclc_compile(b->session, b->options, name, b->source, b->size,
+                                  &b->log, &b->log_len,
+                                  b->options->options.output_filename != NULL ? &b->binary : NULL,
+                                  &b->binary_size);
+    if (b->status != ONLINECLC_SUCCESS && b->status != ONLINECLC_BUILD_FAILED
+        && b->status != ONLINECLC_TIMED_OUT)
     {
-        fprintf(stderr, "%s\n\n", message);
+        /* Only this thread can see the messages of the call */
+        b->log_len = strlen(onlineclc_messages());
+        b->log = onlineclc_strndup(onlineclc_messages(), b->log_len, "the messages");
     }
-    fputs("Usage: onlineclc [<options>] [-b <machine>] [-o <outfile>] <source>\n"
-          "\n"
-          "   -b machine          Specify device to use\n"
-          "   -o outfile          Specify output file\n"
-          "   -h | --help         Show usage\n"
-          "\n"
-          "Other options are passed to the online compiler\n"
-          "NB: exactly one source file must be given, as the last argument.\n",
-          message != NULL ? stderr : stdout
-         );
-    exit(exitcode);
+    pthread_mutex_lock(&b->lock);
+    b->done = 1;
+    pthread_mutex_unlock(&b->lock);
+    /* A pointer is written atomically to a pipe */
+    if (write(b->done_fd, &b, sizeof(b)) != sizeof(b))
+        pdie(1, "Failed to signal the end of a build");
+    return NULL;
+}
+
+/* Tells whether a build has finished (even if it has not been handed back) */
+static int watch_build_done(watch_build *b)
+{
+    int done;
+
+    pthread_mutex_lock(&b->lock);
+    done = b->done;
+    pthread_mutex_unlock(&b->lock);
+    return done;
+}
+
+/* Watches the file at path, as well as those already in files */
+static void add_watched_file(int fd, const char *path, watched_file **files, size_t *num_files)
+{
+    const char *slash = strrchr(path, '/');
+    char *dir = dir_name(path);
+    int wd;
+
+    if (dir == NULL)
+        terminate(1);
+    wd = inotify_add_watch(fd, dir[0] != '\0' ? dir : ".", IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd < 0)
+        fprintf(message_stream(), "Warning: cannot watch `%s': %s\n", path, strerror(errno));
+    else
+    {
+        watched_file *grown = (watched_file *) realloc(*files, (*num_files + 1) * sizeof(watched_file));
+
+        if (grown == NULL)
+            die(1, "Out of memory trying to allocate watched files");
+        *files = grown;
+        (*files)[*num_files].wd = wd;
+        (*files)[*num_files].name = slash != NULL
+            ? onlineclc_strndup(slash + 1, strlen(slash + 1), "a file name")
+            : onlineclc_strndup(path, strlen(path), "a file name");
+        (*num_files)++;
+    }
+    free(dir);
+}
+
+static void free_watched_files(watched_file *files, size_t num_files)
+{
+    size_t i;
+
+    for (i = 0; i < num_files; i++)
+        free(files[i].name);
+    free(files);
+}
+
+/* Stops watching the directories of files that are not also in keep (a
+ * directory has the same watch for every file in it), and frees files
+ */
+static void unwatch_files(int fd, watched_file *files, size_t num_files,
+                          const watched_file *keep, size_t num_keep)
+{
+    size_t i, j;
+
+    for (i = 0; i < num_files; i++)
+    {
+        int wd = files[i].wd, seen = 0;
+
+        for (j = 0; j < num_keep && !seen; j++)
+            seen = keep[j].wd == wd;
+        /* Only remove each watch once */
+        for (j = 0; j < i && !seen; j++)
+            seen = files[j].wd == wd;
+        if (!seen)
+            inotify_rm_watch(fd, wd);
+    }
+    free_watched_files(files, num_files);
+}
+
+/* What start_watch_build sets up. It belongs to the caller, so that it is
+ * released even if the attempt is trapped part way.
+ */
+typedef struct
+{
+    watch_build *build;
+    /* Set once the build belongs to its thread */
+    int started;
+    watched_file *files;
+    size_t num_files;
+} watch_start;
+
+/* Loads the source and its headers, watches them in place of the files
+ * watched before, and starts building the source. Returns 0, or -1 on
+ * failure (which is reported) with what was set up left in *start.
+ */
+static int start_watch_build(
+    const onlineclc_options *cli,
+    onlineclc_session *session,
+    int inotify_fd,
+    int done_fd,
+    watched_file **files,
+    size_t *num_files,
+    watch_start *start)
+{
+    const compiler_options *options = &cli->options;
+    watch_build *b;
+    source_text src;
+    size_t i, offset = 0;
+    pthread_t thread;
+    int ret;
+
+    if (read_source_data(&src, options->source_filename) != 0)
+        return -1;
+    b = (watch_build *) onlineclc_malloc(sizeof(watch_build), "a build");
+    b->source = NULL;
+    b->deps.paths = NULL;
+    b->deps.num_paths = 0;
+    b->log = NULL;
+    b->binary = NULL;
+    pthread_mutex_init(&b->lock, NULL);
+    start->build = b;
+    b->session = session;
+    b->options = cli;
+    /* A copy, since the file may change again while it is built */
+    b->size = src.len;
+    b->source = (char *) try_malloc(src.len + 1, "the source");
+    for (i = 0; b->source != NULL && i < src.num_chunks; i++)
+    {
+        memcpy(b->source + offset, src.chunks[i], src.chunk_lens[i]);
+        offset += src.chunk_lens[i];
+    }
+    ret = b->source != NULL ? find_dependencies(&b->deps, options, options->source_filename, &src) : -1;
+    free_source(&src);
+    if (ret != 0)
+        return -1;
+
+    add_watched_file(inotify_fd, options->source_filename, &start->files, &start->num_files);
+    for (i = 0; i < b->deps.num_paths; i++)
+        add_watched_file(inotify_fd, b->deps.paths[i], &start->files, &start->num_files);
+
+    b->done_fd = done_fd;
+    b->status = ONLINECLC_ERROR;
+    b->log_len = 0;
+    b->binary_size = 0;
+    b->done = 0;
+    ret = pthread_create(&thread, NULL, watch_build_thread, b);
+    if (ret != 0)
+    {
+        errno = ret;
+        preport("Failed to create thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    start->started = 1;
+
+    unwatch_files(inotify_fd, *files, *num_files, start->files, start->num_files);
+    *files = start->files;
+    *num_files = start->num_files;
+    start->files = NULL;
+    start->num_files = 0;
+    return 0;
+}
+
+/* Runs start_watch_build with its errors trapped. Returns 0 or -1. */
+static int trap_start_watch_build(
+    diagnostics *diag,
+    const onlineclc_options *cli,
+    onlineclc_session *session,
+    int inotify_fd,
+    int done_fd,
+    watched_file **files,
+    size_t *num_files,
+    watch_start *start)
+{
+    int ret;
+
+    set_diagnostics(diag);
+    if (setjmp(diag->trap) == 0)
+        ret = start_watch_build(cli, session, inotify_fd, done_fd, files, num_files, start);
+    else
+        ret = -1;
+    set_diagnostics(NULL);
+    return ret;
+}
+
+/* As start_watch_build, but an error is reported (to diag) and NULL
+ * returned, with whatever the attempt set up released
+ */
+static watch_build *try_start_watch_build(
+    diagnostics *diag,
+    const onlineclc_options *cli,
+    onlineclc_session *session,
+    int inotify_fd,
+    int done_fd,
+    watched_file **files,
+    size_t *num_files)
+{
+    watch_start start = { NULL, 0, NULL, 0 };
+
+    if (trap_start_watch_build(diag, cli, session, inotify_fd, done_fd, files, num_files, &start) == 0)
+        return start.build;
+    /* A build that started is only given back through the done pipe */
+    if (start.build != NULL && !start.started)
+        free_watch_build(start.build);
+    unwatch_files(inotify_fd, start.files, start.num_files, *files, *num_files);
+    return NULL;
+}
+
+/* Reports a build that has finished, and writes its outputs */
+static void finish_watch_build(const compiler_options *options, onlineclc_session *session,
+                               const watch_build *b, double ms)
+{
+    FILE *out = message_stream();
+
+    write_build_log(out, b->log, b->log_len);
+    if (b->status == ONLINECLC_SUCCESS)
+    {
+        if (options->output_filename != NULL)
+            write_program_file(options, session->device, options->output_filename, -1,
+                               b->binary, b->binary_size);
+        if (options->depfile)
+            write_depfile(options, options->output_filename, &options->output_filename, 1,
+                          options->source_filename, &b->deps);
+        fprintf(out, "Built `%s' in %.0f ms\n", source_display_name(options->source_filename), ms);
+    }
+    else if (b->status == ONLINECLC_BUILD_FAILED)
+        fprintf(out, "Build of `%s' failed in %.0f ms\n", source_display_name(options->source_filename), ms);
 }
 
-/* Determine whether a command-line option is expected to be followed by an
- * argument, which should not be parsed as an option. This is necessarily
- * approximate since there may be vendor-specific options, but it reduces the
- * chance of accidentally processing an argument as an option.
- */
-static int option_has_argument(const char *option)
+/* As finish_watch_build, but an error is reported (to diag) */
+static void try_finish_watch_build(diagnostics *diag, const compiler_options *options,
+                                   onlineclc_session *session, const watch_build *b, double ms)
 {
-    return (0 == strcmp(option, "-I"))
-        || (0 == strcmp(option, "-D"))
-        || (0 == strcmp(option, "-b"))
-        || (0 == strcmp(option, "-o"));
+    set_diagnostics(diag);
+    if (setjmp(diag->trap) == 0)
+        finish_watch_build(options, session, b, ms);
+    set_diagnostics(NULL);
 }
 
-/* Adds option to the compiler options, and appends a trailing space so that
- * options will be space-separated. It will dynamically resize the memory if
- * needed, and kill the process if that fails.
+/* Reads the pending inotify events, and tells whether any of them is for
+ * one of files (or may have been, if events were lost)
  */
-static void append_compiler_option(compiler_options *options, const char *option)
+static int read_watch_events(int fd, const watched_file *files, size_t num_files)
 {
-    size_t len = strlen(option);
-    /* options->len + len + 2 bytes are needed:
-     * options->len + len for options text, one for trailing space, one for NUL
-     */
-    while (options->len + len + 1 >= options->size)
+    union
     {
-        size_t new_size = 2 * options->size;
-        if (new_size == 0)
-            new_size = 64;
-        options->options = realloc(options->options, new_size);
-        if (options->options == NULL)
-            die(1, "Out of memory trying to allocate %zu bytes", new_size);
+        struct inotify_event event;
+        char bytes[4096];
+    } buf;
+    ssize_t len;
+    size_t pos, i;
+    int changed = 0;
+
+    len = read(fd, &buf, sizeof(buf));
+    if (len < 0)
+    {
+        if (errno == EINTR || errno == EAGAIN)
+            return 0;
+        pdie(1, "Failed to read file changes");
+    }
+    for (pos = 0; pos < (size_t) len; pos += sizeof(struct inotify_event) + buf.event.len)
+    {
+        const struct inotify_event *event = (const struct inotify_event *) (buf.bytes + pos);
 
-        options->size = new_size;
+        if (event->mask & IN_Q_OVERFLOW)
+            changed = 1;
+        for (i = 0; i < num_files && event->len > 0; i++)
+            if (files[i].wd == event->wd && 0 == strcmp(files[i].name, event->name))
+                changed = 1;
     }
-    memcpy(options->options + options->len, option, len);
-    options->len += len;
-    options->options[options->len] = ' ';
-    options->options[options->len + 1] = '\0';
-    options->len++;
+    return changed;
 }
 
-/* Parse the command-line options into a structure. The options structure
- * does not need to be pre-initialized.
+/* Builds the source, and then builds it again whenever it or one of its
+ * headers changes, with the device and context kept from one build to the
+ * next. A change during a build supersedes it. Only returns on error.
  */
-static void process_options(compiler_options *options, int argc, const char * const *argv)
+static int run_watch(const compiler_options *options)
 {
-    int i;
-    if (argc <= 1)
-        usage(2, "Source file not specified");
+    onlineclc_options cli;
+    onlineclc_session *session;
+    onlineclc_status status;
+    watched_file *files = NULL;
+    size_t num_files = 0;
+    watch_build *current = NULL;
+    /* A build abandoned to a change. Only one is left running at a time, so
+     * that changes faster than builds do not pile them up.
+     */
+    watch_build *superseded = NULL;
+    struct timespec start, end;
+    struct pollfd fds[2];
+    /* Errors in a build, or in loading the source for it, are reported and
+     * the next change is awaited
+     */
+    diagnostics diag;
+    int inotify_fd, done_fds[2];
+    int changed = 1;
 
-    options->options = NULL;
-    options->size = 0;
-    options->len = 0;
-    options->machine = NULL;
-    options->output_filename = NULL;
-    options->source_filename = NULL;
+    cli.options = *options;
+    cli.argv = NULL;
+    cli.argc = 0;
+    status = onlineclc_session_create(&cli, &session);
+    fputs(onlineclc_messages(), stderr);
+    if (status != ONLINECLC_SUCCESS)
+        return library_exit_code(status);
+    inotify_fd = inotify_init();
+    if (inotify_fd < 0)
+        pdie(1, "Failed to watch for changes");
+    if (pipe(done_fds) != 0)
+        pdie(1, "Failed to create pipe");
 
-    /* First look for --help, and show help, even if there is no source file. */
-    for (i = 1; i < argc; i++)
-        if (0 == strcmp(argv[i], "-h") || 0 == strcmp(argv[i], "--help"))
-            usage(0, NULL);
-    for (i = 1; i < argc - 1; i++)
+    diag.messages = stderr;
+    for (;;)
     {
-        if (0 == strcmp(argv[i], "-b"))
+        /* If it is already done, it is reported before rebuilding */
+        if (changed && current != NULL && superseded == NULL && !watch_build_done(current))
         {
-            if (i == argc - 2)
-                usage(2, "Source file not specified");
-            if (options->machine != NULL)
-                die(2, "-b option specified twice");
-            options->machine = argv[i + 1];
-            i++;
+            fprintf(stderr, "Build of `%s' superseded by a change\n",
+                    source_display_name(options->source_filename));
+            superseded = current;
+            current = NULL;
         }
-        else if (0 == strcmp(argv[i], "-o"))
+        if (changed && current == NULL)
         {
-            if (i == argc - 2)
-                usage(2, "Source file not specified");
-            if (options->output_filename != NULL)
-                die(2, "-o option specified twice");
-            options->output_filename = argv[i + 1];
-            i++;
+            changed = 0;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            current = try_start_watch_build(&diag, &cli, session, inotify_fd, done_fds[1], &files, &num_files);
+            /* The source may be missing, so make sure it is watched */
+            if (current == NULL && num_files == 0)
+                add_watched_file(inotify_fd, options->source_filename, &files, &num_files);
         }
-        else
+
+        fds[0].fd = inotify_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = done_fds[0];
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, -1) < 0)
         {
-            append_compiler_option(options, argv[i]);
-            if (option_has_argument(argv[i]) && i < argc - 2)
+            if (errno == EINTR)
+                continue;
+            pdie(1, "Failed to wait for changes");
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            watch_build *finished;
+
+            if (read(done_fds[0], &finished, sizeof(finished)) != sizeof(finished))
+                pdie(1, "Failed to wait for a build");
+            if (finished == current)
             {
-                append_compiler_option(options, argv[i + 1]);
-                i++;
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                try_finish_watch_build(&diag, options, session, current, elapsed_us(&start, &end) / 1000.0);
+                current = NULL;
             }
+            else if (finished == superseded)
+                superseded = NULL;
+            free_watch_build(finished);
         }
-    }
-    options->source_filename = argv[argc - 1];
 
-    /* Strip trailing space after last option */
-    if (options->len > 0)
-    {
-        options->options[options->len - 1] = '\0';
-        options->len--;
+        if ((fds[0].revents & POLLIN) && read_watch_events(inotify_fd, files, num_files))
+        {
+            /* Wait for the changes to stop */
+            fds[0].revents = 0;
+            while (poll(fds, 1, WATCH_DEBOUNCE_MS) > 0)
+                read_watch_events(inotify_fd, files, num_files);
+            changed = 1;
+        }
     }
 }
-
-/* Extract the binary from program and write it to output_filename.
- *
- * This currently uses mmap(), so is not very portable.
- */
-static void write_program(const char *output_filename, cl_program program)
+#else /* !__linux__ */
+static int run_watch(const compiler_options *options)
 {
-    cl_int status;
-    cl_uint num_devices;
-    size_t sizes[1];
-    unsigned char *binaries[1];
-    int fd;
-
-    /* Verify that there is only one device */
-    status = clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &num_devices, NULL);
-    if (status != CL_SUCCESS)
-        die_cl(status, 1, "Failed to query number of devices from program");
-    if (num_devices != 1)
-        die(1, "Expected one device but found %u", (unsigned int) num_devices);
-
-    status = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), sizes, NULL);
-    if (status != CL_SUCCESS)
-        die_cl(status, 1, "Failed to obtain binary size");
-
-    if (sizes[0] == 0)
-        die(1, "No binary was produced by the compiler");
-
-    /* mmap() doesn't like it if we use O_WRONLY, since in some cases
-     * PROT_WRITE implies PROT_READ.
-     */
-    fd = open(output_filename, O_RDWR | O_CREAT, 0666);
-    if (fd < 0)
-        pdie(1, "Failed to open `%s'", output_filename);
-
-    if (ftruncate(fd, sizes[0]) != 0)
-        pdie(1, "Failed to resize `%s' to %zu bytes", output_filename, sizes[0]);
-
-    binaries[0] = (unsigned char *) mmap(NULL, sizes[0], PROT_WRITE, MAP_SHARED, fd, 0);
-    if (binaries[0] == MAP_FAILED)
-        pdie(1, "Failed to map `%s'", output_filename);
-
-    status = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char *), binaries, NULL);
-    if (status != CL_SUCCESS)
-        die_cl(status, 1, "Failed to query the program binary");
-
-    munmap((void *) binaries[0], sizes[0]);
-    close(fd);
+    (void) options;
+    die(2, "--watch needs inotify, which only Linux has");
+    return 2;
 }
+#endif /* !__linux__ */
+#endif /* !ONLINECLC_LIBRARY */
 
-#if !ONLINECLC_CUNIT
+#if !ONLINECLC_CUNIT && !ONLINECLC_LIBRARY
 int main(int argc, const char * const *argv)
 {
     compiler_options options;
-    state s;
+    onlineclc_options cli;
+    onlineclc_session *session;
+    onlineclc_status ret;
+    source_text src;
+    dependency_list deps;
+    int scan;
+    unsigned char *binary;
+    size_t binary_size;
+    cl_int status;
 
     process_options(&options, argc, argv);
-    s.device = find_device(options.machine);
-    s.ctx = create_context(s.device);
-    s.program = create_program(s.ctx, s.device, options.source_filename, options.options);
-    dump_build_log(stderr, s.program, s.device);
-    if (options.output_filename != NULL)
-        write_program(options.output_filename, s.program);
+    profile_start(&options);
+    jobserver_start(&options);
+    meter_start(&options);
+    opencl_start(&options);
+    if (options.batch_filename != NULL || options.server_socket != NULL)
+    {
+        int ret = options.batch_filename != NULL ? run_batch(&options) : run_server(&options);
+        free_options(&options);
+        return ret;
+    }
+    if (options.link)
+    {
+        int ret = run_link(&options);
+        free_options(&options);
+        return ret;
+    }
+    if (options.all_devices)
+    {
+        int ret = run_all_devices(&options);
+        free_options(&options);
+        return ret;
+    }
+    if (options.num_sweeps > 0)
+    {
+        int ret = run_sweep(&options);
+        free_options(&options);
+        return ret;
+    }
+    if (options.watch)
+    {
+        int ret = run_watch(&options);
+        free_options(&options);
+        return ret;
+    }
+    /* The server does not report kernels or the device, so --kernel-info,
+     * --verify-binary and --emit build here. It also has its own --timeout
+     * and --icd.
+     */
+    if (getenv("ONLINECLC_SERVER") != NULL && !options.kernel_info && !options.verify_binary
+        && options.emit == EMIT_BINARY && options.timeout == 0 && options.icd == NULL)
+    {
+        int ret = run_client(getenv("ONLINECLC_SERVER"), argc, argv, &options);
+        if (ret == 0 && options.depfile)
+        {
+            load_source(&src, options.source_filename);
+            if (find_dependencies(&deps, &options, options.source_filename, &src) != 0)
+                terminate(1);
+            write_depfile(&options, options.output_filename, &options.output_filename, 1,
+                          options.source_filename, &deps);
+            free_dependencies(&deps);
+            free_source(&src);
+        }
+        if (ret >= 0)
+        {
+            free_options(&options);
+            return ret;
+        }
+    }
 
-    clReleaseProgram(s.program);
-    clReleaseContext(s.ctx);
-    free(options.options);
+    /* The source is built as it would be with the library */
+    cli.options = options;
+    cli.argv = NULL;
+    cli.argc = 0;
+    ret = onlineclc_session_create(&cli, &session);
+    fputs(onlineclc_messages(), stderr);
+    if (ret != ONLINECLC_SUCCESS)
+    {
+        free_options(&options);
+        return library_exit_code(ret);
+    }
+    load_source(&src, options.source_filename);
+    scan = options.cache_dir != NULL || options.depfile;
+    if (scan && find_dependencies(&deps, &options, options.source_filename, &src) != 0)
+        terminate(1);
+    status = compile_source(&options, session->device, &session->ctx, options.source_filename,
+                            &src, scan ? &deps : NULL, stderr,
+                            options.output_filename != NULL || options.kernel_info || options.verify_binary
+                            ? &binary : NULL, &binary_size);
+    if (status == CL_SUCCESS && options.kernel_info)
+        show_kernel_info(&options, session->device, &session->ctx, src.name, binary, binary_size);
+    if (status == CL_SUCCESS && options.output_filename != NULL)
+        write_program_file(&options, session->device, options.output_filename, -1, binary, binary_size);
+    if (status == CL_SUCCESS && options.verify_binary)
+        verify_binary(&options, session->device, &src, binary, binary_size);
+    free_source(&src);
+    if (status == CL_SUCCESS && (options.output_filename != NULL || options.kernel_info || options.verify_binary))
+        free(binary);
+    if (status == CL_SUCCESS && options.depfile)
+        write_depfile(&options, options.output_filename, &options.output_filename, 1,
+                      options.source_filename, &deps);
+    if (scan)
+        free_dependencies(&deps);
 
-    return 0;
+    onlineclc_session_free(session);
+    free_options(&options);
+
+    return library_exit_code(build_result(status));
 }
-#endif /* !ONLINECLC_CUNIT */
+#endif /* !ONLINECLC_CUNIT && !ONLINECLC_LIBRARY */
 
 #if ONLINECLC_CUNIT
 
@@ -708,6 +9611,402 @@ static void test_escape_c_string_backslash(void)
     test_escape_c_string("backslash\\", "backslash\\134");
 }
 
+/* Writes text to a temporary file and parses it as a batch list */
+static batch_entry *test_batch_list(const char *text, size_t *num_entries)
+{
+    batch_entry *entries;
+    FILE *f = tmpfile();
+
+    CU_ASSERT_PTR_NOT_NULL(f);
+    fputs(text, f);
+    rewind(f);
+    entries = read_batch_list(f, "test", num_entries);
+    fclose(f);
+    return entries;
+}
+
+static void test_read_batch_list_empty(void)
+{
+    size_t n;
+    batch_entry *entries = test_batch_list("", &n);
+    CU_ASSERT_EQUAL(n, 0);
+    free_batch_list(entries, n);
+}
+
+static void test_read_batch_list_simple(void)
+{
+    size_t n;
+    batch_entry *entries = test_batch_list("a.cl\nb c.cl\tb c.out\n", &n);
+    CU_ASSERT_EQUAL(n, 2);
+    CU_ASSERT_STRING_EQUAL(entries[0].source_filename, "a.cl");
+    CU_ASSERT_PTR_NULL(entries[0].output_filename);
+    CU_ASSERT_STRING_EQUAL(entries[1].source_filename, "b c.cl");
+    CU_ASSERT_STRING_EQUAL(entries[1].output_filename, "b c.out");
+    free_batch_list(entries, n);
+}
+
+static void test_read_batch_list_skip(void)
+{
+    size_t n;
+    batch_entry *entries = test_batch_list("# comment\n\r\n\na.cl\r\nb.cl", &n);
+    CU_ASSERT_EQUAL(n, 2);
+    CU_ASSERT_STRING_EQUAL(entries[0].source_filename, "a.cl");
+    CU_ASSERT_STRING_EQUAL(entries[1].source_filename, "b.cl");
+    free_batch_list(entries, n);
+}
+
+static void test_sha256(const char *data, size_t len, const char *expected)
+{
+    static const char hex_digits[] = "0123456789abcdef";
+    sha256_context ctx;
+    unsigned char hash[32];
+    char hex[65];
+    int i;
+
+    sha256_init(&ctx);
+    /* Feed in uneven pieces to exercise the block buffering */
+    for (i = 0; len > 0; i++)
+    {
+        size_t piece = (size_t) (i % 7) * 13 + 1 < len ? (size_t) (i % 7) * 13 + 1 : len;
+        sha256_update(&ctx, data, piece);
+        data += piece;
+        len -= piece;
+    }
+    sha256_final(&ctx, hash);
+    for (i = 0; i < 32; i++)
+    {
+        hex[2 * i] = hex_digits[hash[i] >> 4];
+        hex[2 * i + 1] = hex_digits[hash[i] & 15];
+    }
+    hex[64] = '\0';
+    CU_ASSERT_STRING_EQUAL(hex, expected);
+}
+
+static void test_sha256_empty(void)
+{
+    test_sha256("", 0, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+}
+
+static void test_sha256_abc(void)
+{
+    test_sha256("abc", 3, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+}
+
+static void test_sha256_two_blocks(void)
+{
+    const char *msg = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    test_sha256(msg, strlen(msg), "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+}
+
+static void test_sha256_million(void)
+{
+    char *msg = (char *) malloc(1000000);
+    memset(msg, 'a', 1000000);
+    test_sha256(msg, 1000000, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+    free(msg);
+}
+
+static void test_parse_size(const char *str, int expected_ret, unsigned long long expected)
+{
+    unsigned long long size = 0;
+    CU_ASSERT_EQUAL(parse_size(str, &size), expected_ret);
+    if (expected_ret == 0)
+        CU_ASSERT_EQUAL(size, expected);
+}
+
+static void test_parse_size_valid(void)
+{
+    test_parse_size("0", 0, 0);
+    test_parse_size("123", 0, 123);
+    test_parse_size("4k", 0, 4096);
+    test_parse_size("3M", 0, 3 * 1024 * 1024);
+    test_parse_size("2G", 0, 2ULL * 1024 * 1024 * 1024);
+}
+
+static void test_parse_size_invalid(void)
+{
+    test_parse_size("", -1, 0);
+    test_parse_size("-1", -1, 0);
+    test_parse_size("1T", -1, 0);
+    test_parse_size("1kb", -1, 0);
+    test_parse_size("99999999999999999999", -1, 0);
+}
+
+static void test_parse_selector_name(void)
+{
+    device_selector sel;
+    CU_ASSERT_EQUAL(parse_selector(&sel, "GeForce GTX 580"), 0);
+    CU_ASSERT_STRING_EQUAL(sel.device_name, "GeForce GTX 580");
+    CU_ASSERT_EQUAL(sel.platform_index, -1);
+    CU_ASSERT_PTR_NULL(sel.platform_name);
+    CU_ASSERT_EQUAL(sel.type, CL_DEVICE_TYPE_ALL);
+    CU_ASSERT_EQUAL(sel.device_index, -1);
+    free_selector(&sel);
+
+    /* Not every component has a known key, so it is a name */
+    CU_ASSERT_EQUAL(parse_selector(&sel, "platform:0/Tahiti"), 0);
+    CU_ASSERT_STRING_EQUAL(sel.device_name, "platform:0/Tahiti");
+    CU_ASSERT_EQUAL(sel.platform_index, -1);
+    free_selector(&sel);
+}
+
+static void test_parse_selector_keys(void)
+{
+    device_selector sel;
+    CU_ASSERT_EQUAL(parse_selector(&sel, "platform:1/device:2"), 0);
+    CU_ASSERT_EQUAL(sel.platform_index, 1);
+    CU_ASSERT_EQUAL(sel.device_index, 2);
+    CU_ASSERT_PTR_NULL(sel.device_name);
+    free_selector(&sel);
+
+    CU_ASSERT_EQUAL(parse_selector(&sel, "platform:NVIDIA CUDA/type:gpu/name:Tahiti"), 0);
+    CU_ASSERT_EQUAL(sel.platform_index, -1);
+    CU_ASSERT_STRING_EQUAL(sel.platform_name, "NVIDIA CUDA");
+    CU_ASSERT_EQUAL(sel.type, CL_DEVICE_TYPE_GPU);
+    CU_ASSERT_STRING_EQUAL(sel.device_name, "Tahiti");
+    free_selector(&sel);
+}
+
+static void test_parse_selector_invalid(void)
+{
+    device_selector sel;
+    CU_ASSERT_EQUAL(parse_selector(&sel, "type:fpga"), 2);
+    CU_ASSERT_PTR_NULL(sel.storage);
+    CU_ASSERT_EQUAL(parse_selector(&sel, "device:first"), 2);
+    CU_ASSERT_PTR_NULL(sel.storage);
+    CU_ASSERT_EQUAL(parse_selector(&sel, "platform:1x"), 2);
+    CU_ASSERT_PTR_NULL(sel.storage);
+}
+
+static int record_include(void *arg, const include_directive *inc)
+{
+    string_buffer *found = (string_buffer *) arg;
+    if (inc->name == NULL)
+        return try_buffer_printf(found, "once");
+    return try_buffer_printf(found, inc->angle ? "<%s>" : "\"%s\"", inc->name);
+}
+
+/* Scans text split into two chunks at every possible point, checking that
+ * the includes found are always the expected ones.
+ */
+static void test_scan_includes(const char *text, const char *expected)
+{
+    size_t len = strlen(text), split;
+
+    for (split = 0; split <= len; split++)
+    {
+        source_text src;
+        string_buffer found = { NULL, 0, 0 };
+
+        source_from_memory(&src, "test.cl", text, split);
+        if (split < len)
+            add_source_chunk(&src, text + split, len - split);
+        CU_ASSERT_EQUAL(scan_includes(&src, record_include, &found), 0);
+        buffer_append(&found, "", 1);
+        CU_ASSERT_STRING_EQUAL(found.data, expected);
+        free(found.data);
+        free_source(&src);
+    }
+}
+
+static void test_scan_includes_simple(void)
+{
+    test_scan_includes("#include \"a.h\"\n#include <b.h>\n", "\"a.h\"<b.h>");
+    test_scan_includes("  #  include\t\"a.h\"", "\"a.h\"");
+    test_scan_includes("#define X\n#pragma once\nint include;\n", "once");
+    test_scan_includes("#pragma onceX\n#pragma  once // guard\n", "once");
+    test_scan_includes("#include MACRO\n#include \"\"\n", "");
+}
+
+static void test_scan_includes_comments(void)
+{
+    test_scan_includes("/* #include \"a.h\" */\n// #include \"b.h\"\n", "");
+    /* A comment is whitespace, so the # still starts the line */
+    test_scan_includes("/* multi\n#include \"a.h\"\n*/ #include \"b.h\"\n", "\"b.h\"");
+    test_scan_includes("/**/#include \"a.h\"\n#/**/include \"b.h\"\n", "\"a.h\"\"b.h\"");
+    test_scan_includes("#include \"a//b.h\"\n", "\"a//b.h\"");
+}
+
+static void test_scan_includes_literals(void)
+{
+    test_scan_includes("x = \"\\\"#include <a.h>\";\n", "");
+    test_scan_includes("c = '\"';\n#include <a.h>\n", "<a.h>");
+    test_scan_includes("x = \"\\\n#include <a.h>\";\n", "");
+}
+
+static void test_scan_includes_splices(void)
+{
+    test_scan_includes("#inc\\\nlude \"a.h\"\n", "\"a.h\"");
+    test_scan_includes("#include \\\r\n<a.h>\n", "<a.h>");
+    test_scan_includes("// comment \\\n#include \"a.h\"\n#include \"b.h\"", "\"b.h\"");
+}
+
+static int record_position(void *arg, const include_directive *inc)
+{
+    string_buffer *found = (string_buffer *) arg;
+    return try_buffer_printf(found, "%lu-%lu:%lu ", (unsigned long) inc->begin,
+                             (unsigned long) inc->end, (unsigned long) inc->next_line);
+}
+
+/* Checks the offsets and line numbers of the directives found in text */
+static void test_include_positions(const char *text, const char *expected)
+{
+    size_t len = strlen(text), split;
+
+    for (split = 0; split <= len; split++)
+    {
+        source_text src;
+        string_buffer found = { NULL, 0, 0 };
+
+        source_from_memory(&src, "test.cl", text, split);
+        if (split < len)
+            add_source_chunk(&src, text + split, len - split);
+        CU_ASSERT_EQUAL(scan_includes(&src, record_position, &found), 0);
+        buffer_append(&found, "", 1);
+        CU_ASSERT_STRING_EQUAL(found.data, expected);
+        free(found.data);
+        free_source(&src);
+    }
+}
+
+static void test_scan_includes_positions(void)
+{
+    test_include_positions("#include \"a.h\"\nx\n#pragma once\n", "0-15:2 17-30:4 ");
+    test_include_positions("x\n  #include \\\n<a.h>\ny", "2-21:4 ");
+    test_include_positions("/* a\nb */ #include <a.h>", "0-24:2 ");
+}
+
+static int record_conditional(void *arg, const include_directive *inc)
+{
+    string_buffer *found = (string_buffer *) arg;
+    return try_buffer_printf(found, "%u ", inc->conditional);
+}
+
+static void test_scan_includes_conditionals(void)
+{
+    const char *text = "#include <a.h>\n#if X\n#ifdef Y\n#pragma once\n#endif\n#include <b.h>\n"
+        "#else\n# ifndef Z\n#include <c.h>\n#endif\n#endif\n#iffy\n#endif\n#endif\n#include <d.h>\n";
+    source_text src;
+    string_buffer found = { NULL, 0, 0 };
+
+    source_from_memory(&src, "test.cl", text, strlen(text));
+    CU_ASSERT_EQUAL(scan_includes(&src, record_conditional, &found), 0);
+    buffer_append(&found, "", 1);
+    CU_ASSERT_STRING_EQUAL(found.data, "0 2 1 2 0 ");
+    free(found.data);
+    free_source(&src);
+}
+
+static void test_symbol_name(const char *symbol, const char *output_filename, int index,
+                             const char *expected)
+{
+    char *name = symbol_name(symbol, output_filename, index);
+    CU_ASSERT_STRING_EQUAL(name, expected);
+    free(name);
+}
+
+static void test_symbol_name_output(void)
+{
+    test_symbol_name(NULL, "out/kernel.c", -1, "kernel");
+    test_symbol_name(NULL, "my-kernel.v2.o", -1, "my_kernel_v2");
+    test_symbol_name(NULL, "2d.h", -1, "_2d");
+    test_symbol_name(NULL, ".hidden", -1, "_hidden");
+    test_symbol_name(NULL, "kernel.o", 3, "kernel_3");
+}
+
+static void test_symbol_name_given(void)
+{
+    test_symbol_name("blob", "out/kernel.c", -1, "blob");
+    test_symbol_name("blob", "out/kernel.c", 0, "blob_0");
+}
+
+static void set_fat_entry(fat_entry *entry, char *device, char *driver, const char *options,
+                          const char *binary)
+{
+    entry->meta.device = device;
+    entry->meta.device_version = driver;
+    entry->meta.driver_version = driver;
+    entry->options = options;
+    entry->binary = (const unsigned char *) binary;
+    entry->size = strlen(binary);
+}
+
+static void test_fat_binary_find(void)
+{
+    char gpu[] = "GPU", cpu[] = "CPU", v1[] = "1.0", v2[] = "2.0";
+    fat_entry entries[4];
+    string_buffer buf = { NULL, 0, 0 };
+    clcfat *fat;
+    const unsigned char *binary;
+    size_t size;
+
+    set_fat_entry(&entries[0], gpu, v1, "-DN=1 ", "gpu1");
+    set_fat_entry(&entries[1], gpu, v1, "-DN=2 ", "gpu2");
+    set_fat_entry(&entries[2], cpu, v2, "-DN=1 ", "cpu1");
+    set_fat_entry(&entries[3], gpu, v1, "-DN=1 ", "duplicate");
+    format_fat_binary(&buf, entries, 4);
+    CU_ASSERT_EQUAL_FATAL(clcfat_open_memory(buf.data, buf.len, &fat), CLCFAT_SUCCESS);
+
+    CU_ASSERT_EQUAL(clcfat_find(fat, "GPU", "1.0", "-DN=2", &binary, &size), CLCFAT_SUCCESS);
+    CU_ASSERT(size == 4 && 0 == memcmp(binary, "gpu2", 4));
+    CU_ASSERT((binary - (const unsigned char *) buf.data) % 4096 == 0);
+    CU_ASSERT_EQUAL(clcfat_find(fat, "GPU", "1.0", " -DN=1", &binary, &size), CLCFAT_SUCCESS);
+    CU_ASSERT(size == 4 && 0 == memcmp(binary, "gpu1", 4));
+    CU_ASSERT_EQUAL(clcfat_find(fat, "CPU", "2.0", "-DN=1", &binary, &size), CLCFAT_SUCCESS);
+    CU_ASSERT(size == 4 && 0 == memcmp(binary, "cpu1", 4));
+    CU_ASSERT_EQUAL(clcfat_find(fat, "CPU", "1.0", "-DN=1", &binary, &size), CLCFAT_NO_MATCH);
+    CU_ASSERT_EQUAL(clcfat_find(fat, "GPU", "1.0", NULL, &binary, &size), CLCFAT_NO_MATCH);
+    clcfat_close(fat);
+    free(buf.data);
+}
+
+static void test_fat_binary_invalid(void)
+{
+    char gpu[] = "GPU", v1[] = "1.0";
+    fat_entry entry;
+    string_buffer buf = { NULL, 0, 0 };
+    clcfat *fat;
+
+    set_fat_entry(&entry, gpu, v1, "", "binary");
+    format_fat_binary(&buf, &entry, 1);
+    /* Cut off the end of the binary */
+    CU_ASSERT_EQUAL(clcfat_open_memory(buf.data, buf.len - 1, &fat), CLCFAT_INVALID_FILE);
+    CU_ASSERT_EQUAL(clcfat_open_memory(buf.data, CLCFAT_HEADER_SIZE - 1, &fat), CLCFAT_INVALID_FILE);
+    buf.data[8] = 2;
+    CU_ASSERT_EQUAL(clcfat_open_memory(buf.data, buf.len, &fat), CLCFAT_INVALID_FILE);
+    free(buf.data);
+}
+
+static void test_fat_options_hash(void)
+{
+    CU_ASSERT(clcfat_options_hash(NULL) == clcfat_options_hash(""));
+    CU_ASSERT(clcfat_options_hash(" ") == clcfat_options_hash(""));
+    CU_ASSERT(clcfat_options_hash("-DA\t -DB ") == clcfat_options_hash("-DA -DB"));
+    CU_ASSERT(clcfat_options_hash("-DA -DB") != clcfat_options_hash("-DA-DB"));
+    CU_ASSERT(clcfat_options_hash("-DA") != clcfat_options_hash("-DB"));
+}
+
+static void test_depfile_name(void)
+{
+    compiler_options options;
+    char *name;
+
+    options.depfile_filename = NULL;
+    name = depfile_name(&options, "out/kernel.bin");
+    CU_ASSERT_STRING_EQUAL(name, "out/kernel.d");
+    free(name);
+    name = depfile_name(&options, "out.dir/kernel");
+    CU_ASSERT_STRING_EQUAL(name, "out.dir/kernel.d");
+    free(name);
+    name = depfile_name(&options, ".hidden");
+    CU_ASSERT_STRING_EQUAL(name, ".hidden.d");
+    free(name);
+    options.depfile_filename = "deps.mk";
+    name = depfile_name(&options, "kernel.bin");
+    CU_ASSERT_STRING_EQUAL(name, "deps.mk");
+    free(name);
+}
+
 int main(void)
 {
     int ret;
@@ -720,9 +10019,68 @@ int main(void)
         { "backslash", test_escape_c_string_backslash },
         CU_TEST_INFO_NULL
     };
+    static CU_TestInfo read_batch_list_tests[] =
+    {
+        { "empty", test_read_batch_list_empty },
+        { "simple", test_read_batch_list_simple },
+        { "skip", test_read_batch_list_skip },
+        CU_TEST_INFO_NULL
+    };
+    static CU_TestInfo sha256_tests[] =
+    {
+        { "empty", test_sha256_empty },
+        { "abc", test_sha256_abc },
+        { "two_blocks", test_sha256_two_blocks },
+        { "million", test_sha256_million },
+        CU_TEST_INFO_NULL
+    };
+    static CU_TestInfo parse_size_tests[] =
+    {
+        { "valid", test_parse_size_valid },
+        { "invalid", test_parse_size_invalid },
+        CU_TEST_INFO_NULL
+    };
+    static CU_TestInfo parse_selector_tests[] =
+    {
+        { "name", test_parse_selector_name },
+        { "keys", test_parse_selector_keys },
+        { "invalid", test_parse_selector_invalid },
+        CU_TEST_INFO_NULL
+    };
+    static CU_TestInfo dependency_tests[] =
+    {
+        { "scan_simple", test_scan_includes_simple },
+        { "scan_comments", test_scan_includes_comments },
+        { "scan_literals", test_scan_includes_literals },
+        { "scan_splices", test_scan_includes_splices },
+        { "scan_positions", test_scan_includes_positions },
+        { "scan_conditionals", test_scan_includes_conditionals },
+        { "depfile_name", test_depfile_name },
+        CU_TEST_INFO_NULL
+    };
+    static CU_TestInfo symbol_name_tests[] =
+    {
+        { "output", test_symbol_name_output },
+        { "given", test_symbol_name_given },
+        CU_TEST_INFO_NULL
+    };
+    static CU_TestInfo fat_binary_tests[] =
+    {
+        { "find", test_fat_binary_find },
+        { "invalid", test_fat_binary_invalid },
+        { "options_hash", test_fat_options_hash },
+        CU_TEST_INFO_NULL
+    };
     static CU_SuiteInfo suites[] =
     {
         { "escape_c_string", NULL, NULL, escape_c_string_tests },
+        { "read_batch_list", NULL, NULL, read_batch_list_tests },
+        { "sha256", NULL, NULL, sha256_tests },
+        { "parse_size", NULL, NULL, parse_size_tests },
+        { "parse_selector", NULL, NULL, parse_selector_tests },
+        { "dependencies", NULL, NULL, dependency_tests },
+        { "symbol_name", NULL, NULL, symbol_name_tests },
+        { "fat_binary", NULL, NULL, fat_binary_tests },
         CU_SUITE_INFO_NULL
     };
 
@@ -0,0 +1,145 @@
+/*  OnlineCLC: Front-end to online OpenCL C compiler
+ *  Copyright (C) 2011  Bruce Merry
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Library interface to onlineclc (libonlineclc), for applications that
+ * build many programs in one process rather than running onlineclc once
+ * per source. It does what the command-line tool does for a single source:
+ * device selection with -b, the binary cache, header bundling, SPIR-V and
+ * --timeout all behave as documented in the README.
+ *
+ * No function exits the process. Each returns a status, and the messages
+ * that onlineclc would have written to stderr are kept for the calling
+ * thread until its next call (see onlineclc_messages). A failed call
+ * releases what it held.
+ *
+ * Options and sessions are safe to share between threads once created, and
+ * any number of threads may build at once with the same session.
+ */
+
+#ifndef ONLINECLC_H
+#define ONLINECLC_H
+
+#include <stddef.h>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Parsed options, as given on the command line */
+typedef struct onlineclc_options onlineclc_options;
+
+/* A selected device, and a context on it created when first needed */
+typedef struct onlineclc_session onlineclc_session;
+
+typedef enum
+{
+    ONLINECLC_SUCCESS = 0,
+    ONLINECLC_BUILD_FAILED,         /* the source did not build (see the build log) */
+    ONLINECLC_TIMED_OUT,            /* the build was abandoned at the --timeout deadline */
+    ONLINECLC_INVALID_ARGUMENTS,    /* the options are not valid */
+    ONLINECLC_ERROR                 /* anything else, described by onlineclc_messages */
+} onlineclc_status;
+
+/* Parses options for the compiler and for onlineclc itself, as they would
+ * be given to onlineclc but without the program name or the source. Modes
+ * of the command-line tool (--batch, --server, --link, --all-devices,
+ * --sweep and --watch) are not accepted, and options that only concern its
+ * output files (such as -o and -MD) are ignored. Nor is --icd (or
+ * $ONLINECLC_ICD) accepted, since OpenCL comes from whatever the program is
+ * linked with, nor --mem-budget, --time or --trace, which measure the
+ * whole process. The arguments are copied. On success, *options is set to a
+ * handle to be released with onlineclc_options_free.
+ */
+onlineclc_status onlineclc_options_create(int argc, const char * const *argv, onlineclc_options **options);
+
+void onlineclc_options_free(onlineclc_options *options);
+
+/* Selects the device named by the -b option (and uses the --cache-dir
+ * device map, if any). On success, *session is set to a handle to be
+ * released with onlineclc_session_free once no other call is using it.
+ */
+onlineclc_status onlineclc_session_create(const onlineclc_options *options, onlineclc_session **session);
+
+void onlineclc_session_free(onlineclc_session *session);
+
+cl_device_id onlineclc_session_device(const onlineclc_session *session);
+
+/* Stores the session's context in *ctx, creating it if necessary. The
+ * context belongs to the session.
+ */
+onlineclc_status onlineclc_session_context(onlineclc_session *session, cl_context *ctx);
+
+/* Creates a program from source (OpenCL C, or a SPIR-V module) of size
+ * bytes and builds it for the session's device. name is shown in messages
+ * and #line directives, and -I paths are relative to it. The cache is not
+ * used. On success or ONLINECLC_BUILD_FAILED, *program is set to the
+ * program, which the caller must release; otherwise it is not set.
+ */
+onlineclc_status onlineclc_build_program(onlineclc_session *session, const onlineclc_options *options,
+                                         const char *name, const void *source, size_t size,
+                                         cl_program *program);
+
+/* Retrieves the build log of a program for the session's device. *log is
+ * set to a NUL-terminated string (to be released with onlineclc_free) or
+ * NULL if the log is empty, and *len to its length.
+ */
+onlineclc_status onlineclc_get_build_log(const onlineclc_session *session, cl_program program,
+                                         char **log, size_t *len);
+
+/* Retrieves the binary of a program for the session's device. *binary is
+ * set to the binary, to be released with onlineclc_free, and *size to its
+ * size.
+ */
+onlineclc_status onlineclc_get_binary(const onlineclc_session *session, cl_program program,
+                                      unsigned char **binary, size_t *size);
+
+/* Builds source as onlineclc does, fetching the result from the cache if
+ * --cache-dir was given. On success, if binary is not NULL, *binary is set
+ * to the binary (to be released with onlineclc_free) and *binary_size to its
+ * size. The build log, preceded by any warnings, goes to the messages; but
+ * if log is not NULL and the source was built (or failed to build, or timed
+ * out), it is moved to *log instead (to be released with onlineclc_free, or
+ * NULL if empty) and its length stored in *log_len.
+ */
+onlineclc_status onlineclc_compile(onlineclc_session *session, const onlineclc_options *options,
+                                   const char *name, const void *source, size_t size,
+                                   char **log, size_t *log_len,
+                                   unsigned char **binary, size_t *binary_size);
+
+/* Releases memory returned by the library */
+void onlineclc_free(void *ptr);
+
+/* The messages written by the calling thread's last call into the library
+ * (empty if there were none). The string is valid until the thread's next
+ * call.
+ */
+const char *onlineclc_messages(void);
+
+/* Describes a status, for messages */
+const char *onlineclc_status_string(onlineclc_status status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ONLINECLC_H */
@@ -1,10 +1,8 @@
 #!/bin/sh
 
 # TODO:
-# - check that -o /dev/stdout doesn't do anything too nasty
 # - check that -I and -D work
 # - fault injection on malloc()
-# - mocking of CL functions to test zero platforms, zero devices, query failures etc.
 
 set -e
 
@@ -12,6 +10,12 @@ TESTDIR=../tests
 BUILDDIR=.
 PROGRAM=$BUILDDIR/onlineclc-cov
 PROGRAM_CUNIT=$BUILDDIR/onlineclc-test
+# Loads fat binaries with the clcfat library, built from fatload.c
+FATLOAD=$BUILDDIR/fatload
+# Builds sources concurrently with libonlineclc, built from libbuild.c
+LIBBUILD=$BUILDDIR/libbuild
+# Runs the program against the stub libOpenCL built from mockcl.c
+MOCK="env LD_LIBRARY_PATH=$BUILDDIR/mock"
 STDERR='(?:Warning: multiple devices match, using the first one\n)?'
 
 qmtest create-tdb
@@ -65,6 +69,60 @@ qmtest create -i cmdparse.double_output \
     -a exit_code=2 \
     -a arguments="['-o', 'foo', '-o', 'bar', '$TESTDIR/empty.cl']" \
     test command.ExecTest
+qmtest create -i cmdparse.depfile_no_target \
+    -a program="$PROGRAM" \
+    -a stderr="-MD needs -o <outfile> or -MT <target>" \
+    -a exit_code=2 \
+    -a arguments="['-MD', '$TESTDIR/empty.cl']" \
+    test command.ExecTest
+qmtest create -i cmdparse.sweep_invalid \
+    -a program="$PROGRAM" \
+    -a stderr="Invalid sweep \`TILE'" \
+    -a exit_code=2 \
+    -a arguments="['--sweep', 'TILE', '$TESTDIR/empty.cl']" \
+    test command.ExecTest
+qmtest create -i cmdparse.report_without_mode \
+    -a program="$PROGRAM" \
+    -a stderr="--report needs --sweep or --kernel-info" \
+    -a exit_code=2 \
+    -a arguments="['--report', 'out.csv', '$TESTDIR/empty.cl']" \
+    test command.ExecTest
+qmtest create -i cmdparse.verify_runs_without_verify \
+    -a program="$PROGRAM" \
+    -a stderr="--verify-runs needs --verify-binary" \
+    -a exit_code=2 \
+    -a arguments="['--verify-runs', '3', '$TESTDIR/empty.cl']" \
+    test command.ExecTest
+qmtest create -i cmdparse.mem_budget_invalid \
+    -a program="$PROGRAM" \
+    -a stderr="Invalid memory budget \`0'" \
+    -a exit_code=2 \
+    -a arguments="['--mem-budget', '0', '$TESTDIR/empty.cl']" \
+    test command.ExecTest
+qmtest create -i cmdparse.timeout_invalid \
+    -a program="$PROGRAM" \
+    -a stderr="Invalid timeout \`0'" \
+    -a exit_code=2 \
+    -a arguments="['--timeout', '0', '$TESTDIR/empty.cl']" \
+    test command.ExecTest
+qmtest create -i cmdparse.icd_invalid \
+    -a program="$PROGRAM" \
+    -a stderr="Failed to load \`$TESTDIR/empty.cl': .*" \
+    -a exit_code=1 \
+    -a arguments="['--icd', '$TESTDIR/empty.cl', '$TESTDIR/empty.cl']" \
+    test command_regex.ExecTest
+qmtest create -i cmdparse.watch_stdin \
+    -a program="$PROGRAM" \
+    -a stderr="--watch needs a source file, not -" \
+    -a exit_code=2 \
+    -a arguments="['--watch', '-']" \
+    test command.ExecTest
+qmtest create -i cmdparse.emit_stdout_symbol \
+    -a program="$PROGRAM" \
+    -a stderr="--emit needs --symbol when writing to stdout" \
+    -a exit_code=2 \
+    -a arguments="['--emit', 'c', '-o', '-', '$TESTDIR/empty.cl']" \
+    test command.ExecTest
 qmtest create -i cmdparse.end_machine \
     -a program="$PROGRAM" \
     -a stderr='Source file not specified\n.*' \
@@ -78,6 +136,25 @@ qmtest create -i cmdparse.end_output \
     -a arguments="['-o', 'foo']" \
     test command_regex.ExecTest
 
+qmtest create -i cmdparse.batch_output \
+    -a program="$PROGRAM" \
+    -a stderr="-o cannot be used with --batch" \
+    -a exit_code=2 \
+    -a arguments="['-o', 'foo', '--batch', 'list']" \
+    test command.ExecTest
+qmtest create -i cmdparse.bad_jobs \
+    -a program="$PROGRAM" \
+    -a stderr="Invalid job count \`x'" \
+    -a exit_code=2 \
+    -a arguments="['-j', 'x', '$TESTDIR/empty.cl']" \
+    test command.ExecTest
+qmtest create -i cmdparse.server_options \
+    -a program="$PROGRAM" \
+    -a stderr="--server only accepts the -j, --mem-budget, --timeout and --icd options" \
+    -a exit_code=2 \
+    -a arguments="['-o', 'foo', '--server', 'sock']" \
+    test command.ExecTest
+
 qmtest create -i compile.empty \
     -a program="$PROGRAM" \
     -a stderr="$STDERR" \
@@ -120,6 +197,12 @@ qmtest create -i compile.overwrite_output \
     -a command="$PROGRAM -o \$QMV_ONLINECLC_TMP_DIR/test-overwrite_output.out $TESTDIR/empty.cl && $PROGRAM -o \$QMV_ONLINECLC_TMP_DIR/test-overwrite_output.out $TESTDIR/empty.cl" \
     -a resources="['tmpdir']" \
     test command_regex.ShellCommandTest
+qmtest create -i compile.dangling_symlink_output \
+    -a exit_code=0 \
+    -a stderr="$STDERR" \
+    -a command="rm -f \$QMV_ONLINECLC_TMP_DIR/test-dangling.out \$QMV_ONLINECLC_TMP_DIR/test-dangling.link && ln -s test-dangling.out \$QMV_ONLINECLC_TMP_DIR/test-dangling.link && $PROGRAM -o \$QMV_ONLINECLC_TMP_DIR/test-dangling.link $TESTDIR/empty.cl && test -L \$QMV_ONLINECLC_TMP_DIR/test-dangling.link && test -s \$QMV_ONLINECLC_TMP_DIR/test-dangling.out" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
 qmtest create -i compile.bad_option \
     -a program="$PROGRAM" \
     -a exit_code=1 \
@@ -127,10 +210,481 @@ qmtest create -i compile.bad_option \
     -a arguments="['-bad-cmdline-option', '$TESTDIR/empty.cl']" \
     test command_regex.ExecTest
 
-# Doesn't pass because stdout is a pipe
-#qmtest create -i compile.log_stdout \
-#    -a program="$PROGRAM" \
-#    -a stdout='.+' \
-#    -a exit_code=0 \
-#    -a arguments="['-o', '/dev/stdout', 'empty.cl']" \
-#    test command_regex.ExecTest
+qmtest create -i compile.stdin \
+    -a exit_code=0 \
+    -a stderr="$STDERR" \
+    -a command="cat $TESTDIR/empty.cl | $PROGRAM -o \$QMV_ONLINECLC_TMP_DIR/test-stdin.out - && test -s \$QMV_ONLINECLC_TMP_DIR/test-stdin.out" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i compile.stdin_invalid \
+    -a exit_code=1 \
+    -a stderr='.+' \
+    -a command="cat $TESTDIR/invalid.cl | $PROGRAM -" \
+    test command_regex.ShellCommandTest
+qmtest create -i compile.time \
+    -a program="$PROGRAM" \
+    -a stderr="$STDERR(?:Time: .*\n)*Time: build .*" \
+    -a exit_code=0 \
+    -a arguments="['--time', '$TESTDIR/empty.cl']" \
+    test command_regex.ExecTest
+qmtest create -i compile.trace \
+    -a exit_code=0 \
+    -a stderr="$STDERR$STDERR" \
+    -a command="rm -f \$QMV_ONLINECLC_TMP_DIR/test-trace.json && $PROGRAM --trace \$QMV_ONLINECLC_TMP_DIR/test-trace.json $TESTDIR/empty.cl && $PROGRAM --trace \$QMV_ONLINECLC_TMP_DIR/test-trace.json $TESTDIR/empty.cl && test \$(grep -c '^\\[' \$QMV_ONLINECLC_TMP_DIR/test-trace.json) = 1 && test \$(grep -c '\"name\":\"build\"' \$QMV_ONLINECLC_TMP_DIR/test-trace.json) = 2" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i compile.all_devices \
+    -a exit_code=0 \
+    -a stderr="Device 0: .*" \
+    -a command="$PROGRAM --all-devices -o \$QMV_ONLINECLC_TMP_DIR/test-all.out $TESTDIR/empty.cl && test -s \$QMV_ONLINECLC_TMP_DIR/test-all.out.0" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i cmdparse.all_devices_batch \
+    -a program="$PROGRAM" \
+    -a stderr="--all-devices cannot be used with --batch or --server" \
+    -a exit_code=2 \
+    -a arguments="['--all-devices', '--batch', 'list']" \
+    test command.ExecTest
+
+qmtest create -i batch.write_output \
+    -a exit_code=0 \
+    -a stderr="$STDERR" \
+    -a command="printf '%s\\t%s\\n' $TESTDIR/empty.cl \$QMV_ONLINECLC_TMP_DIR/test-batch1.out $TESTDIR/empty.cl \$QMV_ONLINECLC_TMP_DIR/test-batch2.out | $PROGRAM -j 2 --batch - && test -f \$QMV_ONLINECLC_TMP_DIR/test-batch1.out && test -f \$QMV_ONLINECLC_TMP_DIR/test-batch2.out" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i batch.invalid \
+    -a exit_code=1 \
+    -a stderr='.+' \
+    -a command="printf '%s\\n' $TESTDIR/invalid.cl $TESTDIR/empty.cl | $PROGRAM --batch -" \
+    test command_regex.ShellCommandTest
+
+qmtest create -i server.write_output \
+    -a exit_code=0 \
+    -a stderr="$STDERR" \
+    -a command="$PROGRAM --server \$QMV_ONLINECLC_TMP_DIR/server.sock & pid=\$!; sleep 1; ONLINECLC_SERVER=\$QMV_ONLINECLC_TMP_DIR/server.sock $PROGRAM -o \$QMV_ONLINECLC_TMP_DIR/test-server.out $TESTDIR/empty.cl; ret=\$?; kill \$pid; test \$ret = 0 && test -f \$QMV_ONLINECLC_TMP_DIR/test-server.out" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i server.invalid \
+    -a exit_code=1 \
+    -a stderr='.+' \
+    -a command="$PROGRAM --server \$QMV_ONLINECLC_TMP_DIR/server-invalid.sock & pid=\$!; sleep 1; ONLINECLC_SERVER=\$QMV_ONLINECLC_TMP_DIR/server-invalid.sock $PROGRAM $TESTDIR/invalid.cl; ret=\$?; kill \$pid; exit \$ret" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+
+qmtest create -i cache.hit \
+    -a exit_code=0 \
+    -a stderr="$STDERR$STDERR" \
+    -a command="$PROGRAM --cache-dir \$QMV_ONLINECLC_TMP_DIR/cache -o \$QMV_ONLINECLC_TMP_DIR/test-cache1.out $TESTDIR/empty.cl && $PROGRAM --cache-dir \$QMV_ONLINECLC_TMP_DIR/cache -o \$QMV_ONLINECLC_TMP_DIR/test-cache2.out $TESTDIR/empty.cl && cmp \$QMV_ONLINECLC_TMP_DIR/test-cache1.out \$QMV_ONLINECLC_TMP_DIR/test-cache2.out && test \$(ls \$QMV_ONLINECLC_TMP_DIR/cache | wc -l) = 1" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i cache.invalid \
+    -a exit_code=1 \
+    -a stderr='.+' \
+    -a command="$PROGRAM --cache-dir \$QMV_ONLINECLC_TMP_DIR/cache-invalid $TESTDIR/invalid.cl" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i cmdparse.bad_cache_size \
+    -a program="$PROGRAM" \
+    -a stderr="Invalid cache size \`1x'" \
+    -a exit_code=2 \
+    -a arguments="['--cache-size', '1x', '$TESTDIR/empty.cl']" \
+    test command.ExecTest
+
+qmtest create -i compile.log_stdout \
+    -a program="$PROGRAM" \
+    -a stdout='.+' \
+    -a stderr="$STDERR" \
+    -a exit_code=0 \
+    -a arguments="['-o', '/dev/stdout', '$TESTDIR/empty.cl']" \
+    test command_regex.ExecTest
+qmtest create -i compile.depfile \
+    -a exit_code=0 \
+    -a stdout=".*/test-depfile\\.out: $TESTDIR/deps.cl \\\\\n $TESTDIR/deps.h \\\\\n $TESTDIR/include/deps_inc.h" \
+    -a stderr="$STDERR" \
+    -a command="$PROGRAM -MD -I $TESTDIR/include -o \$QMV_ONLINECLC_TMP_DIR/test-depfile.out $TESTDIR/deps.cl && cat \$QMV_ONLINECLC_TMP_DIR/test-depfile.d" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i compile.depfile_options \
+    -a program="$PROGRAM" \
+    -a stdout="kernel\\\\ one\\.bin: $TESTDIR/deps.cl \\\\\n $TESTDIR/deps.h \\\\\n $TESTDIR/include/deps_inc.h\n\n$TESTDIR/deps.h:\n\n$TESTDIR/include/deps_inc.h:" \
+    -a stderr="$STDERR" \
+    -a exit_code=0 \
+    -a arguments="['-MD', '-MP', '-MF', '-', '-MT', 'kernel one.bin', '-I$TESTDIR/include', '$TESTDIR/deps.cl']" \
+    test command_regex.ExecTest
+qmtest create -i compile.output_dash \
+    -a program="$PROGRAM" \
+    -a stdout='.+' \
+    -a stderr="$STDERR" \
+    -a exit_code=0 \
+    -a arguments="['-o', '-', '$TESTDIR/empty.cl']" \
+    test command_regex.ExecTest
+qmtest create -i compile.output_pipe \
+    -a exit_code=0 \
+    -a stderr="$STDERR$STDERR" \
+    -a command="$PROGRAM -o \$QMV_ONLINECLC_TMP_DIR/test-output_pipe.out $TESTDIR/empty.cl && $PROGRAM -o /dev/stdout $TESTDIR/empty.cl | cmp - \$QMV_ONLINECLC_TMP_DIR/test-output_pipe.out" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+
+# Tests using the stub OpenCL library
+qmtest create -i mock.no_platforms \
+    -a exit_code=1 \
+    -a stderr="No OpenCL platforms found" \
+    -a command="$MOCK MOCKCL_PLATFORMS=0 $PROGRAM $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.no_devices \
+    -a exit_code=1 \
+    -a stderr="No OpenCL devices found" \
+    -a command="$MOCK MOCKCL_DEVICES=0 $PROGRAM $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.platform_query_fails \
+    -a exit_code=1 \
+    -a stderr="Failed to get platform ID count: Error code -6 \\(CL_OUT_OF_HOST_MEMORY\\)" \
+    -a command="$MOCK MOCKCL_FAIL=clGetPlatformIDs=-6 $PROGRAM $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.device_query_fails \
+    -a exit_code=1 \
+    -a stderr="Failed to get device ID count: Error code -5 \\(CL_OUT_OF_RESOURCES\\)" \
+    -a command="$MOCK MOCKCL_FAIL=clGetDeviceIDs=-5 $PROGRAM $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.context_fails \
+    -a exit_code=1 \
+    -a stderr="Failed to create OpenCL context: Error code -6 \\(CL_OUT_OF_HOST_MEMORY\\)" \
+    -a command="$MOCK MOCKCL_FAIL=clCreateContext=-6 $PROGRAM $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.binary_query_fails \
+    -a exit_code=1 \
+    -a stderr="Failed to query number of devices from program: Error code -5 \\(CL_OUT_OF_RESOURCES\\)" \
+    -a command="$MOCK MOCKCL_FAIL=clGetProgramInfo=-5 $PROGRAM -o \$QMV_ONLINECLC_TMP_DIR/test-mock.out $TESTDIR/empty.cl" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.multiple_devices \
+    -a exit_code=0 \
+    -a stderr="Warning: multiple devices match, using the first one" \
+    -a command="$MOCK MOCKCL_PLATFORMS=2 $PROGRAM $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.select_device \
+    -a exit_code=0 \
+    -a stderr="" \
+    -a command="$MOCK MOCKCL_PLATFORMS=2 MOCKCL_DEVICES=2 $PROGRAM -b 'Mock Device 1.1' $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.selector \
+    -a exit_code=0 \
+    -a stderr="Device 0: Mock Device 1.1" \
+    -a command="$MOCK MOCKCL_PLATFORMS=2 MOCKCL_DEVICES=2 $PROGRAM -b platform:1/device:1 --all-devices -o \$QMV_ONLINECLC_TMP_DIR/test-mock_selector.out $TESTDIR/empty.cl" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.selector_type \
+    -a exit_code=0 \
+    -a stderr="Device 0: Mock Device 0.1\nDevice 1: Mock Device 0.3" \
+    -a command="$MOCK MOCKCL_DEVICES=4 MOCKCL_DEVICE_TYPES=cpu,gpu $PROGRAM -b type:gpu --all-devices -o \$QMV_ONLINECLC_TMP_DIR/test-mock_selector_type.out $TESTDIR/empty.cl" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.selector_no_platform \
+    -a exit_code=1 \
+    -a stderr="No OpenCL platform 2 found \\(there are 2\\)" \
+    -a command="$MOCK MOCKCL_PLATFORMS=2 $PROGRAM -b platform:2 $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.selector_no_match \
+    -a exit_code=1 \
+    -a stderr="No OpenCL device matches \`type:gpu'" \
+    -a command="$MOCK $PROGRAM -b type:gpu $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.no_compiler \
+    -a exit_code=1 \
+    -a stderr="No OpenCL device matching \`type:cpu' has a compiler" \
+    -a command="$MOCK MOCKCL_NO_COMPILER=cpu $PROGRAM -b type:cpu $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.no_compiler_skipped \
+    -a exit_code=0 \
+    -a stderr="" \
+    -a command="$MOCK MOCKCL_DEVICES=2 MOCKCL_DEVICE_TYPES=cpu,gpu MOCKCL_NO_COMPILER=cpu $PROGRAM $TESTDIR/empty.cl > /dev/null" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.selector_invalid \
+    -a exit_code=2 \
+    -a stderr="Invalid device selector \`device:first'" \
+    -a command="$MOCK $PROGRAM -b device:first $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.platforms_concurrent \
+    -a exit_code=0 \
+    -a command="start=\$(date +%s); $MOCK MOCKCL_PLATFORMS=4 MOCKCL_DEVICE_DELAY_MS=1000 $PROGRAM -b 'Mock Device 3.0' $TESTDIR/empty.cl && test \$((\$(date +%s) - start)) -lt 6" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.device_map \
+    -a exit_code=0 \
+    -a stdout="1" \
+    -a command="$MOCK MOCKCL_PLATFORMS=4 $PROGRAM --cache-dir \$QMV_ONLINECLC_TMP_DIR/mock-map -b 'Mock Device 2.0' $TESTDIR/empty.cl && $MOCK MOCKCL_PLATFORMS=4 MOCKCL_DEVICE_LOG=\$QMV_ONLINECLC_TMP_DIR/mock-map.log $PROGRAM --cache-dir \$QMV_ONLINECLC_TMP_DIR/mock-map -b 'Mock Device 2.0' $TESTDIR/empty.cl && grep -c . \$QMV_ONLINECLC_TMP_DIR/mock-map.log" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.device_map_stale \
+    -a exit_code=0 \
+    -a command="$MOCK MOCKCL_PLATFORMS=4 $PROGRAM --cache-dir \$QMV_ONLINECLC_TMP_DIR/mock-map-stale -b 'Mock Device 2.0' $TESTDIR/empty.cl && $MOCK MOCKCL_PLATFORMS=4 MOCKCL_DEVICES=2 $PROGRAM --cache-dir \$QMV_ONLINECLC_TMP_DIR/mock-map-stale -b 'Mock Device 2.1' $TESTDIR/empty.cl" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.build_log \
+    -a exit_code=0 \
+    -a stderr="a warning from the compiler" \
+    -a command="$MOCK 'MOCKCL_BUILD_LOG=a warning from the compiler' $PROGRAM $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.build_stats \
+    -a exit_code=0 \
+    -a stderr="Build: [0-9.]+ ms CPU, peak RSS \\+(6[0-9]|7[0-9])\\.[0-9] MiB\n" \
+    -a command="$MOCK MOCKCL_BUILD_ALLOC_MB=64 MOCKCL_BUILD_DELAY_MS=50 $PROGRAM --build-stats $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.mem_budget \
+    -a exit_code=0 \
+    -a command="printf '%s\\n' $TESTDIR/empty.cl $TESTDIR/deps.cl $TESTDIR/empty.cl $TESTDIR/deps.cl | $MOCK MOCKCL_BUILD_ALLOC_MB=32 MOCKCL_BUILD_DELAY_MS=50 MOCKCL_MAX_BUILDS=1 $PROGRAM --mem-budget 48M --cache-dir \$QMV_ONLINECLC_TMP_DIR/mem-budget -I $TESTDIR/include -j 4 --batch - && grep -q ' .*/deps.cl\$' \$QMV_ONLINECLC_TMP_DIR/mem-budget/memory-usage" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.mem_budget_timeout \
+    -a exit_code=124 \
+    -a stderr="Build of \`.*' timed out after 0.5 s\nBuild of \`.*' timed out after 0.5 s\n" \
+    -a command="printf '%s\\n' $TESTDIR/empty.cl $TESTDIR/deps.cl | $MOCK MOCKCL_SOURCE_DELAY_MS=1500 MOCKCL_MAX_BUILDS=1 $PROGRAM --mem-budget 1M -I $TESTDIR/include -j 2 --timeout 0.5 --batch -" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.timeout \
+    -a exit_code=124 \
+    -a stderr="Build of \`.*empty.cl' timed out after 0.5 s\n" \
+    -a command="$MOCK MOCKCL_SLOW_OPTION=-DSLOW $PROGRAM --timeout 0.5 -DSLOW $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.timeout_async \
+    -a exit_code=124 \
+    -a stderr="Build of \`.*empty.cl' timed out after 0.5 s\n" \
+    -a command="$MOCK MOCKCL_ASYNC=1 MOCKCL_SLOW_OPTION=-DSLOW $PROGRAM --timeout 0.5 -DSLOW $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.timeout_sweep \
+    -a exit_code=124 \
+    -a stdout="variant,.*\n0,-DN=1,ok,.*\n1,-DN=2,timeout,.*\n2,-DN=3,ok,[^\n]*" \
+    -a stderr="Build of \`.*empty.cl' timed out after 0.5 s\nVariant 0: -DN=1\nVariant 1: -DN=2\nVariant 2: -DN=3\n" \
+    -a command="$MOCK MOCKCL_SLOW_OPTION=-DN=2 $PROGRAM --timeout 0.5 --sweep N=1,2,3 $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.sweep \
+    -a exit_code=0 \
+    -a stdout="variant,options,status,build_ms,cpu_ms,peak_rss_mb,binary_size,kernel,work_group_size,compile_work_group_size,preferred_work_group_size_multiple,local_mem_size,private_mem_size,warnings\n0,-DTILE=4 -DUNROLL=1,ok,[0-9.]+,[0-9.]+,[0-9.]+,[0-9]+,deps,256,,32,64,0,.*\n1,-DTILE=4 -DUNROLL=2,ok,.*\n2,-DTILE=8 -DUNROLL=1,ok,.*\n3,-DTILE=8 -DUNROLL=2,ok,[^\n]*" \
+    -a stderr="Variant 0: -DTILE=4 -DUNROLL=1\nVariant 1: -DTILE=4 -DUNROLL=2\nVariant 2: -DTILE=8 -DUNROLL=1\nVariant 3: -DTILE=8 -DUNROLL=2" \
+    -a command="$MOCK MOCKCL_LOCAL_MEM=64 $PROGRAM --sweep TILE=4,8 --sweep UNROLL=1,2 -o \$QMV_ONLINECLC_TMP_DIR/test-sweep.out -I $TESTDIR/include $TESTDIR/deps.cl && test -s \$QMV_ONLINECLC_TMP_DIR/test-sweep.out.3" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.sweep_json \
+    -a exit_code=1 \
+    -a stdout=".*\"options\": \"-DN=1\",\n      \"status\": \"ok\".*\"kernels\": \\[\\n        \\{\"name\": \"deps\".*\"options\": \"-DN=2\",\n      \"status\": \"failed\".*" \
+    -a stderr="Variant 0: -DN=1\nVariant 1: -DN=2\n.+" \
+    -a command="$MOCK MOCKCL_ERROR_OPTION=-DN=2 $PROGRAM --sweep N=1,2 --report-format json --report \$QMV_ONLINECLC_TMP_DIR/test-sweep.json -I $TESTDIR/include $TESTDIR/deps.cl; status=\$?; cat \$QMV_ONLINECLC_TMP_DIR/test-sweep.json; exit \$status" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.kernel_info \
+    -a exit_code=0 \
+    -a stderr="Kernel deps:\n    Work-group size: +256\n    Preferred work-group size multiple: +32\n    Local memory: +20000 bytes\n    Private memory: +16 bytes\nWarning: kernel \`deps' uses 16 bytes of private memory per work-item.*\nWarning: kernel \`deps' can only run 256 work-items per group.*\nWarning: kernel \`deps' uses 20000 bytes of local memory.*" \
+    -a command="$MOCK MOCKCL_PRIVATE_MEM=16 MOCKCL_LOCAL_MEM=20000 $PROGRAM --kernel-info -I $TESTDIR/include $TESTDIR/deps.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.kernel_info_report \
+    -a exit_code=0 \
+    -a stdout=".*\"max_work_group_size\": 1024,\n  \"local_mem_size\": 32768,\n  \"kernels\": \\[\n    \\{\"name\": \"deps\", \"work_group_size\": 256, .*\"warnings\": \\[\"can only run 256 work-items per group.*" \
+    -a command="$MOCK $PROGRAM --kernel-info --report-format json --report \$QMV_ONLINECLC_TMP_DIR/test-kernel_info.json -I $TESTDIR/include $TESTDIR/deps.cl 2>/dev/null && cat \$QMV_ONLINECLC_TMP_DIR/test-kernel_info.json" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.emit_c \
+    -a exit_code=0 \
+    -a stderr="Mock Device 0.0" \
+    -a command="$MOCK $PROGRAM -o \$QMV_ONLINECLC_TMP_DIR/test-emit_c.bin -I $TESTDIR/include $TESTDIR/deps.cl && $MOCK $PROGRAM --emit c --symbol embedded -o \$QMV_ONLINECLC_TMP_DIR/embedded.c -I $TESTDIR/include $TESTDIR/deps.cl && \${CC:-cc} -o \$QMV_ONLINECLC_TMP_DIR/test-emit_c $TESTDIR/embed.c \$QMV_ONLINECLC_TMP_DIR/embedded.c && \$QMV_ONLINECLC_TMP_DIR/test-emit_c > \$QMV_ONLINECLC_TMP_DIR/test-emit_c.out && cmp \$QMV_ONLINECLC_TMP_DIR/test-emit_c.bin \$QMV_ONLINECLC_TMP_DIR/test-emit_c.out" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.emit_header \
+    -a exit_code=0 \
+    -a stderr="Mock Device 0.0" \
+    -a command="$MOCK $PROGRAM -o \$QMV_ONLINECLC_TMP_DIR/test-emit_header.bin -I $TESTDIR/include $TESTDIR/deps.cl && $MOCK $PROGRAM --emit header --symbol embedded -o \$QMV_ONLINECLC_TMP_DIR/embedded.h -I $TESTDIR/include $TESTDIR/deps.cl && \${CC:-cc} -o \$QMV_ONLINECLC_TMP_DIR/test-emit_header -DEMBED_HEADER -include \$QMV_ONLINECLC_TMP_DIR/embedded.h $TESTDIR/embed.c && \$QMV_ONLINECLC_TMP_DIR/test-emit_header > \$QMV_ONLINECLC_TMP_DIR/test-emit_header.out && cmp \$QMV_ONLINECLC_TMP_DIR/test-emit_header.bin \$QMV_ONLINECLC_TMP_DIR/test-emit_header.out" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.emit_elf \
+    -a exit_code=0 \
+    -a stderr="Mock Device 0.0" \
+    -a command="$MOCK $PROGRAM -o \$QMV_ONLINECLC_TMP_DIR/test-emit_elf.bin -I $TESTDIR/include $TESTDIR/deps.cl && $MOCK $PROGRAM --emit elf --symbol embedded -o \$QMV_ONLINECLC_TMP_DIR/embedded.o -I $TESTDIR/include $TESTDIR/deps.cl && \${CC:-cc} -o \$QMV_ONLINECLC_TMP_DIR/test-emit_elf $TESTDIR/embed.c \$QMV_ONLINECLC_TMP_DIR/embedded.o && \$QMV_ONLINECLC_TMP_DIR/test-emit_elf > \$QMV_ONLINECLC_TMP_DIR/test-emit_elf.out && cmp \$QMV_ONLINECLC_TMP_DIR/test-emit_elf.bin \$QMV_ONLINECLC_TMP_DIR/test-emit_elf.out" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.verify_binary \
+    -a exit_code=0 \
+    -a stderr="Binary reload: OK\nSource build: .* over 3 runs\nBinary load: .* over 3 runs\nSpeedup: [0-9.]+x\n\$" \
+    -a command="$MOCK MOCKCL_SOURCE_DELAY_MS=20 $PROGRAM --verify-binary --verify-runs 3 -o \$QMV_ONLINECLC_TMP_DIR/test-verify.out $TESTDIR/empty.cl && test -s \$QMV_ONLINECLC_TMP_DIR/test-verify.out" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.verify_binary_recompiled \
+    -a exit_code=0 \
+    -a stderr="Binary reload: OK\n(?:.*\n){3}Warning: loading the binary is less than 2x faster than building .*empty.cl' from source; the driver may be recompiling it\n" \
+    -a command="$MOCK MOCKCL_BUILD_DELAY_MS=20 $PROGRAM --verify-binary --verify-runs 2 $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.verify_binary_fails \
+    -a exit_code=1 \
+    -a stderr="Failed to load binary from .*empty.cl'.*" \
+    -a command="$MOCK MOCKCL_FAIL=clCreateProgramWithBinary=-42 $PROGRAM --verify-binary $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.emit_fat \
+    -a exit_code=0 \
+    -a stdout="Mock Device 0.0: [0-9]+ bytes\nMock Device 0.1: [0-9]+ bytes\nMock Device 1.0: [0-9]+ bytes\nMock Device 1.1: [0-9]+ bytes\n" \
+    -a command="$MOCK MOCKCL_PLATFORMS=2 MOCKCL_DEVICES=2 $PROGRAM --all-devices --emit fat -o \$QMV_ONLINECLC_TMP_DIR/test-emit_fat.fat $TESTDIR/empty.cl 2> /dev/null && $MOCK MOCKCL_PLATFORMS=2 MOCKCL_DEVICES=2 $FATLOAD \$QMV_ONLINECLC_TMP_DIR/test-emit_fat.fat" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.emit_fat_sweep \
+    -a exit_code=0 \
+    -a stdout="Mock Device 0.0: [0-9]+ bytes\nMock Device 0.0: [0-9]+ bytes\nMock Device 0.0: no match\n" \
+    -a command="$MOCK $PROGRAM --sweep N=1,2 --emit fat -o \$QMV_ONLINECLC_TMP_DIR/test-emit_fat_sweep.fat $TESTDIR/empty.cl > /dev/null 2>&1 && $MOCK $FATLOAD \$QMV_ONLINECLC_TMP_DIR/test-emit_fat_sweep.fat -DN=1 && $MOCK $FATLOAD \$QMV_ONLINECLC_TMP_DIR/test-emit_fat_sweep.fat ' -DN=2 ' && $MOCK $FATLOAD \$QMV_ONLINECLC_TMP_DIR/test-emit_fat_sweep.fat -DN=3" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.emit_fat_invalid \
+    -a exit_code=1 \
+    -a stderr=".*: not a valid fat binary\n" \
+    -a command="$MOCK $FATLOAD $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.library \
+    -a exit_code=1 \
+    -a stdout=".*/empty.cl: success, [0-9]+ bytes\n.*/invalid.cl: build failed\nnot valid CLC code\n.*/deps.cl: success, [0-9]+ bytes\n.*/empty.spv: success, [0-9]+ bytes\n" \
+    -a command="$MOCK MOCKCL_BUILD_DELAY_MS=20 $LIBBUILD -I $TESTDIR/include -- $TESTDIR/empty.cl $TESTDIR/invalid.cl $TESTDIR/deps.cl $TESTDIR/empty.spv" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.library_cache \
+    -a exit_code=0 \
+    -a stdout=".*/empty.cl: success, [0-9]+ bytes\n" \
+    -a command="$MOCK $LIBBUILD --cache-dir \$QMV_ONLINECLC_TMP_DIR/library-cache -- $TESTDIR/empty.cl > /dev/null && $MOCK MOCKCL_FAIL=clBuildProgram=-6 $LIBBUILD --cache-dir \$QMV_ONLINECLC_TMP_DIR/library-cache -- $TESTDIR/empty.cl" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.library_timeout \
+    -a exit_code=1 \
+    -a stdout="(?:.*/empty.cl: build timed out\nBuild of \`.*/empty.cl' timed out after 0.5 s\n){2}" \
+    -a command="$MOCK MOCKCL_SLOW_OPTION=-DSLOW $LIBBUILD --timeout 0.5 -DSLOW -- $TESTDIR/empty.cl $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.library_driver_error \
+    -a exit_code=1 \
+    -a stdout="(?:.*/empty.cl: error\nFailed to build \`.*/empty.cl': Error code -6 \\(CL_OUT_OF_HOST_MEMORY\\)\n){2}" \
+    -a command="$MOCK MOCKCL_FAIL=clBuildProgram=-6 $LIBBUILD --timeout 5 -- $TESTDIR/empty.cl $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.library_bad_device \
+    -a exit_code=2 \
+    -a stderr="error\nNo OpenCL device called \`bad' found\n" \
+    -a command="$MOCK $LIBBUILD -b bad -- $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.library_mode \
+    -a exit_code=2 \
+    -a stderr="invalid arguments\n--batch, --server, --link, --all-devices, --sweep and --watch are not available in the library\n" \
+    -a command="$MOCK $LIBBUILD --sweep N=1,2 -- $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.library_icd \
+    -a exit_code=2 \
+    -a stderr="invalid arguments\n--icd and ONLINECLC_ICD are not available in the library\n" \
+    -a command="$MOCK ONLINECLC_ICD=$BUILDDIR/mock/libOpenCL.so.1 $LIBBUILD -- $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.library_mem_budget \
+    -a exit_code=2 \
+    -a stderr="invalid arguments\n--mem-budget, --time and --trace are not available in the library\n" \
+    -a command="$MOCK $LIBBUILD --mem-budget 1G -- $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.watch \
+    -a exit_code=0 \
+    -a stdout="Built \`.*/deps.cl' in [0-9]+ ms\nBuilt \`.*/deps.cl' in [0-9]+ ms\n#error edit\nBuild of \`.*/deps.cl' failed in [0-9]+ ms\n" \
+    -a command="mkdir \$QMV_ONLINECLC_TMP_DIR/watch && cp $TESTDIR/deps.cl $TESTDIR/deps.h \$QMV_ONLINECLC_TMP_DIR/watch/ && { $MOCK timeout 3 $PROGRAM --watch -I $TESTDIR/include -o \$QMV_ONLINECLC_TMP_DIR/watch/deps.out \$QMV_ONLINECLC_TMP_DIR/watch/deps.cl 2> \$QMV_ONLINECLC_TMP_DIR/watch/log & } && sleep 1 && echo '#define WATCHED' >> \$QMV_ONLINECLC_TMP_DIR/watch/deps.h && sleep 0.5 && echo '#error edit' >> \$QMV_ONLINECLC_TMP_DIR/watch/deps.cl; wait; cat \$QMV_ONLINECLC_TMP_DIR/watch/log && test -s \$QMV_ONLINECLC_TMP_DIR/watch/deps.out" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.watch_supersede \
+    -a exit_code=0 \
+    -a stdout="Built \`.*/empty.cl' in [0-9]+ ms\nBuild of \`.*/empty.cl' superseded by a change\nBuilt \`.*/empty.cl' in [0-9]+ ms\n" \
+    -a command="mkdir \$QMV_ONLINECLC_TMP_DIR/watch_supersede && cp $TESTDIR/empty.cl \$QMV_ONLINECLC_TMP_DIR/watch_supersede/ && { $MOCK MOCKCL_BUILD_DELAY_MS=1000 timeout 4 $PROGRAM --watch \$QMV_ONLINECLC_TMP_DIR/watch_supersede/empty.cl 2> \$QMV_ONLINECLC_TMP_DIR/watch_supersede/log & } && sleep 1.5 && echo '/* first */' >> \$QMV_ONLINECLC_TMP_DIR/watch_supersede/empty.cl && sleep 0.5 && echo '/* second */' >> \$QMV_ONLINECLC_TMP_DIR/watch_supersede/empty.cl; wait; cat \$QMV_ONLINECLC_TMP_DIR/watch_supersede/log" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.icd \
+    -a exit_code=0 \
+    -a stderr="$STDERR" \
+    -a command="env -u LD_LIBRARY_PATH $PROGRAM --icd $BUILDDIR/mock/libOpenCL.so.1 -o \$QMV_ONLINECLC_TMP_DIR/test-mock_icd.out $TESTDIR/empty.cl && test -s \$QMV_ONLINECLC_TMP_DIR/test-mock_icd.out" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.icd_env \
+    -a exit_code=0 \
+    -a stderr="Device 0: Mock Device 0.0\nDevice 1: Mock Device 1.0" \
+    -a command="env -u LD_LIBRARY_PATH ONLINECLC_ICD=$BUILDDIR/mock/libOpenCL.so.1 MOCKCL_PLATFORMS=2 $PROGRAM --all-devices -o \$QMV_ONLINECLC_TMP_DIR/test-mock_icd_env.out $TESTDIR/empty.cl" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.all_devices \
+    -a exit_code=0 \
+    -a stderr="Device 0: Mock Device 0.0\nDevice 1: Mock Device 0.1\nDevice 2: Mock Device 1.0\nDevice 3: Mock Device 1.1" \
+    -a command="$MOCK MOCKCL_PLATFORMS=2 MOCKCL_DEVICES=2 $PROGRAM --all-devices -o \$QMV_ONLINECLC_TMP_DIR/test-mock_all.out $TESTDIR/empty.cl && test -s \$QMV_ONLINECLC_TMP_DIR/test-mock_all.out.3 && ! cmp -s \$QMV_ONLINECLC_TMP_DIR/test-mock_all.out.0 \$QMV_ONLINECLC_TMP_DIR/test-mock_all.out.1" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.cache_skips_build \
+    -a exit_code=0 \
+    -a command="$MOCK $PROGRAM --cache-dir \$QMV_ONLINECLC_TMP_DIR/mock-cache $TESTDIR/empty.cl && $MOCK MOCKCL_FAIL=clBuildProgram=-6 $PROGRAM --cache-dir \$QMV_ONLINECLC_TMP_DIR/mock-cache $TESTDIR/empty.cl" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.cache_header_change \
+    -a exit_code=1 \
+    -a command="cp $TESTDIR/deps.cl $TESTDIR/deps.h \$QMV_ONLINECLC_TMP_DIR/ && $MOCK $PROGRAM --cache-dir \$QMV_ONLINECLC_TMP_DIR/mock-deps-cache -I $TESTDIR/include \$QMV_ONLINECLC_TMP_DIR/deps.cl && $MOCK MOCKCL_FAIL=clBuildProgram=-11 $PROGRAM --cache-dir \$QMV_ONLINECLC_TMP_DIR/mock-deps-cache -I $TESTDIR/include \$QMV_ONLINECLC_TMP_DIR/deps.cl && echo '#define DEPS_CHANGED' >> \$QMV_ONLINECLC_TMP_DIR/deps.h && $MOCK MOCKCL_FAIL=clBuildProgram=-11 $PROGRAM --cache-dir \$QMV_ONLINECLC_TMP_DIR/mock-deps-cache -I $TESTDIR/include \$QMV_ONLINECLC_TMP_DIR/deps.cl" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.bundle_headers \
+    -a exit_code=0 \
+    -a stdout="#line 1 \"$TESTDIR/include/deps_inc\\.h\"\n#define DEPS_INC_VALUE 1" \
+    -a command="$MOCK $PROGRAM --bundle-headers -I $TESTDIR/include -o \$QMV_ONLINECLC_TMP_DIR/test-bundle.out $TESTDIR/deps.cl && grep -A1 '^#line 1 .*deps_inc' \$QMV_ONLINECLC_TMP_DIR/test-bundle.out" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.bundle_once \
+    -a exit_code=0 \
+    -a stdout="#if 0\n#define ONLINECLC_ONCE_0\nint a;\n#endif\n#ifndef ONLINECLC_ONCE_0\n#define ONLINECLC_ONCE_0\nint a;\n#endif /\\* ONLINECLC_ONCE_0 \\*/" \
+    -a command="mkdir -p \$QMV_ONLINECLC_TMP_DIR/bundle_once/sub && printf '#pragma once\\nint a;\\n' > \$QMV_ONLINECLC_TMP_DIR/bundle_once/a.h && printf '#if 0\\n#include \"a.h\"\\n#endif\\n#include \"sub/../a.h\"\\n#include \"a.h\"\\n' > \$QMV_ONLINECLC_TMP_DIR/bundle_once/once.cl && $MOCK $PROGRAM --bundle-headers -o \$QMV_ONLINECLC_TMP_DIR/bundle_once/once.out \$QMV_ONLINECLC_TMP_DIR/bundle_once/once.cl && grep '^#if\\|^#endif\\|^#define\\|^int' \$QMV_ONLINECLC_TMP_DIR/bundle_once/once.out" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.spirv \
+    -a exit_code=0 \
+    -a command="$MOCK MOCKCL_FAIL=clCreateProgramWithSource=-6 $PROGRAM -o \$QMV_ONLINECLC_TMP_DIR/test-spirv.out $TESTDIR/empty.spv && test -s \$QMV_ONLINECLC_TMP_DIR/test-spirv.out" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.spirv_flag \
+    -a exit_code=1 \
+    -a stderr="Failed to load SPIR-V from .*deps.cl'.*" \
+    -a command="$MOCK MOCKCL_FAIL=clCreateProgramWithIL=-30 $PROGRAM --spirv $TESTDIR/deps.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.spirv_cache \
+    -a exit_code=0 \
+    -a command="printf 'kernel void k(void) {}\\n' > \$QMV_ONLINECLC_TMP_DIR/spirv-cache.cl && $MOCK $PROGRAM --cache-dir \$QMV_ONLINECLC_TMP_DIR/spirv-cache -o \$QMV_ONLINECLC_TMP_DIR/test-spirv-cache1.out \$QMV_ONLINECLC_TMP_DIR/spirv-cache.cl && $MOCK $PROGRAM --cache-dir \$QMV_ONLINECLC_TMP_DIR/spirv-cache --spirv -o \$QMV_ONLINECLC_TMP_DIR/test-spirv-cache2.out \$QMV_ONLINECLC_TMP_DIR/spirv-cache.cl && ! cmp -s \$QMV_ONLINECLC_TMP_DIR/test-spirv-cache1.out \$QMV_ONLINECLC_TMP_DIR/test-spirv-cache2.out && test \$(ls \$QMV_ONLINECLC_TMP_DIR/spirv-cache | wc -l) = 2" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.spirv_unsupported \
+    -a exit_code=1 \
+    -a stderr="Device \`Mock Device 0.0' does not accept SPIR-V \\(CL_DEVICE_IL_VERSION is \`'\\)\n" \
+    -a command="$MOCK MOCKCL_IL_VERSION= $PROGRAM $TESTDIR/empty.spv" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.jobserver_fifo \
+    -a exit_code=0 \
+    -a command="mkfifo \$QMV_ONLINECLC_TMP_DIR/test-jobserver.fifo && printf '%s\\n' $TESTDIR/empty.cl $TESTDIR/empty.cl $TESTDIR/empty.cl $TESTDIR/empty.cl | $MOCK MAKEFLAGS=\"-j4 --jobserver-auth=fifo:\$QMV_ONLINECLC_TMP_DIR/test-jobserver.fifo\" MOCKCL_MAX_BUILDS=1 MOCKCL_BUILD_DELAY_MS=50 $PROGRAM -j 4 --batch -" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.jobserver_fds \
+    -a exit_code=0 \
+    -a stdout="2\n" \
+    -a command="mkfifo \$QMV_ONLINECLC_TMP_DIR/test-jobserver_fds.fifo && exec 3<>\$QMV_ONLINECLC_TMP_DIR/test-jobserver_fds.fifo && printf ab >&3 && printf '%s\\n' $TESTDIR/empty.cl $TESTDIR/empty.cl $TESTDIR/empty.cl $TESTDIR/empty.cl | $MOCK MAKEFLAGS=\"-j4 --jobserver-auth=3,3\" MOCKCL_MAX_BUILDS=3 MOCKCL_BUILD_DELAY_MS=50 $PROGRAM -j 4 --batch - && timeout 5 dd bs=1 count=2 <&3 2> /dev/null | wc -c" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.jobserver_missing \
+    -a exit_code=0 \
+    -a command="printf '%s\\n' $TESTDIR/empty.cl $TESTDIR/empty.cl | $MOCK MAKEFLAGS=\"-j4 --jobserver-auth=97,98\" $PROGRAM -j 2 --batch -" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.compile_link \
+    -a exit_code=0 \
+    -a command="$MOCK $PROGRAM -c -DN=1 -o \$QMV_ONLINECLC_TMP_DIR/test-link1.o $TESTDIR/empty.cl && $MOCK $PROGRAM -c -o \$QMV_ONLINECLC_TMP_DIR/test-link2.o -I $TESTDIR/include $TESTDIR/deps.cl && $MOCK $PROGRAM --link -cl-fast-relaxed-math -o \$QMV_ONLINECLC_TMP_DIR/test-link.out \$QMV_ONLINECLC_TMP_DIR/test-link1.o \$QMV_ONLINECLC_TMP_DIR/test-link2.o && test -s \$QMV_ONLINECLC_TMP_DIR/test-link.out" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.link_options \
+    -a exit_code=0 \
+    -a command="$MOCK $PROGRAM --link -DN=1 -I $TESTDIR/include -create-library -o \$QMV_ONLINECLC_TMP_DIR/test-link_options.out $TESTDIR/empty.cl $TESTDIR/deps.cl" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.link_only_option \
+    -a exit_code=2 \
+    -a stderr="-create-library can only be used with --link" \
+    -a command="$MOCK $PROGRAM -c -create-library $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.link_compile_error \
+    -a exit_code=1 \
+    -a stderr=".+" \
+    -a command="$MOCK $PROGRAM --link $TESTDIR/invalid.cl $TESTDIR/empty.cl" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.link_reuses_objects \
+    -a exit_code=0 \
+    -a command="$MOCK $PROGRAM --cache-dir \$QMV_ONLINECLC_TMP_DIR/mock-link-cache --link -o \$QMV_ONLINECLC_TMP_DIR/test-link_reuse1.out $TESTDIR/empty.cl $TESTDIR/deps.cl -I $TESTDIR/include && $MOCK MOCKCL_FAIL=clCompileProgram=-11 $PROGRAM --cache-dir \$QMV_ONLINECLC_TMP_DIR/mock-link-cache --link -o \$QMV_ONLINECLC_TMP_DIR/test-link_reuse2.out $TESTDIR/empty.cl $TESTDIR/deps.cl -I $TESTDIR/include && cmp \$QMV_ONLINECLC_TMP_DIR/test-link_reuse1.out \$QMV_ONLINECLC_TMP_DIR/test-link_reuse2.out" \
+    -a resources="['tmpdir']" \
+    test command_regex.ShellCommandTest
+qmtest create -i mock.batch_parallel \
+    -a exit_code=0 \
+    -a command="start=\$(date +%s); printf '$TESTDIR/empty.cl\\n$TESTDIR/empty.cl\\n$TESTDIR/empty.cl\\n$TESTDIR/empty.cl\\n' | $MOCK MOCKCL_BUILD_DELAY_MS=2000 $PROGRAM -j 4 --batch - && test \$((\$(date +%s) - start)) -lt 6" \
+    test command_regex.ShellCommandTest
@@ -0,0 +1,7 @@
+#include "deps.h"
+/* #include "commented_out.h" */
+
+__kernel void deps(__global int *out)
+{
+    *out = DEPS_VALUE;
+}
@@ -0,0 +1,3 @@
+#include <deps_inc.h>
+
+#define DEPS_VALUE (DEPS_INC_VALUE + 1)
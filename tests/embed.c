@@ -0,0 +1,22 @@
+/* Test program for --emit: writes the binary linked into it to stdout, to
+ * be compared with the raw binary, and the device name to stderr. Built
+ * with the output of --emit c or elf, or with -DEMBED_HEADER and -include
+ * for the output of --emit header. Fails if the binary is not aligned.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+
+#ifndef EMBED_HEADER
+extern const unsigned char embedded[];
+extern const size_t embedded_size;
+extern const char embedded_device[];
+#endif
+
+int main(void)
+{
+    fprintf(stderr, "%s\n", embedded_device);
+    if (fwrite(embedded, 1, embedded_size, stdout) != embedded_size)
+        return 1;
+    return ((size_t) embedded % 64) != 0;
+}
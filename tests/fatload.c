@@ -0,0 +1,91 @@
+/* Test program for --emit fat and the clcfat loader: opens the fat binary
+ * named by the first argument and, for every device of every platform,
+ * creates a program from it with the options in the second argument (if
+ * any). Prints the device name and the size of the binary found, or "no
+ * match". Fails if the file is not valid, a binary is not page-aligned in
+ * the mapping, or an OpenCL call fails.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "clcfat.h"
+
+static int load(const clcfat *fat, cl_platform_id platform, cl_device_id device, const char *options)
+{
+    char name[256], driver[256];
+    const unsigned char *binary;
+    size_t size;
+    cl_context_properties props[3];
+    cl_context ctx;
+    cl_program program;
+    cl_int status;
+    clcfat_status ret;
+
+    if (clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, NULL) != CL_SUCCESS
+        || clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver), driver, NULL) != CL_SUCCESS)
+        return 1;
+    ret = clcfat_find(fat, name, driver, options, &binary, &size);
+    if (ret == CLCFAT_NO_MATCH)
+    {
+        printf("%s: no match\n", name);
+        return 0;
+    }
+    if ((uintptr_t) binary % 4096 != 0)
+    {
+        fprintf(stderr, "%s: binary is not page-aligned\n", name);
+        return 1;
+    }
+
+    props[0] = CL_CONTEXT_PLATFORM;
+    props[1] = (cl_context_properties) platform;
+    props[2] = 0;
+    ctx = clCreateContext(props, 1, &device, NULL, NULL, &status);
+    if (status != CL_SUCCESS)
+        return 1;
+    ret = clcfat_create_program(fat, ctx, device, options, &program, &status);
+    if (ret != CLCFAT_SUCCESS)
+    {
+        fprintf(stderr, "%s: %s (%d)\n", name, clcfat_status_string(ret), (int) status);
+        clReleaseContext(ctx);
+        return 1;
+    }
+    printf("%s: %lu bytes\n", name, (unsigned long) size);
+    clReleaseProgram(program);
+    clReleaseContext(ctx);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    clcfat *fat;
+    clcfat_status ret;
+    cl_platform_id platforms[16];
+    cl_device_id devices[16];
+    cl_uint num_platforms, num_devices, i, j;
+    const char *options = argc > 2 ? argv[2] : NULL;
+    int failed = 0;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: fatload file [options]\n");
+        return 2;
+    }
+    ret = clcfat_open(argv[1], &fat);
+    if (ret != CLCFAT_SUCCESS)
+    {
+        fprintf(stderr, "%s: %s\n", argv[1], clcfat_status_string(ret));
+        return 1;
+    }
+    if (clGetPlatformIDs(16, platforms, &num_platforms) != CL_SUCCESS)
+        return 1;
+    for (i = 0; i < num_platforms && i < 16; i++)
+    {
+        if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 16, devices, &num_devices) != CL_SUCCESS)
+            return 1;
+        for (j = 0; j < num_devices && j < 16; j++)
+            failed |= load(fat, platforms[i], devices[j], options);
+    }
+    clcfat_close(fat);
+    return failed;
+}
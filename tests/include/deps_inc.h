@@ -0,0 +1 @@
+#define DEPS_INC_VALUE 1
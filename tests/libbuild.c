@@ -0,0 +1,169 @@
+/* Test program for the libonlineclc library interface: builds every source
+ * named after "--" on the command line, each in a thread of its own and all
+ * with the same options and session. The arguments before "--" are the
+ * options. Sources at even positions are built with onlineclc_compile, and
+ * those at odd positions with onlineclc_build_program, with the log and
+ * binary retrieved separately, so that both run at once.
+ *
+ * Prints, for each source in order, its status (and the size of its binary
+ * if it built), then any build log and messages. Exits with 0 if every
+ * source built, 1 if one did not, or 2 if the options or device are not
+ * valid.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "onlineclc.h"
+
+typedef struct
+{
+    onlineclc_session *session;
+    const onlineclc_options *options;
+    const char *filename;
+    int use_program;
+    onlineclc_status status;
+    size_t binary_size;
+    char *log;
+    char *messages;
+} job;
+
+/* Reads a whole file, returning it dynamically allocated, or NULL */
+static char *read_file(const char *filename, size_t *size)
+{
+    FILE *f = fopen(filename, "rb");
+    char *data = NULL;
+    long len;
+
+    if (f == NULL)
+        return NULL;
+    if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0)
+    {
+        data = (char *) malloc(len + 1);
+        if (data != NULL && fread(data, 1, len, f) != (size_t) len)
+        {
+            free(data);
+            data = NULL;
+        }
+        *size = len;
+    }
+    fclose(f);
+    return data;
+}
+
+static void *build(void *arg)
+{
+    job *j = (job *) arg;
+    char *source;
+    size_t size, log_len;
+    unsigned char *binary = NULL;
+
+    source = read_file(j->filename, &size);
+    if (source == NULL)
+    {
+        j->status = ONLINECLC_ERROR;
+        return NULL;
+    }
+    if (j->use_program)
+    {
+        cl_program program;
+
+        j->status = onlineclc_build_program(j->session, j->options, j->filename, source, size, &program);
+        if (j->status == ONLINECLC_SUCCESS || j->status == ONLINECLC_BUILD_FAILED)
+        {
+            onlineclc_status status = j->status;
+
+            if (onlineclc_get_build_log(j->session, program, &j->log, &log_len) != ONLINECLC_SUCCESS)
+                status = ONLINECLC_ERROR;
+            if (status == ONLINECLC_SUCCESS
+                && onlineclc_get_binary(j->session, program, &binary, &j->binary_size) != ONLINECLC_SUCCESS)
+                status = ONLINECLC_ERROR;
+            j->status = status;
+            clReleaseProgram(program);
+        }
+    }
+    else
+        j->status = onlineclc_compile(j->session, j->options, j->filename, source, size,
+                                      &j->log, &log_len, &binary, &j->binary_size);
+    if (j->status != ONLINECLC_SUCCESS && j->status != ONLINECLC_BUILD_FAILED)
+    {
+        const char *messages = onlineclc_messages();
+
+        j->messages = (char *) malloc(strlen(messages) + 1);
+        if (j->messages != NULL)
+            strcpy(j->messages, messages);
+    }
+    onlineclc_free(binary);
+    free(source);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    onlineclc_options *options;
+    onlineclc_session *session;
+    onlineclc_status status;
+    job *jobs;
+    pthread_t *threads;
+    int sep, num_jobs, i, failed = 0;
+
+    for (sep = 1; sep < argc && strcmp(argv[sep], "--") != 0; sep++)
+        ;
+    num_jobs = argc - sep - 1;
+    if (num_jobs <= 0)
+    {
+        fprintf(stderr, "Usage: libbuild [options] -- source...\n");
+        return 2;
+    }
+
+    status = onlineclc_options_create(sep - 1, (const char * const *) argv + 1, &options);
+    if (status == ONLINECLC_SUCCESS)
+    {
+        status = onlineclc_session_create(options, &session);
+        if (status != ONLINECLC_SUCCESS)
+            onlineclc_options_free(options);
+    }
+    if (status != ONLINECLC_SUCCESS)
+    {
+        fprintf(stderr, "%s\n%s", onlineclc_status_string(status), onlineclc_messages());
+        return 2;
+    }
+
+    jobs = (job *) calloc(num_jobs, sizeof(job));
+    threads = (pthread_t *) malloc(num_jobs * sizeof(pthread_t));
+    if (jobs == NULL || threads == NULL)
+        return 1;
+    for (i = 0; i < num_jobs; i++)
+    {
+        jobs[i].session = session;
+        jobs[i].options = options;
+        jobs[i].filename = argv[sep + 1 + i];
+        jobs[i].use_program = i % 2;
+        if (pthread_create(&threads[i], NULL, build, &jobs[i]) != 0)
+            return 1;
+    }
+    for (i = 0; i < num_jobs; i++)
+    {
+        pthread_join(threads[i], NULL);
+        if (jobs[i].status == ONLINECLC_SUCCESS)
+            printf("%s: %s, %lu bytes\n", jobs[i].filename, onlineclc_status_string(jobs[i].status),
+                   (unsigned long) jobs[i].binary_size);
+        else
+        {
+            printf("%s: %s\n", jobs[i].filename, onlineclc_status_string(jobs[i].status));
+            failed = 1;
+        }
+        if (jobs[i].log != NULL && jobs[i].log[0] != '\0')
+            printf("%s%s", jobs[i].log, jobs[i].log[strlen(jobs[i].log) - 1] == '\n' ? "" : "\n");
+        if (jobs[i].messages != NULL)
+            printf("%s", jobs[i].messages);
+        onlineclc_free(jobs[i].log);
+        free(jobs[i].messages);
+    }
+    free(threads);
+    free(jobs);
+    onlineclc_session_free(session);
+    onlineclc_options_free(options);
+    return failed;
+}
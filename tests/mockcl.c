@@ -0,0 +1,1095 @@
+/*  OnlineCLC: Front-end to online OpenCL C compiler
+ *  Copyright (C) 2011  Bruce Merry
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; version 2.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* A stub implementation of the subset of OpenCL used by onlineclc. It is
+ * built as a shared library with the soname of libOpenCL, so that the tests
+ * can substitute it with LD_LIBRARY_PATH. It does not compile anything: a
+ * build "succeeds" unless the source contains #error or the phrase "not valid"
+ * (as tests/invalid.cl does), and the binary is just a copy of the inputs.
+ *
+ * Behaviour is controlled by environment variables:
+ *
+ *   MOCKCL_PLATFORMS          number of platforms (default 1)
+ *   MOCKCL_DEVICES            number of devices per platform (default 1)
+ *   MOCKCL_DEVICE_TYPES       comma-separated cpu/gpu/accelerator, cycled
+ *                             over the devices of a platform (default cpu)
+ *   MOCKCL_DEVICE_NAME        printf pattern for the device name, given the
+ *                             platform and device indices (default
+ *                             "Mock Device %u.%u")
+ *   MOCKCL_NO_COMPILER        type of the devices (cpu, gpu or accelerator)
+ *                             without a compiler
+ *   MOCKCL_IL_VERSION         value of CL_DEVICE_IL_VERSION (default
+ *                             "SPIR-V_1.2")
+ *   MOCKCL_FAIL               comma-separated function=code pairs, e.g.
+ *                             "clGetDeviceIDs=-1", to inject errors
+ *   MOCKCL_PLATFORM_DELAY_MS  delay added to clGetPlatformIDs
+ *   MOCKCL_DEVICE_DELAY_MS    delay added to clGetDeviceIDs, as a driver
+ *                             starting up
+ *   MOCKCL_DEVICE_LOG         file to which each clGetDeviceIDs call appends
+ *                             a line with the platform index
+ *   MOCKCL_BUILD_DELAY_MS     delay added to each build, compile and link
+ *   MOCKCL_SOURCE_DELAY_MS    further delay added to builds and compiles of
+ *                             programs created from source
+ *   MOCKCL_BUILD_ALLOC_MB     memory touched by each build, for RSS tests
+ *   MOCKCL_MAX_BUILDS         builds, compiles and links that may run at
+ *                             once in the process; any more fail with
+ *                             CL_OUT_OF_RESOURCES
+ *   MOCKCL_BUILD_LOG          text returned as the build log
+ *   MOCKCL_ERROR_OPTION       a build whose options contain this text fails
+ *                             as if the source had #error
+ *   MOCKCL_SLOW_OPTION        a build whose options contain this text takes
+ *                             a further 10 s, as if the compiler hung
+ *   MOCKCL_ASYNC              if set, builds with a callback run in a thread
+ *   MOCKCL_PRIVATE_MEM        CL_KERNEL_PRIVATE_MEM_SIZE (default 0)
+ *   MOCKCL_LOCAL_MEM          CL_KERNEL_LOCAL_MEM_SIZE (default 0)
+ */
+
+#ifndef _POSIX_C_SOURCE
+# define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#ifndef CL_DEVICE_IL_VERSION
+# define CL_DEVICE_IL_VERSION 0x105B
+#endif
+#ifndef CL_PROGRAM_BINARY_TYPE
+# define CL_PROGRAM_BINARY_TYPE 0x1184
+# define CL_PROGRAM_BINARY_TYPE_NONE 0x0
+# define CL_PROGRAM_BINARY_TYPE_COMPILED_OBJECT 0x1
+# define CL_PROGRAM_BINARY_TYPE_LIBRARY 0x2
+# define CL_PROGRAM_BINARY_TYPE_EXECUTABLE 0x4
+#endif
+
+#define MAX_PLATFORMS 8
+#define MAX_DEVICES 8
+
+/* Prefix of the binaries produced; the next line gives the binary type */
+#define BINARY_MAGIC "MOCKCL\n"
+
+struct _cl_platform_id
+{
+    unsigned int index;
+    char name[64];
+    cl_uint num_devices;
+};
+
+struct _cl_device_id
+{
+    cl_platform_id platform;
+    unsigned int index;
+    cl_device_type type;
+    char name[128];
+};
+
+struct _cl_context
+{
+    cl_uint refcount;
+    cl_platform_id platform;
+    cl_uint num_devices;
+    cl_device_id devices[MAX_DEVICES];
+};
+
+struct _cl_program
+{
+    cl_uint refcount;
+    cl_context ctx;
+    cl_device_id device;      /* device of the last build, or NULL */
+    char *source;             /* source text, or binary payload */
+    size_t source_len;
+    char *options;
+    cl_int build_status;
+    cl_uint binary_type;
+    char *log;
+    pthread_mutex_t lock;
+};
+
+struct _cl_kernel
+{
+    cl_program program;
+    char name[128];
+};
+
+static struct _cl_platform_id platforms[MAX_PLATFORMS];
+static struct _cl_device_id devices[MAX_PLATFORMS][MAX_DEVICES];
+static cl_uint num_platforms;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static unsigned long env_ulong(const char *name, unsigned long def)
+{
+    const char *value = getenv(name);
+    if (value == NULL || *value == '\0')
+        return def;
+    return strtoul(value, NULL, 10);
+}
+
+static void sleep_ms(unsigned long ms)
+{
+    struct timespec ts;
+    if (ms == 0)
+        return;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) != 0)
+        ;
+}
+
+/* Returns the injected error for function, or CL_SUCCESS */
+static cl_int injected(const char *function)
+{
+    const char *spec = getenv("MOCKCL_FAIL");
+    size_t len = strlen(function);
+
+    while (spec != NULL && *spec != '\0')
+    {
+        if (strncmp(spec, function, len) == 0 && spec[len] == '=')
+            return (cl_int) strtol(spec + len + 1, NULL, 10);
+        spec = strchr(spec, ',');
+        if (spec != NULL)
+            spec++;
+    }
+    return CL_SUCCESS;
+}
+
+static cl_device_type parse_type(const char *types, unsigned int index)
+{
+    const char *cur = types;
+    unsigned int count = 0, i;
+    const char *starts[MAX_DEVICES];
+
+    if (types == NULL || *types == '\0')
+        return CL_DEVICE_TYPE_CPU;
+    while (cur != NULL && count < MAX_DEVICES)
+    {
+        starts[count++] = cur;
+        cur = strchr(cur, ',');
+        if (cur != NULL)
+            cur++;
+    }
+    i = index % count;
+    if (strncmp(starts[i], "gpu", 3) == 0)
+        return CL_DEVICE_TYPE_GPU;
+    else if (strncmp(starts[i], "acc", 3) == 0)
+        return CL_DEVICE_TYPE_ACCELERATOR;
+    else
+        return CL_DEVICE_TYPE_CPU;
+}
+
+static void init(void)
+{
+    const char *pattern = getenv("MOCKCL_DEVICE_NAME");
+    unsigned int i, j;
+    cl_uint ndev;
+
+    num_platforms = (cl_uint) env_ulong("MOCKCL_PLATFORMS", 1);
+    if (num_platforms > MAX_PLATFORMS)
+        num_platforms = MAX_PLATFORMS;
+    ndev = (cl_uint) env_ulong("MOCKCL_DEVICES", 1);
+    if (ndev > MAX_DEVICES)
+        ndev = MAX_DEVICES;
+    if (pattern == NULL)
+        pattern = "Mock Device %u.%u";
+
+    for (i = 0; i < num_platforms; i++)
+    {
+        platforms[i].index = i;
+        platforms[i].num_devices = ndev;
+        sprintf(platforms[i].name, "Mock Platform %u", i);
+        for (j = 0; j < ndev; j++)
+        {
+            devices[i][j].platform = &platforms[i];
+            devices[i][j].index = j;
+            devices[i][j].type = parse_type(getenv("MOCKCL_DEVICE_TYPES"), j);
+            snprintf(devices[i][j].name, sizeof(devices[i][j].name), pattern, i, j);
+        }
+    }
+}
+
+static void ensure_init(void)
+{
+    pthread_once(&init_once, init);
+}
+
+/* Implements the usual size-query protocol for a block of memory */
+static cl_int return_info(const void *data, size_t size,
+                          size_t param_value_size, void *param_value, size_t *param_value_size_ret)
+{
+    if (param_value != NULL)
+    {
+        if (param_value_size < size)
+            return CL_INVALID_VALUE;
+        memcpy(param_value, data, size);
+    }
+    if (param_value_size_ret != NULL)
+        *param_value_size_ret = size;
+    return CL_SUCCESS;
+}
+
+static cl_int return_string(const char *str,
+                            size_t param_value_size, void *param_value, size_t *param_value_size_ret)
+{
+    return return_info(str, strlen(str) + 1, param_value_size, param_value, param_value_size_ret);
+}
+
+static char *dup_bytes(const char *data, size_t len)
+{
+    char *out = malloc(len + 1);
+    if (out == NULL)
+        return NULL;
+    memcpy(out, data, len);
+    out[len] = '\0';
+    return out;
+}
+
+cl_int clGetPlatformIDs(cl_uint num_entries, cl_platform_id *out, cl_uint *num_out)
+{
+    cl_uint i;
+    cl_int status = injected("clGetPlatformIDs");
+
+    ensure_init();
+    sleep_ms(env_ulong("MOCKCL_PLATFORM_DELAY_MS", 0));
+    if (status != CL_SUCCESS)
+        return status;
+    if (out == NULL && num_out == NULL)
+        return CL_INVALID_VALUE;
+    if (num_out != NULL)
+        *num_out = num_platforms;
+    for (i = 0; out != NULL && i < num_entries && i < num_platforms; i++)
+        out[i] = &platforms[i];
+    return CL_SUCCESS;
+}
+
+cl_int clGetPlatformInfo(cl_platform_id platform, cl_platform_info param,
+                         size_t size, void *value, size_t *size_ret)
+{
+    cl_int status = injected("clGetPlatformInfo");
+    if (status != CL_SUCCESS)
+        return status;
+    if (platform == NULL)
+        return CL_INVALID_PLATFORM;
+    switch (param)
+    {
+    case CL_PLATFORM_NAME:
+        return return_string(platform->name, size, value, size_ret);
+    case CL_PLATFORM_VENDOR:
+        return return_string("onlineclc", size, value, size_ret);
+    case CL_PLATFORM_VERSION:
+        return return_string("OpenCL 2.1 mock", size, value, size_ret);
+    case CL_PLATFORM_PROFILE:
+        return return_string("FULL_PROFILE", size, value, size_ret);
+    case CL_PLATFORM_EXTENSIONS:
+        return return_string("", size, value, size_ret);
+    default:
+        return CL_INVALID_VALUE;
+    }
+}
+
+cl_int clGetDeviceIDs(cl_platform_id platform, cl_device_type type, cl_uint num_entries,
+                      cl_device_id *out, cl_uint *num_out)
+{
+    cl_uint i, n = 0;
+    cl_int status = injected("clGetDeviceIDs");
+    if (status != CL_SUCCESS)
+        return status;
+    if (platform == NULL)
+        return CL_INVALID_PLATFORM;
+    if (getenv("MOCKCL_DEVICE_LOG") != NULL)
+    {
+        FILE *log = fopen(getenv("MOCKCL_DEVICE_LOG"), "a");
+        if (log != NULL)
+        {
+            fprintf(log, "clGetDeviceIDs %u\n", platform->index);
+            fclose(log);
+        }
+    }
+    sleep_ms(env_ulong("MOCKCL_DEVICE_DELAY_MS", 0));
+    for (i = 0; i < platform->num_devices; i++)
+    {
+        struct _cl_device_id *dev = &devices[platform->index][i];
+        if (type == CL_DEVICE_TYPE_ALL || (type & dev->type)
+            || (type == CL_DEVICE_TYPE_DEFAULT && i == 0))
+        {
+            if (out != NULL && n < num_entries)
+                out[n] = dev;
+            n++;
+        }
+    }
+    if (num_out != NULL)
+        *num_out = n;
+    return n == 0 ? CL_DEVICE_NOT_FOUND : CL_SUCCESS;
+}
+
+cl_int clGetDeviceInfo(cl_device_id device, cl_device_info param,
+                       size_t size, void *value, size_t *size_ret)
+{
+    cl_uint u;
+    cl_ulong ul;
+    size_t sz;
+    cl_bool b = CL_TRUE;
+    cl_int status = injected("clGetDeviceInfo");
+    if (status != CL_SUCCESS)
+        return status;
+    if (device == NULL)
+        return CL_INVALID_DEVICE;
+    switch (param)
+    {
+    case CL_DEVICE_NAME:
+        return return_string(device->name, size, value, size_ret);
+    case CL_DEVICE_VENDOR:
+        return return_string("onlineclc", size, value, size_ret);
+    case CL_DRIVER_VERSION:
+        return return_string("1.0-mock", size, value, size_ret);
+    case CL_DEVICE_VERSION:
+        return return_string("OpenCL 2.1 mock", size, value, size_ret);
+    case CL_DEVICE_EXTENSIONS:
+        return return_string("cl_khr_il_program", size, value, size_ret);
+    case CL_DEVICE_IL_VERSION:
+        {
+            const char *il = getenv("MOCKCL_IL_VERSION");
+            return return_string(il != NULL ? il : "SPIR-V_1.2", size, value, size_ret);
+        }
+    case CL_DEVICE_PLATFORM:
+        return return_info(&device->platform, sizeof(cl_platform_id), size, value, size_ret);
+    case CL_DEVICE_TYPE:
+        return return_info(&device->type, sizeof(cl_device_type), size, value, size_ret);
+    case CL_DEVICE_MAX_COMPUTE_UNITS:
+        u = 4;
+        return return_info(&u, sizeof(u), size, value, size_ret);
+    case CL_DEVICE_MAX_WORK_GROUP_SIZE:
+        sz = 1024;
+        return return_info(&sz, sizeof(sz), size, value, size_ret);
+    case CL_DEVICE_LOCAL_MEM_SIZE:
+        ul = 32768;
+        return return_info(&ul, sizeof(ul), size, value, size_ret);
+    case CL_DEVICE_COMPILER_AVAILABLE:
+        {
+            const char *none = getenv("MOCKCL_NO_COMPILER");
+            if (none != NULL && *none != '\0' && (parse_type(none, 0) & device->type))
+                b = CL_FALSE;
+            return return_info(&b, sizeof(b), size, value, size_ret);
+        }
+    case CL_DEVICE_LINKER_AVAILABLE:
+        return return_info(&b, sizeof(b), size, value, size_ret);
+    default:
+        return CL_INVALID_VALUE;
+    }
+}
+
+cl_context clCreateContext(const cl_context_properties *props, cl_uint num_devices,
+                           const cl_device_id *devs,
+                           void (CL_CALLBACK *notify)(const char *, const void *, size_t, void *),
+                           void *user_data, cl_int *errcode_ret)
+{
+    cl_context ctx;
+    cl_platform_id platform = NULL;
+    cl_int status = injected("clCreateContext");
+
+    (void) notify;
+    (void) user_data;
+    if (status == CL_SUCCESS && (num_devices == 0 || devs == NULL))
+        status = CL_INVALID_VALUE;
+    while (status == CL_SUCCESS && props != NULL && props[0] != 0)
+    {
+        if (props[0] == CL_CONTEXT_PLATFORM)
+            platform = (cl_platform_id) props[1];
+        props += 2;
+    }
+    if (status == CL_SUCCESS && platform != NULL && devs[0]->platform != platform)
+        status = CL_INVALID_DEVICE;
+    if (status != CL_SUCCESS)
+    {
+        if (errcode_ret != NULL)
+            *errcode_ret = status;
+        return NULL;
+    }
+
+    ctx = malloc(sizeof(*ctx));
+    ctx->refcount = 1;
+    ctx->platform = devs[0]->platform;
+    ctx->num_devices = num_devices < MAX_DEVICES ? num_devices : MAX_DEVICES;
+    memcpy(ctx->devices, devs, ctx->num_devices * sizeof(cl_device_id));
+    if (errcode_ret != NULL)
+        *errcode_ret = CL_SUCCESS;
+    return ctx;
+}
+
+cl_int clGetContextInfo(cl_context ctx, cl_context_info param, size_t size, void *value, size_t *size_ret)
+{
+    cl_int status = injected("clGetContextInfo");
+    if (status != CL_SUCCESS)
+        return status;
+    if (ctx == NULL)
+        return CL_INVALID_CONTEXT;
+    switch (param)
+    {
+    case CL_CONTEXT_NUM_DEVICES:
+        return return_info(&ctx->num_devices, sizeof(cl_uint), size, value, size_ret);
+    case CL_CONTEXT_DEVICES:
+        return return_info(ctx->devices, ctx->num_devices * sizeof(cl_device_id), size, value, size_ret);
+    default:
+        return CL_INVALID_VALUE;
+    }
+}
+
+cl_int clRetainContext(cl_context ctx)
+{
+    if (ctx == NULL)
+        return CL_INVALID_CONTEXT;
+    ctx->refcount++;
+    return CL_SUCCESS;
+}
+
+cl_int clReleaseContext(cl_context ctx)
+{
+    if (ctx == NULL)
+        return CL_INVALID_CONTEXT;
+    if (--ctx->refcount == 0)
+        free(ctx);
+    return CL_SUCCESS;
+}
+
+static cl_program new_program(cl_context ctx, char *source, size_t len, cl_uint binary_type)
+{
+    cl_program program = calloc(1, sizeof(*program));
+    program->refcount = 1;
+    program->ctx = ctx;
+    program->source = source;
+    program->source_len = len;
+    program->build_status = CL_BUILD_NONE;
+    program->binary_type = binary_type;
+    pthread_mutex_init(&program->lock, NULL);
+    clRetainContext(ctx);
+    return program;
+}
+
+cl_program clCreateProgramWithSource(cl_context ctx, cl_uint count, const char **strings,
+                                     const size_t *lengths, cl_int *errcode_ret)
+{
+    size_t total = 0, pos = 0;
+    cl_uint i;
+    char *source;
+    cl_int status = injected("clCreateProgramWithSource");
+
+    if (status == CL_SUCCESS && (ctx == NULL || count == 0 || strings == NULL))
+        status = ctx == NULL ? CL_INVALID_CONTEXT : CL_INVALID_VALUE;
+    if (status != CL_SUCCESS)
+    {
+        if (errcode_ret != NULL)
+            *errcode_ret = status;
+        return NULL;
+    }
+
+    for (i = 0; i < count; i++)
+        total += (lengths == NULL || lengths[i] == 0) ? strlen(strings[i]) : lengths[i];
+    source = malloc(total + 1);
+    for (i = 0; i < count; i++)
+    {
+        size_t len = (lengths == NULL || lengths[i] == 0) ? strlen(strings[i]) : lengths[i];
+        memcpy(source + pos, strings[i], len);
+        pos += len;
+    }
+    source[total] = '\0';
+    if (errcode_ret != NULL)
+        *errcode_ret = CL_SUCCESS;
+    return new_program(ctx, source, total, CL_PROGRAM_BINARY_TYPE_NONE);
+}
+
+cl_program clCreateProgramWithIL(cl_context ctx, const void *il, size_t length, cl_int *errcode_ret)
+{
+    cl_int status = injected("clCreateProgramWithIL");
+    if (status == CL_SUCCESS && (ctx == NULL || il == NULL || length == 0))
+        status = CL_INVALID_VALUE;
+    if (status != CL_SUCCESS)
+    {
+        if (errcode_ret != NULL)
+            *errcode_ret = status;
+        return NULL;
+    }
+    if (errcode_ret != NULL)
+        *errcode_ret = CL_SUCCESS;
+    return new_program(ctx, dup_bytes((const char *) il, length), length, CL_PROGRAM_BINARY_TYPE_NONE);
+}
+
+cl_program clCreateProgramWithBinary(cl_context ctx, cl_uint num_devices, const cl_device_id *devs,
+                                     const size_t *lengths, const unsigned char **binaries,
+                                     cl_int *binary_status, cl_int *errcode_ret)
+{
+    const size_t magic_len = strlen(BINARY_MAGIC);
+    const char *bin;
+    const char *body;
+    cl_uint type;
+    cl_program program;
+    cl_int status = injected("clCreateProgramWithBinary");
+
+    if (status == CL_SUCCESS && (num_devices != 1 || devs == NULL || lengths == NULL || binaries == NULL))
+        status = CL_INVALID_VALUE;
+    if (status == CL_SUCCESS)
+    {
+        bin = (const char *) binaries[0];
+        if (lengths[0] < magic_len + 2 || memcmp(bin, BINARY_MAGIC, magic_len) != 0)
+            status = CL_INVALID_BINARY;
+    }
+    if (binary_status != NULL)
+        binary_status[0] = status;
+    if (status != CL_SUCCESS)
+    {
+        if (errcode_ret != NULL)
+            *errcode_ret = status;
+        return NULL;
+    }
+
+    type = bin[magic_len] == 'O' ? CL_PROGRAM_BINARY_TYPE_COMPILED_OBJECT
+        : CL_PROGRAM_BINARY_TYPE_EXECUTABLE;
+    body = bin + magic_len + 2;
+    program = new_program(ctx, dup_bytes(body, lengths[0] - magic_len - 2),
+                          lengths[0] - magic_len - 2, type);
+    program->device = devs[0];
+    if (errcode_ret != NULL)
+        *errcode_ret = CL_SUCCESS;
+    return program;
+}
+
+cl_int clRetainProgram(cl_program program)
+{
+    if (program == NULL)
+        return CL_INVALID_PROGRAM;
+    pthread_mutex_lock(&program->lock);
+    program->refcount++;
+    pthread_mutex_unlock(&program->lock);
+    return CL_SUCCESS;
+}
+
+cl_int clReleaseProgram(cl_program program)
+{
+    cl_uint refs;
+    if (program == NULL)
+        return CL_INVALID_PROGRAM;
+    pthread_mutex_lock(&program->lock);
+    refs = --program->refcount;
+    pthread_mutex_unlock(&program->lock);
+    if (refs == 0)
+    {
+        clReleaseContext(program->ctx);
+        free(program->source);
+        free(program->options);
+        free(program->log);
+        pthread_mutex_destroy(&program->lock);
+        free(program);
+    }
+    return CL_SUCCESS;
+}
+
+/* Which call options are given to, since each accepts different ones */
+enum { STAGE_BUILD, STAGE_COMPILE, STAGE_LINK };
+
+/* Checks options against those that a real compiler would accept */
+static int valid_options(const char *options, int stage)
+{
+    const char *cur = options;
+    while (cur != NULL && *cur != '\0')
+    {
+        size_t len;
+        while (*cur == ' ')
+            cur++;
+        len = strcspn(cur, " ");
+        if (len == 0)
+            break;
+        if (*cur == '-'
+            && strncmp(cur, "-D", 2) != 0
+            && strncmp(cur, "-I", 2) != 0
+            && strncmp(cur, "-cl-", 4) != 0
+            && strncmp(cur, "-w", len) != 0
+            && strncmp(cur, "-Werror", len) != 0
+            && strncmp(cur, "-create-library", len) != 0
+            && strncmp(cur, "-enable-link-options", len) != 0)
+            return 0;
+        /* Only the linker takes library options, and it takes no -D or -I */
+        if (stage != STAGE_LINK
+            && (strncmp(cur, "-create-library", len) == 0 || strncmp(cur, "-enable-link-options", len) == 0))
+            return 0;
+        if (stage == STAGE_LINK && (strncmp(cur, "-D", 2) == 0 || strncmp(cur, "-I", 2) == 0))
+            return 0;
+        cur += len;
+    }
+    return 1;
+}
+
+/* Builds, compiles and links in progress, for MOCKCL_MAX_BUILDS */
+static pthread_mutex_t active_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long active_builds = 0;
+
+/* Does the work of a build, compile or link: sleeps, touches memory and
+ * checks for #error.
+ */
+static cl_int do_build(cl_program program, cl_device_id device, const char *options,
+                       cl_uint binary_type, cl_int failure)
+{
+    unsigned long alloc_mb = env_ulong("MOCKCL_BUILD_ALLOC_MB", 0);
+    const char *log = getenv("MOCKCL_BUILD_LOG");
+    const char *error_option = getenv("MOCKCL_ERROR_OPTION");
+    const char *slow_option = getenv("MOCKCL_SLOW_OPTION");
+    const char *error;
+    char *buffer = NULL;
+    int from_source;
+    unsigned long max_builds = env_ulong("MOCKCL_MAX_BUILDS", 0);
+    int too_many;
+
+    pthread_mutex_lock(&active_lock);
+    too_many = max_builds > 0 && active_builds >= max_builds;
+    if (!too_many)
+        active_builds++;
+    pthread_mutex_unlock(&active_lock);
+    if (too_many)
+        return CL_OUT_OF_RESOURCES;
+
+    if (alloc_mb > 0)
+    {
+        buffer = malloc(alloc_mb << 20);
+        if (buffer != NULL)
+            memset(buffer, 1, alloc_mb << 20);
+    }
+    sleep_ms(env_ulong("MOCKCL_BUILD_DELAY_MS", 0));
+    if (slow_option != NULL && slow_option[0] != '\0' && strstr(options, slow_option) != NULL)
+        sleep_ms(10000);
+    pthread_mutex_lock(&program->lock);
+    from_source = program->binary_type == CL_PROGRAM_BINARY_TYPE_NONE;
+    pthread_mutex_unlock(&program->lock);
+    if (from_source)
+        sleep_ms(env_ulong("MOCKCL_SOURCE_DELAY_MS", 0));
+    free(buffer);
+    pthread_mutex_lock(&active_lock);
+    active_builds--;
+    pthread_mutex_unlock(&active_lock);
+
+    pthread_mutex_lock(&program->lock);
+    program->device = device;
+    free(program->options);
+    program->options = dup_bytes(options, strlen(options));
+    free(program->log);
+    error = strstr(program->source, "#error");
+    if (error == NULL)
+        error = strstr(program->source, "not valid");
+    if (error == NULL && error_option != NULL && error_option[0] != '\0')
+        error = strstr(options, error_option);
+    if (error != NULL)
+    {
+        program->log = dup_bytes(error, strcspn(error, "\n"));
+        program->build_status = CL_BUILD_ERROR;
+    }
+    else
+    {
+        program->log = dup_bytes(log != NULL ? log : "", log != NULL ? strlen(log) : 0);
+        program->build_status = CL_BUILD_SUCCESS;
+        program->binary_type = binary_type;
+    }
+    pthread_mutex_unlock(&program->lock);
+    return error != NULL ? failure : CL_SUCCESS;
+}
+
+typedef struct
+{
+    cl_program program;
+    cl_device_id device;
+    char *options;
+    void (CL_CALLBACK *notify)(cl_program, void *);
+    void *user_data;
+} async_build;
+
+static void *async_build_thread(void *arg)
+{
+    async_build *build = (async_build *) arg;
+    do_build(build->program, build->device, build->options,
+             CL_PROGRAM_BINARY_TYPE_EXECUTABLE, CL_BUILD_PROGRAM_FAILURE);
+    build->notify(build->program, build->user_data);
+    clReleaseProgram(build->program);
+    free(build->options);
+    free(build);
+    return NULL;
+}
+
+cl_int clBuildProgram(cl_program program, cl_uint num_devices, const cl_device_id *devs,
+                      const char *options, void (CL_CALLBACK *notify)(cl_program, void *),
+                      void *user_data)
+{
+    cl_int status = injected("clBuildProgram");
+    cl_uint i;
+
+    if (status != CL_SUCCESS)
+        return status;
+    if (program == NULL)
+        return CL_INVALID_PROGRAM;
+    if (options == NULL)
+        options = "";
+    if (!valid_options(options, STAGE_BUILD))
+        return CL_INVALID_BUILD_OPTIONS;
+    if (program->binary_type == CL_PROGRAM_BINARY_TYPE_COMPILED_OBJECT)
+        return CL_INVALID_OPERATION;
+
+    if (notify != NULL && getenv("MOCKCL_ASYNC") != NULL && num_devices == 1)
+    {
+        pthread_t thread;
+        async_build *build = malloc(sizeof(*build));
+        build->program = program;
+        build->device = devs[0];
+        build->options = dup_bytes(options, strlen(options));
+        build->notify = notify;
+        build->user_data = user_data;
+        clRetainProgram(program);
+        program->build_status = CL_BUILD_IN_PROGRESS;
+        pthread_create(&thread, NULL, async_build_thread, build);
+        pthread_detach(thread);
+        return CL_SUCCESS;
+    }
+
+    for (i = 0; i < num_devices || (devs == NULL && i == 0); i++)
+    {
+        status = do_build(program, devs != NULL ? devs[i] : &devices[program->ctx->platform->index][0],
+                          options, CL_PROGRAM_BINARY_TYPE_EXECUTABLE, CL_BUILD_PROGRAM_FAILURE);
+        if (status != CL_SUCCESS)
+            break;
+    }
+    if (notify != NULL)
+        notify(program, user_data);
+    return status;
+}
+
+cl_int clCompileProgram(cl_program program, cl_uint num_devices, const cl_device_id *devs,
+                        const char *options, cl_uint num_headers, const cl_program *headers,
+                        const char **header_names,
+                        void (CL_CALLBACK *notify)(cl_program, void *), void *user_data)
+{
+    cl_int status = injected("clCompileProgram");
+    (void) num_headers;
+    (void) headers;
+    (void) header_names;
+
+    if (status != CL_SUCCESS)
+        return status;
+    if (program == NULL)
+        return CL_INVALID_PROGRAM;
+    if (num_devices != 1 || devs == NULL)
+        return CL_INVALID_VALUE;
+    if (options == NULL)
+        options = "";
+    if (!valid_options(options, STAGE_COMPILE))
+        return CL_INVALID_COMPILER_OPTIONS;
+    status = do_build(program, devs[0], options,
+                      CL_PROGRAM_BINARY_TYPE_COMPILED_OBJECT, CL_COMPILE_PROGRAM_FAILURE);
+    if (notify != NULL)
+        notify(program, user_data);
+    return status;
+}
+
+cl_program clLinkProgram(cl_context ctx, cl_uint num_devices, const cl_device_id *devs,
+                         const char *options, cl_uint num_inputs, const cl_program *inputs,
+                         void (CL_CALLBACK *notify)(cl_program, void *), void *user_data,
+                         cl_int *errcode_ret)
+{
+    size_t total = 0, pos = 0;
+    cl_uint i;
+    char *source;
+    cl_program program;
+    cl_int status = injected("clLinkProgram");
+
+    if (status == CL_SUCCESS && (num_devices != 1 || devs == NULL || num_inputs == 0))
+        status = CL_INVALID_VALUE;
+    for (i = 0; status == CL_SUCCESS && i < num_inputs; i++)
+        if (inputs[i]->binary_type != CL_PROGRAM_BINARY_TYPE_COMPILED_OBJECT
+            && inputs[i]->binary_type != CL_PROGRAM_BINARY_TYPE_LIBRARY)
+            status = CL_INVALID_PROGRAM;
+    if (status == CL_SUCCESS && options != NULL && !valid_options(options, STAGE_LINK))
+        status = CL_INVALID_LINKER_OPTIONS;
+    if (status != CL_SUCCESS)
+    {
+        if (errcode_ret != NULL)
+            *errcode_ret = status;
+        return NULL;
+    }
+
+    for (i = 0; i < num_inputs; i++)
+        total += inputs[i]->source_len;
+    source = malloc(total + 1);
+    for (i = 0; i < num_inputs; i++)
+    {
+        memcpy(source + pos, inputs[i]->source, inputs[i]->source_len);
+        pos += inputs[i]->source_len;
+    }
+    source[total] = '\0';
+    program = new_program(ctx, source, total, CL_PROGRAM_BINARY_TYPE_NONE);
+    status = do_build(program, devs[0], options != NULL ? options : "",
+                      options != NULL && strstr(options, "-create-library") != NULL
+                      ? CL_PROGRAM_BINARY_TYPE_LIBRARY : CL_PROGRAM_BINARY_TYPE_EXECUTABLE,
+                      CL_LINK_PROGRAM_FAILURE);
+    if (notify != NULL)
+        notify(program, user_data);
+    if (errcode_ret != NULL)
+        *errcode_ret = status;
+    return program;
+}
+
+/* Builds the binary image of a program for one of the devices in its
+ * context. The caller must free it.
+ */
+static char *make_binary(cl_program program, cl_uint device, size_t *len)
+{
+    const size_t magic_len = strlen(BINARY_MAGIC);
+    char *binary;
+
+    *len = magic_len + 2 + program->source_len + (device > 0 ? 2 : 0);
+    binary = malloc(*len);
+    memcpy(binary, BINARY_MAGIC, magic_len);
+    binary[magic_len] = program->binary_type == CL_PROGRAM_BINARY_TYPE_COMPILED_OBJECT ? 'O' : 'X';
+    binary[magic_len + 1] = '\n';
+    memcpy(binary + magic_len + 2, program->source, program->source_len);
+    /* Make the binaries for the devices differ */
+    if (device > 0)
+    {
+        binary[*len - 2] = '0' + device % 10;
+        binary[*len - 1] = '\n';
+    }
+    return binary;
+}
+
+/* Finds the names of the kernels in a program, by looking for "kernel void".
+ * Returns the number found, and fills in up to max names.
+ */
+static cl_uint find_kernels(cl_program program, char names[][128], cl_uint max)
+{
+    const char *cur = program->source;
+    cl_uint n = 0;
+
+    while ((cur = strstr(cur, "kernel void ")) != NULL)
+    {
+        size_t len;
+        cur += strlen("kernel void ");
+        len = 0;
+        while (isalnum((unsigned char) cur[len]) || cur[len] == '_')
+            len++;
+        if (len > 0 && len < 128)
+        {
+            if (n < max)
+            {
+                memcpy(names[n], cur, len);
+                names[n][len] = '\0';
+            }
+            n++;
+        }
+    }
+    return n;
+}
+
+cl_int clGetProgramInfo(cl_program program, cl_program_info param,
+                        size_t size, void *value, size_t *size_ret)
+{
+    cl_uint u;
+    cl_int status = injected("clGetProgramInfo");
+    if (status != CL_SUCCESS)
+        return status;
+    if (program == NULL)
+        return CL_INVALID_PROGRAM;
+    switch (param)
+    {
+    case CL_PROGRAM_NUM_DEVICES:
+        u = program->ctx->num_devices;
+        return return_info(&u, sizeof(u), size, value, size_ret);
+    case CL_PROGRAM_DEVICES:
+        return return_info(program->ctx->devices, program->ctx->num_devices * sizeof(cl_device_id),
+                           size, value, size_ret);
+    case CL_PROGRAM_CONTEXT:
+        return return_info(&program->ctx, sizeof(cl_context), size, value, size_ret);
+    case CL_PROGRAM_BINARY_SIZES:
+        {
+            size_t lens[MAX_DEVICES];
+            for (u = 0; u < program->ctx->num_devices; u++)
+            {
+                lens[u] = 0;
+                if (program->build_status == CL_BUILD_SUCCESS
+                    || program->binary_type != CL_PROGRAM_BINARY_TYPE_NONE)
+                    free(make_binary(program, u, &lens[u]));
+            }
+            return return_info(lens, program->ctx->num_devices * sizeof(size_t), size, value, size_ret);
+        }
+    case CL_PROGRAM_BINARIES:
+        {
+            unsigned char **binaries = (unsigned char **) value;
+            if (binaries != NULL)
+            {
+                if (size < program->ctx->num_devices * sizeof(unsigned char *))
+                    return CL_INVALID_VALUE;
+                for (u = 0; u < program->ctx->num_devices; u++)
+                {
+                    size_t len;
+                    char *binary;
+                    if (binaries[u] == NULL)
+                        continue;
+                    binary = make_binary(program, u, &len);
+                    memcpy(binaries[u], binary, len);
+                    free(binary);
+                }
+            }
+            if (size_ret != NULL)
+                *size_ret = program->ctx->num_devices * sizeof(unsigned char *);
+            return CL_SUCCESS;
+        }
+    case CL_PROGRAM_NUM_KERNELS:
+        {
+            size_t n = find_kernels(program, NULL, 0);
+            return return_info(&n, sizeof(n), size, value, size_ret);
+        }
+    default:
+        return CL_INVALID_VALUE;
+    }
+}
+
+cl_int clGetProgramBuildInfo(cl_program program, cl_device_id device, cl_program_build_info param,
+                             size_t size, void *value, size_t *size_ret)
+{
+    cl_int status = injected("clGetProgramBuildInfo");
+    (void) device;
+    if (status != CL_SUCCESS)
+        return status;
+    if (program == NULL)
+        return CL_INVALID_PROGRAM;
+    pthread_mutex_lock(&program->lock);
+    switch (param)
+    {
+    case CL_PROGRAM_BUILD_LOG:
+        status = return_string(program->log != NULL ? program->log : "", size, value, size_ret);
+        break;
+    case CL_PROGRAM_BUILD_OPTIONS:
+        status = return_string(program->options != NULL ? program->options : "", size, value, size_ret);
+        break;
+    case CL_PROGRAM_BUILD_STATUS:
+        status = return_info(&program->build_status, sizeof(cl_build_status), size, value, size_ret);
+        break;
+    case CL_PROGRAM_BINARY_TYPE:
+        status = return_info(&program->binary_type, sizeof(cl_uint), size, value, size_ret);
+        break;
+    default:
+        status = CL_INVALID_VALUE;
+    }
+    pthread_mutex_unlock(&program->lock);
+    return status;
+}
+
+cl_int clCreateKernelsInProgram(cl_program program, cl_uint num_kernels, cl_kernel *kernels,
+                                cl_uint *num_kernels_ret)
+{
+    char names[16][128];
+    cl_uint n, i;
+    cl_int status = injected("clCreateKernelsInProgram");
+    if (status != CL_SUCCESS)
+        return status;
+    if (program == NULL)
+        return CL_INVALID_PROGRAM;
+    if (program->build_status != CL_BUILD_SUCCESS
+        || program->binary_type != CL_PROGRAM_BINARY_TYPE_EXECUTABLE)
+        return CL_INVALID_PROGRAM_EXECUTABLE;
+    n = find_kernels(program, names, 16);
+    if (n > 16)
+        n = 16;
+    if (kernels != NULL)
+    {
+        if (num_kernels < n)
+            return CL_INVALID_VALUE;
+        for (i = 0; i < n; i++)
+        {
+            kernels[i] = malloc(sizeof(struct _cl_kernel));
+            kernels[i]->program = program;
+            strcpy(kernels[i]->name, names[i]);
+            clRetainProgram(program);
+        }
+    }
+    if (num_kernels_ret != NULL)
+        *num_kernels_ret = n;
+    return CL_SUCCESS;
+}
+
+cl_int clReleaseKernel(cl_kernel kernel)
+{
+    if (kernel == NULL)
+        return CL_INVALID_KERNEL;
+    clReleaseProgram(kernel->program);
+    free(kernel);
+    return CL_SUCCESS;
+}
+
+cl_int clGetKernelInfo(cl_kernel kernel, cl_kernel_info param,
+                       size_t size, void *value, size_t *size_ret)
+{
+    cl_uint u = 0;
+    if (kernel == NULL)
+        return CL_INVALID_KERNEL;
+    switch (param)
+    {
+    case CL_KERNEL_FUNCTION_NAME:
+        return return_string(kernel->name, size, value, size_ret);
+    case CL_KERNEL_NUM_ARGS:
+        return return_info(&u, sizeof(u), size, value, size_ret);
+    default:
+        return CL_INVALID_VALUE;
+    }
+}
+
+cl_int clGetKernelWorkGroupInfo(cl_kernel kernel, cl_device_id device, cl_kernel_work_group_info param,
+                                size_t size, void *value, size_t *size_ret)
+{
+    size_t sz;
+    size_t wg[3] = {0, 0, 0};
+    cl_ulong ul;
+    (void) device;
+    if (kernel == NULL)
+        return CL_INVALID_KERNEL;
+    switch (param)
+    {
+    case CL_KERNEL_WORK_GROUP_SIZE:
+        sz = 256;
+        return return_info(&sz, sizeof(sz), size, value, size_ret);
+    case CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE:
+        sz = 32;
+        return return_info(&sz, sizeof(sz), size, value, size_ret);
+    case CL_KERNEL_COMPILE_WORK_GROUP_SIZE:
+        return return_info(wg, sizeof(wg), size, value, size_ret);
+    case CL_KERNEL_LOCAL_MEM_SIZE:
+        ul = env_ulong("MOCKCL_LOCAL_MEM", 0);
+        return return_info(&ul, sizeof(ul), size, value, size_ret);
+    case CL_KERNEL_PRIVATE_MEM_SIZE:
+        ul = env_ulong("MOCKCL_PRIVATE_MEM", 0);
+        return return_info(&ul, sizeof(ul), size, value, size_ret);
+    default:
+        return CL_INVALID_VALUE;
+    }
+}
+
+void *clGetExtensionFunctionAddressForPlatform(cl_platform_id platform, const char *name)
+{
+    (void) platform;
+    if (strcmp(name, "clCreateProgramWithILKHR") == 0)
+        return (void *) clCreateProgramWithIL;
+    return NULL;
+}